@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+#define ATOMIC_KEY	0xA70
+
+enum atomic_kind {
+	ATOMIC_WRITE,
+	ATOMIC_FETCH,
+	ATOMIC_COMPARE,
+};
+
+struct atomic_target {
+	uint64_t value;
+	struct fid_mr *mr;
+	uint64_t key;
+};
+
+static uint64_t operand = 1, compare, result;
+
+static ssize_t atomic_post(struct bench_ep *a, fi_addr_t dest,
+			   struct atomic_target *target, enum atomic_kind kind)
+{
+	uint64_t addr = (uintptr_t) &target->value;
+
+	switch (kind) {
+	case ATOMIC_FETCH:
+		return fi_fetch_atomic(a->ep, &operand, 1, NULL, &result, NULL,
+				       dest, addr, target->key, FI_UINT64,
+				       FI_SUM, NULL);
+	case ATOMIC_COMPARE:
+		return fi_compare_atomic(a->ep, &operand, 1, NULL, &compare,
+					 NULL, &result, NULL, dest, addr,
+					 target->key, FI_UINT64, FI_CSWAP,
+					 NULL);
+	case ATOMIC_WRITE:
+	default:
+		return fi_atomic(a->ep, &operand, 1, NULL, dest, addr,
+				 target->key, FI_UINT64, FI_SUM, NULL);
+	}
+}
+
+static int atomic_stream(struct bench_ep *a, fi_addr_t dest,
+			 struct atomic_target *target, enum atomic_kind kind,
+			 long windows, int depth)
+{
+	long i;
+	int j;
+
+	for (i = 0; i < windows; i++) {
+		for (j = 0; j < depth; j++)
+			BENCH_POST(atomic_post(a, dest, target, kind),
+				   a->tx_cq);
+		BENCH_CHECK(bench_cq_wait(a->tx_cq, depth));
+	}
+	return 0;
+}
+
+static int run(const char *test, struct bench_rdm *rdm,
+	       struct atomic_target *target, enum atomic_kind kind)
+{
+	struct bench_ep *a = &rdm->eps[0];
+	fi_addr_t dest = rdm->eps[1].addr;
+	uint64_t start, end;
+	long windows;
+	char name[64];
+
+	BENCH_CHECK(atomic_stream(a, dest, target, kind, opts.warmup, 1));
+	start = bench_time_ns();
+	BENCH_CHECK(atomic_stream(a, dest, target, kind, opts.iterations, 1));
+	end = bench_time_ns();
+	snprintf(name, sizeof name, "%s_lat", test);
+	bench_report(name, sizeof(uint64_t), opts.iterations,
+		     (end - start) / 1000.0 / opts.iterations, "usec");
+
+	windows = opts.iterations / BENCH_WINDOW;
+	if (windows < 1)
+		windows = 1;
+	start = bench_time_ns();
+	BENCH_CHECK(atomic_stream(a, dest, target, kind, windows,
+				  BENCH_WINDOW));
+	end = bench_time_ns();
+	snprintf(name, sizeof name, "%s_rate", test);
+	bench_report(name, sizeof(uint64_t), windows * BENCH_WINDOW,
+		     windows * BENCH_WINDOW * 1000.0 / (end - start),
+		     "Mops/s");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct atomic_target target;
+	struct bench_rdm rdm;
+	int ret;
+
+	ret = bench_parse_args(argc, argv, "atomic", NULL);
+	if (ret)
+		return EXIT_FAILURE;
+
+	memset(&target, 0, sizeof target);
+	ret = bench_rdm_open(&rdm, FI_ATOMICS, 2);
+	if (!ret)
+		ret = bench_mr_reg(rdm.nodes[1].domain, &target.value,
+				   sizeof target.value,
+				   FI_REMOTE_READ | FI_REMOTE_WRITE,
+				   ATOMIC_KEY, &target.mr);
+	if (!ret) {
+		target.key = fi_mr_key(target.mr);
+		ret = run("rdm_sum", &rdm, &target, ATOMIC_WRITE);
+	}
+	if (!ret)
+		ret = run("rdm_fetch_sum", &rdm, &target, ATOMIC_FETCH);
+	if (!ret)
+		ret = run("rdm_cswap", &rdm, &target, ATOMIC_COMPARE);
+	bench_report_done();
+
+	if (target.mr)
+		fi_close(&target.mr->fid);
+	bench_rdm_close(&rdm);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
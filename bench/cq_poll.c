@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared.h"
+
+#define CQ_FILL		(BENCH_CQ_SIZE / 2)
+#define SREAD_ROUNDS	10
+#define SREAD_TIMEOUT	20	/* msec */
+
+/* cost of polling a CQ with nothing on it, including any manual progress */
+static int empty_read(struct fid_cq *cq)
+{
+	struct fi_cq_entry comp;
+	uint64_t start, end;
+	ssize_t ret;
+	long i;
+
+	start = bench_time_ns();
+	for (i = 0; i < opts.iterations; i++) {
+		ret = fi_cq_read(cq, &comp, 1);
+		if (ret != 0 && ret != -FI_EAGAIN) {
+			fprintf(stderr, "unexpected completion: %zd\n", ret);
+			return -FI_EOTHER;
+		}
+	}
+	end = bench_time_ns();
+	bench_report("empty_read", 0, opts.iterations,
+		     (double) (end - start) / opts.iterations, "nsec/call");
+	return 0;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* share of a core burnt by blocking reads that time out on an empty CQ */
+static int idle_sread(struct fid_cq *cq)
+{
+	struct fi_cq_entry comp;
+	uint64_t start, end, cpu;
+	ssize_t ret;
+	int i;
+
+	start = bench_time_ns();
+	cpu = thread_cpu_ns();
+	for (i = 0; i < SREAD_ROUNDS; i++) {
+		ret = fi_cq_sread(cq, &comp, 1, NULL, SREAD_TIMEOUT);
+		if (ret != 0 && ret != -FI_ETIMEDOUT && ret != -FI_EAGAIN) {
+			fprintf(stderr, "fi_cq_sread: %zd\n", ret);
+			return -FI_EOTHER;
+		}
+	}
+	cpu = thread_cpu_ns() - cpu;
+	end = bench_time_ns();
+	bench_report("idle_sread", 0, SREAD_ROUNDS,
+		     100.0 * cpu / (end - start), "%cpu");
+	return 0;
+}
+
+/*
+ * Fills the CQ with user generated completions and drains it in
+ * batches, reporting the write and the per-entry read cost.
+ */
+static int drain(struct fid_cq *cq, int batch)
+{
+	struct fi_cq_entry comp[BENCH_CQ_BATCH], entry;
+	uint64_t write_ns = 0, read_ns = 0, start;
+	long rounds, i, done;
+	ssize_t ret;
+	char name[64];
+	int j;
+
+	rounds = opts.iterations / CQ_FILL;
+	if (rounds < 1)
+		rounds = 1;
+
+	memset(&entry, 0, sizeof entry);
+	for (i = 0; i < rounds; i++) {
+		start = bench_time_ns();
+		for (j = 0; j < CQ_FILL; j++) {
+			entry.op_context = (void *) (uintptr_t) j;
+			ret = fi_cq_write(cq, &entry, sizeof entry);
+			if (ret != sizeof entry) {
+				fprintf(stderr, "fi_cq_write: %zd\n", ret);
+				return -FI_EOTHER;
+			}
+		}
+		write_ns += bench_time_ns() - start;
+
+		start = bench_time_ns();
+		for (done = 0; done < CQ_FILL; ) {
+			ret = fi_cq_read(cq, comp, batch);
+			if (ret < 0 && ret != -FI_EAGAIN) {
+				fprintf(stderr, "fi_cq_read: %s\n",
+					fi_strerror((int) -ret));
+				return (int) ret;
+			}
+			if (ret > 0)
+				done += ret;
+		}
+		read_ns += bench_time_ns() - start;
+	}
+
+	if (batch == 1)
+		bench_report("write", sizeof entry, rounds * CQ_FILL,
+			     (double) write_ns / (rounds * CQ_FILL),
+			     "nsec/entry");
+	snprintf(name, sizeof name, "read_batch%d", batch);
+	bench_report(name, sizeof entry, rounds * CQ_FILL,
+		     (double) read_ns / (rounds * CQ_FILL), "nsec/entry");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_rdm rdm;
+	int ret;
+
+	ret = bench_parse_args(argc, argv, "cq_poll", NULL);
+	if (ret)
+		return EXIT_FAILURE;
+
+	ret = bench_rdm_open(&rdm, FI_MSG, 1);
+	if (!ret)
+		ret = empty_read(rdm.eps[0].tx_cq);
+	if (!ret)
+		ret = idle_sread(rdm.eps[0].tx_cq);
+	if (!ret)
+		ret = drain(rdm.eps[0].tx_cq, 1);
+	if (!ret)
+		ret = drain(rdm.eps[0].tx_cq, BENCH_CQ_BATCH);
+	bench_report_done();
+
+	bench_rdm_close(&rdm);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
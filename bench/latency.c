@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+/*
+ * Ping-pong between two endpoints of the same process. Half the round
+ * trip time is reported as the one-way latency.
+ */
+static int pingpong(struct bench_ep *a, struct bench_ep *b, fi_addr_t a_addr,
+		    fi_addr_t b_addr, char *buf, size_t size, long iterations)
+{
+	long i;
+
+	for (i = 0; i < iterations; i++) {
+		BENCH_POST(fi_recv(b->ep, buf + BENCH_MAX_SIZE, size, NULL,
+				   FI_ADDR_UNSPEC, NULL), b->rx_cq);
+		BENCH_POST(fi_send(a->ep, buf, size, NULL, b_addr, NULL),
+			   a->tx_cq);
+		BENCH_CHECK(bench_cq_wait(b->rx_cq, 1));
+
+		BENCH_POST(fi_recv(a->ep, buf, size, NULL, FI_ADDR_UNSPEC,
+				   NULL), a->rx_cq);
+		BENCH_POST(fi_send(b->ep, buf + BENCH_MAX_SIZE, size, NULL,
+				   a_addr, NULL), b->tx_cq);
+		BENCH_CHECK(bench_cq_wait(a->rx_cq, 1));
+
+		BENCH_CHECK(bench_cq_wait(a->tx_cq, 1));
+		BENCH_CHECK(bench_cq_wait(b->tx_cq, 1));
+	}
+	return 0;
+}
+
+static int run(const char *test, struct bench_ep *a, struct bench_ep *b,
+	       fi_addr_t a_addr, fi_addr_t b_addr, char *buf)
+{
+	uint64_t start, end;
+	size_t size = 0;
+	long iterations;
+
+	while (bench_next_size(&size)) {
+		iterations = bench_iterations(opts.iterations, size);
+		BENCH_CHECK(pingpong(a, b, a_addr, b_addr, buf, size,
+				     opts.warmup));
+		start = bench_time_ns();
+		BENCH_CHECK(pingpong(a, b, a_addr, b_addr, buf, size,
+				     iterations));
+		end = bench_time_ns();
+		bench_report(test, size, iterations,
+			     (end - start) / 1000.0 / iterations / 2, "usec");
+	}
+	return 0;
+}
+
+static int run_rdm(char *buf)
+{
+	struct bench_rdm rdm;
+	int ret;
+
+	BENCH_CHECK(bench_rdm_open(&rdm, FI_MSG, 2));
+	ret = run("rdm_latency", &rdm.eps[0], &rdm.eps[1],
+		  rdm.eps[0].addr, rdm.eps[1].addr, buf);
+	bench_rdm_close(&rdm);
+	return ret;
+}
+
+static int run_msg(char *buf)
+{
+	struct bench_msg msg;
+	struct bench_conn conn;
+	int ret;
+
+	BENCH_CHECK(bench_msg_open(&msg, FI_MSG));
+	BENCH_CHECK(bench_msg_connect(&msg, &conn, 1, FI_MSG));
+	ret = run("msg_latency", &conn.client, &conn.server, 0, 0, buf);
+	bench_msg_disconnect(&conn);
+	bench_msg_close(&msg);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	char *buf;
+	int ret;
+
+	ret = bench_parse_args(argc, argv, "latency", NULL);
+	if (ret)
+		return EXIT_FAILURE;
+
+	buf = calloc(2, BENCH_MAX_SIZE);
+	if (!buf)
+		return EXIT_FAILURE;
+
+	ret = run_rdm(buf);
+	if (!ret)
+		ret = run_msg(buf);
+	bench_report_done();
+
+	free(buf);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
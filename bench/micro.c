@@ -0,0 +1,774 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Microbenchmarks of the data structures on the sockets provider data
+ * path. The provider sources are linked into this program so that its
+ * internal functions can be called directly.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sock.h"
+#include "shared.h"
+
+#define MICRO_OPS_SCALE		100
+#define MICRO_RB_SIZE		(1 << 16)
+#define MICRO_MT_THREADS	4
+#define MICRO_EQ_BURST		64
+
+static long micro_ops;
+static int micro_threads;
+
+static void micro_report(const char *test, size_t size, long ops,
+			 int threads, uint64_t ns)
+{
+	bench_report_mt(test, size, ops, threads, (double) ns / ops,
+			"nsec/op");
+}
+
+/*
+ * Contended runs: every thread executes the same operation against a
+ * shared structure, with the lock discipline the provider uses for it.
+ */
+struct micro_mt {
+	void (*op)(struct micro_mt *mt, long i);
+	fastlock_t lock;
+	pthread_barrier_t barrier;
+	long ops;
+	void *arg;
+};
+
+static void *micro_mt_thread(void *arg)
+{
+	struct micro_mt *mt = arg;
+	long i;
+
+	pthread_barrier_wait(&mt->barrier);
+	for (i = 0; i < mt->ops; i++)
+		mt->op(mt, i);
+	pthread_barrier_wait(&mt->barrier);
+	return NULL;
+}
+
+static void micro_mt_run(const char *test, size_t size, struct micro_mt *mt)
+{
+	pthread_t *threads;
+	uint64_t start, end;
+	int i;
+
+	threads = calloc(micro_threads, sizeof(*threads));
+	if (!threads)
+		return;
+
+	mt->ops = micro_ops / micro_threads;
+	fastlock_init(&mt->lock);
+	pthread_barrier_init(&mt->barrier, NULL, micro_threads + 1);
+	for (i = 0; i < micro_threads; i++)
+		pthread_create(&threads[i], NULL, micro_mt_thread, mt);
+
+	pthread_barrier_wait(&mt->barrier);
+	start = bench_time_ns();
+	pthread_barrier_wait(&mt->barrier);
+	end = bench_time_ns();
+
+	for (i = 0; i < micro_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&mt->barrier);
+	fastlock_destroy(&mt->lock);
+	free(threads);
+
+	micro_report(test, size, mt->ops * micro_threads, micro_threads,
+		     end - start);
+}
+
+/* ring buffer: one write + commit + read per op, as a CQ or tx ring does */
+static size_t rb_len;
+
+static void rb_mt_op(struct micro_mt *mt, long i)
+{
+	struct ringbuf *rb = mt->arg;
+	char buf[512];
+
+	fastlock_acquire(&mt->lock);
+	rbwrite(rb, buf, rb_len);
+	rbcommit(rb);
+	rbread(rb, buf, rb_len);
+	fastlock_release(&mt->lock);
+}
+
+static int micro_rbuf(void)
+{
+	static const size_t sizes[] = { 8, 64, 512 };
+	struct ringbuffd rbfd;
+	struct ringbuf rb;
+	struct micro_mt mt;
+	uint64_t start, end;
+	char buf[512];
+	long i;
+	int s;
+
+	if (rbinit(&rb, MICRO_RB_SIZE) || rbfdinit(&rbfd, MICRO_RB_SIZE))
+		return -FI_ENOMEM;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		start = bench_time_ns();
+		for (i = 0; i < micro_ops; i++) {
+			rbwrite(&rb, buf, sizes[s]);
+			rbcommit(&rb);
+			rbread(&rb, buf, sizes[s]);
+		}
+		end = bench_time_ns();
+		micro_report("rb_write_read", sizes[s], micro_ops, 1,
+			     end - start);
+
+		start = bench_time_ns();
+		for (i = 0; i < micro_ops; i++) {
+			rbfdwrite(&rbfd, buf, sizes[s]);
+			rbfdcommit(&rbfd);
+			rbfdread(&rbfd, buf, sizes[s]);
+		}
+		end = bench_time_ns();
+		micro_report("rbfd_write_read", sizes[s], micro_ops, 1,
+			     end - start);
+
+		memset(&mt, 0, sizeof mt);
+		mt.op = rb_mt_op;
+		mt.arg = &rb;
+		rb_len = sizes[s];
+		micro_mt_run("rb_write_read_locked", sizes[s], &mt);
+	}
+
+	rbfdfree(&rbfd);
+	rbfree(&rb);
+	return 0;
+}
+
+/* index map: lookups of populated slots, and set/clear churn */
+static int idm_size;
+
+static void idm_mt_op(struct micro_mt *mt, long i)
+{
+	struct index_map *idm = mt->arg;
+	void *item;
+
+	fastlock_acquire(&mt->lock);
+	item = idm_lookup(idm, (int) (i % idm_size) + 1);
+	fastlock_release(&mt->lock);
+	if (!item)
+		abort();
+}
+
+static void idm_mt_churn(struct micro_mt *mt, long i)
+{
+	struct index_map *idm = mt->arg;
+	int index = (int) (i % idm_size) + 1;
+
+	fastlock_acquire(&mt->lock);
+	if (idm_lookup(idm, index))
+		idm_clear(idm, index);
+	else
+		idm_set(idm, index, idm);
+	fastlock_release(&mt->lock);
+}
+
+static int micro_idm(void)
+{
+	static const int sizes[] = { 16, 1024, IDX_MAX_INDEX - 1 };
+	struct index_map idm;
+	struct micro_mt mt;
+	uint64_t start, end;
+	void * volatile sink;
+	long i;
+	int s, j;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		idm_size = sizes[s];
+		memset(&idm, 0, sizeof idm);
+
+		start = bench_time_ns();
+		for (j = 1; j <= idm_size; j++)
+			idm_set(&idm, j, &idm);
+		end = bench_time_ns();
+		micro_report("idm_set", idm_size, idm_size, 1, end - start);
+
+		start = bench_time_ns();
+		for (i = 0; i < micro_ops; i++)
+			sink = idm_lookup(&idm, (int) (i % idm_size) + 1);
+		end = bench_time_ns();
+		(void) sink;
+		micro_report("idm_lookup", idm_size, micro_ops, 1, end - start);
+
+		memset(&mt, 0, sizeof mt);
+		mt.op = idm_mt_op;
+		mt.arg = &idm;
+		micro_mt_run("idm_lookup_locked", idm_size, &mt);
+
+		start = bench_time_ns();
+		for (j = 1; j <= idm_size; j++)
+			idm_clear(&idm, j);
+		end = bench_time_ns();
+		micro_report("idm_clear", idm_size, idm_size, 1, end - start);
+
+		memset(&mt, 0, sizeof mt);
+		mt.op = idm_mt_churn;
+		mt.arg = &idm;
+		micro_mt_run("idm_set_clear_locked", idm_size, &mt);
+		for (j = 1; j <= idm_size; j++)
+			if (idm_lookup(&idm, j))
+				idm_clear(&idm, j);
+	}
+	return 0;
+}
+
+/* radix map: the same lookups without a lock, plus sparse 64-bit keys */
+static uint64_t radix_size;
+static uint64_t radix_stride;
+static uint64_t radix_next;
+
+static void radix_mt_op(struct micro_mt *mt, long i)
+{
+	if (!radix_map_lookup(mt->arg, ((i % radix_size) + 1) * radix_stride))
+		abort();
+}
+
+/*
+ * New keys wrap over a window as large as the map, so the number of
+ * leaves a sparse run allocates does not grow with the op count.
+ */
+static void radix_mt_set(struct micro_mt *mt, long i)
+{
+	uint64_t index;
+
+	index = __atomic_fetch_add(&radix_next, 1, __ATOMIC_RELAXED);
+	index = radix_size + 1 + index % radix_size;
+	if (radix_map_set(mt->arg, index * radix_stride, mt->arg))
+		abort();
+}
+
+static int micro_radix_run(const char *sfx)
+{
+	char name[64];
+	struct radix_map map;
+	struct micro_mt mt;
+	uint64_t start, end, j;
+	void * volatile sink;
+	long i;
+
+	memset(&map, 0, sizeof map);
+	start = bench_time_ns();
+	for (j = 1; j <= radix_size; j++) {
+		if (radix_map_set(&map, j * radix_stride, &map)) {
+			fprintf(stderr, "radix_map_set failed\n");
+			radix_map_destroy(&map);
+			return -FI_ENOMEM;
+		}
+	}
+	end = bench_time_ns();
+	snprintf(name, sizeof name, "radix_set%s", sfx);
+	micro_report(name, radix_size, radix_size, 1, end - start);
+
+	start = bench_time_ns();
+	for (i = 0; i < micro_ops; i++)
+		sink = radix_map_lookup(&map,
+				((i % radix_size) + 1) * radix_stride);
+	end = bench_time_ns();
+	(void) sink;
+	snprintf(name, sizeof name, "radix_lookup%s", sfx);
+	micro_report(name, radix_size, micro_ops, 1, end - start);
+
+	memset(&mt, 0, sizeof mt);
+	mt.op = radix_mt_op;
+	mt.arg = &map;
+	snprintf(name, sizeof name, "radix_lookup%s_lockfree", sfx);
+	micro_mt_run(name, radix_size, &mt);
+
+	radix_next = 0;
+	memset(&mt, 0, sizeof mt);
+	mt.op = radix_mt_set;
+	mt.arg = &map;
+	snprintf(name, sizeof name, "radix_set%s_lockfree", sfx);
+	micro_mt_run(name, radix_size, &mt);
+
+	start = bench_time_ns();
+	for (j = 1; j <= radix_size; j++)
+		radix_map_clear(&map, j * radix_stride);
+	end = bench_time_ns();
+	snprintf(name, sizeof name, "radix_clear%s", sfx);
+	micro_report(name, radix_size, radix_size, 1, end - start);
+	radix_map_destroy(&map);
+	return 0;
+}
+
+static int micro_radix(void)
+{
+	static const uint64_t sizes[] = { 16, 1024, 1 << 20 };
+	int s, ret;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		radix_size = sizes[s];
+		radix_stride = 1;
+		ret = micro_radix_run("");
+		if (ret)
+			return ret;
+
+		/* keys spread across the 64-bit range: a leaf chain per key */
+		if (radix_size > 1024)
+			continue;
+		radix_stride = (uint64_t) 1 << 32;
+		ret = micro_radix_run("_sparse");
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* lists: queue an entry at the tail and take one from the head */
+static void dlist_mt_op(struct micro_mt *mt, long i)
+{
+	struct dlist_entry *head = mt->arg, *entry;
+	struct dlist_entry item;
+
+	fastlock_acquire(&mt->lock);
+	dlist_insert_tail(&item, head);
+	entry = head->next;
+	dlist_remove(entry);
+	fastlock_release(&mt->lock);
+}
+
+static int micro_dlist(void)
+{
+	struct dlist_entry head, items[2];
+	struct dlistfd_head fdhead;
+	struct micro_mt mt;
+	uint64_t start, end;
+	long i;
+
+	dlist_init(&head);
+	start = bench_time_ns();
+	for (i = 0; i < micro_ops; i++) {
+		dlist_insert_tail(&items[i & 1], &head);
+		dlist_remove(head.next);
+	}
+	end = bench_time_ns();
+	micro_report("dlist_insert_remove", 0, micro_ops, 1, end - start);
+
+	/* an entry is always queued, so the fd is signaled only once */
+	if (dlistfd_head_init(&fdhead))
+		return -FI_EOTHER;
+	dlistfd_insert_tail(&items[0], &fdhead);
+	start = bench_time_ns();
+	for (i = 0; i < micro_ops; i++) {
+		dlistfd_insert_tail(&items[1], &fdhead);
+		dlistfd_remove(&items[1], &fdhead);
+	}
+	end = bench_time_ns();
+	micro_report("dlistfd_insert_remove", 0, micro_ops, 1, end - start);
+
+	/* the list drains on every op, so each insert writes the fd */
+	dlistfd_remove(&items[0], &fdhead);
+	start = bench_time_ns();
+	for (i = 0; i < micro_ops; i++) {
+		dlistfd_insert_tail(&items[0], &fdhead);
+		dlistfd_remove(&items[0], &fdhead);
+	}
+	end = bench_time_ns();
+	micro_report("dlistfd_insert_remove_signal", 0, micro_ops, 1,
+		     end - start);
+	dlistfd_head_free(&fdhead);
+
+	memset(&mt, 0, sizeof mt);
+	dlist_init(&head);
+	mt.op = dlist_mt_op;
+	mt.arg = &head;
+	micro_mt_run("dlist_insert_remove_locked", 0, &mt);
+	return 0;
+}
+
+/*
+ * Tag matching: a receive context with depth posted receives of distinct
+ * tags, searched for the first, the last and a missing tag.
+ */
+static int micro_rx_match(void)
+{
+	static const int depths[] = { 1, 16, 256, 4096 };
+	struct sock_rx_entry *rx_entry;
+	struct sock_rx_ctx *rx_ctx;
+	struct fi_rx_attr attr;
+	struct dlist_entry *entry;
+	uint64_t start, end;
+	long i;
+	int d, j;
+
+	memset(&attr, 0, sizeof attr);
+	for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		rx_ctx = sock_rx_ctx_alloc(&attr, NULL);
+		if (!rx_ctx)
+			return -FI_ENOMEM;
+
+		for (j = 0; j < depths[d]; j++) {
+			rx_entry = sock_rx_new_entry(rx_ctx);
+			if (!rx_entry)
+				return -FI_ENOMEM;
+			rx_entry->addr = FI_ADDR_UNSPEC;
+			rx_entry->tag = j;
+			dlist_insert_tail(&rx_entry->entry,
+					  &rx_ctx->rx_entry_list);
+		}
+
+		start = bench_time_ns();
+		for (i = 0; i < micro_ops; i++) {
+			rx_entry = sock_rx_get_entry(rx_ctx, FI_ADDR_UNSPEC, 0);
+			rx_entry->is_busy = 0;
+		}
+		end = bench_time_ns();
+		micro_report("rx_match_first", depths[d], micro_ops, 1,
+			     end - start);
+
+		start = bench_time_ns();
+		for (i = 0; i < micro_ops; i++) {
+			rx_entry = sock_rx_get_entry(rx_ctx, FI_ADDR_UNSPEC,
+						     depths[d] - 1);
+			rx_entry->is_busy = 0;
+		}
+		end = bench_time_ns();
+		micro_report("rx_match_last", depths[d], micro_ops, 1,
+			     end - start);
+
+		start = bench_time_ns();
+		for (i = 0; i < micro_ops; i++) {
+			if (sock_rx_get_entry(rx_ctx, FI_ADDR_UNSPEC,
+					      depths[d]))
+				abort();
+		}
+		end = bench_time_ns();
+		micro_report("rx_match_miss", depths[d], micro_ops, 1,
+			     end - start);
+
+		while (!dlist_empty(&rx_ctx->rx_entry_list)) {
+			entry = rx_ctx->rx_entry_list.next;
+			dlist_remove(entry);
+			sock_rx_release_entry(container_of(entry,
+					struct sock_rx_entry, entry));
+		}
+		sock_rx_ctx_free(rx_ctx);
+	}
+	return 0;
+}
+
+/*
+ * fi_cancel: depth posted receives with distinct contexts, canceled one
+ * by one newest first, then all at once. No CQ is bound, so this is the
+ * cost of finding and unlinking the receives.
+ */
+static int micro_rx_post(struct sock_rx_ctx *rx_ctx, int depth)
+{
+	struct sock_rx_entry *rx_entry;
+	int j;
+
+	for (j = 0; j < depth; j++) {
+		rx_entry = sock_rx_new_entry(rx_ctx);
+		if (!rx_entry)
+			return -FI_ENOMEM;
+		rx_entry->addr = FI_ADDR_UNSPEC;
+		rx_entry->context = (uint64_t) (j + 1) * 64;
+		sock_rx_ctx_post_entry(rx_ctx, rx_entry);
+	}
+	return 0;
+}
+
+static int micro_rx_cancel(void)
+{
+	static const int depths[] = { 16, 4096, 65536 };
+	struct sock_domain domain;
+	struct sock_rx_ctx *rx_ctx;
+	struct fi_rx_attr attr;
+	uint64_t start, end;
+	int d, j;
+
+	memset(&attr, 0, sizeof attr);
+	memset(&domain, 0, sizeof domain);
+	for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		rx_ctx = sock_rx_ctx_alloc(&attr, NULL);
+		if (!rx_ctx)
+			return -FI_ENOMEM;
+		rx_ctx->domain = &domain;
+
+		BENCH_CHECK(micro_rx_post(rx_ctx, depths[d]));
+		start = bench_time_ns();
+		for (j = depths[d] - 1; j >= 0; j--) {
+			if (sock_rx_ctx_cancel(rx_ctx, NULL,
+					       (void *) ((uint64_t) (j + 1) * 64),
+					       0))
+				abort();
+		}
+		end = bench_time_ns();
+		micro_report("rx_cancel", depths[d], depths[d], 1,
+			     end - start);
+
+		BENCH_CHECK(micro_rx_post(rx_ctx, depths[d]));
+		start = bench_time_ns();
+		if (sock_rx_ctx_cancel(rx_ctx, NULL, NULL, 1) != depths[d])
+			abort();
+		end = bench_time_ns();
+		micro_report("rx_cancel_all", depths[d], depths[d], 1,
+			     end - start);
+
+		sock_rx_ctx_free(rx_ctx);
+	}
+	return 0;
+}
+
+/*
+ * Reverse address lookup of an incoming connection: an AV of count
+ * entries whose connection keys are all known, searched for the first,
+ * the last and an unknown key.
+ */
+static int micro_av_lookup(void)
+{
+	static const int counts[] = { 16, 256, 4096 };
+	struct sockaddr_in *addrs;
+	struct fi_av_attr attr;
+	struct bench_rdm rdm;
+	struct sock_av *av;
+	struct fid_av *av_fid;
+	uint64_t start, end;
+	long i, ops;
+	int c, j, ret;
+
+	ret = bench_rdm_open(&rdm, FI_MSG, 1);
+	if (ret)
+		return ret;
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		addrs = calloc(counts[c], sizeof(*addrs));
+		if (!addrs)
+			return -FI_ENOMEM;
+		for (j = 0; j < counts[c]; j++) {
+			addrs[j].sin_addr.s_addr = inet_addr(BENCH_NODE);
+			addrs[j].sin_port = htons(opts.port + 1024 + j);
+		}
+
+		memset(&attr, 0, sizeof attr);
+		attr.type = FI_AV_TABLE;
+		attr.count = counts[c];
+		BENCH_CHECK(fi_av_open(rdm.nodes[0].domain, &attr, &av_fid,
+				       NULL));
+		if (fi_av_insert(av_fid, addrs, counts[c], NULL, 0, NULL) !=
+		    counts[c]) {
+			fprintf(stderr, "fi_av_insert failed\n");
+			return -FI_EINVAL;
+		}
+
+		/* pretend every peer is connected: key k maps to entry k */
+		av = container_of(av_fid, struct sock_av, av_fid);
+		for (j = 0; j < counts[c]; j++) {
+			av->table[j].key = j + 1;
+			if (radix_map_set(&av->key_map, j + 1,
+					  (void *) (uintptr_t) (j + 1))) {
+				fprintf(stderr, "radix_map_set failed\n");
+				return -FI_ENOMEM;
+			}
+		}
+
+		ops = micro_ops / MICRO_OPS_SCALE;
+		start = bench_time_ns();
+		for (i = 0; i < ops; i++)
+			sock_av_lookup_key(av, 0);
+		end = bench_time_ns();
+		micro_report("av_lookup_key_first", counts[c], ops, 1,
+			     end - start);
+
+		start = bench_time_ns();
+		for (i = 0; i < ops; i++)
+			sock_av_lookup_key(av, counts[c] - 1);
+		end = bench_time_ns();
+		micro_report("av_lookup_key_last", counts[c], ops, 1,
+			     end - start);
+
+		start = bench_time_ns();
+		for (i = 0; i < ops; i++)
+			sock_av_lookup_key(av, counts[c]);
+		end = bench_time_ns();
+		micro_report("av_lookup_key_miss", counts[c], ops, 1,
+			     end - start);
+
+		fi_close(&av_fid->fid);
+		free(addrs);
+	}
+
+	bench_rdm_close(&rdm);
+	return 0;
+}
+
+/*
+ * EQ: bursts of events written and drained as a connection storm does.
+ * 8 byte events fit the preallocated ring, 128 byte ones overflow it.
+ */
+static char eq_event[128];
+
+static void eq_mt_op(struct micro_mt *mt, long i)
+{
+	char buf[sizeof(eq_event)];
+	uint32_t event;
+
+	fi_eq_write(mt->arg, FI_NOTIFY, eq_event, 8, 0);
+	fi_eq_read(mt->arg, &event, buf, sizeof buf, 0);
+}
+
+static int micro_eq(void)
+{
+	static const size_t sizes[] = { 8, sizeof(eq_event) };
+	char buf[sizeof(eq_event)];
+	struct fi_eq_attr attr;
+	struct bench_rdm rdm;
+	struct fid_eq *eq;
+	struct micro_mt mt;
+	uint64_t start, end;
+	uint32_t event;
+	long i, ops;
+	int s, j, ret;
+
+	ret = bench_rdm_open(&rdm, FI_MSG, 1);
+	if (ret)
+		return ret;
+
+	memset(&attr, 0, sizeof attr);
+	attr.size = MICRO_EQ_BURST;
+	attr.flags = FI_WRITE;
+	attr.wait_obj = FI_WAIT_FD;
+	BENCH_CHECK(fi_eq_open(rdm.fabric, &attr, &eq, NULL));
+
+	ops = micro_ops / MICRO_EQ_BURST;
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		start = bench_time_ns();
+		for (i = 0; i < ops; i++) {
+			for (j = 0; j < MICRO_EQ_BURST; j++)
+				fi_eq_write(eq, FI_NOTIFY, eq_event, sizes[s],
+					    0);
+			for (j = 0; j < MICRO_EQ_BURST; j++)
+				fi_eq_read(eq, &event, buf, sizeof buf, 0);
+		}
+		end = bench_time_ns();
+		micro_report("eq_write_read", sizes[s], ops * MICRO_EQ_BURST,
+			     1, end - start);
+	}
+
+	memset(&mt, 0, sizeof mt);
+	mt.op = eq_mt_op;
+	mt.arg = eq;
+	micro_mt_run("eq_write_read_locked", 8, &mt);
+
+	fi_close(&eq->fid);
+	bench_rdm_close(&rdm);
+	return 0;
+}
+
+/* fi_info copies, as middleware makes per communicator */
+static void info_mt_op(struct micro_mt *mt, long i)
+{
+	fi_freeinfo(fi_dupinfo(mt->arg));
+}
+
+static int micro_info(void)
+{
+	struct fi_info *hints, *info, *dup;
+	struct micro_mt mt;
+	uint64_t start, end, sum = 0;
+	long i;
+	int ret;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return -FI_ENOMEM;
+	hints->ep_type = FI_EP_RDM;
+	hints->fabric_attr->prov_name = strdup("sockets");
+	ret = fi_getinfo(FI_VERSION(1, 0), NULL, NULL, 0, hints, &info);
+	fi_freeinfo(hints);
+	if (ret)
+		return ret;
+
+	start = bench_time_ns();
+	for (i = 0; i < micro_ops; i++) {
+		dup = fi_dupinfo(info);
+		sum += dup->tx_attr->size + dup->domain_attr->name[0];
+		fi_freeinfo(dup);
+	}
+	end = bench_time_ns();
+	micro_report("info_dup_free", 0, micro_ops, 1, end - start);
+
+	memset(&mt, 0, sizeof mt);
+	mt.op = info_mt_op;
+	mt.arg = info;
+	micro_mt_run("info_dup_free_mt", 0, &mt);
+
+	fi_freeinfo(info);
+	return sum ? 0 : -FI_EOTHER;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	ret = bench_parse_args(argc, argv, "micro", NULL);
+	if (ret)
+		return EXIT_FAILURE;
+
+	micro_ops = opts.iterations * MICRO_OPS_SCALE;
+	micro_threads = opts.threads > 1 ? opts.threads : MICRO_MT_THREADS;
+
+	ret = micro_rbuf();
+	if (!ret)
+		ret = micro_idm();
+	if (!ret)
+		ret = micro_radix();
+	if (!ret)
+		ret = micro_dlist();
+	if (!ret)
+		ret = micro_rx_match();
+	if (!ret)
+		ret = micro_rx_cancel();
+	if (!ret)
+		ret = micro_av_lookup();
+	if (!ret)
+		ret = micro_eq();
+	if (!ret)
+		ret = micro_info();
+	bench_report_done();
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+#define RATE_MSG_SIZE	8
+
+struct rate_thread {
+	pthread_t thread;
+	struct bench_rdm rdm;
+	char buf[2][RATE_MSG_SIZE];
+	char mbuf[BENCH_WINDOW * RATE_MSG_SIZE];
+	long msgs;
+	uint64_t more;
+	int multi;
+	int ret;
+};
+
+static pthread_barrier_t barrier;
+
+/*
+ * Each thread streams 8-byte messages between its own pair of endpoints.
+ * With FI_MORE all sends of a window but the last are posted as a batch;
+ * with multi set a whole window lands in one FI_MULTI_RECV buffer.
+ */
+static int rate_stream(struct rate_thread *t, long windows)
+{
+	struct bench_ep *a = &t->rdm.eps[0], *b = &t->rdm.eps[1];
+	struct fi_msg msg, rmsg;
+	struct iovec iov, riov;
+	long i;
+	int j;
+
+	iov.iov_base = t->buf[0];
+	iov.iov_len = RATE_MSG_SIZE;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.iov_count = 1;
+	msg.addr = b->addr;
+
+	riov.iov_base = t->mbuf;
+	riov.iov_len = sizeof t->mbuf;
+	memset(&rmsg, 0, sizeof rmsg);
+	rmsg.msg_iov = &riov;
+	rmsg.iov_count = 1;
+	rmsg.addr = FI_ADDR_UNSPEC;
+
+	for (i = 0; i < windows; i++) {
+		if (t->multi)
+			BENCH_POST(fi_recvmsg(b->ep, &rmsg, FI_MULTI_RECV),
+				   b->rx_cq);
+		else for (j = 0; j < BENCH_WINDOW; j++)
+			BENCH_POST(fi_recv(b->ep, t->buf[1], RATE_MSG_SIZE,
+					   NULL, FI_ADDR_UNSPEC, NULL),
+				   b->rx_cq);
+		for (j = 0; j < BENCH_WINDOW; j++)
+			BENCH_POST(fi_sendmsg(a->ep, &msg,
+					      j < BENCH_WINDOW - 1 ?
+					      t->more : 0), a->tx_cq);
+
+		BENCH_CHECK(bench_cq_wait(a->tx_cq, BENCH_WINDOW));
+		BENCH_CHECK(bench_cq_wait(b->rx_cq, BENCH_WINDOW));
+	}
+	return 0;
+}
+
+static void *rate_thread(void *arg)
+{
+	struct rate_thread *t = arg;
+
+	bench_progress_set(t->rdm.eps, t->rdm.num_eps);
+	t->ret = rate_stream(t, 1);
+	pthread_barrier_wait(&barrier);
+	if (!t->ret)
+		t->ret = rate_stream(t, t->msgs / BENCH_WINDOW);
+	pthread_barrier_wait(&barrier);
+	return NULL;
+}
+
+static int run(const char *test, struct rate_thread *threads, uint64_t more,
+	       int multi)
+{
+	uint64_t start, end;
+	long msgs;
+	int i, ret = 0;
+
+	msgs = opts.iterations < BENCH_WINDOW ? BENCH_WINDOW : opts.iterations;
+	pthread_barrier_init(&barrier, NULL, opts.threads + 1);
+	for (i = 0; i < opts.threads; i++) {
+		threads[i].msgs = msgs;
+		threads[i].more = more;
+		threads[i].multi = multi;
+		ret = pthread_create(&threads[i].thread, NULL, rate_thread,
+				     &threads[i]);
+		if (ret) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = bench_time_ns();
+	pthread_barrier_wait(&barrier);
+	end = bench_time_ns();
+
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].ret)
+			ret = threads[i].ret;
+	}
+	pthread_barrier_destroy(&barrier);
+	if (ret)
+		return ret;
+
+	msgs = (msgs / BENCH_WINDOW) * BENCH_WINDOW * opts.threads;
+	bench_report(test, RATE_MSG_SIZE, msgs,
+		     msgs * 1000.0 / (end - start), "Mmsg/s");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct rate_thread *threads;
+	size_t min_multi_recv = RATE_MSG_SIZE;
+	int i, ret = 0;
+
+	ret = bench_parse_args(argc, argv, "msg_rate", NULL);
+	if (ret)
+		return EXIT_FAILURE;
+
+	threads = calloc(opts.threads, sizeof(*threads));
+	if (!threads)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < opts.threads && !ret; i++) {
+		ret = bench_rdm_open(&threads[i].rdm, FI_MSG | FI_MULTI_RECV, 2);
+		if (!ret)
+			ret = fi_setopt(&threads[i].rdm.eps[1].ep->fid,
+					FI_OPT_ENDPOINT, FI_OPT_MIN_MULTI_RECV,
+					&min_multi_recv, sizeof min_multi_recv);
+	}
+
+	if (!ret)
+		ret = run("rdm_rate", threads, 0, 0);
+	if (!ret)
+		ret = run("rdm_rate_more", threads, FI_MORE, 0);
+	if (!ret)
+		ret = run("rdm_rate_multi_recv", threads, 0, 1);
+	bench_report_done();
+
+	for (i = 0; i < opts.threads; i++)
+		bench_rdm_close(&threads[i].rdm);
+	free(threads);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+#define RMA_KEY		0xC0DE
+
+enum rma_op {
+	RMA_WRITE,
+	RMA_READ,
+};
+
+struct rma_target {
+	struct fid_mr *mr;
+	uint64_t addr;
+	uint64_t key;
+};
+
+/* issues windows of depth RMA operations from a into the target buffer */
+static int rma_stream(struct bench_ep *a, fi_addr_t dest,
+		      struct rma_target *target, enum rma_op op, char *buf,
+		      size_t size, long windows, int depth)
+{
+	long i;
+	int j;
+
+	for (i = 0; i < windows; i++) {
+		for (j = 0; j < depth; j++) {
+			if (op == RMA_WRITE)
+				BENCH_POST(fi_write(a->ep, buf, size, NULL,
+						    dest, target->addr,
+						    target->key, NULL),
+					   a->tx_cq);
+			else
+				BENCH_POST(fi_read(a->ep, buf, size, NULL,
+						   dest, target->addr,
+						   target->key, NULL),
+					   a->tx_cq);
+		}
+		BENCH_CHECK(bench_cq_wait(a->tx_cq, depth));
+	}
+	return 0;
+}
+
+static int run(const char *test, struct bench_rdm *rdm,
+	       struct rma_target *target, enum rma_op op, char *buf)
+{
+	struct bench_ep *a = &rdm->eps[0];
+	fi_addr_t dest = rdm->eps[1].addr;
+	uint64_t start, end;
+	size_t size = 0;
+	long iterations;
+	char name[64];
+
+	while (bench_next_size(&size)) {
+		iterations = bench_iterations(opts.iterations, size);
+
+		/* one operation in flight: completion latency */
+		BENCH_CHECK(rma_stream(a, dest, target, op, buf, size,
+				       opts.warmup, 1));
+		start = bench_time_ns();
+		BENCH_CHECK(rma_stream(a, dest, target, op, buf, size,
+				       iterations, 1));
+		end = bench_time_ns();
+		snprintf(name, sizeof name, "%s_lat", test);
+		bench_report(name, size, iterations,
+			     (end - start) / 1000.0 / iterations, "usec");
+
+		/* a full window in flight: bandwidth */
+		iterations /= BENCH_WINDOW;
+		start = bench_time_ns();
+		BENCH_CHECK(rma_stream(a, dest, target, op, buf, size,
+				       iterations, BENCH_WINDOW));
+		end = bench_time_ns();
+		snprintf(name, sizeof name, "%s_bw", test);
+		bench_report(name, size, iterations * BENCH_WINDOW,
+			     (double) size * iterations * BENCH_WINDOW *
+			     1000.0 / (end - start), "MB/s");
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_rdm rdm;
+	struct rma_target target;
+	char *buf;
+	int ret;
+
+	ret = bench_parse_args(argc, argv, "rma", NULL);
+	if (ret)
+		return EXIT_FAILURE;
+
+	buf = calloc(2, BENCH_MAX_SIZE);
+	if (!buf)
+		return EXIT_FAILURE;
+
+	memset(&target, 0, sizeof target);
+	ret = bench_rdm_open(&rdm, FI_RMA, 2);
+	if (!ret)
+		ret = bench_mr_reg(rdm.nodes[1].domain, buf + BENCH_MAX_SIZE,
+				   BENCH_MAX_SIZE,
+				   FI_REMOTE_READ | FI_REMOTE_WRITE, RMA_KEY,
+				   &target.mr);
+	if (!ret) {
+		target.addr = (uintptr_t) (buf + BENCH_MAX_SIZE);
+		target.key = fi_mr_key(target.mr);
+		ret = run("rdm_write", &rdm, &target, RMA_WRITE, buf);
+	}
+	if (!ret)
+		ret = run("rdm_read", &rdm, &target, RMA_READ, buf);
+	bench_report_done();
+
+	if (target.mr)
+		fi_close(&target.mr->fid);
+	bench_rdm_close(&rdm);
+	free(buf);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
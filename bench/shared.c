@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared.h"
+
+struct bench_opts opts = {
+	.iterations = 10000,
+	.warmup = 100,
+	.size = 0,
+	.threads = 1,
+	.peers = 16,
+	.depth = 0,
+	.port = BENCH_DEF_PORT,
+	.progress = FI_PROGRESS_AUTO,
+	.format = BENCH_FMT_CSV,
+};
+
+static const char *bench_name;
+static int bench_reported;
+
+/*
+ * With manual progress a single thread drives both sides of a transfer,
+ * so waiting on one CQ also progresses the CQs of the thread's peers.
+ */
+static __thread struct bench_ep *progress_eps;
+static __thread int progress_cnt;
+
+void bench_progress_set(struct bench_ep *eps, int count)
+{
+	progress_eps = eps;
+	progress_cnt = count;
+}
+
+void bench_progress(void)
+{
+	int i;
+
+	if (opts.progress != FI_PROGRESS_MANUAL)
+		return;
+
+	for (i = 0; i < progress_cnt; i++) {
+		if (progress_eps[i].tx_cq)
+			fi_cq_read(progress_eps[i].tx_cq, NULL, 0);
+		if (progress_eps[i].rx_cq)
+			fi_cq_read(progress_eps[i].rx_cq, NULL, 0);
+	}
+}
+
+static void bench_usage(const char *name, const char *usage)
+{
+	fprintf(stderr, "usage: %s [options]\n", name);
+	fprintf(stderr, "  -i <count>   iterations (default %ld)\n",
+		opts.iterations);
+	fprintf(stderr, "  -w <count>   warmup iterations (default %ld)\n",
+		opts.warmup);
+	fprintf(stderr, "  -s <bytes>   transfer size (default: sweep)\n");
+	fprintf(stderr, "  -t <count>   threads (default %d)\n", opts.threads);
+	fprintf(stderr, "  -p <count>   peers (default %d)\n", opts.peers);
+	fprintf(stderr, "  -d <count>   queue depth (default: sweep)\n");
+	fprintf(stderr, "  -P <port>    base port (default %d)\n", opts.port);
+	fprintf(stderr, "  -m           use manual progress\n");
+	fprintf(stderr, "  -f csv|json  output format (default csv)\n");
+	if (usage)
+		fprintf(stderr, "%s", usage);
+}
+
+int bench_parse_args(int argc, char **argv, const char *name,
+		     const char *usage)
+{
+	int op;
+
+	bench_name = name;
+	signal(SIGPIPE, SIG_IGN);
+	while ((op = getopt(argc, argv, "i:w:s:t:p:d:P:mf:h")) != -1) {
+		switch (op) {
+		case 'i':
+			opts.iterations = atol(optarg);
+			break;
+		case 'w':
+			opts.warmup = atol(optarg);
+			break;
+		case 's':
+			opts.size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'p':
+			opts.peers = atoi(optarg);
+			break;
+		case 'd':
+			opts.depth = atoi(optarg);
+			break;
+		case 'P':
+			opts.port = atoi(optarg);
+			break;
+		case 'm':
+			opts.progress = FI_PROGRESS_MANUAL;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "json")) {
+				opts.format = BENCH_FMT_JSON;
+			} else if (!strcmp(optarg, "csv")) {
+				opts.format = BENCH_FMT_CSV;
+			} else {
+				bench_usage(name, usage);
+				return -FI_EINVAL;
+			}
+			break;
+		default:
+			bench_usage(name, usage);
+			return -FI_EINVAL;
+		}
+	}
+
+	if (opts.iterations <= 0 || opts.threads <= 0 || opts.peers <= 0 ||
+	    opts.size > BENCH_MAX_SIZE || opts.depth < 0 ||
+	    opts.depth > BENCH_MAX_DEPTH) {
+		bench_usage(name, usage);
+		return -FI_EINVAL;
+	}
+	return 0;
+}
+
+uint64_t bench_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Steps through the transfer sizes of a run: the size given on the
+ * command line, or powers of two from 1 byte to 1 MiB.
+ */
+int bench_next_size(size_t *size)
+{
+	if (opts.size) {
+		if (*size)
+			return 0;
+		*size = opts.size;
+		return 1;
+	}
+
+	*size = *size ? *size * 2 : 1;
+	return *size <= (1 << 20);
+}
+
+/*
+ * Large transfers are dominated by copy time; scale their iteration
+ * count down so that a sweep finishes in bounded time.
+ */
+long bench_iterations(long iterations, size_t size)
+{
+	if (size > BENCH_SCALE_SIZE)
+		iterations /= size / BENCH_SCALE_SIZE;
+	return iterations < BENCH_WINDOW ? BENCH_WINDOW : iterations;
+}
+
+void bench_report(const char *test, size_t size, long iterations,
+		  double value, const char *unit)
+{
+	bench_report_mt(test, size, iterations, opts.threads, value, unit);
+}
+
+void bench_report_mt(const char *test, size_t size, long iterations,
+		     int threads, double value, const char *unit)
+{
+	const char *progress;
+
+	progress = (opts.progress == FI_PROGRESS_MANUAL) ? "manual" : "auto";
+	switch (opts.format) {
+	case BENCH_FMT_JSON:
+		printf("%s\n  {\"benchmark\": \"%s\", \"test\": \"%s\", "
+		       "\"size\": %zu, \"iterations\": %ld, \"threads\": %d, "
+		       "\"progress\": \"%s\", \"value\": %.3f, "
+		       "\"unit\": \"%s\"}",
+		       bench_reported ? "," : "[", bench_name, test, size,
+		       iterations, threads, progress, value, unit);
+		break;
+	case BENCH_FMT_CSV:
+	default:
+		if (!bench_reported)
+			printf("benchmark,test,size,iterations,threads,"
+			       "progress,value,unit\n");
+		printf("%s,%s,%zu,%ld,%d,%s,%.3f,%s\n", bench_name, test,
+		       size, iterations, threads, progress, value, unit);
+		break;
+	}
+	bench_reported = 1;
+	fflush(stdout);
+}
+
+void bench_report_done(void)
+{
+	if (opts.format == BENCH_FMT_JSON)
+		printf("%s]\n", bench_reported ? "\n" : "[");
+}
+
+static struct fi_info *bench_hints(enum fi_ep_type type, uint64_t caps)
+{
+	struct fi_info *hints;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return NULL;
+
+	hints->ep_type = type;
+	hints->caps = caps;
+	hints->mode = ~0ULL;
+	hints->domain_attr->data_progress = opts.progress;
+	hints->domain_attr->control_progress = opts.progress;
+	hints->fabric_attr->prov_name = strdup("sockets");
+	return hints;
+}
+
+/*
+ * Every domain listens on its own port. Ports are never reused within
+ * a run, so closed connections lingering in TIME_WAIT do not collide
+ * with a later test.
+ */
+static int bench_getinfo(enum fi_ep_type type, uint64_t caps,
+			 struct fi_info **info)
+{
+	static int port_offset;
+	struct fi_info *hints;
+	char service[16];
+	int ret;
+
+	hints = bench_hints(type, caps);
+	if (!hints)
+		return -FI_ENOMEM;
+
+	snprintf(service, sizeof service, "%d", opts.port + port_offset++);
+	ret = fi_getinfo(FI_VERSION(1, 0), BENCH_NODE, service, FI_SOURCE,
+			 hints, info);
+	fi_freeinfo(hints);
+	if (ret)
+		return ret;
+
+	/* the returned attributes carry the provider defaults */
+	(*info)->domain_attr->data_progress = opts.progress;
+	(*info)->domain_attr->control_progress = opts.progress;
+
+	/*
+	 * A single manually progressed thread serializes everything, which
+	 * lets the provider drop its data path locks.
+	 */
+	if (opts.progress == FI_PROGRESS_MANUAL && opts.threads == 1)
+		(*info)->domain_attr->threading = FI_THREAD_DOMAIN;
+	return 0;
+}
+
+static int bench_ep_open(struct fid_domain *domain, struct fi_info *info,
+			 struct bench_ep *ep)
+{
+	struct fi_cq_attr cq_attr;
+
+	memset(&cq_attr, 0, sizeof cq_attr);
+	cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+	cq_attr.wait_obj = FI_WAIT_NONE;
+	cq_attr.size = BENCH_CQ_SIZE;
+	cq_attr.flags = FI_WRITE;	/* lets cq_poll inject entries */
+
+	BENCH_CHECK(fi_cq_open(domain, &cq_attr, &ep->tx_cq, NULL));
+	BENCH_CHECK(fi_cq_open(domain, &cq_attr, &ep->rx_cq, NULL));
+	BENCH_CHECK(fi_endpoint(domain, info, &ep->ep, NULL));
+	BENCH_CHECK(fi_ep_bind(ep->ep, &ep->tx_cq->fid, FI_SEND));
+	BENCH_CHECK(fi_ep_bind(ep->ep, &ep->rx_cq->fid, FI_RECV));
+	return 0;
+}
+
+static void bench_ep_close(struct bench_ep *ep)
+{
+	if (ep->ep)
+		fi_close(&ep->ep->fid);
+	if (ep->tx_cq)
+		fi_close(&ep->tx_cq->fid);
+	if (ep->rx_cq)
+		fi_close(&ep->rx_cq->fid);
+	memset(ep, 0, sizeof *ep);
+}
+
+int bench_rdm_open(struct bench_rdm *rdm, uint64_t caps, int num_eps)
+{
+	struct fi_av_attr av_attr;
+	struct bench_node *node;
+	char *names;
+	size_t len;
+	int i, j, ret = 0;
+
+	memset(rdm, 0, sizeof *rdm);
+	rdm->eps = calloc(num_eps, sizeof(*rdm->eps));
+	rdm->nodes = calloc(num_eps, sizeof(*rdm->nodes));
+	names = calloc(num_eps, BENCH_NAME_LEN);
+	if (!rdm->eps || !rdm->nodes || !names) {
+		ret = -FI_ENOMEM;
+		goto out;
+	}
+	rdm->num_eps = num_eps;
+
+	memset(&av_attr, 0, sizeof av_attr);
+	av_attr.type = FI_AV_TABLE;
+	av_attr.count = num_eps;
+
+	for (i = 0; i < num_eps; i++) {
+		node = &rdm->nodes[i];
+		ret = bench_getinfo(FI_EP_RDM, caps, &node->info);
+		if (ret)
+			goto out;
+		if (!rdm->fabric) {
+			ret = fi_fabric(node->info->fabric_attr, &rdm->fabric,
+					NULL);
+			if (ret)
+				goto out;
+		}
+		ret = fi_domain(rdm->fabric, node->info, &node->domain, NULL);
+		if (ret)
+			goto out;
+		ret = fi_av_open(node->domain, &av_attr, &node->av, NULL);
+		if (ret)
+			goto out;
+		ret = bench_ep_open(node->domain, node->info, &rdm->eps[i]);
+		if (ret)
+			goto out;
+		ret = fi_ep_bind(rdm->eps[i].ep, &node->av->fid, 0);
+		if (ret)
+			goto out;
+		ret = fi_enable(rdm->eps[i].ep);
+		if (ret)
+			goto out;
+
+		len = BENCH_NAME_LEN;
+		ret = fi_getname(&rdm->eps[i].ep->fid,
+				 names + i * BENCH_NAME_LEN, &len);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < num_eps; i++) {
+		for (j = 0; j < num_eps; j++) {
+			if (fi_av_insert(rdm->nodes[i].av,
+					 names + j * BENCH_NAME_LEN, 1,
+					 &rdm->eps[j].addr, 0, NULL) != 1) {
+				fprintf(stderr, "fi_av_insert failed\n");
+				ret = -FI_EINVAL;
+				goto out;
+			}
+		}
+	}
+	bench_progress_set(rdm->eps, num_eps);
+out:
+	if (ret)
+		fprintf(stderr, "bench_rdm_open: %s\n", fi_strerror(-ret));
+	free(names);
+	return ret;
+}
+
+void bench_rdm_close(struct bench_rdm *rdm)
+{
+	int i;
+
+	bench_progress_set(NULL, 0);
+	for (i = 0; i < rdm->num_eps; i++) {
+		bench_ep_close(&rdm->eps[i]);
+		if (rdm->nodes[i].av)
+			fi_close(&rdm->nodes[i].av->fid);
+		if (rdm->nodes[i].domain)
+			fi_close(&rdm->nodes[i].domain->fid);
+		if (rdm->nodes[i].info)
+			fi_freeinfo(rdm->nodes[i].info);
+	}
+	free(rdm->eps);
+	free(rdm->nodes);
+	if (rdm->fabric)
+		fi_close(&rdm->fabric->fid);
+	memset(rdm, 0, sizeof *rdm);
+}
+
+int bench_msg_open(struct bench_msg *msg, uint64_t caps)
+{
+	struct fi_eq_attr eq_attr;
+	struct sockaddr_in *sin;
+
+	memset(msg, 0, sizeof *msg);
+	BENCH_CHECK(bench_getinfo(FI_EP_MSG, caps, &msg->info));
+	BENCH_CHECK(fi_fabric(msg->info->fabric_attr, &msg->fabric, NULL));
+
+	memset(&eq_attr, 0, sizeof eq_attr);
+	eq_attr.wait_obj = FI_WAIT_NONE;
+	BENCH_CHECK(fi_eq_open(msg->fabric, &eq_attr, &msg->eq, NULL));
+
+	/* accepted endpoints all live in the listener's domain */
+	BENCH_CHECK(fi_domain(msg->fabric, msg->info, &msg->domain, NULL));
+	BENCH_CHECK(fi_passive_ep(msg->fabric, msg->info, &msg->pep, NULL));
+	BENCH_CHECK(fi_pep_bind(msg->pep, &msg->eq->fid, 0));
+	BENCH_CHECK(fi_listen(msg->pep));
+
+	msg->namelen = sizeof msg->name;
+	BENCH_CHECK(fi_getname(&msg->pep->fid, msg->name, &msg->namelen));
+
+	/* a wildcard listener is reached through the loopback address */
+	sin = (struct sockaddr_in *) msg->name;
+	if (sin->sin_family == AF_INET && sin->sin_addr.s_addr == INADDR_ANY)
+		sin->sin_addr.s_addr = inet_addr(BENCH_NODE);
+	return 0;
+}
+
+static struct bench_conn *bench_msg_find(struct bench_conn *conns, int count,
+					 fid_t fid)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if ((conns[i].client.ep && &conns[i].client.ep->fid == fid) ||
+		    (conns[i].server.ep && &conns[i].server.ep->fid == fid))
+			return &conns[i];
+	}
+	return NULL;
+}
+
+/*
+ * Issues all connection requests up front and then serves the listener
+ * until every pair has seen both of its FI_CONNECTED events.
+ */
+int bench_msg_connect(struct bench_msg *msg, struct bench_conn *conns,
+		      int count, uint64_t caps)
+{
+	struct fi_eq_cm_entry entry;
+	struct fi_eq_err_entry err_entry;
+	struct bench_conn *conn;
+	struct bench_ep *server;
+	uint32_t event;
+	ssize_t rd;
+	int i, pending = 2 * count, accepted = 0;
+
+	for (i = 0; i < count; i++) {
+		memset(&conns[i], 0, sizeof conns[i]);
+		BENCH_CHECK(bench_getinfo(FI_EP_MSG, caps, &conns[i].info));
+		if (conns[i].info->dest_addr &&
+		    conns[i].info->dest_addrlen == msg->namelen)
+			memcpy(conns[i].info->dest_addr, msg->name,
+			       msg->namelen);
+		BENCH_CHECK(fi_domain(msg->fabric, conns[i].info,
+				      &conns[i].domain, NULL));
+		BENCH_CHECK(bench_ep_open(conns[i].domain, conns[i].info,
+					  &conns[i].client));
+		BENCH_CHECK(fi_ep_bind(conns[i].client.ep, &msg->eq->fid, 0));
+		BENCH_CHECK(fi_connect(conns[i].client.ep, msg->name, NULL, 0));
+	}
+
+	while (pending) {
+		rd = fi_eq_read(msg->eq, &event, &entry, sizeof entry, 0);
+		if (rd == -FI_EAGAIN || rd == -FI_ETIMEDOUT || rd == 0)
+			continue;
+
+		if (rd == -FI_EAVAIL) {
+			fi_eq_readerr(msg->eq, &err_entry, 0);
+			fprintf(stderr, "connection error: %s\n",
+				fi_strerror(err_entry.err));
+			return -err_entry.err;
+		} else if (rd < 0) {
+			fprintf(stderr, "fi_eq_read: %s\n",
+				fi_strerror((int) -rd));
+			return (int) rd;
+		}
+
+		switch (event) {
+		case FI_CONNREQ:
+			if (accepted == count) {
+				fi_reject(msg->pep, entry.info->connreq,
+					  NULL, 0);
+				fi_freeinfo(entry.info);
+				break;
+			}
+			server = &conns[accepted++].server;
+			BENCH_CHECK(bench_ep_open(msg->domain, entry.info,
+						  server));
+			BENCH_CHECK(fi_ep_bind(server->ep, &msg->eq->fid, 0));
+			BENCH_CHECK(fi_accept(server->ep, NULL, 0));
+			fi_freeinfo(entry.info);
+			break;
+
+		case FI_CONNECTED:
+			conn = bench_msg_find(conns, count, entry.fid);
+			if (conn)
+				conn->connected++;
+			pending--;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	free(msg->eps);
+	msg->eps = calloc(2 * count, sizeof(*msg->eps));
+	if (!msg->eps)
+		return -FI_ENOMEM;
+	for (i = 0; i < count; i++) {
+		msg->eps[2 * i] = conns[i].client;
+		msg->eps[2 * i + 1] = conns[i].server;
+	}
+	bench_progress_set(msg->eps, 2 * count);
+	return 0;
+}
+
+void bench_msg_disconnect(struct bench_conn *conn)
+{
+	if (conn->client.ep)
+		fi_shutdown(conn->client.ep, 0);
+	bench_ep_close(&conn->client);
+	bench_ep_close(&conn->server);
+	if (conn->domain)
+		fi_close(&conn->domain->fid);
+	if (conn->info)
+		fi_freeinfo(conn->info);
+	memset(conn, 0, sizeof *conn);
+}
+
+void bench_msg_close(struct bench_msg *msg)
+{
+	bench_progress_set(NULL, 0);
+	free(msg->eps);
+	if (msg->pep)
+		fi_close(&msg->pep->fid);
+	if (msg->domain)
+		fi_close(&msg->domain->fid);
+	if (msg->eq)
+		fi_close(&msg->eq->fid);
+	if (msg->fabric)
+		fi_close(&msg->fabric->fid);
+	if (msg->info)
+		fi_freeinfo(msg->info);
+	memset(msg, 0, sizeof *msg);
+}
+
+int bench_cq_wait(struct fid_cq *cq, long count)
+{
+	struct fi_cq_entry comp[BENCH_CQ_BATCH];
+	struct fi_cq_err_entry err_entry;
+	ssize_t ret;
+
+	while (count > 0) {
+		ret = fi_cq_read(cq, comp, count < BENCH_CQ_BATCH ?
+				 count : BENCH_CQ_BATCH);
+		if (ret > 0) {
+			count -= ret;
+		} else if (ret == -FI_EAVAIL) {
+			fi_cq_readerr(cq, &err_entry, 0);
+			fprintf(stderr, "completion error: %s\n",
+				fi_strerror(err_entry.err));
+			return -err_entry.err;
+		} else if (ret < 0 && ret != -FI_EAGAIN) {
+			fprintf(stderr, "fi_cq_read: %s\n",
+				fi_strerror((int) -ret));
+			return (int) ret;
+		} else {
+			bench_progress();
+		}
+	}
+	return 0;
+}
+
+int bench_mr_reg(struct fid_domain *domain, void *buf, size_t len,
+		 uint64_t access, uint64_t key, struct fid_mr **mr)
+{
+	return fi_mr_reg(domain, buf, len, access, 0, key, 0, mr, NULL);
+}
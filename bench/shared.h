@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef _BENCH_SHARED_H_
+#define _BENCH_SHARED_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_atomic.h>
+#include <rdma/fi_cm.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_eq.h>
+#include <rdma/fi_errno.h>
+#include <rdma/fi_rma.h>
+#include <rdma/fi_tagged.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BENCH_NODE		"127.0.0.1"
+#define BENCH_DEF_PORT		9228
+#define BENCH_MAX_SIZE		(1 << 22)
+#define BENCH_WINDOW		64
+#define BENCH_CQ_BATCH		16
+#define BENCH_CQ_SIZE		4096
+#define BENCH_MAX_DEPTH		1024
+#define BENCH_NAME_LEN		64
+#define BENCH_SCALE_SIZE	(1 << 16)
+
+enum bench_format {
+	BENCH_FMT_CSV,
+	BENCH_FMT_JSON,
+};
+
+struct bench_opts {
+	long iterations;
+	long warmup;
+	size_t size;		/* 0 sweeps the default sizes */
+	int threads;
+	int peers;
+	int depth;
+	int port;
+	enum fi_progress progress;
+	enum bench_format format;
+};
+
+extern struct bench_opts opts;
+
+struct bench_ep {
+	struct fid_ep *ep;
+	struct fid_cq *tx_cq;
+	struct fid_cq *rx_cq;
+	fi_addr_t addr;
+};
+
+/* per-endpoint resources of an RDM run: one domain per simulated node */
+struct bench_node {
+	struct fi_info *info;
+	struct fid_domain *domain;
+	struct fid_av *av;
+};
+
+/*
+ * RDM endpoints that each live in their own domain. Every AV holds all
+ * endpoint names in the same order, so eps[i].addr is valid everywhere.
+ */
+struct bench_rdm {
+	struct fid_fabric *fabric;
+	int num_eps;
+	struct bench_ep *eps;
+	struct bench_node *nodes;
+};
+
+/* connected pair of MSG endpoints */
+struct bench_conn {
+	struct fi_info *info;
+	struct fid_domain *domain;
+	struct bench_ep client;
+	struct bench_ep server;
+	int connected;
+};
+
+struct bench_msg {
+	struct fi_info *info;
+	struct fid_fabric *fabric;
+	struct fid_domain *domain;
+	struct fid_eq *eq;
+	struct fid_pep *pep;
+	char name[BENCH_NAME_LEN];
+	size_t namelen;
+	struct bench_ep *eps;	/* handles of all connected pairs */
+};
+
+int bench_parse_args(int argc, char **argv, const char *name,
+		     const char *usage);
+uint64_t bench_time_ns(void);
+int bench_next_size(size_t *size);
+long bench_iterations(long iterations, size_t size);
+
+void bench_report(const char *test, size_t size, long iterations,
+		  double value, const char *unit);
+void bench_report_mt(const char *test, size_t size, long iterations,
+		     int threads, double value, const char *unit);
+void bench_report_done(void);
+
+int bench_rdm_open(struct bench_rdm *rdm, uint64_t caps, int num_eps);
+void bench_rdm_close(struct bench_rdm *rdm);
+
+int bench_msg_open(struct bench_msg *msg, uint64_t caps);
+int bench_msg_connect(struct bench_msg *msg, struct bench_conn *conns,
+		      int count, uint64_t caps);
+void bench_msg_disconnect(struct bench_conn *conn);
+void bench_msg_close(struct bench_msg *msg);
+
+int bench_cq_wait(struct fid_cq *cq, long count);
+void bench_progress_set(struct bench_ep *eps, int count);
+void bench_progress(void);
+int bench_mr_reg(struct fid_domain *domain, void *buf, size_t len,
+		 uint64_t access, uint64_t key, struct fid_mr **mr);
+
+#define BENCH_CHECK(call)						\
+	do {								\
+		int _ret = (int) (call);				\
+		if (_ret) {						\
+			fprintf(stderr, "%s:%d: %s: %s\n", __FILE__,	\
+				__LINE__, #call, fi_strerror(-_ret));	\
+			return _ret;					\
+		}							\
+	} while (0)
+
+#define BENCH_POST(call, cq)						\
+	do {								\
+		ssize_t _ret;						\
+		while ((_ret = (call)) == -FI_EAGAIN) {			\
+			fi_cq_read(cq, NULL, 0);			\
+			bench_progress();				\
+		}							\
+		if (_ret) {						\
+			fprintf(stderr, "%s:%d: %s: %s\n", __FILE__,	\
+				__LINE__, #call, fi_strerror((int) -_ret)); \
+			return (int) _ret;				\
+		}							\
+	} while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BENCH_SHARED_H_ */
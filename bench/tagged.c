@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+#define TAGGED_MSG_SIZE	8
+
+static char tx_buf[TAGGED_MSG_SIZE], rx_buf[TAGGED_MSG_SIZE];
+
+/* queue depths of a sweep: the -d value, or powers of four up to 1024 */
+static int next_depth(int *depth)
+{
+	if (opts.depth) {
+		if (*depth)
+			return 0;
+		*depth = opts.depth;
+		return 1;
+	}
+
+	*depth = *depth ? *depth * 4 : 1;
+	return *depth <= BENCH_MAX_DEPTH;
+}
+
+/*
+ * Posts depth receives with distinct tags and sends in the reverse tag
+ * order, so that every arriving message is matched against the tail of
+ * the posted queue.
+ */
+static int posted(struct bench_rdm *rdm, int depth)
+{
+	struct bench_ep *a = &rdm->eps[0], *b = &rdm->eps[1];
+	int i;
+
+	for (i = 0; i < depth; i++)
+		BENCH_POST(fi_trecv(b->ep, rx_buf, TAGGED_MSG_SIZE, NULL,
+				    FI_ADDR_UNSPEC, i, 0, NULL), b->rx_cq);
+	for (i = depth - 1; i >= 0; i--)
+		BENCH_POST(fi_tsend(a->ep, tx_buf, TAGGED_MSG_SIZE, NULL,
+				    b->addr, i, NULL), a->tx_cq);
+
+	BENCH_CHECK(bench_cq_wait(a->tx_cq, depth));
+	BENCH_CHECK(bench_cq_wait(b->rx_cq, depth));
+	return 0;
+}
+
+/*
+ * Lets depth messages arrive unexpected and then posts the receives in
+ * the reverse order, so that every receive searches the whole unexpected
+ * queue.
+ */
+static int unexpected(struct bench_rdm *rdm, int depth)
+{
+	struct bench_ep *a = &rdm->eps[0], *b = &rdm->eps[1];
+	int i;
+
+	for (i = 0; i < depth; i++)
+		BENCH_POST(fi_tsend(a->ep, tx_buf, TAGGED_MSG_SIZE, NULL,
+				    b->addr, i, NULL), a->tx_cq);
+	BENCH_CHECK(bench_cq_wait(a->tx_cq, depth));
+
+	for (i = depth - 1; i >= 0; i--)
+		BENCH_POST(fi_trecv(b->ep, rx_buf, TAGGED_MSG_SIZE, NULL,
+				    FI_ADDR_UNSPEC, i, 0, NULL), b->rx_cq);
+	BENCH_CHECK(bench_cq_wait(b->rx_cq, depth));
+	return 0;
+}
+
+static int run(const char *test, struct bench_rdm *rdm,
+	       int (*fn)(struct bench_rdm *, int))
+{
+	uint64_t start, end;
+	long i, rounds;
+	int depth = 0;
+	char name[64];
+
+	while (next_depth(&depth)) {
+		rounds = opts.iterations / depth;
+		if (rounds < 1)
+			rounds = 1;
+
+		BENCH_CHECK(fn(rdm, depth));
+		start = bench_time_ns();
+		for (i = 0; i < rounds; i++)
+			BENCH_CHECK(fn(rdm, depth));
+		end = bench_time_ns();
+
+		snprintf(name, sizeof name, "%s_depth%d", test, depth);
+		bench_report(name, TAGGED_MSG_SIZE, rounds * depth,
+			     (end - start) / 1000.0 / (rounds * depth),
+			     "usec/msg");
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_rdm rdm;
+	int ret;
+
+	ret = bench_parse_args(argc, argv, "tagged", NULL);
+	if (ret)
+		return EXIT_FAILURE;
+
+	ret = bench_rdm_open(&rdm, FI_TAGGED, 2);
+	if (!ret)
+		ret = run("posted", &rdm, posted);
+	if (!ret)
+		ret = run("unexpected", &rdm, unexpected);
+	bench_report_done();
+
+	bench_rdm_close(&rdm);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+/*
+ * Cost of fi_getinfo for the first call of the process, which loads
+ * and initializes the providers, and for repeated identical calls.
+ */
+static int getinfo_wireup(void)
+{
+	struct fi_info *hints, *info;
+	uint64_t start, end;
+	long i;
+	int ret;
+
+	hints = fi_allocinfo();
+	if (!hints)
+		return -FI_ENOMEM;
+	hints->ep_type = FI_EP_RDM;
+	hints->caps = FI_MSG;
+	hints->mode = ~0ULL;
+	hints->fabric_attr->prov_name = strdup("sockets");
+
+	start = bench_time_ns();
+	ret = fi_getinfo(FI_VERSION(1, 0), NULL, NULL, 0, hints, &info);
+	end = bench_time_ns();
+	if (ret)
+		goto out;
+	fi_freeinfo(info);
+	bench_report("getinfo_first", 0, 1, (end - start) / 1000.0, "usec");
+
+	start = bench_time_ns();
+	for (i = 0; i < opts.iterations; i++) {
+		ret = fi_getinfo(FI_VERSION(1, 0), NULL, NULL, 0, hints, &info);
+		if (ret)
+			goto out;
+		fi_freeinfo(info);
+	}
+	end = bench_time_ns();
+	bench_report("getinfo_repeat", 0, opts.iterations,
+		     (end - start) / 1000.0 / opts.iterations, "usec");
+out:
+	if (ret)
+		fprintf(stderr, "getinfo_wireup: %s\n", fi_strerror(-ret));
+	fi_freeinfo(hints);
+	return ret;
+}
+
+/* time to bring up opts.peers connected MSG endpoint pairs */
+static int msg_wireup(void)
+{
+	struct bench_msg msg;
+	struct bench_conn *conns;
+	uint64_t start, end;
+	int i, ret;
+
+	conns = calloc(opts.peers, sizeof(*conns));
+	if (!conns)
+		return -FI_ENOMEM;
+
+	start = bench_time_ns();
+	ret = bench_msg_open(&msg, FI_MSG);
+	if (!ret)
+		ret = bench_msg_connect(&msg, conns, opts.peers, FI_MSG);
+	end = bench_time_ns();
+	if (!ret) {
+		bench_report("msg_connect", 0, opts.peers,
+			     (end - start) / 1000.0, "usec");
+		bench_report("msg_connect_per_peer", 0, opts.peers,
+			     (end - start) / 1000.0 / opts.peers, "usec");
+	}
+
+	for (i = 0; i < opts.peers; i++)
+		bench_msg_disconnect(&conns[i]);
+	bench_msg_close(&msg);
+	free(conns);
+	return ret;
+}
+
+/*
+ * Time to open one RDM endpoint per peer plus a root, and then for the
+ * root to complete a first message to every peer. Connections are set
+ * up on first use, so the latter is the lazy wire-up cost.
+ */
+static int rdm_wireup(void)
+{
+	struct bench_rdm rdm;
+	struct bench_ep *root;
+	uint64_t start, end;
+	char buf[8];
+	int i, ret;
+
+	start = bench_time_ns();
+	ret = bench_rdm_open(&rdm, FI_MSG, opts.peers + 1);
+	end = bench_time_ns();
+	if (ret)
+		goto out;
+	bench_report("rdm_open", 0, opts.peers + 1,
+		     (end - start) / 1000.0, "usec");
+
+	root = &rdm.eps[0];
+	start = bench_time_ns();
+	for (i = 1; i <= opts.peers; i++) {
+		ret = fi_recv(rdm.eps[i].ep, buf, sizeof buf, NULL,
+			      FI_ADDR_UNSPEC, NULL);
+		if (ret)
+			goto out;
+	}
+	for (i = 1; i <= opts.peers; i++) {
+		do {
+			ret = fi_send(root->ep, buf, sizeof buf, NULL,
+				      rdm.eps[i].addr, NULL);
+			if (ret == -FI_EAGAIN)
+				bench_progress();
+		} while (ret == -FI_EAGAIN);
+		if (ret)
+			goto out;
+	}
+	ret = bench_cq_wait(root->tx_cq, opts.peers);
+	for (i = 1; !ret && i <= opts.peers; i++)
+		ret = bench_cq_wait(rdm.eps[i].rx_cq, 1);
+	end = bench_time_ns();
+	if (!ret) {
+		bench_report("rdm_first_send", sizeof buf, opts.peers,
+			     (end - start) / 1000.0, "usec");
+		bench_report("rdm_first_send_per_peer", sizeof buf,
+			     opts.peers,
+			     (end - start) / 1000.0 / opts.peers, "usec");
+	}
+out:
+	if (ret)
+		fprintf(stderr, "rdm_wireup: %s\n", fi_strerror(-ret));
+	bench_rdm_close(&rdm);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	ret = bench_parse_args(argc, argv, "wireup", NULL);
+	if (ret)
+		return EXIT_FAILURE;
+
+	ret = getinfo_wireup();
+	if (!ret)
+		ret = msg_wireup();
+	if (!ret)
+		ret = rdm_wireup();
+	bench_report_done();
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
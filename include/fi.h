@@ -209,6 +209,14 @@ int fi_rma_target_allowed(uint64_t caps);
 
 uint64_t fi_gettime_ms();
 
+/* fi_info and its attributes in one allocation, released by fi_freeinfo */
+struct fi_info *fi_allocinfo_arena(size_t src_addrlen, size_t dest_addrlen,
+				   const char *domain_name,
+				   const char *fabric_name,
+				   const char *prov_name);
+struct fi_info *fi_dupinfo_arena(const struct fi_info *info);
+int fi_freeinfo_arena(struct fi_info *info);
+
 #define RDMA_CONF_DIR  SYSCONFDIR "/" RDMADIR
 #define FI_CONF_DIR RDMA_CONF_DIR "/fabric"
 
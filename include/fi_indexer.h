@@ -38,6 +38,7 @@
 #  include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#include <stdint.h>
 #include <sys/types.h>
 
 /*
@@ -104,4 +105,51 @@ static inline void *idm_lookup(struct index_map *idm, int index)
 		idm_at(idm, index) : NULL;
 }
 
+/*
+ * Radix map - associates a structure with a 64-bit index.  The tree
+ * grows in height as larger indices are set, so small maps stay one
+ * level deep.  Lookups take no lock, and set/clear on different indices
+ * do not contend: nodes are installed with compare-and-swap and are only
+ * released by radix_map_destroy, so a reader never sees a freed node.
+ * Callers serialize set/clear of the same index.  Initialize by setting
+ * the map to 0.
+ */
+
+#define RADIX_BITS	8
+#define RADIX_SIZE	(1 << RADIX_BITS)
+#define RADIX_MASK	(RADIX_SIZE - 1)
+
+struct radix_node
+{
+	int		shift;
+	void		*slot[RADIX_SIZE];
+};
+
+struct radix_map
+{
+	struct radix_node *root;
+};
+
+int radix_map_set(struct radix_map *map, uint64_t index, void *item);
+void *radix_map_clear(struct radix_map *map, uint64_t index);
+void radix_map_destroy(struct radix_map *map);
+
+static inline void *radix_map_lookup(struct radix_map *map, uint64_t index)
+{
+	struct radix_node *node;
+	void *item;
+
+	node = __atomic_load_n(&map->root, __ATOMIC_ACQUIRE);
+	if (!node || (index >> node->shift) >> RADIX_BITS)
+		return NULL;
+
+	for (;;) {
+		item = __atomic_load_n(&node->slot[(index >> node->shift) &
+						   RADIX_MASK], __ATOMIC_ACQUIRE);
+		if (!node->shift || !item)
+			return item;
+		node = item;
+	}
+}
+
 #endif /* INDEXER_H */
@@ -38,6 +38,9 @@
 #  include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -47,6 +50,10 @@
 
 /*
  * Simple ring buffer
+ *
+ * A mirrored ring maps its pages twice back to back, so that any span of
+ * up to size bytes is contiguous and can be handed to memcpy or to a
+ * socket call in one piece.
  */
 struct ringbuf {
 	size_t		size;
@@ -55,6 +62,7 @@ struct ringbuf {
 	size_t		wcnt;
 	size_t		wpos;
 	void		*buf;
+	int		mirrored;
 };
 
 static inline int rbinit(struct ringbuf *rb, size_t size)
@@ -64,15 +72,81 @@ static inline int rbinit(struct ringbuf *rb, size_t size)
 	rb->rcnt = 0;
 	rb->wcnt = 0;
 	rb->wpos = 0;
+	rb->mirrored = 0;
 	rb->buf = calloc(1, rb->size);
 	if (!rb->buf)
 		return -ENOMEM;
 	return 0;
 }
 
+static inline int rbmirror_fd(size_t size)
+{
+	char path[] = "/dev/shm/fi_rbuf.XXXXXX";
+	int fd = -1;
+
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "fi_rbuf", 0);
+#endif
+	if (fd < 0) {
+		fd = mkstemp(path);
+		if (fd < 0)
+			return -1;
+		unlink(path);
+	}
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Falls back to a plain ring if the double mapping cannot be set up */
+static inline int rbinit_mirrored(struct ringbuf *rb, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *addr;
+	int fd;
+
+	size = roundup_power_of_two(MAX(size, page));
+	fd = rbmirror_fd(size);
+	if (fd < 0)
+		return rbinit(rb, size);
+
+	addr = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+	if (addr == MAP_FAILED)
+		goto err1;
+
+	if (mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		 fd, 0) == MAP_FAILED ||
+	    mmap(addr + size, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		goto err2;
+	close(fd);
+
+	rb->size = size;
+	rb->size_mask = size - 1;
+	rb->rcnt = 0;
+	rb->wcnt = 0;
+	rb->wpos = 0;
+	rb->mirrored = 1;
+	rb->buf = addr;
+	return 0;
+
+err2:
+	munmap(addr, 2 * size);
+err1:
+	close(fd);
+	return rbinit(rb, size);
+}
+
 static inline void rbfree(struct ringbuf *rb)
 {
-	free(rb->buf);
+	if (rb->mirrored)
+		munmap(rb->buf, 2 * rb->size);
+	else
+		free(rb->buf);
 }
 
 static inline int rbfull(struct ringbuf *rb)
@@ -100,7 +174,7 @@ static inline void rbwrite(struct ringbuf *rb, const void *buf, size_t len)
 	size_t endlen;
 
 	endlen = rb->size - (rb->wpos & rb->size_mask);
-	if (len <= endlen) {
+	if (len <= endlen || rb->mirrored) {
 		memcpy((char*)rb->buf + (rb->wpos & rb->size_mask), buf, len);
 	} else {
 		memcpy((char*)rb->buf + (rb->wpos & rb->size_mask), buf, endlen);
@@ -109,6 +183,36 @@ static inline void rbwrite(struct ringbuf *rb, const void *buf, size_t len)
 	rb->wpos += len;
 }
 
+/*
+ * Reserves len bytes for the caller to format in place; they are
+ * published with the next rbcommit. Returns NULL, reserving nothing, if
+ * the span wraps in a ring that is not mirrored. The caller checks for
+ * space first, as with rbwrite.
+ */
+static inline void *rbreserve(struct ringbuf *rb, size_t len)
+{
+	void *ptr;
+
+	if (!rb->mirrored &&
+	    len > rb->size - (rb->wpos & rb->size_mask))
+		return NULL;
+
+	ptr = (char*)rb->buf + (rb->wpos & rb->size_mask);
+	rb->wpos += len;
+	return ptr;
+}
+
+/* Contiguous free space at the write position, for recv() into the ring */
+static inline size_t rbwritespan(struct ringbuf *rb, void **ptr)
+{
+	size_t avail = rb->size - (rb->wpos - rb->rcnt);
+
+	*ptr = (char*)rb->buf + (rb->wpos & rb->size_mask);
+	if (rb->mirrored)
+		return avail;
+	return MIN(avail, rb->size - (rb->wpos & rb->size_mask));
+}
+
 static inline void rbcommit(struct ringbuf *rb)
 {
 	rb->wcnt = rb->wpos;
@@ -124,7 +228,7 @@ static inline void rbpeek(struct ringbuf *rb, void *buf, size_t len)
 	size_t endlen;
 
 	endlen = rb->size - (rb->rcnt & rb->size_mask);
-	if (len <= endlen) {
+	if (len <= endlen || rb->mirrored) {
 		memcpy(buf, (char*)rb->buf + (rb->rcnt & rb->size_mask), len);
 	} else {
 		memcpy(buf, (char*)rb->buf + (rb->rcnt & rb->size_mask), endlen);
@@ -138,6 +242,31 @@ static inline void rbread(struct ringbuf *rb, void *buf, size_t len)
 	rb->rcnt += len;
 }
 
+/* Returns the next len committed bytes in place, or NULL if they wrap */
+static inline void *rbpeekptr(struct ringbuf *rb, size_t len)
+{
+	if (!rb->mirrored &&
+	    len > rb->size - (rb->rcnt & rb->size_mask))
+		return NULL;
+	return (char*)rb->buf + (rb->rcnt & rb->size_mask);
+}
+
+/* Contiguous committed data at the read position, for send() */
+static inline size_t rbreadspan(struct ringbuf *rb, void **ptr)
+{
+	size_t used = rbused(rb);
+
+	*ptr = (char*)rb->buf + (rb->rcnt & rb->size_mask);
+	if (rb->mirrored)
+		return used;
+	return MIN(used, rb->size - (rb->rcnt & rb->size_mask));
+}
+
+static inline void rbconsume(struct ringbuf *rb, size_t len)
+{
+	rb->rcnt += len;
+}
+
 
 /*
  * Ring buffer with blocking read support using an fd
@@ -154,13 +283,15 @@ struct ringbuffd {
 	int		fd[2];
 };
 
-static inline int rbfdinit(struct ringbuffd *rbfd, size_t size)
+static inline int _rbfdinit(struct ringbuffd *rbfd, size_t size,
+			    int mirrored)
 {
 	int ret, flags;
 
 	rbfd->fdrcnt = 0;
 	rbfd->fdwcnt = 0;
-	ret = rbinit(&rbfd->rb, size);
+	ret = mirrored ? rbinit_mirrored(&rbfd->rb, size) :
+			 rbinit(&rbfd->rb, size);
 	if (ret)
 		return ret;
 
@@ -183,6 +314,16 @@ err1:
 	return -errno;
 }
 
+static inline int rbfdinit(struct ringbuffd *rbfd, size_t size)
+{
+	return _rbfdinit(rbfd, size, 0);
+}
+
+static inline int rbfdinit_mirrored(struct ringbuffd *rbfd, size_t size)
+{
+	return _rbfdinit(rbfd, size, 1);
+}
+
 static inline void rbfdfree(struct ringbuffd *rbfd)
 {
 	rbfree(&rbfd->rb);
@@ -255,6 +396,12 @@ static inline void rbfdread(struct ringbuffd *rbfd, void *buf, size_t len)
 	rbfdreset(rbfd);
 }
 
+static inline void rbfdconsume(struct ringbuffd *rbfd, size_t len)
+{
+	rbconsume(&rbfd->rb, len);
+	rbfdreset(rbfd);
+}
+
 static inline size_t rbfdsread(struct ringbuffd *rbfd, void *buf, size_t len,
 				int timeout)
 {
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _FI_EXT_SOCKETS_H_
+#define _FI_EXT_SOCKETS_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <rdma/fabric.h>
+
+/*
+ * Sockets provider statistics, opened with fi_open_ops() on a domain,
+ * which owns the progress engine and the connections, or on an endpoint
+ * or CQ. Endpoints and CQs only count their own posts, EAGAINs and
+ * completions: TX/RX_POSTED, EAGAIN, TX/RX_DONE, and in TX/RX_BYTES the
+ * payload bytes of those completions. A CQ counts the operations of the
+ * endpoints bound to it. Their gauges and latencies read as zero, and
+ * read_conn() is for domains only.
+ */
+#define FI_SOCK_STATS_OPS_1 "sock_stats"
+
+enum {
+	FI_SOCK_STAT_TX_POSTED,		/* send, RMA and atomic ops queued */
+	FI_SOCK_STAT_RX_POSTED,		/* receive buffers posted */
+	FI_SOCK_STAT_TX_DONE,		/* tx progress entries completed */
+	FI_SOCK_STAT_RX_DONE,		/* incoming messages processed */
+	FI_SOCK_STAT_EAGAIN,		/* posts failed with -FI_EAGAIN */
+	FI_SOCK_STAT_PROGRESS,		/* progress passes over a context */
+	FI_SOCK_STAT_SYSCALLS,		/* send, recv and poll calls */
+	FI_SOCK_STAT_TX_BYTES,		/* bytes written to sockets */
+	FI_SOCK_STAT_RX_BYTES,		/* bytes read from sockets */
+	FI_SOCK_STAT_PE_USED,		/* progress entries in use (gauge) */
+	FI_SOCK_STAT_PE_HIGH,		/* high-water mark of PE_USED */
+	FI_SOCK_STAT_BUFFERED,		/* unexpected bytes buffered (gauge) */
+	FI_SOCK_STAT_TX_QUEUED,		/* bytes queued in tx rings (gauge) */
+	FI_SOCK_STAT_CONNS,		/* open connections (gauge) */
+	FI_SOCK_STAT_CREDIT_WAIT,	/* sends held for peer credits */
+	FI_SOCK_STAT_RX_STALL,		/* messages held at the buffer limit */
+	FI_SOCK_STAT_MAX
+};
+
+/*
+ * Post-to-completion latencies; bucket i counts operations that took
+ * [2^i, 2^(i+1)) nanoseconds, the last bucket everything longer. Only
+ * collected when OFI_SOCK_STATS_LATENCY is set in the environment.
+ */
+#define FI_SOCK_STATS_HIST_SZ 32
+
+struct fi_sock_stats {
+	uint64_t counter[FI_SOCK_STAT_MAX];
+	uint64_t tx_latency[FI_SOCK_STATS_HIST_SZ];
+	uint64_t rx_latency[FI_SOCK_STATS_HIST_SZ];
+};
+
+struct fi_sock_conn_stats {
+	struct sockaddr_storage addr;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t syscalls;
+};
+
+struct fi_sock_ops_stats {
+	size_t size;
+	int (*read)(struct fid *fid, struct fi_sock_stats *stats);
+	int (*reset)(struct fid *fid);
+	/* fills up to *count entries, sets *count to the number of conns */
+	int (*read_conn)(struct fid *fid, struct fi_sock_conn_stats *stats,
+			 size_t *count);
+};
+
+/*
+ * Data path trace, recorded when OFI_SOCK_TRACE names an output file; the
+ * trace is written there at exit, or on demand with dump(). Decode it
+ * with fi_sock_trace.
+ */
+#define FI_SOCK_TRACE_OPS_1 "sock_trace"
+
+struct fi_sock_ops_trace {
+	size_t size;
+	/* writes to path, or to the OFI_SOCK_TRACE file if NULL */
+	int (*dump)(const char *path);
+};
+
+/*
+ * Endpoint extensions, opened with fi_open_ops() on an endpoint, a
+ * receive context or a shared receive context.
+ */
+#define FI_SOCK_EP_OPS_1 "sock_ep"
+
+struct fi_sock_ops_ep {
+	size_t size;
+	/*
+	 * cancels every posted receive that has not started to match, each
+	 * with an FI_ECANCELED error completion; returns how many
+	 */
+	ssize_t (*cancel_all)(struct fid *fid);
+};
+
+#endif /* _FI_EXT_SOCKETS_H_ */
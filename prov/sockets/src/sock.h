@@ -58,8 +58,12 @@
 #ifndef _SOCK_H_
 #define _SOCK_H_
 
+#include "fi_ext_sockets.h"
+#include "sock_trace.h"
+
 #define SOCK_EP_MAX_MSG_SZ (1<<23)
-#define SOCK_EP_MAX_INJECT_SZ ((1<<8) - 1)
+#define SOCK_EP_MAX_INJECT_SZ (1<<13)
+#define SOCK_EP_MAX_INLINE_SZ ((1<<8) - 1)
 #define SOCK_EP_MAX_BUFF_RECV (1<<20)
 #define SOCK_EP_MAX_ORDER_RAW_SZ SOCK_EP_MAX_MSG_SZ
 #define SOCK_EP_MAX_ORDER_WAR_SZ SOCK_EP_MAX_MSG_SZ
@@ -70,10 +74,12 @@
 #define SOCK_EP_MAX_RX_CNT (16)
 #define SOCK_EP_MAX_IOV_LIMIT (8)
 #define SOCK_EP_TX_SZ (256)
+#define SOCK_EP_INJECT_POOL_SZ (64)
 #define SOCK_EP_RX_SZ (256)
 #define SOCK_EP_TX_ENTRY_SZ (256)
 #define SOCK_EP_RX_ENTRY_SZ (256)
 #define SOCK_EP_MIN_MULTI_RECV (64)
+#define SOCK_MULTI_RECV_ALIGN (8)
 #define SOCK_EP_MAX_ATOMIC_SZ (256)
 #define SOCK_EP_MAX_CTX_BITS (16)
 
@@ -81,9 +87,14 @@
 #define SOCK_PE_MAX_ENTRIES (128)
 #define SOCK_PE_MIN_ENTRIES (1)
 
+#define SOCK_CONN_MIN_CREDITS (1<<16)
+
 #define SOCK_EQ_DEF_SZ (1<<8)
+#define SOCK_EQ_INLINE_SZ (64)
 #define SOCK_CQ_DEF_SZ (1<<8)
 #define SOCK_AV_DEF_SZ (1<<8)
+#define SOCK_AV_SHARED_TIMEOUT (10000)
+#define SOCK_AV_SHARED_CHECK (10)
 
 #define SOCK_CQ_DATA_SIZE (sizeof(uint64_t))
 #define SOCK_TAG_SIZE (sizeof(uint64_t))
@@ -92,6 +103,12 @@
 #define SOCK_CM_COMM_TIMEOUT (5000)
 #define SOCK_EP_MAX_RETRY (5)
 #define SOCK_EP_MAX_CM_DATA_SZ (256)
+#define SOCK_CM_MAX_BATCH (16)
+#define SOCK_CM_MAX_EVENTS (16)
+#define SOCK_CM_RECENT_SZ (64)
+#define SOCK_WAIT_MAX_EVENTS (16)
+#define SOCK_STATS_SHARDS (16)
+#define SOCK_TRACE_SZ (1 << 14)
 
 #define SOCK_EP_RDM_CAP (FI_MSG | FI_RMA | FI_TAGGED | FI_ATOMICS |	\
 			 FI_DYNAMIC_MR | FI_NAMED_RX_CTX | \
@@ -124,11 +141,44 @@
 #define SOCK_MAJOR_VERSION 1
 #define SOCK_MINOR_VERSION 0
 
-#define SOCK_INJECT_OK(_flgs)  ((_flgs) & FI_INJECT)
+/*
+ * Inject payloads up to SOCK_EP_MAX_INLINE_SZ travel in the tx ring;
+ * larger ones are staged in a bounce buffer of the tx ctx and queued
+ * like a regular send, marked with the internal SOCK_INJECT_BOUNCE.
+ */
+#define SOCK_INJECT_BOUNCE (1ULL << 60)
+#define SOCK_INJECT_OK(_flgs)  \
+	(((_flgs) & (FI_INJECT | SOCK_INJECT_BOUNCE)) == FI_INJECT)
+
+struct sock_cm_msg_id {
+	uint32_t msg_id;
+	uint16_t port;
+	uint32_t addr;
+};
+
+/*
+ * One CM service per fabric: a single thread multiplexes the shared UDP
+ * socket used by all active MSG endpoints and the listen socket of each
+ * passive endpoint through one epoll fd.
+ */
+struct sock_cm_service {
+	int epoll_fd;
+	int sock;
+	int signal_fds[2];
+	int do_listen;
+	uint32_t msg_id;
+	fastlock_t lock;
+	pthread_t listener_thread;
+	struct dlist_entry entry_list;
+	struct dlist_entry msg_list;
+	struct sock_cm_msg_id recent[SOCK_CM_RECENT_SZ];
+	int recent_idx;
+};
 
 struct sock_fabric{
 	struct fid_fabric fab_fid;
 	atomic_t ref;
+	struct sock_cm_service cm;
 };
 
 struct sock_conn {
@@ -138,6 +188,27 @@ struct sock_conn {
         struct sock_pe_entry *tx_pe_entry;
 	struct ringbuf inbuf;
 	struct ringbuf outbuf;
+
+	/*
+	 * Eager send flow control, in bytes: tx_credits is what the peer
+	 * still accepts out of the tx_window it advertised, rx_window what
+	 * we advertised to the peer, rx_credits what we consumed from the
+	 * peer but have not yet returned, and credit_wait is set while a
+	 * send is held for credits.
+	 */
+	uint32_t tx_window;
+	uint32_t tx_credits;
+	uint32_t rx_window;
+	uint32_t rx_credits;
+	uint8_t credit_wait;
+
+	/* receive context of a scalable endpoint the traffic is steered to */
+	uint16_t lane;
+
+	/* updated by the progress engine only */
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t syscalls;
 };
 
 struct sock_conn_map {
@@ -147,6 +218,21 @@ struct sock_conn_map {
 	struct sock_domain *domain;
 	fastlock_t lock;
 	struct sockaddr_storage curr_addr;
+	uint16_t curr_lane;
+};
+
+/*
+ * Domain statistics, split in cache line aligned shards so that threads
+ * updating them do not share lines; a thread always uses the same shard.
+ */
+struct sock_stats_shard {
+	uint64_t counter[FI_SOCK_STAT_MAX];
+	uint64_t tx_latency[FI_SOCK_STATS_HIST_SZ];
+	uint64_t rx_latency[FI_SOCK_STATS_HIST_SZ];
+} __attribute__((aligned(64)));
+
+struct sock_stats {
+	struct sock_stats_shard shard[SOCK_STATS_SHARDS];
 };
 
 struct sock_domain {
@@ -161,7 +247,9 @@ struct sock_domain {
 	struct sock_eq *mr_eq;
 
 	enum fi_progress progress_mode;
-	struct index_map mr_idm;
+	int elide_ctx_locks;
+	int elide_pe_lock;
+	struct radix_map mr_map;
 	struct sock_pe *pe;
 	struct sock_conn_map r_cmap;
 	pthread_t listen_thread;
@@ -169,13 +257,21 @@ struct sock_domain {
 	char service[NI_MAXSERV];
 	int signal_fds[2];
 	struct sockaddr_storage src_addr;
+	struct sock_stats stats;
+};
+
+struct sock_cntr_waiter {
+	uint64_t threshold;
+	pthread_cond_t cond;
+	int index;
+	int status;
+	int progressing;
 };
 
 struct sock_cntr {
 	struct fid_cntr cntr_fid;
 	struct sock_domain *domain;
 	atomic_t value;
-	atomic_t threshold;
 	atomic_t ref;
 	atomic_t err_cnt;
 	pthread_cond_t 	cond;
@@ -188,7 +284,16 @@ struct sock_cntr {
 
 	struct fid_wait *waitset;
 	int signal;
-	int is_waiting;
+
+	struct sock_cntr_waiter **waiters;
+	int num_waiters;
+	int max_waiters;
+	int progressing;
+	int epoll_fd;			/* manual progress wait set */
+
+	struct dlist_entry poll_list;
+
+	struct dlist_entry trigger_list;
 };
 
 struct sock_mr {
@@ -205,17 +310,30 @@ struct sock_mr {
 	struct sock_cq *cq;
 };
 
+/*
+ * Packed peer address; IPv4 uses the first four bytes of addr. The
+ * entries of a named AV live in the node-shared segment, where key is
+ * unused: connection keys are local to a process and kept in av->keys.
+ */
 struct sock_av_addr {
-	struct sockaddr_storage addr;
-	uint8_t valid;
+	uint8_t addr[16];
+	uint16_t port;
 	uint16_t rem_ep_id;
-	uint8_t reserved[5];
+	uint8_t family;
+	uint8_t valid;
+	uint16_t key;
 };
 
 struct sock_av_table_hdr {
 	uint64_t size;
 	uint64_t stored;
 	uint64_t req_sz;
+	uint64_t claimed;
+	uint64_t generation;
+	uint64_t hash_sz;
+	uint64_t leader_pid;
+	uint64_t leader_gen;
+	uint64_t magic;
 };
 
 struct sock_av {
@@ -225,17 +343,25 @@ struct sock_av {
 	struct fi_av_attr attr;
 	uint64_t mask;
 	int rx_ctx_bits;
-	struct index_map addr_idm;
+	struct sock_av_addr *table;
+	size_t table_sz;
+	struct slist retired;		/* tables replaced by a grow */
+	struct radix_map key_map;
+	struct radix_map lane_map;
 	socklen_t addrlen;
 	struct sock_conn_map *cmap;
 	struct sock_eq *eq;
 	struct sock_av_table_hdr *table_hdr;
-	struct sock_av_addr *table;
-	uint16_t *key;
+	uint16_t *keys;
+	uint64_t *hash;
+	int leader;
 	char *name;
 	int shared_fd;
 };
 
+#define SOCK_GET_RX_ID(_addr, _bits) ((_bits) == 0) ? 0 : \
+	(((uint64_t)_addr) >> (64 - _bits))
+
 struct sock_fid_list {
 	struct dlist_entry entry;
 	struct fid *fid;
@@ -245,12 +371,33 @@ struct sock_poll {
 	struct fid_poll poll_fid;
 	struct sock_domain *domain;
 	struct dlist_entry fid_list;
+	struct dlist_entry ready_list;
+	fastlock_t lock;
+};
+
+/* membership of a CQ, counter or EQ in a poll set */
+struct sock_poll_item {
+	struct dlist_entry entry;
+	struct dlist_entry obj_entry;
+	struct dlist_entry ready_entry;
+	struct sock_poll *poll;
+	struct fid *fid;
+	int ready;
+};
+
+struct sock_wait_pe {
+	struct dlist_entry entry;
+	struct sock_pe *pe;
+	int ref;
 };
 
 struct sock_wait {
 	struct fid_wait wait_fid;
 	struct sock_fabric *fab;
 	struct dlist_entry fid_list;
+	struct dlist_entry pe_list;
+	fastlock_t lock;
+	int epoll_fd;
 	enum fi_wait_obj type;
 	union {
 		int fd[2];
@@ -279,6 +426,8 @@ enum {
 	SOCK_OP_ATOMIC_COMPLETE = 10,
 	SOCK_OP_ATOMIC_ERROR = 11,
 
+	SOCK_OP_CREDIT = 12,
+
 	/* internal */
 	SOCK_OP_RECV,
 	SOCK_OP_TRECV,
@@ -338,19 +487,37 @@ struct sock_eq_entry{
 	char event[0];
 };
 
+/* preallocated ring slot, for events of up to SOCK_EQ_INLINE_SZ bytes */
+struct sock_eq_slot {
+	uint32_t type;
+	uint32_t len;
+	uint64_t flags;
+	char event[SOCK_EQ_INLINE_SZ];
+};
+
 struct sock_eq{
 	struct fid_eq eq;
 	struct fi_eq_attr attr;
 	struct sock_fabric *sock_fab;
 
+	struct sock_eq_slot *ring;
+	uint64_t ring_mask;
+	uint64_t ring_head;
+	uint64_t ring_tail;
+
+	/* overflow: events that did not fit the ring, and the wait fd */
 	struct dlistfd_head list;
-	struct dlistfd_head err_list;
+	struct dlist_entry err_list;
+	int fd_waiters;
+	int fd_exported;
 	fastlock_t lock;
 
 	struct fid_wait *waitset;
 	int signal;
 	int wait_fd;
 	char service[NI_MAXSERV];
+
+	struct dlist_entry poll_list;
 };
 
 struct sock_comp {
@@ -381,12 +548,9 @@ struct sock_comp {
 
 struct sock_cm_entry {
 	int sock;
-	int do_listen;
-	int signal_fds[2];
-	fastlock_t lock;
 	int shutdown_received;
-	pthread_t listener_thread;
-	struct dlist_entry msg_list;
+	fid_t fid;
+	struct dlist_entry entry;
 };
 
 struct sock_ep {
@@ -434,6 +598,8 @@ struct sock_ep {
 	uint16_t key;
 	int is_disabled;
 	struct sock_cm_entry cm;
+
+	uint64_t stats[FI_SOCK_STAT_MAX];	/* posts, EAGAINs, completions */
 };
 
 struct sock_pep {
@@ -452,7 +618,9 @@ struct sock_rx_entry {
 	uint8_t is_busy;
 	uint8_t is_claimed;
 	uint8_t is_complete;
-	uint8_t reserved[5];
+	uint8_t is_retired;
+	uint8_t reserved[3];
+	uint32_t pending;		/* multi-recv: messages still landing */
 
 	uint64_t used;
 	uint64_t total_len;
@@ -463,10 +631,15 @@ struct sock_rx_entry {
 	uint64_t data;
 	uint64_t tag;
 	uint64_t ignore;
+	uint64_t post_ns;
 	struct sock_comp *comp;
+	struct sock_ep *ep;		/* matched endpoint, for its stats */
+	struct sock_conn *conn;		/* owed credits once buffered data drains */
+	uint64_t credits;
 	
 	union sock_iov iov[SOCK_EP_MAX_IOV_LIMIT];
 	struct dlist_entry entry;
+	struct dlist_entry ctx_entry;	/* rx_ctx->ctx_hash, while posted */
 };
 
 struct sock_rx_ctx {
@@ -479,9 +652,9 @@ struct sock_rx_ctx {
 	uint8_t recv_cq_event;
 	uint8_t rem_read_cq_event;
 	uint8_t rem_write_cq_event;
-	uint16_t buffered_len;
 	uint16_t min_multi_recv;
-	uint8_t reserved[7];
+	uint8_t reserved[3];
+	uint64_t buffered_len;
 
 	uint64_t addr;
 	struct sock_comp comp;
@@ -497,8 +670,12 @@ struct sock_rx_ctx {
 
 	struct dlist_entry pe_entry_list;
 	struct dlist_entry rx_entry_list;
+	struct dlist_entry *ctx_hash;	/* posted receives by context */
+	uint64_t ctx_hash_mask;
+	uint64_t ctx_hash_cnt;
 	struct dlist_entry rx_buffered_list;
 	struct dlist_entry ep_list;
+	struct index_map ep_map;	/* SRX: attached endpoints by ep_id */
 	fastlock_t lock;
 
 	struct fi_rx_attr attr;
@@ -535,10 +712,27 @@ struct sock_tx_ctx {
 	struct dlist_entry ep_list;
 	fastlock_t lock;
 
+	struct dlist_entry trigger_list;
 	struct fi_tx_attr attr;
+
+	/* ring positions of ops posted with FI_MORE but not yet committed */
+	size_t batch_wpos;
+	size_t batch_seen;
+
+	/* post times of queued ops, for the latency statistics */
+	uint64_t *post_ns;
+	uint64_t post_mask;
+	uint64_t post_seq;
+	uint64_t pick_seq;
+
+	/* bounce buffers for large injects, allocated on first use */
+	char *bounce_buf;
+	size_t bounce_sz;
+	struct slist bounce_list;
+	fastlock_t bounce_lock;
 };
 
-#define SOCK_WIRE_PROTO_VERSION (0)
+#define SOCK_WIRE_PROTO_VERSION (1)
 
 struct sock_msg_hdr{
 	uint8_t version;
@@ -588,6 +782,11 @@ struct sock_msg_response {
 	uint8_t reserved[6];
 };
 
+struct sock_msg_credit {
+	struct sock_msg_hdr msg_hdr;
+	uint64_t credits;
+};
+
 struct sock_rma_read_req {
 	struct sock_msg_hdr msg_hdr;
 	/* src iov(s)*/
@@ -622,9 +821,10 @@ struct sock_tx_pe_entry{
 	uint8_t reserved[6];
 
 	struct sock_tx_ctx *tx_ctx;
-	union {
+	/* inline data is followed by dst/res/cmp iovs, so no union */
+	struct {
 		struct sock_tx_iov tx_iov[SOCK_EP_MAX_IOV_LIMIT];
-		char inject[SOCK_EP_MAX_INJECT_SZ];
+		char inject[SOCK_EP_MAX_INLINE_SZ];
 	} data;
 };
 
@@ -634,8 +834,10 @@ struct sock_rx_pe_entry{
 	struct sock_comp *comp;
 	uint8_t header_read;
 	uint8_t pending_send;
-	uint8_t reserved[6];
+	uint8_t held;
+	uint8_t reserved[5];
 	struct sock_rx_entry *rx_entry;
+	uint64_t rx_offset;		/* where the message lands in rx_entry */
 	union sock_iov rx_iov[SOCK_EP_MAX_IOV_LIMIT];
 	char atomic_cmp[SOCK_EP_MAX_ATOMIC_SZ];
 	char atomic_src[SOCK_EP_MAX_ATOMIC_SZ];
@@ -670,6 +872,7 @@ struct sock_pe_entry{
 	uint64_t done_len;
 	uint64_t total_len;
 	uint64_t data_len;
+	uint64_t post_ns;
 	struct sock_ep *ep;
 	struct sock_conn *conn;
 	struct sock_comp *comp;
@@ -681,6 +884,7 @@ struct sock_pe_entry{
 struct sock_pe{
 	struct sock_domain *domain;
 	int num_free_entries;
+	int max_used_entries;
 	struct sock_pe_entry pe_table[SOCK_PE_MAX_ENTRIES];
 	fastlock_t lock;
 
@@ -693,6 +897,9 @@ struct sock_pe{
 	pthread_t progress_thread;
 	volatile int do_progress;
 	struct sock_pe_entry *pe_atomic;
+
+	int epoll_fd;
+	int signal_fds[2];
 };
 
 typedef int (*sock_cq_report_fn) (struct sock_cq *cq, fi_addr_t addr,
@@ -713,16 +920,54 @@ struct sock_cq {
 
 	struct fid_wait *waitset;
 	int signal;
+	int epoll_fd;	/* manual progress: PE poll set + cq_rbfd */
 
+	struct dlist_entry poll_list;
 	struct dlist_entry ep_list;
 	struct dlist_entry rx_list;
 	struct dlist_entry tx_list;
 
 	sock_cq_report_fn report_completion;
+	uint64_t stats[FI_SOCK_STAT_MAX];	/* posts, EAGAINs, completions */
+};
+
+struct sock_trigger {
+	uint8_t op_type;
+	size_t threshold;
+	struct dlist_entry entry;
+
+	struct fid_ep *ep;
+	struct sock_tx_ctx *tx_ctx;
+	uint64_t flags;
+
+	union {
+		struct fi_msg msg;
+		struct fi_msg_tagged tmsg;
+		struct fi_msg_rma rma;
+		struct fi_msg_atomic atomic;
+	} op;
+
+	union {
+		struct iovec iov[SOCK_EP_MAX_IOV_LIMIT];
+		struct fi_ioc ioc[SOCK_EP_MAX_IOV_LIMIT];
+	} msg_iov;
+	void *desc[SOCK_EP_MAX_IOV_LIMIT];
+	union {
+		struct fi_rma_iov iov[SOCK_EP_MAX_IOV_LIMIT];
+		struct fi_rma_ioc ioc[SOCK_EP_MAX_IOV_LIMIT];
+	} rma_iov;
+
+	struct fi_ioc comparev[SOCK_EP_MAX_IOV_LIMIT];
+	struct fi_ioc resultv[SOCK_EP_MAX_IOV_LIMIT];
+	size_t compare_count;
+	size_t result_count;
+	char inject[];			/* copy of an inject payload */
 };
 
 struct sock_cm_msg_list_entry {
 	size_t msg_len;
+	int retry;
+	uint64_t timeout;
 	struct sockaddr_in addr;
 	struct dlist_entry entry;
 	char msg[0];
@@ -732,6 +977,7 @@ struct sock_conn_hdr {
 	uint8_t type;
 	uint8_t reserved[3];
 	int32_t s_port;
+	uint32_t msg_id;
 	fid_t c_fid;
 	fid_t s_fid;
 };
@@ -761,6 +1007,7 @@ enum {
 	SOCK_CONN_ACCEPT,
 	SOCK_CONN_REJECT,
 	SOCK_CONN_SHUTDOWN,
+	SOCK_CONN_ACK,
 };
 
 int sock_verify_info(struct fi_info *hints);
@@ -812,7 +1059,12 @@ int sock_msg_sep(struct fid_domain *domain, struct fi_info *info,
 int sock_msg_passive_ep(struct fid_fabric *fabric, struct fi_info *info,
 			struct fid_pep **pep, void *context);
 int sock_ep_enable(struct fid_ep *ep);
+void sock_ep_set_tx_ops(struct sock_ep *sock_ep);
 int sock_ep_disable(struct fid_ep *ep);
+int sock_cm_register(struct sock_fabric *fab, struct sock_cm_entry *cm);
+void sock_cm_unregister(struct sock_fabric *fab, struct sock_cm_entry *cm);
+void sock_cm_service_init(struct sock_cm_service *service);
+void sock_cm_service_fini(struct sock_cm_service *service);
 
 
 int sock_stx_ctx(struct fid_domain *domain,
@@ -825,6 +1077,7 @@ int sock_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 		 struct fid_cq **cq, void *context);
 int sock_cq_report_error(struct sock_cq *cq, struct sock_pe_entry *entry,
 			 size_t olen, int err, int prov_errno, void *err_data);
+size_t sock_cq_report_cancel(struct sock_cq *cq, struct dlist_entry *list);
 int sock_cq_progress(struct sock_cq *cq);
 
 
@@ -835,6 +1088,7 @@ ssize_t sock_eq_report_event(struct sock_eq *sock_eq, uint32_t event,
 ssize_t sock_eq_report_error(struct sock_eq *sock_eq, fid_t fid, void *context,
 			     int err, int prov_errno, void *err_data);
 int sock_eq_openwait(struct sock_eq *eq, const char *service);
+int sock_eq_empty(struct sock_eq *eq);
 
 int sock_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
 		   struct fid_cntr **cntr, void *context);
@@ -843,6 +1097,35 @@ int sock_cntr_err_inc(struct sock_cntr *cntr);
 int sock_cntr_progress(struct sock_cntr *cntr);
 
 
+ssize_t sock_ep_sendmsg(struct fid_ep *ep, const struct fi_msg *msg, 
+			uint64_t flags);
+ssize_t sock_ep_tsendmsg(struct fid_ep *ep, 
+			 const struct fi_msg_tagged *msg, uint64_t flags);
+ssize_t sock_ep_rma_readmsg(struct fid_ep *ep, 
+			    const struct fi_msg_rma *msg, uint64_t flags);
+ssize_t sock_ep_rma_writemsg(struct fid_ep *ep, 
+			     const struct fi_msg_rma *msg, uint64_t flags);
+ssize_t sock_ep_tx_atomic(struct fid_ep *ep, 
+			  const struct fi_msg_atomic *msg, 
+			  const struct fi_ioc *comparev, void **compare_desc, 
+			  size_t compare_count, struct fi_ioc *resultv, 
+			  void **result_desc, size_t result_count, uint64_t flags);
+
+ssize_t sock_queue_msg_op(struct fid_ep *ep, const struct fi_msg *msg,
+			  uint64_t flags);
+ssize_t sock_queue_tmsg_op(struct fid_ep *ep, const struct fi_msg_tagged *msg,
+			   uint64_t flags);
+ssize_t sock_queue_rma_op(struct fid_ep *ep, const struct fi_msg_rma *msg,
+			  uint64_t flags, uint8_t op_type);
+ssize_t sock_queue_atomic_op(struct fid_ep *ep, const struct fi_msg_atomic *msg,
+			     const struct fi_ioc *comparev, size_t compare_count,
+			     struct fi_ioc *resultv, size_t result_count,
+			     uint64_t flags);
+void sock_trigger_release(struct sock_trigger *trigger);
+void sock_tx_ctx_progress_triggers(struct sock_tx_ctx *tx_ctx);
+void sock_trigger_free_list(struct dlist_entry *list);
+
+
 int sock_eq_open(struct fid_fabric *fabric, struct fi_eq_attr *attr,
 		 struct fid_eq **eq, void *context);
 ssize_t sock_eq_report_event(struct sock_eq *sock_eq, uint32_t event, 
@@ -851,11 +1134,11 @@ ssize_t sock_eq_report_error(struct sock_eq *sock_eq, fid_t fid, void *context,
 			     int err, int prov_errno, void *err_data);
 
 
-struct sock_mr *sock_mr_verify_key(struct sock_domain *domain, uint16_t key, 
+struct sock_mr *sock_mr_verify_key(struct sock_domain *domain, uint64_t key, 
 				   void *buf, size_t len, uint64_t access);
 struct sock_mr *sock_mr_verify_desc(struct sock_domain *domain, void *desc, 
 				    void *buf, size_t len, uint64_t access);
-struct sock_mr * sock_mr_get_entry(struct sock_domain *domain, uint16_t key);
+struct sock_mr * sock_mr_get_entry(struct sock_domain *domain, uint64_t key);
 
 
 struct sock_rx_ctx *sock_rx_ctx_alloc(const struct fi_rx_attr *attr, void *context);
@@ -865,8 +1148,17 @@ struct sock_tx_ctx *sock_tx_ctx_alloc(const struct fi_tx_attr *attr, void *conte
 void sock_tx_ctx_free(struct sock_tx_ctx *tx_ctx);
 void sock_tx_ctx_start(struct sock_tx_ctx *tx_ctx);
 void sock_tx_ctx_write(struct sock_tx_ctx *tx_ctx, const void *buf, size_t len);
-void sock_tx_ctx_commit(struct sock_tx_ctx *tx_ctx);
-void sock_tx_ctx_abort(struct sock_tx_ctx *tx_ctx);
+void sock_tx_ctx_write_op(struct sock_tx_ctx *tx_ctx, const struct sock_op *op,
+			  uint64_t flags, uint64_t context, uint64_t dest_addr,
+			  uint64_t buf, struct sock_ep *ep, struct sock_conn *conn);
+void sock_tx_ctx_commit(struct sock_tx_ctx *tx_ctx, struct sock_ep *ep,
+			uint64_t flags);
+void sock_tx_ctx_flush(struct sock_tx_ctx *tx_ctx);
+size_t sock_tx_ctx_avail(struct sock_tx_ctx *tx_ctx);
+void sock_tx_ctx_abort(struct sock_tx_ctx *tx_ctx, struct sock_ep *ep);
+void *sock_tx_ctx_bounce_get(struct sock_tx_ctx *tx_ctx,
+			     const struct iovec *iov, size_t count);
+void sock_tx_ctx_bounce_put(struct sock_tx_ctx *tx_ctx, void *buf);
 
 
 int sock_poll_open(struct fid_domain *domain, struct fi_poll_attr *attr,
@@ -874,6 +1166,9 @@ int sock_poll_open(struct fid_domain *domain, struct fi_poll_attr *attr,
 int sock_wait_open(struct fid_fabric *fabric, struct fi_wait_attr *attr,
 		   struct fid_wait **waitset);
 void sock_wait_signal(struct fid_wait *wait_fid);
+int sock_wait_add_fid(struct fid_wait *wait_fid, struct fid *fid);
+void sock_wait_del_fid(struct fid_wait *wait_fid, struct fid *fid);
+void sock_poll_notify(struct dlist_entry *poll_list);
 int sock_wait_get_obj(struct fid_wait *fid, void *arg);
 int sock_wait_close(fid_t fid);
 
@@ -892,12 +1187,13 @@ struct sock_conn *sock_conn_map_lookup_key(struct sock_conn_map *conn_map,
 					   uint16_t key);
 uint16_t sock_conn_map_connect(struct sock_domain *dom,
 			       struct sock_conn_map *map, 
-			       struct sockaddr_in *addr);
+			       struct sockaddr_in *addr, uint16_t lane);
 uint16_t sock_conn_map_lookup(struct sock_conn_map *map,
-			      struct sockaddr_in *addr);
+			      struct sockaddr_in *addr, uint16_t lane);
 uint16_t sock_conn_map_match_or_connect(struct sock_domain *dom,
 					struct sock_conn_map *map, 
-					struct sockaddr_in *addr);
+					struct sockaddr_in *addr,
+					uint16_t lane);
 int sock_conn_listen(struct sock_domain *domain);
 int sock_conn_map_clear_pe_entry(struct sock_conn *conn_entry, uint16_t key);
 void sock_conn_map_destroy(struct sock_conn_map *cmap);
@@ -910,7 +1206,16 @@ int sock_pe_progress_rx_ctx(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx);
 int sock_pe_progress_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx);
 void sock_pe_remove_tx_ctx(struct sock_tx_ctx *tx_ctx);
 void sock_pe_remove_rx_ctx(struct sock_rx_ctx *rx_ctx);
+int sock_pe_add_srx_ep(struct sock_rx_ctx *rx_ctx, struct sock_ep *ep);
+void sock_pe_remove_srx_ep(struct sock_rx_ctx *rx_ctx, struct sock_ep *ep);
 void sock_pe_finalize(struct sock_pe *pe);
+void sock_pe_poll_add(struct sock_pe *pe, int fd);
+void sock_pe_poll_del(struct sock_pe *pe, int fd);
+void sock_pe_signal(struct sock_pe *pe);
+void sock_pe_drain_signal(struct sock_pe *pe);
+int sock_pe_wait_open(struct sock_pe *pe, int fd);
+int sock_pe_wait_set(struct sock_pe *pe, int epoll_fd, int timeout);
+int sock_pe_progress(struct sock_pe *pe);
 
 
 struct sock_rx_entry *sock_rx_new_entry(struct sock_rx_ctx *rx_ctx);
@@ -919,7 +1224,15 @@ struct sock_rx_entry *sock_rx_new_buffered_entry(struct sock_rx_ctx *rx_ctx,
 struct sock_rx_entry *sock_rx_get_entry(struct sock_rx_ctx *rx_ctx, 
 					uint64_t addr, uint64_t tag);
 size_t sock_rx_avail_len(struct sock_rx_entry *rx_entry);
+uint64_t sock_rx_claim_multi_recv(struct sock_rx_ctx *rx_ctx,
+				  struct sock_rx_entry *rx_entry, size_t len);
 void sock_rx_release_entry(struct sock_rx_entry *rx_entry);
+void sock_rx_ctx_post_entry(struct sock_rx_ctx *rx_ctx,
+			    struct sock_rx_entry *rx_entry);
+void sock_rx_ctx_unlink_entry(struct sock_rx_ctx *rx_ctx,
+			      struct sock_rx_entry *rx_entry);
+ssize_t sock_rx_ctx_cancel(struct sock_rx_ctx *rx_ctx, struct sock_comp *comp,
+			   void *context, int all);
 
 
 int sock_comm_buffer_init(struct sock_conn *conn);
@@ -929,4 +1242,145 @@ ssize_t sock_comm_recv(struct sock_conn *conn, void *buf, size_t len);
 ssize_t sock_comm_peek(struct sock_conn *conn, void *buf, size_t len);
 ssize_t sock_comm_flush(struct sock_conn *conn);
 
+
+/*
+ * Locks the application's threading model already makes redundant are
+ * skipped; see sock_domain_set_lock_elision.
+ */
+static inline int sock_lock_acquire(int elide, fastlock_t *lock)
+{
+	return elide ? 0 : fastlock_acquire(lock);
+}
+
+static inline void sock_lock_release(int elide, fastlock_t *lock)
+{
+	if (!elide)
+		fastlock_release(lock);
+}
+
+
+extern __thread int sock_stats_tid;
+int sock_stats_next_tid(void);
+uint64_t sock_stats_now(void);
+void sock_stats_record_latency(struct sock_domain *domain, int rx,
+			       uint64_t post_ns);
+int sock_stats_ops_open(struct fid *fid, void **ops);
+int sock_ep_ops_open(struct fid *fid, void **ops);
+
+static inline void sock_stats_counter_add(struct sock_domain *domain,
+					  uint64_t *ctr, uint64_t val)
+{
+	/* a domain serialized by the application shares counters safely */
+	if (domain->elide_pe_lock)
+		*ctr += val;
+	else
+		__atomic_fetch_add(ctr, val, __ATOMIC_RELAXED);
+}
+
+static inline void sock_stats_add(struct sock_domain *domain, int counter,
+				  uint64_t val)
+{
+	if (sock_stats_tid < 0)
+		sock_stats_tid = sock_stats_next_tid();
+	sock_stats_counter_add(domain,
+		&domain->stats.shard[sock_stats_tid].counter[counter], val);
+}
+
+static inline void sock_stats_inc(struct sock_domain *domain, int counter)
+{
+	sock_stats_add(domain, counter, 1);
+}
+
+/* either may be NULL, e.g. for a shared context posted to directly */
+static inline void sock_stats_obj_add(struct sock_ep *ep, struct sock_cq *cq,
+				      int counter, uint64_t val)
+{
+	if (ep)
+		sock_stats_counter_add(ep->domain, &ep->stats[counter], val);
+	if (cq)
+		sock_stats_counter_add(cq->domain, &cq->stats[counter], val);
+}
+
+/* shared contexts complete to the CQ of the endpoint posting through them */
+static inline struct sock_cq *sock_tx_ctx_cq(struct sock_tx_ctx *tx_ctx,
+					     struct sock_ep *ep)
+{
+	if (ep && tx_ctx->fid.stx.fid.fclass == FI_CLASS_STX_CTX)
+		return ep->comp.send_cq;
+	return tx_ctx->comp.send_cq;
+}
+
+static inline struct sock_cq *sock_rx_ctx_cq(struct sock_rx_ctx *rx_ctx,
+					     struct sock_ep *ep)
+{
+	if (ep && rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX)
+		return ep->comp.recv_cq;
+	return rx_ctx->comp.recv_cq;
+}
+
+static inline void sock_stats_tx_inc(struct sock_tx_ctx *tx_ctx,
+				     struct sock_ep *ep, int counter)
+{
+	sock_stats_inc(tx_ctx->domain, counter);
+	sock_stats_obj_add(ep, sock_tx_ctx_cq(tx_ctx, ep), counter, 1);
+}
+
+static inline void sock_stats_rx_inc(struct sock_rx_ctx *rx_ctx,
+				     struct sock_ep *ep, int counter)
+{
+	sock_stats_inc(rx_ctx->domain, counter);
+	sock_stats_obj_add(ep, sock_rx_ctx_cq(rx_ctx, ep), counter, 1);
+}
+
+
+/*
+ * Per-thread trace ring: only its thread writes it, publishing each
+ * record by advancing head, so a dump can copy it without locking.
+ */
+struct sock_trace_buf {
+	struct dlist_entry entry;
+	uint64_t tid;
+	uint64_t head;
+	struct sock_trace_rec rec[SOCK_TRACE_SZ];
+};
+
+extern int sock_trace_enabled;
+extern uint64_t sock_trace_gen;
+extern __thread struct sock_trace_buf *sock_trace_buf;
+extern __thread uint64_t sock_trace_buf_gen;
+struct sock_trace_buf *sock_trace_buf_alloc(void);
+int sock_trace_dump(const char *path);
+int sock_trace_ops_open(struct fid *fid, void **ops);
+void sock_trace_init(void);
+void sock_trace_fini(void);
+int sock_ops_open(struct fid *fid, const char *name, uint64_t flags,
+		  void **ops, void *context);
+
+static inline void sock_trace(uint32_t event, uint64_t arg0, uint64_t arg1,
+			      uint64_t arg2)
+{
+	struct sock_trace_buf *buf = sock_trace_buf;
+	struct sock_trace_rec *rec;
+
+	if ((!buf || sock_trace_buf_gen !=
+		     __atomic_load_n(&sock_trace_gen, __ATOMIC_RELAXED)) &&
+	    !(buf = sock_trace_buf_alloc()))
+		return;
+
+	rec = &buf->rec[buf->head & (SOCK_TRACE_SZ - 1)];
+	rec->ts = sock_stats_now();
+	rec->event = event;
+	rec->arg[0] = arg0;
+	rec->arg[1] = arg1;
+	rec->arg[2] = arg2;
+	__atomic_store_n(&buf->head, buf->head + 1, __ATOMIC_RELEASE);
+}
+
+#define SOCK_TRACE(_event, _a0, _a1, _a2)				\
+	do {								\
+		if (sock_trace_enabled)					\
+			sock_trace(_event, (uint64_t) (_a0),		\
+				   (uint64_t) (_a1), (uint64_t) (_a2));	\
+	} while (0)
+
 #endif
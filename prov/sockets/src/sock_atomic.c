@@ -58,11 +58,11 @@
 #include "sock_util.h"
 
 
-static ssize_t sock_ep_tx_atomic(struct fid_ep *ep, 
-				  const struct fi_msg_atomic *msg, 
-				  const struct fi_ioc *comparev, void **compare_desc, 
-				  size_t compare_count, struct fi_ioc *resultv, 
-				  void **result_desc, size_t result_count, uint64_t flags)
+ssize_t sock_ep_tx_atomic(struct fid_ep *ep, 
+			  const struct fi_msg_atomic *msg, 
+			  const struct fi_ioc *comparev, void **compare_desc, 
+			  size_t compare_count, struct fi_ioc *resultv, 
+			  void **result_desc, size_t result_count, uint64_t flags)
 {
 	int i, ret;
 	size_t datatype_sz;
@@ -89,6 +89,10 @@ static ssize_t sock_ep_tx_atomic(struct fid_ep *ep,
 		return -FI_EINVAL;
 	}
 
+	if (flags & FI_TRIGGER)
+		return sock_queue_atomic_op(ep, msg, comparev, compare_count,
+					    resultv, result_count, flags);
+
 	assert(tx_ctx->enabled && 
 	       msg->iov_count <= SOCK_EP_MAX_IOV_LIMIT &&
 	       msg->rma_iov_count <= SOCK_EP_MAX_IOV_LIMIT);
@@ -99,8 +103,10 @@ static ssize_t sock_ep_tx_atomic(struct fid_ep *ep,
 		conn = sock_av_lookup_addr(tx_ctx->av, msg->addr);
 	}
 
-	if (!conn)
+	if (!conn) {
+		sock_stats_tx_inc(tx_ctx, sock_ep, FI_SOCK_STAT_EAGAIN);
 		return -FI_EAGAIN;
+	}
 
 	src_len = 0;
 	datatype_sz = fi_datatype_size(msg->datatype);
@@ -108,7 +114,10 @@ static ssize_t sock_ep_tx_atomic(struct fid_ep *ep,
 		for (i=0; i< msg->iov_count; i++) {
 			src_len += (msg->msg_iov[i].count * datatype_sz);
 		}
-		assert(src_len <= SOCK_EP_MAX_INJECT_SZ);
+		/* atomic injects only travel inline in the tx ring */
+		if (src_len > tx_ctx->attr.inject_size ||
+		    src_len > SOCK_EP_MAX_INLINE_SZ)
+			return -FI_EINVAL;
 		total_len = src_len;
 	} else {
 		total_len = msg->iov_count * sizeof(union sock_iov);
@@ -119,7 +128,7 @@ static ssize_t sock_ep_tx_atomic(struct fid_ep *ep,
 		      (result_count * sizeof (union sock_iov)));
 	
 	sock_tx_ctx_start(tx_ctx);
-	if (rbfdavail(&tx_ctx->rbfd) < total_len) {
+	if (sock_tx_ctx_avail(tx_ctx) < total_len) {
 		ret = -FI_EAGAIN;
 		goto err;
 	}
@@ -138,13 +147,8 @@ static ssize_t sock_ep_tx_atomic(struct fid_ep *ep,
 	else 
 		tx_op.src_iov_len = msg->iov_count;
 
-	sock_tx_ctx_write(tx_ctx, &tx_op, sizeof(struct sock_op));
-	sock_tx_ctx_write(tx_ctx, &flags, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->context, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->addr, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &conn, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->msg_iov[0].addr, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &sock_ep, sizeof(uint64_t));
+	sock_tx_ctx_write_op(tx_ctx, &tx_op, flags, (uintptr_t) msg->context,
+			     msg->addr, (uintptr_t) msg->msg_iov[0].addr, sock_ep, conn);
 
 	if (flags & FI_REMOTE_CQ_DATA) {
 		sock_tx_ctx_write(tx_ctx, &msg->data, sizeof(uint64_t));
@@ -211,12 +215,12 @@ static ssize_t sock_ep_tx_atomic(struct fid_ep *ep,
 		goto err;
 	}
 	
-	sock_tx_ctx_commit(tx_ctx);
+	sock_tx_ctx_commit(tx_ctx, sock_ep, flags);
 	return 0;
 
 err:
 	SOCK_LOG_INFO("Not enough space for TX entry, try again\n");
-	sock_tx_ctx_abort(tx_ctx);
+	sock_tx_ctx_abort(tx_ctx, sock_ep);
 	return ret;
 }
 
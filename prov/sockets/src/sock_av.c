@@ -43,35 +43,130 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <ctype.h>
+#include <sched.h>
 #include <sys/ipc.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "sock.h"
 #include "sock_util.h"
 
+static void sock_av_pack(struct sock_av_addr *av_addr,
+			 const struct sockaddr_in *sin, uint16_t rem_ep_id)
+{
+	memset(av_addr, 0, sizeof(*av_addr));
+	memcpy(av_addr->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+	av_addr->port = sin->sin_port;
+	av_addr->family = AF_INET;
+	av_addr->rem_ep_id = rem_ep_id;
+}
+
+static void sock_av_unpack(const struct sock_av_addr *av_addr,
+			   struct sockaddr_in *sin)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = av_addr->family;
+	sin->sin_port = av_addr->port;
+	memcpy(&sin->sin_addr, av_addr->addr, sizeof(sin->sin_addr));
+}
+
+static int sock_av_addr_equal(const struct sock_av_addr *a1,
+			      const struct sock_av_addr *a2)
+{
+	return a1->family == a2->family && a1->port == a2->port &&
+		!memcmp(a1->addr, a2->addr, sizeof(a1->addr));
+}
+
+/*
+ * Both AV types hand out the entry index as the fi_addr_t, so an address
+ * resolves to its entry, and the connection key stored in it, with one
+ * load. The range check uses the local table size rather than the
+ * (possibly shared) table header.
+ *
+ * Lookups take no lock, so an unnamed AV that grows publishes a larger
+ * copy of its table and retires the old one until the AV is closed:
+ * the table is stored before its size, so a reader that sees the new
+ * size also sees the new table, and one still holding the old table
+ * reads valid memory.
+ */
+static inline struct sock_av_addr *sock_av_table(struct sock_av *av)
+{
+	return __atomic_load_n(&av->table, __ATOMIC_ACQUIRE);
+}
+
+static inline struct sock_av_addr *sock_av_entry(struct sock_av *av,
+						 fi_addr_t addr)
+{
+	uint64_t index = ((uint64_t)addr & av->mask);
+
+	return (index < __atomic_load_n(&av->table_sz, __ATOMIC_ACQUIRE)) ?
+		&sock_av_table(av)[index] : NULL;
+}
+
+/* Entries of a named AV are shared, so its connection keys live aside */
+static inline uint16_t *sock_av_key(struct sock_av *av, uint64_t index)
+{
+	return av->keys ? &av->keys[index] : &sock_av_table(av)[index].key;
+}
+
+/*
+ * The key map is only a cache, but an entry that has a key is skipped
+ * by the reverse-lookup scan: record the key only once it is mapped.
+ */
+static void sock_av_set_key(struct sock_av *av, uint64_t index,
+			    uint16_t key)
+{
+	if (radix_map_set(&av->key_map, key,
+			  (void *) (uintptr_t) (index + 1))) {
+		SOCK_LOG_ERROR("failed to map key %d\n", key);
+		return;
+	}
+	*sock_av_key(av, index) = key;
+}
+
 fi_addr_t sock_av_lookup_key(struct sock_av *av, int key)
 {
-	int i, idx;
-	struct sock_av_addr *av_addr;
+	uint64_t i, stored;
+	uint16_t conn_key;
+	void *item;
+	struct sock_av_addr *table, *av_addr;
+	struct sock_conn *conn;
+	struct sockaddr_in sin;
+
+	item = radix_map_lookup(&av->key_map, key + 1);
+	if (item)
+		return (fi_addr_t) ((uintptr_t) item - 1);
+
+	/* the peer connected before we sent to it: match by address */
+	conn = (av->cmap && key < av->cmap->used) ?
+		&av->cmap->table[key] : NULL;
+	stored = __atomic_load_n(&av->table_hdr->stored, __ATOMIC_ACQUIRE);
+	table = sock_av_table(av);
+	for (i = 0; conn && i < stored; i++) {
+		av_addr = &table[i];
+		if (!av_addr->valid || (!conn->lane && *sock_av_key(av, i)))
+			continue;
 
-	for (i = 0; i < IDX_MAX_INDEX; i++) {
-		av_addr = idm_lookup(&av->addr_idm, i);
-		if (!av_addr)
+		sock_av_unpack(av_addr, &sin);
+		conn_key = sock_conn_map_lookup(av->cmap, &sin, conn->lane);
+		if (!conn_key)
 			continue;
-		
-		idx = av_addr - &av->table[0];
-		if (!av->key[idx]) {
-			av->key[idx] = sock_conn_map_lookup(
-				av->cmap,
-				(struct sockaddr_in*)&av_addr->addr);
-			if (!av->key[idx]) {
+
+		if (conn->lane) {
+			if (conn_key != key + 1)
 				continue;
-			}
-		}
-		
-		if (av->key[idx] == key + 1) {
+			if (radix_map_set(&av->key_map, conn_key,
+					  (void *) (uintptr_t) (i + 1)))
+				SOCK_LOG_ERROR("failed to map key %d\n",
+					       conn_key);
 			return i;
 		}
+
+		sock_av_set_key(av, i, conn_key);
+		if (conn_key == key + 1)
+			return i;
 	}
 	
 	SOCK_LOG_INFO("Reverse-lookup failed: %d\n", key);
@@ -81,33 +176,63 @@ fi_addr_t sock_av_lookup_key(struct sock_av *av, int key)
 int sock_av_compare_addr(struct sock_av *av, 
 			 fi_addr_t addr1, fi_addr_t addr2)
 {
-	int index1, index2;
 	struct sock_av_addr *av_addr1, *av_addr2;
 
-	index1 = ((uint64_t)addr1 & av->mask);
-	index2 = ((uint64_t)addr2 & av->mask);
-
-	if (index1 >= av->table_hdr->stored || index1 < 0 ||
-	    index2 >= av->table_hdr->stored || index2 < 0) {
+	av_addr1 = sock_av_entry(av, addr1);
+	av_addr2 = sock_av_entry(av, addr2);
+	if (!av_addr1 || !av_addr2) {
 		SOCK_LOG_ERROR("requested rank is larger than av table\n");
 		return -1;
 	}
-	
-	av_addr1 = idm_lookup(&av->addr_idm, index1);
-	av_addr2 = idm_lookup(&av->addr_idm, index2);
 
-	return memcmp(&av_addr1->addr, &av_addr2->addr, 
-		      sizeof(struct sockaddr_in));
+	return !sock_av_addr_equal(av_addr1, av_addr2);
+}
+
+/*
+ * Traffic for a named receive context of a scalable endpoint goes over
+ * its own connection to the peer, a lane, so that each receive context
+ * progresses a disjoint set of sockets.  Lane keys are cached by entry
+ * and context index.
+ */
+static struct sock_conn *sock_av_lookup_lane(struct sock_av *av,
+					     struct sock_av_addr *av_addr,
+					     uint64_t index, uint16_t lane)
+{
+	uint16_t key;
+	uint64_t slot = (index << SOCK_EP_MAX_CTX_BITS) | lane;
+	struct sockaddr_in sin;
+
+	key = (uint16_t) (uintptr_t) radix_map_lookup(&av->lane_map, slot);
+	if (!key) {
+		sock_av_unpack(av_addr, &sin);
+		key = sock_conn_map_match_or_connect(av->domain, av->cmap,
+						     &sin, lane);
+		if (!key) {
+			SOCK_LOG_ERROR("failed to match or connect to addr %"
+				       PRIu64 ", lane %d\n", index, lane);
+			errno = EINVAL;
+			return NULL;
+		}
+		/* on failure the next lookup matches the connection again */
+		if (radix_map_set(&av->lane_map, slot,
+				  (void *) (uintptr_t) key) ||
+		    radix_map_set(&av->key_map, key,
+				  (void *) (uintptr_t) (index + 1)))
+			SOCK_LOG_ERROR("failed to map key %d\n", key);
+	}
+	return sock_conn_map_lookup_key(av->cmap, key);
 }
 
 struct sock_conn *sock_av_lookup_addr(struct sock_av *av, 
 		fi_addr_t addr)
 {
-	int idx;
-	int index = ((uint64_t)addr & av->mask);
+	uint16_t key, lane;
+	uint64_t index;
 	struct sock_av_addr *av_addr;
+	struct sockaddr_in sin;
 
-	if (index >= av->table_hdr->stored || index < 0) {
+	av_addr = sock_av_entry(av, addr);
+	if (!av_addr || !av_addr->valid) {
 		SOCK_LOG_ERROR("requested rank is larger than av table\n");
 		errno = EINVAL;
 		return NULL;
@@ -119,28 +244,33 @@ struct sock_conn *sock_av_lookup_addr(struct sock_av *av,
 		return NULL;
 	}
 
-	av_addr = idm_lookup(&av->addr_idm, index);
-	idx = av_addr - &av->table[0];
-	if (!av->key[idx]) {
-		av->key[idx] = sock_conn_map_match_or_connect(
-			av->domain, av->cmap, 
-			(struct sockaddr_in*)&av_addr->addr);
-		if (!av->key[idx]) {
+	index = (uint64_t) addr & av->mask;
+	lane = SOCK_GET_RX_ID(addr, av->rx_ctx_bits);
+	if (lane)
+		return sock_av_lookup_lane(av, av_addr, index, lane);
+
+	key = *sock_av_key(av, index);
+	if (!key) {
+		sock_av_unpack(av_addr, &sin);
+		key = sock_conn_map_match_or_connect(av->domain, av->cmap,
+						     &sin, 0);
+		if (!key) {
 			SOCK_LOG_ERROR("failed to match or connect to addr %"
 					PRIu64 "\n", addr);
 			errno = EINVAL;
 			return NULL;
 		}
+		sock_av_set_key(av, index, key);
 	}
-	return sock_conn_map_lookup_key(av->cmap, av->key[idx]);
+	return sock_conn_map_lookup_key(av->cmap, key);
 }
 
 uint16_t sock_av_lookup_ep_id(struct sock_av *av, fi_addr_t addr)
 {
-	int index = ((uint64_t)addr & av->mask);
 	struct sock_av_addr *av_addr;
 
-	if (index >= av->table_hdr->stored || index < 0) {
+	av_addr = sock_av_entry(av, addr);
+	if (!av_addr) {
 		return AF_INET;
 	}
 
@@ -149,7 +279,6 @@ uint16_t sock_av_lookup_ep_id(struct sock_av *av, fi_addr_t addr)
 		return 0;
 	}
 
-	av_addr = idm_lookup(&av->addr_idm, index);
 	return av_addr->rem_ep_id;
 }
 
@@ -171,75 +300,220 @@ static inline void sock_av_report_error(struct sock_av *av, void *context,
 	sock_av_report_success(av, index, flags);
 }
 
+/*
+ * Named AVs are shared by all processes on a node. The process that
+ * creates the segment is the leader and the only writer; everyone else
+ * maps it read-only and resolves addresses against it.
+ *
+ * Entries are appended without a lock: an inserter claims a slot, fills
+ * it, and publishes it by advancing 'stored' in claim order, so readers
+ * always see a dense prefix. The entry is then added to an open
+ * addressing hash of the packed address, and 'generation' is bumped to
+ * wake followers waiting for it.
+ *
+ * The leader holds an exclusive flock on the segment until it closes
+ * the AV or exits. A process that can take that lock knows the leader
+ * is gone: it unlinks the segment, and the next writer to open the name
+ * creates a fresh one with leader_gen advanced.
+ */
+#define SOCK_AV_SHM_MAGIC	0x736f636b5f617632ULL	/* "sock_av2" */
+
+static size_t sock_av_shm_size(size_t count)
+{
+	return sizeof(struct sock_av_table_hdr) +
+		count * sizeof(struct sock_av_addr) +
+		roundup_power_of_two(2 * count) * sizeof(uint64_t);
+}
+
+static uint64_t sock_av_hash(const struct sock_av_addr *av_addr)
+{
+	uint64_t w[2], h;
+
+	memcpy(w, av_addr->addr, sizeof(w));
+	h = w[0] ^ (w[1] * 0x9e3779b97f4a7c15ULL) ^
+		((uint64_t) av_addr->port << 16) ^ av_addr->rem_ep_id;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+static int64_t sock_av_shared_find(struct sock_av *av,
+				   const struct sock_av_addr *packed)
+{
+	uint64_t i, slot, mask = av->table_hdr->hash_sz - 1;
+	struct sock_av_addr *av_addr;
+
+	for (i = sock_av_hash(packed) & mask; ; i = (i + 1) & mask) {
+		slot = __atomic_load_n(&av->hash[i], __ATOMIC_ACQUIRE);
+		if (!slot)
+			return -1;
+
+		av_addr = &av->table[slot - 1];
+		if (av_addr->valid && sock_av_addr_equal(av_addr, packed) &&
+		    av_addr->rem_ep_id == packed->rem_ep_id)
+			return slot - 1;
+	}
+}
+
+static int64_t sock_av_shared_append(struct sock_av *av,
+				     const struct sock_av_addr *packed)
+{
+	struct sock_av_table_hdr *hdr = av->table_hdr;
+	uint64_t index, i, slot, mask;
+
+	index = __atomic_load_n(&hdr->claimed, __ATOMIC_RELAXED);
+	do {
+		if (index >= hdr->size) {
+			SOCK_LOG_ERROR("Cannot insert to AV table\n");
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&hdr->claimed, &index, index + 1,
+					      0, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	av->table[index] = *packed;
+	av->table[index].valid = 1;
+
+	while (__atomic_load_n(&hdr->stored, __ATOMIC_ACQUIRE) != index)
+		sched_yield();
+	__atomic_store_n(&hdr->stored, index + 1, __ATOMIC_RELEASE);
+
+	mask = hdr->hash_sz - 1;
+	for (i = sock_av_hash(packed) & mask; ; i = (i + 1) & mask) {
+		slot = 0;
+		if (__atomic_compare_exchange_n(&av->hash[i], &slot, index + 1,
+						0, __ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	__atomic_add_fetch(&hdr->generation, 1, __ATOMIC_RELEASE);
+	return index;
+}
+
+/* the leader's flock is free only once it has closed the AV or exited */
+static int sock_av_shared_leader_gone(int fd)
+{
+	if (flock(fd, LOCK_EX | LOCK_NB))
+		return 0;
+	flock(fd, LOCK_UN);
+	return 1;
+}
+
+static int64_t sock_av_shared_wait(struct sock_av *av,
+				   const struct sock_av_addr *packed)
+{
+	uint64_t gen, now, deadline, check;
+	int64_t index;
+
+	now = fi_gettime_ms();
+	deadline = now + SOCK_AV_SHARED_TIMEOUT;
+	check = now + SOCK_AV_SHARED_CHECK;
+	for (;;) {
+		gen = __atomic_load_n(&av->table_hdr->generation,
+				      __ATOMIC_ACQUIRE);
+		index = sock_av_shared_find(av, packed);
+		if (index >= 0)
+			return index;
+
+		while (__atomic_load_n(&av->table_hdr->generation,
+				       __ATOMIC_ACQUIRE) == gen) {
+			now = fi_gettime_ms();
+			if (now > deadline) {
+				SOCK_LOG_ERROR("Address not in shared AV\n");
+				return -1;
+			}
+			if (now > check) {
+				if (sock_av_shared_leader_gone(av->shared_fd)) {
+					SOCK_LOG_ERROR("shared AV %s lost its leader\n",
+						       av->name);
+					return -1;
+				}
+				check = now + SOCK_AV_SHARED_CHECK;
+			}
+			sched_yield();
+		}
+	}
+}
+
+static int sock_av_shared_insert(struct sock_av *_av, struct sockaddr_in *addr,
+				 fi_addr_t *fi_addr, int count, uint64_t flags,
+				 void *context, int index)
+{
+	int i, ret = 0;
+	int64_t entry;
+	struct sock_av_addr packed;
+	uint16_t rem_ep_id;
+
+	for (i = 0; i < count; i++) {
+		rem_ep_id = addr[i].sin_family;
+		addr[i].sin_family = AF_INET;
+		sock_av_pack(&packed, &addr[i], rem_ep_id);
+
+		entry = _av->leader ? sock_av_shared_append(_av, &packed) :
+				      sock_av_shared_wait(_av, &packed);
+		if (entry < 0) {
+			if (fi_addr)
+				fi_addr[i] = FI_ADDR_NOTAVAIL;
+			sock_av_report_error(_av, context, flags,
+					     count > 1 ? &i : &index);
+			continue;
+		}
+
+		if (fi_addr)
+			fi_addr[i] = (fi_addr_t)entry;
+		sock_av_report_success(_av, count > 1 ? &i : &index, flags);
+		ret++;
+	}
+	return ret;
+}
+
+/*
+ * A key cached in the old table while it is copied is lost; the next
+ * lookup of that entry matches its connection again.
+ */
+static int sock_av_grow(struct sock_av *av)
+{
+	struct sock_av_addr *table;
+	size_t new_count;
+
+	new_count = av->table_sz * 2;
+	table = calloc(new_count, sizeof(*table));
+	if (!table)
+		return -FI_ENOMEM;
+
+	memcpy(table, av->table, av->table_sz * sizeof(*table));
+	slist_insert_head((struct slist_entry *) av->table, &av->retired);
+	__atomic_store_n(&av->table, table, __ATOMIC_RELEASE);
+	__atomic_store_n(&av->table_sz, new_count, __ATOMIC_RELEASE);
+	av->table_hdr->size = new_count;
+	return 0;
+}
+
 static int sock_check_table_in(struct sock_av *_av, struct sockaddr_in *addr,
 			       fi_addr_t *fi_addr, int count, uint64_t flags, 
 			       void *context, int index)
 {
-	int i, j, ret = 0;
+	int i, ret = 0;
 	char sa_ip[INET_ADDRSTRLEN];
 	struct sock_av_addr *av_addr;
-	size_t new_count, table_sz;
 	uint16_t rem_ep_id;
 
 	if ((_av->attr.flags & FI_EVENT) && !_av->eq)
 		return -FI_ENOEQ;
-	
-	if (_av->attr.flags & FI_READ) {
-		for (i = 0; i < count; i++) {
-			for (j = 0; j < _av->table_hdr->stored; j++) {
-				av_addr = &_av->table[j];
-
-				rem_ep_id = ((struct sockaddr_in*)&addr[i])->sin_family;
-				((struct sockaddr_in*)&addr[i])->sin_family = AF_INET;
-
-				if ((memcmp(&av_addr->addr, &addr[i], 
-					    sizeof(struct sockaddr_in)) == 0) && 
-				    av_addr->rem_ep_id == rem_ep_id) {
-					SOCK_LOG_INFO("Found addr in shared av\n");
-					if (idm_set(&_av->addr_idm, _av->key[j], av_addr) < 0) {
-						if (fi_addr)
-							fi_addr[i] = FI_ADDR_NOTAVAIL;
-						sock_av_report_error(
-							_av, context, flags, 
-							count > 1 ? &i : &index);
-						continue;
-					}
-					
-					if (fi_addr)
-						fi_addr[i] = (fi_addr_t)j;
-					
-					sock_av_report_success(
-						_av, count > 1 ? &i : &index, flags);
-					ret++;
-				}
-			}
-		}
-		return ret;
-	}
+
+	if (_av->name)
+		return sock_av_shared_insert(_av, addr, fi_addr, count, flags,
+					     context, index);
 
 	for (i = 0, ret = 0; i < count; i++) {
 
-		if (_av->table_hdr->stored == _av->table_hdr->size) {
+		if (_av->table_hdr->stored == _av->table_sz) {
 			if (_av->table_hdr->req_sz) {
 				SOCK_LOG_ERROR("Cannot insert to AV table\n");
 				return -FI_EINVAL;
-			} else{
-				new_count = _av->table_hdr->size * 2;
-				_av->key = realloc(_av->key, 
-						   sizeof(uint16_t) * new_count);
-				if (!_av->key)
-					return -FI_ENOMEM;
-				
-				table_sz = sizeof(struct sock_av_table_hdr) +
-					new_count * sizeof(struct sock_av_addr);
-
-				_av->table_hdr = realloc(_av->table_hdr, table_sz);
-				if (!_av->table_hdr)
-					return -FI_ENOMEM;
-				_av->table_hdr->size = new_count;
-				_av->table = (struct sock_av_addr*)((char*)_av->table_hdr + 
-								    sizeof(struct sock_av_table_hdr));
 			}
+			if (sock_av_grow(_av))
+				return -FI_ENOMEM;
 		}
 
 		rem_ep_id = ((struct sockaddr_in*)&addr[i])->sin_family;
@@ -251,23 +525,15 @@ static int sock_check_table_in(struct sock_av *_av, struct sockaddr_in *addr,
 			      ((struct sockaddr_in*)&addr[i])->sin_family, sa_ip,
 			      ntohs(((struct sockaddr_in*)&addr[i])->sin_port));
 		
-		memcpy(&av_addr->addr, &addr[i], sizeof(struct sockaddr_in));
-		av_addr->rem_ep_id = rem_ep_id;
-		if (idm_set(&_av->addr_idm, _av->table_hdr->stored, av_addr) < 0) {
-			if (fi_addr)
-				fi_addr[i] = FI_ADDR_NOTAVAIL;
-			sock_av_report_error(
-				_av, context, flags, 
-				count > 1 ? &i : &index);
-			continue;
-		}
+		sock_av_pack(av_addr, &addr[i], rem_ep_id);
+		av_addr->valid = 1;
 		
 		if (fi_addr)
 			fi_addr[i] = (fi_addr_t)_av->table_hdr->stored;
 
 		sock_av_report_success(_av, count > 1 ? &i : &index, flags);
-		av_addr->valid = 1;
-		_av->table_hdr->stored++;
+		__atomic_store_n(&_av->table_hdr->stored,
+				 _av->table_hdr->stored + 1, __ATOMIC_RELEASE);
 		ret++;
 	}
 	return ret;
@@ -285,19 +551,19 @@ static int sock_av_insert(struct fid_av *av, const void *addr, size_t count,
 static int sock_av_lookup(struct fid_av *av, fi_addr_t fi_addr, void *addr,
 			  size_t *addrlen)
 {
-	int index;
 	struct sock_av *_av;
 	struct sock_av_addr *av_addr;
+	struct sockaddr_in sin;
 
 	_av = container_of(av, struct sock_av, av_fid);
-	index = ((uint64_t)fi_addr & _av->mask);
-	if (index >= _av->table_hdr->stored || index < 0) {
+	av_addr = sock_av_entry(_av, fi_addr);
+	if (!av_addr || !av_addr->valid) {
 		SOCK_LOG_ERROR("requested address not inserted\n");
 		return -EINVAL;
 	}
 
-	av_addr = idm_lookup(&_av->addr_idm, index);
-        memcpy(addr, &av_addr->addr, MIN(*addrlen, _av->addrlen));
+	sock_av_unpack(av_addr, &sin);
+        memcpy(addr, &sin, MIN(*addrlen, _av->addrlen));
 	*addrlen = _av->addrlen;
 	return 0;
 }
@@ -388,16 +654,48 @@ int sock_av_insertsym(struct fid_av *av, const char *node, size_t nodecnt,
 }
 
 
+/* forget the lanes of a removed entry, so a reused index starts afresh */
+static void sock_av_clear_lanes(struct sock_av *av, uint64_t index)
+{
+	uint64_t lane, slot;
+	uint16_t key;
+
+	for (lane = 1; lane < (1ULL << av->rx_ctx_bits); lane++) {
+		slot = (index << SOCK_EP_MAX_CTX_BITS) | lane;
+		key = (uint16_t) (uintptr_t) radix_map_clear(&av->lane_map,
+							     slot);
+		if (key && radix_map_lookup(&av->key_map, key) ==
+		    (void *) (uintptr_t) (index + 1))
+			radix_map_clear(&av->key_map, key);
+	}
+}
+
 static int sock_av_remove(struct fid_av *av, fi_addr_t *fi_addr, size_t count,
 			  uint64_t flags)
 {
 	int i;
 	struct sock_av *_av;
 	struct sock_av_addr *av_addr;
+	uint64_t index;
+	uint16_t *key;
 	_av = container_of(av, struct sock_av, av_fid);
 
+	if (_av->name && !_av->leader) {
+		SOCK_LOG_ERROR("Only the leader can remove from a shared AV\n");
+		return -FI_EOPNOTSUPP;
+	}
+
 	for (i = 0; i < count; i++) {
-		av_addr = &_av->table[fi_addr[i]];
+		av_addr = sock_av_entry(_av, fi_addr[i]);
+		if (!av_addr)
+			continue;
+
+		index = (uint64_t) fi_addr[i] & _av->mask;
+		key = sock_av_key(_av, index);
+		if (*key)
+			radix_map_clear(&_av->key_map, *key);
+		*key = 0;
+		sock_av_clear_lanes(_av, index);
 		av_addr->valid = 0;
 	}
 	return 0;
@@ -435,29 +733,29 @@ static int sock_av_bind(struct fid *fid, struct fid *bfid, uint64_t flags)
 static int sock_av_close(struct fid *fid)
 {
 	struct sock_av *av;
-	int i;
 
 	av = container_of(fid, struct sock_av, av_fid.fid);
 	if (atomic_get(&av->ref))
 		return -FI_EBUSY;
 
-	for (i=0; i<av->table_hdr->stored; i++) {
-		if(idm_lookup(&av->addr_idm, i))
-			idm_clear(&av->addr_idm , i);
-	}
+	radix_map_destroy(&av->key_map);
+	radix_map_destroy(&av->lane_map);
 
-	if (!av->name) 
+	if (!av->name) {
+		while (!slist_empty(&av->retired))
+			free(slist_remove_head(&av->retired));
 		free(av->table_hdr);
-	else {
-		shm_unlink(av->name);
+		free(av->table);
+	} else {
+		if (av->leader)
+			shm_unlink(av->name);
 		free(av->name);
-		munmap(av->table_hdr, sizeof(struct sock_av_table_hdr) +
-		       av->attr.count * sizeof(struct sock_av_addr));
+		munmap(av->table_hdr, sock_av_shm_size(av->attr.count));
 		close(av->shared_fd);
+		free(av->keys);
 	}
 
 	atomic_dec(&av->domain->ref);
-	free(av->key);
 	free(av);
 	return 0;
 }
@@ -510,14 +808,201 @@ static int sock_verify_av_attr(struct fi_av_attr *attr)
 	return 0;
 }
 
+/* is fd still the segment that the AV name refers to? */
+static int sock_av_shared_current(struct sock_av *av, int fd)
+{
+	struct stat st, cur_st;
+	int cur_fd, ret;
+
+	cur_fd = shm_open(av->name, O_RDONLY, 0);
+	if (cur_fd < 0)
+		return 0;
+
+	ret = !fstat(fd, &st) && !fstat(cur_fd, &cur_st) &&
+	      st.st_dev == cur_st.st_dev && st.st_ino == cur_st.st_ino;
+	close(cur_fd);
+	return ret;
+}
+
+/*
+ * Unlink the segment open on av->shared_fd if its leader is gone, so
+ * that the open can start over. Returns 1 if the segment was stale.
+ */
+static int sock_av_shared_reap(struct sock_av *av, uint64_t *leader_gen)
+{
+	struct sock_av_table_hdr hdr;
+
+	if (flock(av->shared_fd, LOCK_EX | LOCK_NB))
+		return 0;
+
+	if (pread(av->shared_fd, &hdr, sizeof hdr, 0) == sizeof hdr &&
+	    hdr.magic == SOCK_AV_SHM_MAGIC) {
+		SOCK_LOG_ERROR("shared AV %s: leader %" PRIu64
+			       " (generation %" PRIu64 ") is gone\n",
+			       av->name, hdr.leader_pid, hdr.leader_gen);
+		*leader_gen = hdr.leader_gen;
+	}
+
+	if (sock_av_shared_current(av, av->shared_fd))
+		shm_unlink(av->name);
+	flock(av->shared_fd, LOCK_UN);
+	return 1;
+}
+
+static int sock_av_shared_wait_ready(struct sock_av *av, size_t shm_sz,
+				     uint64_t *leader_gen)
+{
+	struct stat st;
+	uint64_t deadline;
+
+	/* the leader may still be sizing and initializing the segment */
+	deadline = fi_gettime_ms() + SOCK_AV_SHARED_TIMEOUT;
+	for (;;) {
+		if (!av->table_hdr && !fstat(av->shared_fd, &st) &&
+		    st.st_size >= shm_sz) {
+			av->table_hdr = mmap(NULL, shm_sz, PROT_READ,
+					     MAP_SHARED, av->shared_fd, 0);
+			if (av->table_hdr == MAP_FAILED) {
+				av->table_hdr = NULL;
+				return -FI_EINVAL;
+			}
+		}
+
+		if (av->table_hdr &&
+		    __atomic_load_n(&av->table_hdr->magic, __ATOMIC_ACQUIRE) ==
+		    SOCK_AV_SHM_MAGIC)
+			break;
+
+		if (sock_av_shared_reap(av, leader_gen))
+			return -FI_EAGAIN;
+		if (fi_gettime_ms() > deadline)
+			return -FI_ETIMEDOUT;
+		sched_yield();
+	}
+
+	/* a complete segment may still have been left by a dead leader */
+	if (sock_av_shared_reap(av, leader_gen))
+		return -FI_EAGAIN;
+
+	return (av->table_hdr->size == av->attr.count) ? 0 : -FI_EINVAL;
+}
+
+static int sock_av_shared_create(struct sock_av *av, size_t shm_sz,
+				 uint64_t leader_gen)
+{
+	/* blocks only while a reaper briefly holds the lock */
+	if (flock(av->shared_fd, LOCK_EX)) {
+		SOCK_LOG_ERROR("flock failed\n");
+		goto err_unlink;
+	}
+
+	/* a reaper took our segment for a dead leader's: start over */
+	if (!sock_av_shared_current(av, av->shared_fd)) {
+		close(av->shared_fd);
+		return -FI_EAGAIN;
+	}
+
+	if (ftruncate(av->shared_fd, shm_sz) == -1) {
+		SOCK_LOG_ERROR("ftruncate failed\n");
+		goto err_unlink;
+	}
+
+	av->table_hdr = mmap(NULL, shm_sz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, av->shared_fd, 0);
+	if (av->table_hdr == MAP_FAILED) {
+		av->table_hdr = NULL;
+		SOCK_LOG_ERROR("mmap failed\n");
+		goto err_unlink;
+	}
+
+	av->table_hdr->size = av->attr.count;
+	av->table_hdr->hash_sz = roundup_power_of_two(2 * av->attr.count);
+	av->table_hdr->leader_pid = getpid();
+	av->table_hdr->leader_gen = leader_gen + 1;
+	__atomic_store_n(&av->table_hdr->magic, SOCK_AV_SHM_MAGIC,
+			 __ATOMIC_RELEASE);
+	av->leader = 1;
+	return 0;
+
+err_unlink:
+	shm_unlink(av->name);
+	close(av->shared_fd);
+	return -FI_EINVAL;
+}
+
+static int sock_av_shared_attach(struct sock_av *av, size_t shm_sz,
+				 uint64_t *leader_gen)
+{
+	int ret;
+
+	if (!(av->attr.flags & FI_READ)) {
+		av->shared_fd = shm_open(av->name, O_RDWR | O_CREAT | O_EXCL,
+					 S_IRUSR | S_IWUSR);
+		if (av->shared_fd >= 0)
+			return sock_av_shared_create(av, shm_sz, *leader_gen);
+		if (errno != EEXIST)
+			return -FI_EINVAL;
+	}
+
+	av->shared_fd = shm_open(av->name, O_RDONLY, 0);
+	if (av->shared_fd < 0)
+		return (errno == ENOENT) ? -FI_EAGAIN : -FI_EINVAL;
+
+	ret = sock_av_shared_wait_ready(av, shm_sz, leader_gen);
+	if (ret) {
+		if (av->table_hdr)
+			munmap(av->table_hdr, shm_sz);
+		av->table_hdr = NULL;
+		close(av->shared_fd);
+	}
+	return ret;
+}
+
+static int sock_av_shared_open(struct sock_av *av)
+{
+	uint64_t deadline, leader_gen = 0;
+	size_t shm_sz;
+	int ret;
+
+	shm_sz = sock_av_shm_size(av->attr.count);
+	SOCK_LOG_INFO("Opening shm segment :%s (size: %lu)\n",
+		      av->name, shm_sz);
+
+	deadline = fi_gettime_ms() + SOCK_AV_SHARED_TIMEOUT;
+	while ((ret = sock_av_shared_attach(av, shm_sz, &leader_gen)) ==
+	       -FI_EAGAIN) {
+		if (fi_gettime_ms() > deadline) {
+			ret = -FI_ETIMEDOUT;
+			break;
+		}
+		sched_yield();
+	}
+	if (ret) {
+		SOCK_LOG_ERROR("shared AV %s not usable\n", av->name);
+		return ret;
+	}
+
+	av->table = (struct sock_av_addr *) (av->table_hdr + 1);
+	av->table_sz = av->attr.count;
+	av->hash = (uint64_t *) (av->table + av->attr.count);
+	av->keys = calloc(av->attr.count, sizeof(*av->keys));
+	if (!av->keys) {
+		munmap(av->table_hdr, shm_sz);
+		if (av->leader)
+			shm_unlink(av->name);
+		close(av->shared_fd);
+		return -FI_ENOMEM;
+	}
+	return 0;
+}
+
 int sock_av_open(struct fid_domain *domain, struct fi_av_attr *attr,
 		 struct fid_av **av, void *context)
 {
 	int ret = 0;
 	struct sock_domain *dom;
 	struct sock_av *_av;
-	size_t table_sz, i;
-	uint64_t flags = O_RDWR;
+	size_t i;
 	
 	if (!attr || sock_verify_av_attr(attr))
 		return -FI_EINVAL;
@@ -530,15 +1015,6 @@ int sock_av_open(struct fid_domain *domain, struct fi_av_attr *attr,
 	_av->attr = *attr;
 	_av->attr.count = (attr->count) ? attr->count : SOCK_AV_DEF_SZ;
 
-	_av->key = calloc(_av->attr.count, sizeof(uint16_t));
-	if (!_av->key) {
-		ret = -FI_ENOMEM;
-		goto err;
-	}
-
-	table_sz = sizeof(struct sock_av_table_hdr) +
-		_av->attr.count * sizeof(struct sock_av_addr);
-	
 	if (attr->name) {
 		_av->name = calloc(1, FI_NAME_MAX);
 		if(!_av->name) {
@@ -546,60 +1022,31 @@ int sock_av_open(struct fid_domain *domain, struct fi_av_attr *attr,
 			goto err;
 		}
 		strcpy(_av->name, attr->name);
-		if (!(attr->flags & FI_READ))
-			flags |= O_CREAT;
-		
 		for (i = 0; i < strlen(_av->name); i ++)
 			if (_av->name[i] == ' ')
 				_av->name[i] = '_';
-		
-		SOCK_LOG_INFO("Creating shm segment :%s (size: %lu)\n",
-			      _av->name, table_sz);
-		
-		_av->shared_fd = shm_open(_av->name, flags, S_IRUSR | S_IWUSR);
-		if (_av->shared_fd < 0) {
-			SOCK_LOG_ERROR("shm_open failed\n");
-			ret = -FI_EINVAL;
-			goto err;
-		}
-		
-		if (ftruncate(_av->shared_fd, table_sz) == -1) {
-			SOCK_LOG_ERROR("ftruncate failed\n");
-			shm_unlink(_av->name);
-			ret = -FI_EINVAL;
-			goto err;
-		}
-		
-		_av->table_hdr = mmap(NULL, table_sz, PROT_READ | PROT_WRITE, 
-				      MAP_SHARED, _av->shared_fd, 0);
-		if (attr->flags & FI_READ) {
-			if (_av->table_hdr->size != _av->attr.count) {
-				ret = -FI_EINVAL;
-				goto err;
-			}
-		} else {
-			_av->table_hdr->size = _av->attr.count;
-			_av->table_hdr->stored = 0;
-		}
 
-		if (_av->table_hdr == MAP_FAILED) {
-			SOCK_LOG_ERROR("mmap failed\n");
-			shm_unlink(_av->name);
-			ret = -FI_EINVAL;
+		ret = sock_av_shared_open(_av);
+		if (ret)
 			goto err;
-		}
 	} else {
-		_av->table_hdr = calloc(1, table_sz);
+		_av->table_hdr = calloc(1, sizeof(*_av->table_hdr));
 		if (!_av->table_hdr) {
 			ret = -FI_ENOMEM;
 			goto err;
 		}
 		_av->table_hdr->size = _av->attr.count;
 		_av->table_hdr->req_sz = attr->count;
+
+		slist_init(&_av->retired);
+		_av->table_sz = _av->attr.count;
+		_av->table = calloc(_av->table_sz, sizeof(*_av->table));
+		if (!_av->table) {
+			ret = -FI_ENOMEM;
+			goto err;
+		}
 	}
 
-	_av->table = (struct sock_av_addr*)((char*)_av->table_hdr + 
-					    sizeof(struct sock_av_table_hdr));
 	_av->av_fid.fid.fclass = FI_CLASS_AV;
 	_av->av_fid.fid.context = context;
 	_av->av_fid.fid.ops = &sock_av_fi_ops;
@@ -630,10 +1077,21 @@ int sock_av_open(struct fid_domain *domain, struct fi_av_attr *attr,
 	}
 	_av->rx_ctx_bits = attr->rx_ctx_bits;
 	_av->mask = attr->rx_ctx_bits ? 
-		((uint64_t)1<<(64 - attr->rx_ctx_bits + 1))-1 : ~0;
+		((uint64_t)1<<(64 - attr->rx_ctx_bits))-1 : ~0;
 	*av = &_av->av_fid;
 	return 0;
 err:
+	if (_av->keys) {
+		munmap(_av->table_hdr, sock_av_shm_size(_av->attr.count));
+		if (_av->leader)
+			shm_unlink(_av->name);
+		close(_av->shared_fd);
+		free(_av->keys);
+	} else if (!_av->name) {
+		free(_av->table_hdr);
+		free(_av->table);
+	}
+	free(_av->name);
 	free(_av);
 	return ret;
 }
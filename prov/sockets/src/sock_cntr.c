@@ -39,6 +39,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "sock.h"
 #include "sock_util.h"
@@ -85,21 +86,165 @@ static uint64_t sock_cntr_read(struct fid_cntr *cntr)
 	return atomic_get(&_cntr->value);
 }
 
+/* Called with cntr->mut held */
+static void sock_cntr_get_triggers(struct sock_cntr *cntr, 
+				   struct dlist_entry *ready)
+{
+	struct sock_trigger *trigger;
+
+	while (!dlist_empty(&cntr->trigger_list)) {
+		trigger = container_of(cntr->trigger_list.next, 
+				       struct sock_trigger, entry);
+		if (trigger->threshold > atomic_get(&cntr->value))
+			break;
+		dlist_remove(&trigger->entry);
+		dlist_insert_tail(&trigger->entry, ready);
+	}
+}
+
+/*
+ * Waiters are kept in a min-heap ordered by threshold so that an update
+ * only has to look at the top of the heap. All heap operations are
+ * called with cntr->mut held.
+ */
+static void sock_cntr_heap_swap(struct sock_cntr *cntr, int i, int j)
+{
+	struct sock_cntr_waiter *tmp;
+
+	tmp = cntr->waiters[i];
+	cntr->waiters[i] = cntr->waiters[j];
+	cntr->waiters[j] = tmp;
+	cntr->waiters[i]->index = i;
+	cntr->waiters[j]->index = j;
+}
+
+static void sock_cntr_heap_up(struct sock_cntr *cntr, int i)
+{
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (cntr->waiters[parent]->threshold <= cntr->waiters[i]->threshold)
+			break;
+		sock_cntr_heap_swap(cntr, i, parent);
+		i = parent;
+	}
+}
+
+static void sock_cntr_heap_down(struct sock_cntr *cntr, int i)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < cntr->num_waiters) {
+		if (child + 1 < cntr->num_waiters &&
+		    cntr->waiters[child + 1]->threshold <
+		    cntr->waiters[child]->threshold)
+			child++;
+		if (cntr->waiters[i]->threshold <= cntr->waiters[child]->threshold)
+			break;
+		sock_cntr_heap_swap(cntr, i, child);
+		i = child;
+	}
+}
+
+static int sock_cntr_add_waiter(struct sock_cntr *cntr,
+				struct sock_cntr_waiter *waiter)
+{
+	struct sock_cntr_waiter **waiters;
+	int max_waiters;
+
+	if (cntr->num_waiters == cntr->max_waiters) {
+		max_waiters = cntr->max_waiters ? cntr->max_waiters * 2 : 8;
+		waiters = realloc(cntr->waiters, max_waiters * sizeof(*waiters));
+		if (!waiters)
+			return -FI_ENOMEM;
+		cntr->waiters = waiters;
+		cntr->max_waiters = max_waiters;
+	}
+
+	waiter->index = cntr->num_waiters++;
+	cntr->waiters[waiter->index] = waiter;
+	sock_cntr_heap_up(cntr, waiter->index);
+	return 0;
+}
+
+static void sock_cntr_remove_waiter(struct sock_cntr *cntr,
+				    struct sock_cntr_waiter *waiter)
+{
+	int i = waiter->index;
+
+	cntr->num_waiters--;
+	if (i != cntr->num_waiters) {
+		sock_cntr_heap_swap(cntr, i, cntr->num_waiters);
+		sock_cntr_heap_down(cntr, i);
+		sock_cntr_heap_up(cntr, i);
+	}
+	waiter->index = -1;
+}
+
+static void sock_cntr_wake_waiter(struct sock_cntr *cntr,
+				  struct sock_cntr_waiter *waiter, int status)
+{
+	waiter->status = status;
+	if (waiter->progressing)
+		sock_pe_signal(cntr->domain->pe);
+	else
+		pthread_cond_signal(&waiter->cond);
+}
+
+static void sock_cntr_check_waiters(struct sock_cntr *cntr)
+{
+	struct sock_cntr_waiter *waiter;
+
+	while (cntr->num_waiters &&
+	       cntr->waiters[0]->threshold <= atomic_get(&cntr->value)) {
+		waiter = cntr->waiters[0];
+		sock_cntr_remove_waiter(cntr, waiter);
+		sock_cntr_wake_waiter(cntr, waiter, 1);
+	}
+	pthread_cond_signal(&cntr->cond);
+	sock_poll_notify(&cntr->poll_list);
+}
+
+static void sock_cntr_release_triggers(struct dlist_entry *ready)
+{
+	struct sock_trigger *trigger;
+
+	while (!dlist_empty(ready)) {
+		trigger = container_of(ready->next, struct sock_trigger, entry);
+		dlist_remove(&trigger->entry);
+		sock_trigger_release(trigger);
+	}
+}
+
 int sock_cntr_inc(struct sock_cntr *cntr)
 {
+	struct dlist_entry ready;
+
+	dlist_init(&ready);
 	pthread_mutex_lock(&cntr->mut);
 	atomic_inc(&cntr->value);
-	if (atomic_get(&cntr->value) >= atomic_get(&cntr->threshold))
-		pthread_cond_signal(&cntr->cond);
+	sock_cntr_check_waiters(cntr);
+	sock_cntr_get_triggers(cntr, &ready);
 	pthread_mutex_unlock(&cntr->mut);
+
+	sock_cntr_release_triggers(&ready);
 	return 0;
 }
 
 int sock_cntr_err_inc(struct sock_cntr *cntr)
 {
+	struct sock_cntr_waiter *waiter;
+
 	pthread_mutex_lock(&cntr->mut);
 	atomic_inc(&cntr->err_cnt);
+	while (cntr->num_waiters) {
+		waiter = cntr->waiters[0];
+		sock_cntr_remove_waiter(cntr, waiter);
+		sock_cntr_wake_waiter(cntr, waiter, -1);
+	}
 	pthread_cond_signal(&cntr->cond);
+	sock_poll_notify(&cntr->poll_list);
 	pthread_mutex_unlock(&cntr->mut);
 	return 0;
 }
@@ -107,73 +252,113 @@ int sock_cntr_err_inc(struct sock_cntr *cntr)
 static int sock_cntr_add(struct fid_cntr *cntr, uint64_t value)
 {
 	struct sock_cntr *_cntr;
+	struct dlist_entry ready;
 
 	_cntr = container_of(cntr, struct sock_cntr, cntr_fid);
+	dlist_init(&ready);
 	pthread_mutex_lock(&_cntr->mut);
 	atomic_set(&_cntr->value, atomic_get(&_cntr->value) + value);
-	if (atomic_get(&_cntr->value) >= atomic_get(&_cntr->threshold))
-		pthread_cond_signal(&_cntr->cond);
+	sock_cntr_check_waiters(_cntr);
+	sock_cntr_get_triggers(_cntr, &ready);
 	pthread_mutex_unlock(&_cntr->mut);
+
+	sock_cntr_release_triggers(&ready);
 	return 0;
 }
 
 static int sock_cntr_set(struct fid_cntr *cntr, uint64_t value)
 {
 	struct sock_cntr *_cntr;
+	struct dlist_entry ready;
 
 	_cntr = container_of(cntr, struct sock_cntr, cntr_fid);
+	dlist_init(&ready);
 	pthread_mutex_lock(&_cntr->mut);
 	atomic_set(&_cntr->value, value);
-	if (atomic_get(&_cntr->value) >= atomic_get(&_cntr->threshold))
-		pthread_cond_signal(&_cntr->cond);
+	sock_cntr_check_waiters(_cntr);
+	sock_cntr_get_triggers(_cntr, &ready);
 	pthread_mutex_unlock(&_cntr->mut);
+
+	sock_cntr_release_triggers(&ready);
 	return 0;
 }
 
+/*
+ * Any number of threads may wait on a counter, each with its own
+ * threshold. With manual progress, one waiter at a time drives progress
+ * and sleeps on the domain's readiness set; the others sleep on their
+ * own condition and take over progress when the current driver leaves.
+ */
 static int sock_cntr_wait(struct fid_cntr *cntr, uint64_t threshold, int timeout)
 {
-	int ret = 0;
-	uint64_t start_ms = 0, end_ms = 0;
+	int ret = 0, remaining = timeout;
+	uint64_t end_ms = 0;
+	int64_t left;
 	struct sock_cntr *_cntr;
+	struct sock_cntr_waiter waiter;
 	
 	_cntr = container_of(cntr, struct sock_cntr, cntr_fid);
+	if (timeout >= 0)
+		end_ms = fi_gettime_ms() + timeout;
+
 	pthread_mutex_lock(&_cntr->mut);
 	if (atomic_get(&_cntr->value) >= threshold) {
 		pthread_mutex_unlock(&_cntr->mut);
 		return 0;
 	}
 
-	if (_cntr->is_waiting) {
-		pthread_mutex_unlock(&_cntr->mut);
-		return -FI_EBUSY;
-	}
-	
-	_cntr->is_waiting = 1;
-	atomic_set(&_cntr->threshold, threshold);
+	memset(&waiter, 0, sizeof(waiter));
+	waiter.threshold = threshold;
+	pthread_cond_init(&waiter.cond, NULL);
+	ret = sock_cntr_add_waiter(_cntr, &waiter);
+	if (ret)
+		goto out;
 
-	if (_cntr->domain->progress_mode == FI_PROGRESS_MANUAL) {
-		pthread_mutex_unlock(&_cntr->mut);
+	while (!waiter.status) {
 		if (timeout >= 0) {
-			start_ms = fi_gettime_ms();
-			end_ms = start_ms + timeout;
-		}
-		
-		while (atomic_get(&_cntr->value) < threshold) {
-			sock_cntr_progress(_cntr);
-			if (timeout >= 0 && fi_gettime_ms() >= end_ms) {
+			left = (int64_t) (end_ms - fi_gettime_ms());
+			if (left <= 0) {
 				ret = -FI_ETIMEDOUT;
 				break;
 			}
+			remaining = (int) left;
+		}
+
+		if (_cntr->domain->progress_mode == FI_PROGRESS_MANUAL &&
+		    !_cntr->progressing) {
+			_cntr->progressing = 1;
+			waiter.progressing = 1;
+			pthread_mutex_unlock(&_cntr->mut);
+
+			sock_cntr_progress(_cntr);
+			if (atomic_get(&_cntr->value) < threshold)
+				sock_pe_wait_set(_cntr->domain->pe,
+						 _cntr->epoll_fd, remaining);
+
+			pthread_mutex_lock(&_cntr->mut);
+			waiter.progressing = 0;
+			_cntr->progressing = 0;
+		} else {
+			fi_wait_cond(&waiter.cond, &_cntr->mut, remaining);
 		}
-		pthread_mutex_lock(&_cntr->mut);
-	} else {
-		ret = fi_wait_cond(&_cntr->cond, &_cntr->mut, timeout);
 	}
 
-	_cntr->is_waiting = 0;
-	atomic_set(&_cntr->threshold, ~0);
+	if (!waiter.status)
+		sock_cntr_remove_waiter(_cntr, &waiter);
+
+	/* hand progress over to the next waiter in line */
+	if (_cntr->domain->progress_mode == FI_PROGRESS_MANUAL &&
+	    !_cntr->progressing && _cntr->num_waiters)
+		pthread_cond_signal(&_cntr->waiters[0]->cond);
+
+	if (waiter.status < 0)
+		ret = -FI_EAVAIL;
+	else if (waiter.status > 0)
+		ret = 0;
+out:
 	pthread_mutex_unlock(&_cntr->mut);
-	return -ret;
+	pthread_cond_destroy(&waiter.cond);
+	return ret;
 }		
 
 int sock_cntr_control(struct fid *fid, int command, void *arg)
@@ -230,11 +415,18 @@ static int sock_cntr_close(struct fid *fid)
 
 	if (cntr->signal && cntr->attr.wait_obj == FI_WAIT_FD)
 		sock_wait_close(&cntr->waitset->fid);
+	if (cntr->attr.wait_obj == FI_WAIT_SET)
+		sock_wait_del_fid(cntr->waitset, &cntr->cntr_fid.fid);
+
+	sock_trigger_free_list(&cntr->trigger_list);
+	if (cntr->epoll_fd >= 0)
+		close(cntr->epoll_fd);
 	
 	pthread_mutex_destroy(&cntr->mut);
 	fastlock_destroy(&cntr->list_lock);
 
 	pthread_cond_destroy(&cntr->cond);
+	free(cntr->waiters);
 	atomic_dec(&cntr->domain->ref);
 	free(cntr);
 	return 0;
@@ -295,8 +487,6 @@ int sock_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
 	struct sock_domain *dom;
 	struct sock_cntr *_cntr;
 	struct fi_wait_attr wait_attr;
-	struct sock_fid_list *list_entry;
-	struct sock_wait *wait;
 	
 	dom = container_of(domain, struct sock_domain, dom_fid);
 	if (attr && sock_cntr_verify_attr(attr))
@@ -305,11 +495,21 @@ int sock_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
 	_cntr = calloc(1, sizeof(*_cntr));
 	if (!_cntr)
 		return -FI_ENOMEM;
+	_cntr->domain = dom;
+	_cntr->epoll_fd = -1;
 
 	ret = pthread_cond_init(&_cntr->cond, NULL);
 	if (ret)
 		goto err;
 
+	if (dom->progress_mode == FI_PROGRESS_MANUAL) {
+		_cntr->epoll_fd = sock_pe_wait_open(dom->pe, -1);
+		if (_cntr->epoll_fd < 0) {
+			ret = -_cntr->epoll_fd;
+			goto err;
+		}
+	}
+
 	if(attr == NULL)
 		memcpy(&_cntr->attr, &sock_cntr_add, sizeof(sock_cntr_attr));
 	else 
@@ -343,11 +543,10 @@ int sock_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
 
 		_cntr->waitset = attr->wait_set;
 		_cntr->signal = 1;
-		wait = container_of(attr->wait_set, struct sock_wait, wait_fid);
-		list_entry = calloc(1, sizeof(*list_entry));
-		dlist_init(&list_entry->entry);
-		list_entry->fid = &_cntr->cntr_fid.fid;
-		dlist_insert_after(&list_entry->entry, &wait->fid_list);
+		if (sock_wait_add_fid(attr->wait_set, &_cntr->cntr_fid.fid)) {
+			ret = FI_ENOMEM;
+			goto err;
+		}
 		break;
 		
 	default:
@@ -361,10 +560,11 @@ int sock_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
 	atomic_init(&_cntr->err_cnt, 0);
 
 	atomic_init(&_cntr->value, 0);
-	atomic_init(&_cntr->threshold, ~0);
 
 	dlist_init(&_cntr->tx_list);
 	dlist_init(&_cntr->rx_list);
+	dlist_init(&_cntr->trigger_list);
+	dlist_init(&_cntr->poll_list);
 
 	_cntr->cntr_fid.fid.fclass = FI_CLASS_CNTR;
 	_cntr->cntr_fid.fid.context = context;
@@ -372,11 +572,12 @@ int sock_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
 	_cntr->cntr_fid.ops = &sock_cntr_ops;
 
 	atomic_inc(&dom->ref);
-	_cntr->domain = dom;
 	*cntr = &_cntr->cntr_fid;
 	return 0;
 
 err:
+	if (_cntr->epoll_fd >= 0)
+		close(_cntr->epoll_fd);
 	free(_cntr);
 	return -ret;
 }
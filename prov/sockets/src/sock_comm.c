@@ -63,7 +63,9 @@ static ssize_t sock_comm_send_socket(struct sock_conn *conn, const void *buf, si
 
 	while(rem > 0) {
 		len = MIN(rem, SOCK_COMM_BUF_SZ);
-		ret = send(conn->sock_fd, (char *)buf + offset, len, 0);
+		ret = send(conn->sock_fd, (char *)buf + offset, len, MSG_DONTWAIT);
+		conn->syscalls++;
+		SOCK_TRACE(SOCK_TRACE_WIRE_SEND, conn->sock_fd, len, ret);
 		if (ret <= 0) 
 			break;
 		
@@ -71,36 +73,29 @@ static ssize_t sock_comm_send_socket(struct sock_conn *conn, const void *buf, si
 		rem -= ret;
 		offset += ret;
 	}	
+	conn->tx_bytes += done_len;
 	SOCK_LOG_INFO("WROTE %lu on wire\n", done_len);
 	return done_len;
 }
 
 ssize_t sock_comm_flush(struct sock_conn *conn)
 {
-	ssize_t ret1, ret2 = 0;
-	size_t endlen, len, xfer_len;
-
-	len = rbused(&conn->outbuf);
-	endlen = conn->outbuf.size - (conn->outbuf.rcnt & conn->outbuf.size_mask);
-
-	xfer_len = MIN(len, endlen);
-	ret1 = sock_comm_send_socket(conn, conn->outbuf.buf + 
-				     (conn->outbuf.rcnt & conn->outbuf.size_mask), 
-				     xfer_len);
-	if (ret1 > 0)
-		conn->outbuf.rcnt += ret1;
-
-	if (ret1 == xfer_len && xfer_len < len) {
-		ret2 = sock_comm_send_socket(conn, conn->outbuf.buf +
-					     (conn->outbuf.rcnt & conn->outbuf.size_mask), 
-					     len - xfer_len);
-		if (ret2 > 0)
-			conn->outbuf.rcnt += ret2;
-		else
-			ret2 = 0;
-	}
+	ssize_t ret, done = 0;
+	size_t len;
+	void *buf;
+
+	/* a mirrored buffer drains in one send, a plain one may take two */
+	while ((len = rbreadspan(&conn->outbuf, &buf)) > 0) {
+		ret = sock_comm_send_socket(conn, buf, len);
+		if (ret <= 0)
+			break;
 
-	return (ret1 > 0) ? ret1 + ret2 : 0;
+		rbconsume(&conn->outbuf, ret);
+		done += ret;
+		if (ret != len)
+			break;
+	}
+	return done;
 }
 
 ssize_t sock_comm_send(struct sock_conn *conn, const void *buf, size_t len)
@@ -132,38 +127,35 @@ ssize_t sock_comm_recv_socket(struct sock_conn *conn, void *buf, size_t len)
 {
 	ssize_t ret;
 
-	ret = recv(conn->sock_fd, buf, len, 0);
+	ret = recv(conn->sock_fd, buf, len, MSG_DONTWAIT);
+	conn->syscalls++;
+	SOCK_TRACE(SOCK_TRACE_WIRE_RECV, conn->sock_fd, len, ret);
 	if (ret <= 0)
 		return 0;
 
+	conn->rx_bytes += ret;
 	SOCK_LOG_INFO("READ from wire: %lu\n", ret);
 	return ret;
 }
 
 ssize_t sock_comm_recv_buffer(struct sock_conn *conn)
 {
-	int ret;
-	size_t endlen;
-	endlen = conn->inbuf.size - 
-		(conn->inbuf.wpos & conn->inbuf.size_mask);
-
-	if ((ret = sock_comm_recv_socket(conn, (char*) conn->inbuf.buf + 
-					 (conn->inbuf.wpos & conn->inbuf.size_mask), 
-					 endlen)) <= 0)
-		return 0;
-	
-	conn->inbuf.wpos += ret;
-	rbcommit(&conn->inbuf);
-	if (ret != endlen)
-		return ret;
+	ssize_t ret, done = 0;
+	size_t len;
+	void *buf;
 
-	if ((ret = sock_comm_recv_socket(conn, conn->inbuf.buf, 
-					 rbavail(&conn->inbuf))) <= 0)
-		return 0;
+	while ((len = rbwritespan(&conn->inbuf, &buf)) > 0) {
+		ret = sock_comm_recv_socket(conn, buf, len);
+		if (ret <= 0)
+			break;
 
-	conn->inbuf.wpos += ret;
-	rbcommit(&conn->inbuf);
-	return 0;
+		conn->inbuf.wpos += ret;
+		rbcommit(&conn->inbuf);
+		done += ret;
+		if (ret != len)
+			break;
+	}
+	return done;
 }
 
 ssize_t sock_comm_recv(struct sock_conn *conn, void *buf, size_t len)
@@ -216,8 +208,8 @@ int sock_comm_buffer_init(struct sock_conn *conn)
 	if (fcntl(conn->sock_fd, F_SETFL, flags | O_NONBLOCK))
 		SOCK_LOG_ERROR("fcntl failed\n");
 
-	rbinit(&conn->inbuf, SOCK_COMM_BUF_SZ);
-	rbinit(&conn->outbuf, SOCK_COMM_BUF_SZ);
+	rbinit_mirrored(&conn->inbuf, SOCK_COMM_BUF_SZ);
+	rbinit_mirrored(&conn->outbuf, SOCK_COMM_BUF_SZ);
 
 	if (setsockopt(conn->sock_fd, SOL_SOCKET, SO_RCVBUF, &size, optlen))
 		SOCK_LOG_ERROR("setsockopt failed\n");
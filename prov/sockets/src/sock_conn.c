@@ -113,13 +113,14 @@ static int sock_compare_addr(struct sockaddr_in *addr1,
 }
 
 uint16_t sock_conn_map_lookup(struct sock_conn_map *map,
-			      struct sockaddr_in *addr)
+			      struct sockaddr_in *addr, uint16_t lane)
 {
 	int i;
 	struct sockaddr_in *entry;
 	for (i=0; i < map->used; i++) {
 		entry = (struct sockaddr_in *)&(map->table[i].addr);
-		if (sock_compare_addr(entry, addr)) {
+		if (map->table[i].lane == lane &&
+		    sock_compare_addr(entry, addr)) {
 			return i+1;
 		}
 	}
@@ -127,8 +128,9 @@ uint16_t sock_conn_map_lookup(struct sock_conn_map *map,
 }
 
 static int sock_conn_map_insert(struct sock_conn_map *map,
-				struct sockaddr_in *addr,
-				int conn_fd)
+				struct sockaddr_in *addr, uint16_t lane,
+				int conn_fd, uint32_t credits,
+				uint32_t window)
 {
 	int index;
 	if (map->size == map->used) {
@@ -140,18 +142,58 @@ static int sock_conn_map_insert(struct sock_conn_map *map,
 	index = map->used;
 	memcpy(&map->table[index].addr, addr, sizeof *addr);
 	map->table[index].sock_fd = conn_fd;
+	map->table[index].lane = lane;
 	sock_comm_buffer_init(&map->table[index]);
+	map->table[index].tx_window = credits;
+	map->table[index].tx_credits = credits;
+	map->table[index].rx_window = window;
+	map->table[index].rx_credits = 0;
+	map->table[index].credit_wait = 0;
+	sock_pe_poll_add(map->domain->pe, conn_fd);
 	map->used++;
 	return index + 1;
 }				 
 
+/*
+ * Eager send window to advertise to a new peer, in bytes.  The receive
+ * buffering limit of the domain's most constrained rx context is split
+ * across the connections open so far and this one, so that peers sending
+ * at once cannot overrun it; windows are fixed at connection time, and a
+ * floor keeps every peer able to stream a message.
+ */
+static uint32_t sock_conn_window(struct sock_domain *dom,
+				 struct sock_conn_map *map)
+{
+	struct dlist_entry *entry;
+	struct sock_rx_ctx *rx_ctx;
+	uint64_t limit = SOCK_EP_MAX_BUFF_RECV;
+	uint64_t window;
+	int peers;
+
+	fastlock_acquire(&dom->pe->lock);
+	for (entry = dom->pe->rx_list.list.next;
+	     entry != &dom->pe->rx_list.list; entry = entry->next) {
+		rx_ctx = container_of(entry, struct sock_rx_ctx, pe_entry);
+		limit = MIN(limit, rx_ctx->attr.total_buffered_recv);
+	}
+	fastlock_release(&dom->pe->lock);
+
+	fastlock_acquire(&map->lock);
+	peers = map->used + 1;
+	fastlock_release(&map->lock);
+
+	window = limit / peers;
+	return MAX(window, SOCK_CONN_MIN_CREDITS);
+}
+
 uint16_t sock_conn_map_connect(struct sock_domain *dom,
 			       struct sock_conn_map *map, 
-			       struct sockaddr_in *addr)
+			       struct sockaddr_in *addr, uint16_t lane)
 {
 	int conn_fd, optval, ret;
 	char sa_ip[INET_ADDRSTRLEN];
-	unsigned short reply;
+	unsigned short reply, wire_lane;
+	uint32_t credits, window;
 	struct timeval tv;
 	socklen_t optlen;
 	uint64_t flags;
@@ -177,6 +219,7 @@ uint16_t sock_conn_map_connect(struct sock_domain *dom,
 
 	fastlock_acquire(&map->lock);
 	memcpy(&map->curr_addr, addr, sizeof(struct sockaddr_in));
+	map->curr_lane = lane;
 	fastlock_release(&map->lock);
 
 	if (connect(conn_fd, (struct sockaddr *) addr, sizeof *addr) < 0) {
@@ -224,6 +267,23 @@ uint16_t sock_conn_map_connect(struct sock_domain *dom,
 		goto err;
 	}
 
+	window = sock_conn_window(dom, map);
+	credits = htonl(window);
+	ret = send(conn_fd, &credits, sizeof(credits), 0);
+	if (ret != sizeof(credits)) {
+		SOCK_LOG_ERROR("Cannot exchange credits\n");
+		ret = 0;
+		goto err;
+	}
+
+	wire_lane = htons(lane);
+	ret = send(conn_fd, &wire_lane, sizeof(wire_lane), 0);
+	if (ret != sizeof(wire_lane)) {
+		SOCK_LOG_ERROR("Cannot exchange lane\n");
+		ret = 0;
+		goto err;
+	}
+
 	ret = recv(conn_fd,
 		   &reply, sizeof(unsigned short), 0);
 	if (ret != sizeof(unsigned short)) {
@@ -237,8 +297,16 @@ uint16_t sock_conn_map_connect(struct sock_domain *dom,
 
 
 	if (reply == 0) {
+		ret = recv(conn_fd, &credits, sizeof(credits), 0);
+		if (ret != sizeof(credits)) {
+			SOCK_LOG_ERROR("Cannot exchange credits: %d\n", ret);
+			ret = 0;
+			goto err;
+		}
+
 		fastlock_acquire(&map->lock);
-		ret = sock_conn_map_insert(map, addr, conn_fd);
+		ret = sock_conn_map_insert(map, addr, lane, conn_fd,
+					   ntohl(credits), window);
 		fastlock_release(&map->lock);
 	} else {
 		ret = 0;
@@ -246,7 +314,7 @@ uint16_t sock_conn_map_connect(struct sock_domain *dom,
 		SOCK_LOG_INFO("waiting for an accept\n");
 		while (!ret) {
 			fastlock_acquire(&map->lock);
-			ret = sock_conn_map_lookup(map, addr);
+			ret = sock_conn_map_lookup(map, addr, lane);
 			fastlock_release(&map->lock);
 		}
 		SOCK_LOG_INFO("got accept\n");
@@ -261,15 +329,16 @@ err:
 
 uint16_t sock_conn_map_match_or_connect(struct sock_domain *dom,
 					struct sock_conn_map *map, 
-					struct sockaddr_in *addr)
+					struct sockaddr_in *addr,
+					uint16_t lane)
 {
 	uint16_t index;
 	fastlock_acquire(&map->lock);
-	index = sock_conn_map_lookup(map, addr);
+	index = sock_conn_map_lookup(map, addr, lane);
 	fastlock_release(&map->lock);
 
 	if (!index)
-		index = sock_conn_map_connect(dom, map, addr);
+		index = sock_conn_map_connect(dom, map, addr, lane);
 	return index;
 }
 
@@ -286,7 +355,8 @@ static void *_sock_conn_listen(void *arg)
 	struct pollfd poll_fds[2];
 	struct sockaddr_in addr;
 	char sa_ip[INET_ADDRSTRLEN], tmp;
-	unsigned short port, response;
+	unsigned short port, response, lane;
+	uint32_t credits, window, wire_window;
 	uint16_t index;
 
 	memset(&hints, 0, sizeof(hints));
@@ -379,23 +449,45 @@ static void *_sock_conn_listen(void *arg)
 		SOCK_LOG_INFO("ACCEPT: %s, %d\n", sa_ip, ntohs(remote.sin_port));
 
 		ret = recv(conn_fd, &port, sizeof(port), 0);
-		if (ret != sizeof(port)) 
+		if (ret != sizeof(port)) {
 			SOCK_LOG_ERROR("Cannot exchange port\n");
+			close(conn_fd);
+			continue;
+		}
 
 		remote.sin_port = port;
 		SOCK_LOG_INFO("Remote port: %d\n", ntohs(port));
 
+		ret = recv(conn_fd, &credits, sizeof(credits), 0);
+		if (ret != sizeof(credits)) {
+			SOCK_LOG_ERROR("Cannot exchange credits\n");
+			close(conn_fd);
+			continue;
+		}
+		credits = ntohl(credits);
+
+		ret = recv(conn_fd, &lane, sizeof(lane), 0);
+		if (ret != sizeof(lane)) {
+			SOCK_LOG_ERROR("Cannot exchange lane\n");
+			close(conn_fd);
+			continue;
+		}
+		lane = ntohs(lane);
+
 		fastlock_acquire(&map->lock);
-		index = sock_conn_map_lookup(map, &remote);
+		index = sock_conn_map_lookup(map, &remote, lane);
 		response = (index) ? 1 : 0;
-		if (response == 0) {
-			if (sock_compare_addr((struct sockaddr_in*)&map->curr_addr,
+		if (response == 0 &&
+		    !sock_compare_addr((struct sockaddr_in*)&domain->src_addr,
+				       &remote)) {
+			if (map->curr_lane == lane &&
+			    sock_compare_addr((struct sockaddr_in*)&map->curr_addr,
 					      &remote)) {
 				ret = memcmp(&domain->src_addr, &remote, 
 					     sizeof(struct sockaddr_in));
 				
 				if (ret > 0 || 
-				    (ret == 0 && atoi(domain->service) > port)) {
+				    (ret == 0 && atoi(domain->service) > ntohs(port))) {
 					response = 1;
 					SOCK_LOG_INFO("Rejecting accept\n");
 				}
@@ -408,8 +500,18 @@ static void *_sock_conn_listen(void *arg)
 			SOCK_LOG_ERROR("Cannot exchange port\n");
 		
 		if (!response) {
+			window = sock_conn_window(domain, map);
+			wire_window = htonl(window);
+			ret = send(conn_fd, &wire_window, sizeof(wire_window), 0);
+			if (ret != sizeof(wire_window)) {
+				SOCK_LOG_ERROR("Cannot exchange credits\n");
+				close(conn_fd);
+				continue;
+			}
+
 			fastlock_acquire(&map->lock);
-			sock_conn_map_insert(map, &remote, conn_fd);
+			sock_conn_map_insert(map, &remote, lane, conn_fd,
+					     credits, window);
 			fastlock_release(&map->lock);
 		} else
 			close(conn_fd);
@@ -59,7 +59,7 @@ int sock_cq_progress(struct sock_cq *cq)
 	    !sock_progress_thread_wait)
 		return 0;
 
-	fastlock_acquire(&cq->list_lock);
+	sock_lock_acquire(cq->domain->elide_ctx_locks, &cq->list_lock);
 	for (entry = cq->tx_list.next; entry != &cq->tx_list;
 	     entry = entry->next) {
 		tx_ctx = container_of(entry, struct sock_tx_ctx, cq_entry);
@@ -71,7 +71,7 @@ int sock_cq_progress(struct sock_cq *cq)
 		rx_ctx = container_of(entry, struct sock_rx_ctx, cq_entry);
 		sock_pe_progress_rx_ctx(cq->domain->pe, rx_ctx);
 	}
-	fastlock_release(&cq->list_lock);
+	sock_lock_release(cq->domain->elide_ctx_locks, &cq->list_lock);
 
 	return 0;
 }
@@ -106,32 +106,57 @@ static ssize_t sock_cq_entry_size(struct sock_cq *sock_cq)
 	return size;
 }
 
-static ssize_t _sock_cq_write(struct sock_cq *cq, fi_addr_t addr,
-			      const void *buf, size_t len)
+/*
+ * Completions are formatted in place in the CQ ring. _sock_cq_reserve
+ * returns with cq->lock held, and the entry is published by
+ * _sock_cq_commit; tmp is only used when the ring is not mirrored and
+ * the entry would wrap.
+ */
+static void *_sock_cq_reserve(struct sock_cq *cq, fi_addr_t addr,
+			      void *tmp, size_t len)
 {
-	ssize_t ret;
+	void *entry;
 
-	fastlock_acquire(&cq->lock);
+	sock_lock_acquire(cq->domain->elide_ctx_locks, &cq->lock);
 	if (rbfdavail(&cq->cq_rbfd) < len) {
-		ret = -FI_ENOSPC;
 		SOCK_LOG_ERROR("Not enough space in CQ\n");
-		goto out;
+		sock_lock_release(cq->domain->elide_ctx_locks, &cq->lock);
+		return NULL;
 	}
 
-
 	rbwrite(&cq->addr_rb, &addr, sizeof(fi_addr_t));
 	rbcommit(&cq->addr_rb);
 
+	entry = rbreserve(&cq->cq_rbfd.rb, len);
+	return entry ? entry : tmp;
+}
 
-	rbfdwrite(&cq->cq_rbfd, buf, len);
+static ssize_t _sock_cq_commit(struct sock_cq *cq, const void *entry,
+			       const void *tmp, size_t len)
+{
+	if (entry == tmp)
+		rbwrite(&cq->cq_rbfd.rb, tmp, len);
 	rbfdcommit(&cq->cq_rbfd);
-	ret = len;
 
 	if (cq->signal) 
 		sock_wait_signal(cq->waitset);
-out:
-	fastlock_release(&cq->lock);
-	return ret;
+	sock_poll_notify(&cq->poll_list);
+	sock_lock_release(cq->domain->elide_ctx_locks, &cq->lock);
+	return len;
+}
+
+static ssize_t _sock_cq_write(struct sock_cq *cq, fi_addr_t addr,
+			      const void *buf, size_t len)
+{
+	void *entry;
+
+	entry = _sock_cq_reserve(cq, addr, (void *) buf, len);
+	if (!entry)
+		return -FI_ENOSPC;
+
+	if (entry != buf)
+		memcpy(entry, buf, len);
+	return _sock_cq_commit(cq, entry, buf, len);
 }
 
 static ssize_t _sock_cq_writeerr(struct sock_cq *cq, 
@@ -139,7 +164,7 @@ static ssize_t _sock_cq_writeerr(struct sock_cq *cq,
 {
 	ssize_t ret;
 	
-	fastlock_acquire(&cq->lock);
+	sock_lock_acquire(cq->domain->elide_ctx_locks, &cq->lock);
 	if (rbavail(&cq->cqerr_rb) < len) {
 		ret = -FI_ENOSPC;
 		SOCK_LOG_ERROR("Not enough space in CQ\n");
@@ -152,8 +177,9 @@ static ssize_t _sock_cq_writeerr(struct sock_cq *cq,
 
 	if (cq->signal) 
 		sock_wait_signal(cq->waitset);
+	sock_poll_notify(&cq->poll_list);
 out:
-	fastlock_release(&cq->lock);
+	sock_lock_release(cq->domain->elide_ctx_locks, &cq->lock);
 	return ret;
 }
 
@@ -161,44 +187,64 @@ out:
 static int sock_cq_report_context(struct sock_cq *cq, fi_addr_t addr,
 				  struct sock_pe_entry *pe_entry)
 {
-	struct fi_cq_entry cq_entry;
-	cq_entry.op_context = (void*)pe_entry->context;
-	return _sock_cq_write(cq, addr, &cq_entry, sizeof(cq_entry));
+	struct fi_cq_entry *cq_entry, tmp;
+
+	cq_entry = _sock_cq_reserve(cq, addr, &tmp, sizeof(tmp));
+	if (!cq_entry)
+		return -FI_ENOSPC;
+
+	cq_entry->op_context = (void*)pe_entry->context;
+	return _sock_cq_commit(cq, cq_entry, &tmp, sizeof(tmp));
 }
 
 static int sock_cq_report_msg(struct sock_cq *cq, fi_addr_t addr,
 			      struct sock_pe_entry *pe_entry)
 {
-	struct fi_cq_msg_entry cq_entry;
-	cq_entry.op_context = (void*)pe_entry->context;
-	cq_entry.flags = pe_entry->flags;
-	cq_entry.len = pe_entry->data_len;
-	return _sock_cq_write(cq, addr, &cq_entry, sizeof(cq_entry));
+	struct fi_cq_msg_entry *cq_entry, tmp;
+
+	cq_entry = _sock_cq_reserve(cq, addr, &tmp, sizeof(tmp));
+	if (!cq_entry)
+		return -FI_ENOSPC;
+
+	cq_entry->op_context = (void*)pe_entry->context;
+	cq_entry->flags = pe_entry->flags;
+	cq_entry->len = pe_entry->data_len;
+	return _sock_cq_commit(cq, cq_entry, &tmp, sizeof(tmp));
 }
 
 static int sock_cq_report_data(struct sock_cq *cq, fi_addr_t addr,
 			       struct sock_pe_entry *pe_entry)
 {
-	struct fi_cq_data_entry cq_entry;
-	cq_entry.op_context = (void*)pe_entry->context;
-	cq_entry.flags = pe_entry->flags;
-	cq_entry.len = pe_entry->data_len;
-	cq_entry.buf = (void*)pe_entry->buf;
-	cq_entry.data = pe_entry->data;
-	return _sock_cq_write(cq, addr, &cq_entry, sizeof(cq_entry));
+	struct fi_cq_data_entry *cq_entry, tmp;
+
+	cq_entry = _sock_cq_reserve(cq, addr, &tmp, sizeof(tmp));
+	if (!cq_entry)
+		return -FI_ENOSPC;
+
+	cq_entry->op_context = (void*)pe_entry->context;
+	cq_entry->flags = pe_entry->flags;
+	cq_entry->len = pe_entry->data_len;
+	cq_entry->buf = (void*)pe_entry->buf;
+	cq_entry->data = pe_entry->data;
+	return _sock_cq_commit(cq, cq_entry, &tmp, sizeof(tmp));
 }
 
 static int sock_cq_report_tagged(struct sock_cq *cq, fi_addr_t addr,
 				 struct sock_pe_entry *pe_entry)
 {
-	struct fi_cq_tagged_entry cq_entry;
-	cq_entry.op_context = (void*)pe_entry->context;
-	cq_entry.flags = pe_entry->flags;
-	cq_entry.len = pe_entry->data_len;
-	cq_entry.buf = (void*)pe_entry->buf;
-	cq_entry.data = pe_entry->data;
-	cq_entry.tag = pe_entry->tag;
-	return _sock_cq_write(cq, addr, &cq_entry, sizeof(cq_entry));
+	struct fi_cq_tagged_entry *cq_entry, tmp;
+
+	cq_entry = _sock_cq_reserve(cq, addr, &tmp, sizeof(tmp));
+	if (!cq_entry)
+		return -FI_ENOSPC;
+
+	cq_entry->op_context = (void*)pe_entry->context;
+	cq_entry->flags = pe_entry->flags;
+	cq_entry->len = pe_entry->data_len;
+	cq_entry->buf = (void*)pe_entry->buf;
+	cq_entry->data = pe_entry->data;
+	cq_entry->tag = pe_entry->tag;
+	return _sock_cq_commit(cq, cq_entry, &tmp, sizeof(tmp));
 }
 
 static void sock_cq_set_report_fn(struct sock_cq *sock_cq)
@@ -249,7 +295,9 @@ ssize_t sock_cq_sreadfrom(struct fid_cq *cq, void *buf, size_t count,
 	int ret = 0;
 	int64_t threshold;
 	struct sock_cq *sock_cq;
-	uint64_t start_ms = 0, end_ms = 0;
+	uint64_t end_ms = 0;
+	int64_t left;
+	int remaining;
 	ssize_t cq_entry_len, avail;
 	
 	sock_cq = container_of(cq, struct sock_cq, cq_fid);
@@ -262,32 +310,51 @@ ssize_t sock_cq_sreadfrom(struct fid_cq *cq, void *buf, size_t count,
 	}
 
 	if (sock_cq->domain->progress_mode == FI_PROGRESS_MANUAL) {
-		if (timeout >= 0) {
-			start_ms = fi_gettime_ms();
-			end_ms = start_ms + timeout;
-		}
+		if (timeout > 0)
+			end_ms = fi_gettime_ms() + timeout;
 
-		do {
+		for (;;) {
 			sock_cq_progress(sock_cq);
-			fastlock_acquire(&sock_cq->lock);
+			sock_lock_acquire(sock_cq->domain->elide_ctx_locks,
+					  &sock_cq->lock);
 			if ((avail = rbfdused(&sock_cq->cq_rbfd)))
 				ret = sock_cq_rbuf_read(sock_cq, buf, 
 							MIN(threshold, avail / cq_entry_len),
 							src_addr, cq_entry_len);
-			fastlock_release(&sock_cq->lock);
-			if (ret == 0 && timeout >= 0) {
-				if (fi_gettime_ms() >= end_ms)
-					return -FI_ETIMEDOUT;
+			else if (rbused(&sock_cq->cqerr_rb))
+				ret = -FI_EAVAIL;
+			sock_lock_release(sock_cq->domain->elide_ctx_locks,
+					  &sock_cq->lock);
+			if (ret || timeout == 0)
+				break;
+
+			/*
+			 * Nothing to report: sleep until one of the domain's
+			 * tx rings or connections, or the CQ itself, becomes
+			 * readable instead of spinning on progress.
+			 */
+			remaining = -1;
+			if (timeout > 0) {
+				left = (int64_t) (end_ms - fi_gettime_ms());
+				if (left <= 0)
+					break;
+				remaining = (int) left;
 			}
-		}while (ret == 0);
+			sock_pe_wait_set(sock_cq->domain->pe,
+					 sock_cq->epoll_fd, remaining);
+		}
+		if (ret == 0)
+			ret = -FI_ETIMEDOUT;
 	} else {
 		ret = rbfdwait(&sock_cq->cq_rbfd, timeout);
-		fastlock_acquire(&sock_cq->lock);
+		sock_lock_acquire(sock_cq->domain->elide_ctx_locks,
+				  &sock_cq->lock);
 		if (ret != -FI_ETIMEDOUT && (avail = rbfdused(&sock_cq->cq_rbfd)))
 			ret = sock_cq_rbuf_read(sock_cq, buf, 
 						MIN(threshold, avail / cq_entry_len),
 						src_addr, cq_entry_len);
-		fastlock_release(&sock_cq->lock);
+		sock_lock_release(sock_cq->domain->elide_ctx_locks,
+				  &sock_cq->lock);
 	}
 	return ret;
 }
@@ -324,15 +391,14 @@ ssize_t sock_cq_readerr(struct fid_cq *cq, struct fi_cq_err_entry *buf,
 	if (sock_cq->domain->progress_mode == FI_PROGRESS_MANUAL)
 		sock_cq_progress(sock_cq);
 
-	fastlock_acquire(&sock_cq->lock);
-	while (rbused(&sock_cq->cqerr_rb) >= sizeof(struct fi_cq_err_entry)) {
-		rbread(&sock_cq->cqerr_rb, 
-		       (char*)buf +sizeof(struct fi_cq_err_entry) * num_read, 
-		       sizeof(struct fi_cq_err_entry));
-		num_read++;
+	sock_lock_acquire(sock_cq->domain->elide_ctx_locks, &sock_cq->lock);
+	/* buf holds a single entry */
+	if (rbused(&sock_cq->cqerr_rb) >= sizeof(struct fi_cq_err_entry)) {
+		rbread(&sock_cq->cqerr_rb, buf, sizeof(struct fi_cq_err_entry));
+		num_read = 1;
 	}
 
-	fastlock_release(&sock_cq->lock);
+	sock_lock_release(sock_cq->domain->elide_ctx_locks, &sock_cq->lock);
 	return num_read;
 }
 
@@ -377,7 +443,11 @@ int sock_cq_close(struct fid *fid)
 
 	if (cq->signal && cq->attr.wait_obj == FI_WAIT_MUTEX_COND)
 		sock_wait_close(&cq->waitset->fid);
+	if (cq->attr.wait_obj == FI_WAIT_SET)
+		sock_wait_del_fid(cq->waitset, &cq->cq_fid.fid);
 
+	if (cq->epoll_fd >= 0)
+		close(cq->epoll_fd);
 	rbfree(&cq->addr_rb);
 	rbfree(&cq->cqerr_rb);
 	rbfdfree(&cq->cq_rbfd);
@@ -439,6 +509,7 @@ struct fi_ops sock_cq_fi_ops = {
 	.size = sizeof(struct fi_ops),
 	.control = sock_cq_control,
 	.close = sock_cq_close,
+	.ops_open = sock_ops_open,
 };
 
 static int sock_cq_verify_attr(struct fi_cq_attr *attr)
@@ -472,6 +543,23 @@ static int sock_cq_verify_attr(struct fi_cq_attr *attr)
 	return 0;
 }
 
+/*
+ * Manual progress sread sleeps on the PE poll set (tx rings, connections
+ * and the PE signal) together with the CQ ring, which is readable while
+ * completions are queued, e.g. after fi_cq_write from another thread.
+ */
+static int sock_cq_poll_init(struct sock_cq *cq)
+{
+	int ret;
+
+	ret = sock_pe_wait_open(cq->domain->pe, cq->cq_rbfd.fd[RB_READ_FD]);
+	if (ret < 0)
+		return ret;
+
+	cq->epoll_fd = ret;
+	return 0;
+}
+
 static struct fi_cq_attr _sock_cq_def_attr = {
 	.size = SOCK_CQ_DEF_SZ,
 	.flags = 0,
@@ -488,8 +576,6 @@ int sock_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 	struct sock_domain *sock_dom;
 	struct sock_cq *sock_cq;
 	struct fi_wait_attr wait_attr;
-	struct sock_fid_list *list_entry;
-	struct sock_wait *wait;
 	int ret;
 
 	sock_dom = container_of(domain, struct sock_domain, dom_fid);
@@ -522,8 +608,9 @@ int sock_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 	dlist_init(&sock_cq->tx_list);
 	dlist_init(&sock_cq->rx_list);
 	dlist_init(&sock_cq->ep_list);
+	dlist_init(&sock_cq->poll_list);
 
-	if ((ret = rbfdinit(&sock_cq->cq_rbfd, sock_cq->attr.size *
+	if ((ret = rbfdinit_mirrored(&sock_cq->cq_rbfd, sock_cq->attr.size *
 		    sock_cq->cq_entry_size)))
 		goto err1;
 
@@ -537,6 +624,11 @@ int sock_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 
 	fastlock_init(&sock_cq->lock);
 
+	sock_cq->epoll_fd = -1;
+	if (sock_dom->progress_mode == FI_PROGRESS_MANUAL &&
+	    (ret = sock_cq_poll_init(sock_cq)))
+		goto err4;
+
 	switch (sock_cq->attr.wait_obj) {
 	case FI_WAIT_NONE:
 	case FI_WAIT_UNSPEC:
@@ -563,11 +655,9 @@ int sock_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 
 		sock_cq->waitset = attr->wait_set;
 		sock_cq->signal = 1;
-		wait = container_of(attr->wait_set, struct sock_wait, wait_fid);
-		list_entry = calloc(1, sizeof(*list_entry));
-		dlist_init(&list_entry->entry);
-		list_entry->fid = &sock_cq->cq_fid.fid;
-		dlist_insert_after(&list_entry->entry, &wait->fid_list);
+		ret = sock_wait_add_fid(attr->wait_set, &sock_cq->cq_fid.fid);
+		if (ret)
+			goto err4;
 		break;
 
 	default:
@@ -581,6 +671,8 @@ int sock_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 	return 0;
 
 err4:
+	if (sock_cq->epoll_fd >= 0)
+		close(sock_cq->epoll_fd);
 	rbfree(&sock_cq->cqerr_rb);
 err3:
 	rbfree(&sock_cq->addr_rb);
@@ -591,13 +683,52 @@ err1:
 	return ret;
 }
 
+/*
+ * Reports FI_ECANCELED for the receives on list, linked through their
+ * entry field, in one pass under the CQ lock. Returns how many fit.
+ */
+size_t sock_cq_report_cancel(struct sock_cq *cq, struct dlist_entry *list)
+{
+	struct fi_cq_err_entry err_entry;
+	struct sock_rx_entry *rx_entry;
+	struct dlist_entry *entry;
+	size_t count = 0;
+
+	memset(&err_entry, 0, sizeof(err_entry));
+	err_entry.err = FI_ECANCELED;
+	err_entry.prov_errno = FI_ECANCELED;
+
+	sock_lock_acquire(cq->domain->elide_ctx_locks, &cq->lock);
+	for (entry = list->next; entry != list; entry = entry->next) {
+		if (rbavail(&cq->cqerr_rb) < sizeof(struct fi_cq_err_entry))
+			break;
+
+		rx_entry = container_of(entry, struct sock_rx_entry, entry);
+		err_entry.op_context = (void *) rx_entry->context;
+		err_entry.flags = rx_entry->flags;
+		err_entry.buf = (void *) rx_entry->iov[0].iov.addr;
+		err_entry.tag = rx_entry->tag;
+		rbwrite(&cq->cqerr_rb, &err_entry, sizeof(err_entry));
+		count++;
+	}
+
+	if (count) {
+		rbcommit(&cq->cqerr_rb);
+		if (cq->signal)
+			sock_wait_signal(cq->waitset);
+		sock_poll_notify(&cq->poll_list);
+	}
+	sock_lock_release(cq->domain->elide_ctx_locks, &cq->lock);
+	return count;
+}
+
 int sock_cq_report_error(struct sock_cq *cq, struct sock_pe_entry *entry,
 			 size_t olen, int err, int prov_errno, void *err_data)
 {
 	int ret;
 	struct fi_cq_err_entry err_entry;
 
-	fastlock_acquire(&cq->lock);
+	sock_lock_acquire(cq->domain->elide_ctx_locks, &cq->lock);
 	if (rbavail(&cq->cqerr_rb) < sizeof(struct fi_cq_err_entry)) {
 		ret = -FI_ENOSPC;
 		goto out;
@@ -624,7 +755,7 @@ int sock_cq_report_error(struct sock_cq *cq, struct sock_pe_entry *entry,
 	ret = 0;
 
 out:
-	fastlock_release(&cq->lock);
+	sock_lock_release(cq->domain->elide_ctx_locks, &cq->lock);
 	return ret;
 }
 
@@ -34,6 +34,7 @@
 #  include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -44,10 +45,23 @@
 struct sock_rx_ctx *sock_rx_ctx_alloc(const struct fi_rx_attr *attr, void *context)
 {
 	struct sock_rx_ctx *rx_ctx;
+	uint64_t i;
+
 	rx_ctx = calloc(1, sizeof(*rx_ctx));
 	if (!rx_ctx)
 		return NULL;
 
+	rx_ctx->ctx_hash_mask = roundup_power_of_two(attr->size ?
+						     attr->size : SOCK_EP_RX_SZ) - 1;
+	rx_ctx->ctx_hash = calloc(rx_ctx->ctx_hash_mask + 1,
+				  sizeof(*rx_ctx->ctx_hash));
+	if (!rx_ctx->ctx_hash) {
+		free(rx_ctx);
+		return NULL;
+	}
+	for (i = 0; i <= rx_ctx->ctx_hash_mask; i++)
+		dlist_init(&rx_ctx->ctx_hash[i]);
+
 	dlist_init(&rx_ctx->cq_entry);
 	dlist_init(&rx_ctx->cntr_entry);
 	dlist_init(&rx_ctx->pe_entry);
@@ -68,6 +82,7 @@ struct sock_rx_ctx *sock_rx_ctx_alloc(const struct fi_rx_attr *attr, void *conte
 void sock_rx_ctx_free(struct sock_rx_ctx *rx_ctx)
 {
 	fastlock_destroy(&rx_ctx->lock);
+	free(rx_ctx->ctx_hash);
 	free(rx_ctx);
 }
 
@@ -80,21 +95,41 @@ static struct sock_tx_ctx *sock_tx_context_alloc(const struct fi_tx_attr *attr,
 	if (!tx_ctx)
 		return NULL;
 
-	if (rbfdinit(&tx_ctx->rbfd, 
+	if (rbfdinit_mirrored(&tx_ctx->rbfd, 
 		     (attr->size) ? attr->size * SOCK_EP_TX_ENTRY_SZ: 
 		     SOCK_EP_TX_SZ * SOCK_EP_TX_ENTRY_SZ))
 		goto err;
 
+	/* every queued op takes at least a sock_op_send in the ring */
+	if (sock_stats_latency) {
+		tx_ctx->post_mask = roundup_power_of_two(tx_ctx->rbfd.rb.size /
+					sizeof(struct sock_op_send)) - 1;
+		tx_ctx->post_ns = calloc(tx_ctx->post_mask + 1,
+					 sizeof(*tx_ctx->post_ns));
+		if (!tx_ctx->post_ns) {
+			rbfdfree(&tx_ctx->rbfd);
+			goto err;
+		}
+	}
+
 	dlist_init(&tx_ctx->cq_entry);
 	dlist_init(&tx_ctx->cntr_entry);
 	dlist_init(&tx_ctx->pe_entry);
 	
 	dlist_init(&tx_ctx->pe_entry_list);
 	dlist_init(&tx_ctx->ep_list);
+	dlist_init(&tx_ctx->trigger_list);
 	
 	fastlock_init(&tx_ctx->rlock);
 	fastlock_init(&tx_ctx->wlock);
 
+	slist_init(&tx_ctx->bounce_list);
+	fastlock_init(&tx_ctx->bounce_lock);
+	tx_ctx->bounce_sz = (attr->inject_size > SOCK_EP_MAX_INLINE_SZ) ?
+		attr->inject_size : SOCK_EP_MAX_INJECT_SZ;
+	tx_ctx->bounce_sz = (tx_ctx->bounce_sz + sizeof(uint64_t) - 1) &
+		~(sizeof(uint64_t) - 1);
+
 	switch (fclass) {
 	case FI_CLASS_TX_CTX:
 		tx_ctx->fid.ctx.fid.fclass = FI_CLASS_TX_CTX;
@@ -128,15 +163,69 @@ struct sock_tx_ctx *sock_stx_ctx_alloc(const struct fi_tx_attr *attr, void *cont
 
 void sock_tx_ctx_free(struct sock_tx_ctx *tx_ctx)
 {
+	sock_trigger_free_list(&tx_ctx->trigger_list);
 	fastlock_destroy(&tx_ctx->rlock);
 	fastlock_destroy(&tx_ctx->wlock);
+	fastlock_destroy(&tx_ctx->bounce_lock);
 	rbfdfree(&tx_ctx->rbfd);
+	free(tx_ctx->post_ns);
+	free(tx_ctx->bounce_buf);
 	free(tx_ctx);
 }
 
+/*
+ * Copies an inject payload too large for the tx ring into a bounce
+ * buffer, so the caller may reuse its own buffer at once. The pool is
+ * carved on first use and refilled as the PE releases the entries
+ * that carried the buffers; NULL means it is exhausted for now.
+ */
+void *sock_tx_ctx_bounce_get(struct sock_tx_ctx *tx_ctx,
+			     const struct iovec *iov, size_t count)
+{
+	struct slist_entry *entry = NULL;
+	size_t i, len;
+	char *buf;
+
+	sock_lock_acquire(tx_ctx->domain->elide_ctx_locks,
+			  &tx_ctx->bounce_lock);
+	if (!tx_ctx->bounce_buf) {
+		tx_ctx->bounce_buf = malloc(SOCK_EP_INJECT_POOL_SZ *
+					    tx_ctx->bounce_sz);
+		for (i = 0; tx_ctx->bounce_buf &&
+		     i < SOCK_EP_INJECT_POOL_SZ; i++)
+			slist_insert_tail((struct slist_entry *)
+					  (tx_ctx->bounce_buf +
+					   i * tx_ctx->bounce_sz),
+					  &tx_ctx->bounce_list);
+	}
+	if (!slist_empty(&tx_ctx->bounce_list))
+		entry = slist_remove_head(&tx_ctx->bounce_list);
+	sock_lock_release(tx_ctx->domain->elide_ctx_locks,
+			  &tx_ctx->bounce_lock);
+	if (!entry)
+		return NULL;
+
+	buf = (char *) entry;
+	for (i = 0, len = 0; i < count; i++) {
+		assert(len + iov[i].iov_len <= tx_ctx->bounce_sz);
+		memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	return buf;
+}
+
+void sock_tx_ctx_bounce_put(struct sock_tx_ctx *tx_ctx, void *buf)
+{
+	sock_lock_acquire(tx_ctx->domain->elide_ctx_locks,
+			  &tx_ctx->bounce_lock);
+	slist_insert_head((struct slist_entry *) buf, &tx_ctx->bounce_list);
+	sock_lock_release(tx_ctx->domain->elide_ctx_locks,
+			  &tx_ctx->bounce_lock);
+}
+
 void sock_tx_ctx_start(struct sock_tx_ctx *tx_ctx)
 {
-	fastlock_acquire(&tx_ctx->wlock);
+	sock_lock_acquire(tx_ctx->domain->elide_ctx_locks, &tx_ctx->wlock);
 }
 
 void sock_tx_ctx_write(struct sock_tx_ctx *tx_ctx, const void *buf, size_t len)
@@ -144,15 +233,75 @@ void sock_tx_ctx_write(struct sock_tx_ctx *tx_ctx, const void *buf, size_t len)
 	rbfdwrite(&tx_ctx->rbfd, buf, len);
 }
 
-void sock_tx_ctx_commit(struct sock_tx_ctx *tx_ctx)
+/*
+ * Formats the fixed op header in place in the ring. Inject data can
+ * leave the write position unaligned, and a plain ring can split the
+ * header at the wrap; both cases go through a stack copy.
+ */
+void sock_tx_ctx_write_op(struct sock_tx_ctx *tx_ctx, const struct sock_op *op,
+			  uint64_t flags, uint64_t context, uint64_t dest_addr,
+			  uint64_t buf, struct sock_ep *ep, struct sock_conn *conn)
+{
+	struct sock_op_send *send_op = NULL, tmp;
+
+	if (!(tx_ctx->rbfd.rb.wpos & (sizeof(uint64_t) - 1)))
+		send_op = rbreserve(&tx_ctx->rbfd.rb, sizeof(*send_op));
+	if (!send_op)
+		send_op = &tmp;
+
+	send_op->op = *op;
+	send_op->flags = flags;
+	send_op->context = context;
+	send_op->dest_addr = dest_addr;
+	send_op->conn = conn;
+	send_op->buf = buf;
+	send_op->ep = ep;
+
+	if (send_op == &tmp)
+		rbwrite(&tx_ctx->rbfd.rb, &tmp, sizeof(tmp));
+}
+
+/*
+ * Ops posted with FI_MORE stay in the ring uncommitted, so the progress
+ * engine is only signaled once for the whole sequence when the next op
+ * without FI_MORE commits it.
+ */
+void sock_tx_ctx_commit(struct sock_tx_ctx *tx_ctx, struct sock_ep *ep,
+			uint64_t flags)
+{
+	sock_stats_tx_inc(tx_ctx, ep, FI_SOCK_STAT_TX_POSTED);
+	if (tx_ctx->post_ns)
+		tx_ctx->post_ns[tx_ctx->post_seq++ & tx_ctx->post_mask] =
+			sock_stats_now();
+
+	SOCK_TRACE(SOCK_TRACE_TX_POST, tx_ctx, flags,
+		   tx_ctx->rbfd.rb.wpos - tx_ctx->rbfd.rb.rcnt);
+
+	if (!(flags & FI_MORE))
+		rbfdcommit(&tx_ctx->rbfd);
+	tx_ctx->batch_wpos = tx_ctx->rbfd.rb.wpos;
+	sock_lock_release(tx_ctx->domain->elide_ctx_locks, &tx_ctx->wlock);
+}
+
+void sock_tx_ctx_abort(struct sock_tx_ctx *tx_ctx, struct sock_ep *ep)
+{
+	sock_stats_tx_inc(tx_ctx, ep, FI_SOCK_STAT_EAGAIN);
+	tx_ctx->rbfd.rb.wpos = tx_ctx->batch_wpos;
+	/* let the PE drain what was already accepted */
+	sock_tx_ctx_flush(tx_ctx);
+	sock_lock_release(tx_ctx->domain->elide_ctx_locks, &tx_ctx->wlock);
+}
+
+/* Commits a pending FI_MORE sequence; called with wlock held */
+void sock_tx_ctx_flush(struct sock_tx_ctx *tx_ctx)
 {
-	rbfdcommit(&tx_ctx->rbfd);
-	fastlock_release(&tx_ctx->wlock);
+	if (tx_ctx->rbfd.rb.wpos != tx_ctx->rbfd.rb.wcnt)
+		rbfdcommit(&tx_ctx->rbfd);
 }
 
-void sock_tx_ctx_abort(struct sock_tx_ctx *tx_ctx)
+size_t sock_tx_ctx_avail(struct sock_tx_ctx *tx_ctx)
 {
-	rbfdabort(&tx_ctx->rbfd);
-	fastlock_release(&tx_ctx->wlock);
+	return tx_ctx->rbfd.rb.size -
+		(tx_ctx->rbfd.rb.wpos - tx_ctx->rbfd.rb.rcnt);
 }
 
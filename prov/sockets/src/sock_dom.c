@@ -144,20 +144,20 @@ static int sock_dom_close(struct fid *fid)
 	fastlock_destroy(&dom->r_cmap.lock);
 
 	sock_pe_finalize(dom->pe);
+	radix_map_destroy(&dom->mr_map);
 	fastlock_destroy(&dom->lock);
+	atomic_dec(&dom->fab->ref);
 	free(dom);
 	return 0;
 }
 
-static uint16_t sock_get_mr_key(struct sock_domain *dom)
+static uint64_t sock_get_mr_key(struct sock_domain *dom)
 {
-	uint16_t i;
+	uint64_t i;
 
-	for (i = 1; i < IDX_MAX_INDEX; i++) {
-		if (!idm_lookup(&dom->mr_idm, i))
-			return i;
-	}
-	return 0;
+	for (i = 1; radix_map_lookup(&dom->mr_map, i); i++)
+		;
+	return i;
 }
 
 static int sock_mr_close(struct fid *fid)
@@ -167,9 +167,7 @@ static int sock_mr_close(struct fid *fid)
 
 	mr = container_of(fid, struct sock_mr, mr_fid.fid);
 	dom = mr->domain;
-	fastlock_acquire(&dom->lock);
-	idm_clear(&dom->mr_idm , (int) mr->mr_fid.key);
-	fastlock_release(&dom->lock);
+	radix_map_clear(&dom->mr_map, mr->mr_fid.key);
 	atomic_dec(&dom->ref);
 	free(mr);
 	return 0;
@@ -211,17 +209,17 @@ static struct fi_ops sock_mr_fi_ops = {
 	.ops_open = fi_no_ops_open,
 };
 
-struct sock_mr * sock_mr_get_entry(struct sock_domain *domain, uint16_t key)
+struct sock_mr * sock_mr_get_entry(struct sock_domain *domain, uint64_t key)
 {
-	return (struct sock_mr *)idm_lookup(&domain->mr_idm, key);
+	return (struct sock_mr *)radix_map_lookup(&domain->mr_map, key);
 }
 
-struct sock_mr *sock_mr_verify_key(struct sock_domain *domain, uint16_t key, 
+struct sock_mr *sock_mr_verify_key(struct sock_domain *domain, uint64_t key, 
 				   void *buf, size_t len, uint64_t access)
 {
 	int i;
 	struct sock_mr *mr;
-	mr = idm_lookup(&domain->mr_idm, key);
+	mr = radix_map_lookup(&domain->mr_map, key);
 	
 	if (!mr)
 		return NULL;
@@ -266,8 +264,7 @@ static int sock_regattr(struct fid *fid, const struct fi_mr_attr *attr,
 
 	dom = container_of(domain, struct sock_domain, dom_fid);
 	if (!(dom->info.mode & FI_PROV_MR_ATTR) && 
-	    ((attr->requested_key > IDX_MAX_INDEX) ||
-	    idm_lookup(&dom->mr_idm, (int) attr->requested_key)))
+	    radix_map_lookup(&dom->mr_map, attr->requested_key))
 		return -FI_ENOKEY;
 
 	_mr = calloc(1, sizeof(*_mr) + sizeof(_mr->mr_iov) * (attr->iov_count - 1));
@@ -287,8 +284,8 @@ static int sock_regattr(struct fid *fid, const struct fi_mr_attr *attr,
 
 	fastlock_acquire(&dom->lock);
 	key = (dom->info.mode & FI_PROV_MR_ATTR) ?
-	      sock_get_mr_key(dom) : (uint16_t) attr->requested_key;
-	if (idm_set(&dom->mr_idm, key, _mr) < 0)
+	      sock_get_mr_key(dom) : attr->requested_key;
+	if (radix_map_set(&dom->mr_map, key, _mr) < 0)
 		goto err;
 	_mr->mr_fid.key = key;
 	_mr->mr_fid.mem_desc = (void *)key;
@@ -396,7 +393,7 @@ static struct fi_ops sock_dom_fi_ops = {
 	.close = sock_dom_close,
 	.bind = sock_dom_bind,
 	.control = fi_no_control,
-	.ops_open = fi_no_ops_open,
+	.ops_open = sock_ops_open,
 };
 
 static struct fi_ops_domain sock_dom_ops = {
@@ -418,6 +415,33 @@ static struct fi_ops_mr sock_dom_mr_ops = {
 	.regattr = sock_regattr,
 };
 
+/*
+ * With manual progress every data path lock is taken by a thread the
+ * application has made a call on, so the threading model tells us which
+ * ones can be skipped.  FI_THREAD_COMPLETION serializes everything bound
+ * to a CQ, which covers the context and CQ locks; FI_THREAD_DOMAIN also
+ * serializes the progress engine.  FI_THREAD_ENDPOINT is left alone: a
+ * CQ shared between endpoints may progress an endpoint while its owner
+ * is posting to it.
+ */
+static void sock_domain_set_lock_elision(struct sock_domain *dom,
+					 enum fi_threading threading)
+{
+	if (dom->progress_mode != FI_PROGRESS_MANUAL)
+		return;
+
+	switch (threading) {
+	case FI_THREAD_DOMAIN:
+		dom->elide_pe_lock = 1;
+		/* fall through */
+	case FI_THREAD_COMPLETION:
+		dom->elide_ctx_locks = 1;
+		break;
+	default:
+		break;
+	}
+}
+
 int sock_domain(struct fid_fabric *fabric, struct fi_info *info,
 		struct fid_domain **dom, void *context)
 {
@@ -430,9 +454,10 @@ int sock_domain(struct fid_fabric *fabric, struct fi_info *info,
 			return ret;
 	}
 
-	sock_domain = calloc(1, sizeof *sock_domain);
-	if (!sock_domain)
+	/* the statistics shards must not share cache lines */
+	if (posix_memalign((void **) &sock_domain, 64, sizeof *sock_domain))
 		return -FI_ENOMEM;
+	memset(sock_domain, 0, sizeof *sock_domain);
 	
 	fastlock_init(&sock_domain->lock);
 	atomic_init(&sock_domain->ref, 0);
@@ -457,6 +482,7 @@ int sock_domain(struct fid_fabric *fabric, struct fi_info *info,
 	sock_domain->dom_fid.fid.ops = &sock_dom_fi_ops;
 	sock_domain->dom_fid.ops = &sock_dom_ops;
 	sock_domain->dom_fid.mr = &sock_dom_mr_ops;
+	sock_domain->fab = container_of(fabric, struct sock_fabric, fab_fid);
 
 	if (!info || !info->domain_attr || 
 	    info->domain_attr->data_progress == FI_PROGRESS_UNSPEC)
@@ -464,6 +490,10 @@ int sock_domain(struct fid_fabric *fabric, struct fi_info *info,
 	else
 		sock_domain->progress_mode = info->domain_attr->data_progress;
 
+	if (info && info->domain_attr)
+		sock_domain_set_lock_elision(sock_domain,
+					     info->domain_attr->threading);
+
 	sock_domain->pe = sock_pe_init(sock_domain);
 	if(!sock_domain->pe){
 		SOCK_LOG_ERROR("Failed to init PE\n");
@@ -485,6 +515,7 @@ int sock_domain(struct fid_fabric *fabric, struct fi_info *info,
 	while(!(volatile int)sock_domain->listening)
 		pthread_yield();
 
+	atomic_inc(&sock_domain->fab->ref);
 	*dom = &sock_domain->dom_fid;
 	return 0;
 
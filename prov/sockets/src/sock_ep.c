@@ -103,6 +103,8 @@ static int sock_ctx_close(struct fid *fid)
 
 	case FI_CLASS_SRX_CTX:
 		rx_ctx = container_of(fid, struct sock_rx_ctx, ctx.fid);
+		if (!dlist_empty(&rx_ctx->ep_list))
+			return -FI_EBUSY;
 		atomic_dec(&rx_ctx->domain->ref);
 		sock_pe_remove_rx_ctx(rx_ctx);
 		sock_rx_ctx_free(rx_ctx);
@@ -376,6 +378,7 @@ static struct fi_ops sock_ctx_ops = {
 	.close = sock_ctx_close,
 	.bind = sock_ctx_bind,
 	.control = sock_ctx_control,
+	.ops_open = sock_ops_open,
 };
 
 static int sock_ctx_getopt(fid_t fid, int level, int optname,
@@ -426,58 +429,90 @@ static int sock_ctx_setopt(fid_t fid, int level, int optname,
 	return 0;
 }
 
-static ssize_t sock_rx_ctx_cancel(struct sock_rx_ctx *rx_ctx, void *context)
-{
-	struct dlist_entry *entry;
-	ssize_t ret = -FI_ENOENT;
-	struct sock_rx_entry *rx_entry;
-
-	fastlock_acquire(&rx_ctx->lock);
-	for (entry = rx_ctx->rx_entry_list.next;
-	     entry != &rx_ctx->rx_entry_list; entry = entry->next) {
-		
-		rx_entry = container_of(entry, struct sock_rx_entry, entry);
-		if (rx_entry->is_busy)
-			continue;
-		
-		if ((uint64_t)context == rx_entry->context) {
-			dlist_remove(&rx_entry->entry);
-			sock_rx_release_entry(rx_entry);
-			ret = 0;
-			break;
-		}
-	}		
-	fastlock_release(&rx_ctx->lock);
-	return ret;
-}
-
-static ssize_t sock_ep_cancel(fid_t fid, void *context)
+/*
+ * Receives posted through an endpoint complete to its own CQ even when
+ * they sit on a shared receive context; receives posted to an SRX that
+ * are canceled directly go to the first endpoint sharing it.
+ */
+static struct sock_rx_ctx *sock_ep_cancel_ctx(fid_t fid,
+					      struct sock_comp **comp)
 {
-	struct sock_rx_ctx *rx_ctx = NULL;
+	struct sock_rx_ctx *rx_ctx;
 	struct sock_ep *sock_ep;
 
 	switch (fid->fclass) {
 	case FI_CLASS_EP:
 		sock_ep = container_of(fid, struct sock_ep, ep.fid);
+		if (!(sock_ep->info.caps & FI_CANCEL) || !sock_ep->rx_ctx)
+			return NULL;
 		rx_ctx = sock_ep->rx_ctx;
-		break;
+		*comp = (rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX) ?
+			&sock_ep->comp : &rx_ctx->comp;
+		return rx_ctx;
 
 	case FI_CLASS_RX_CTX:
+		rx_ctx = container_of(fid, struct sock_rx_ctx, ctx.fid);
+		if (!(rx_ctx->ep->info.caps & FI_CANCEL))
+			return NULL;
+		*comp = &rx_ctx->comp;
+		return rx_ctx;
+
 	case FI_CLASS_SRX_CTX:
 		rx_ctx = container_of(fid, struct sock_rx_ctx, ctx.fid);
-		sock_ep = rx_ctx->ep;
-		break;
+		*comp = NULL;
+		if (!dlist_empty(&rx_ctx->ep_list)) {
+			sock_ep = container_of(rx_ctx->ep_list.next,
+					       struct sock_ep, rx_ctx_entry);
+			*comp = &sock_ep->comp;
+		}
+		return rx_ctx;
 
 	default:
 		SOCK_LOG_ERROR("Invalid ep type\n");
-		return -FI_EINVAL;
+		return NULL;
 	}
-	
-	if (!(sock_ep->info.caps & FI_CANCEL)) {
+}
+
+static ssize_t sock_ep_cancel(fid_t fid, void *context)
+{
+	struct sock_rx_ctx *rx_ctx;
+	struct sock_comp *comp;
+
+	rx_ctx = sock_ep_cancel_ctx(fid, &comp);
+	if (!rx_ctx)
 		return -FI_EINVAL;
-	}
 
-	return sock_rx_ctx_cancel(rx_ctx, context);
+	return sock_rx_ctx_cancel(rx_ctx, comp, context, 0);
+}
+
+static ssize_t sock_ep_cancel_all(struct fid *fid)
+{
+	struct sock_rx_ctx *rx_ctx;
+	struct sock_comp *comp;
+
+	rx_ctx = sock_ep_cancel_ctx(fid, &comp);
+	if (!rx_ctx)
+		return -FI_EINVAL;
+
+	return sock_rx_ctx_cancel(rx_ctx, comp, NULL, 1);
+}
+
+static struct fi_sock_ops_ep sock_ep_ext_ops = {
+	.size = sizeof(struct fi_sock_ops_ep),
+	.cancel_all = sock_ep_cancel_all,
+};
+
+int sock_ep_ops_open(struct fid *fid, void **ops)
+{
+	switch (fid->fclass) {
+	case FI_CLASS_EP:
+	case FI_CLASS_RX_CTX:
+	case FI_CLASS_SRX_CTX:
+		*ops = &sock_ep_ext_ops;
+		return 0;
+	default:
+		return -FI_EINVAL;
+	}
 }
 
 struct fi_ops_ep sock_ctx_ep_ops = {
@@ -494,7 +529,6 @@ struct fi_ops_ep sock_ctx_ep_ops = {
 static int sock_ep_close(struct fid *fid)
 {
 	struct sock_ep *sock_ep;
-	char c = 0;
 
 	switch(fid->fclass) {
 	case FI_CLASS_EP:
@@ -513,6 +547,10 @@ static int sock_ep_close(struct fid *fid)
 	    atomic_get(&sock_ep->num_tx_ctx))
 		return -FI_EBUSY;
 
+	if (sock_ep->rx_ctx &&
+	    sock_ep->rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX)
+		sock_pe_remove_srx_ep(sock_ep->rx_ctx, sock_ep);
+
 	if (sock_ep->fclass != FI_CLASS_SEP && !sock_ep->tx_shared) {
 		sock_pe_remove_tx_ctx(sock_ep->tx_array[0]);
 		sock_tx_ctx_free(sock_ep->tx_array[0]);
@@ -531,21 +569,8 @@ static int sock_ep_close(struct fid *fid)
 	if (sock_ep->dest_addr)
 		free(sock_ep->dest_addr);
 
-	if (sock_ep->ep_type == FI_EP_MSG) {
-
-		sock_ep->cm.do_listen = 0;
-
-		if (write(sock_ep->cm.signal_fds[0], &c, 1) != 1)
-			SOCK_LOG_INFO("Failed to signal\n");
-
-		if (sock_ep->cm.listener_thread && 
-		    pthread_join(sock_ep->cm.listener_thread, NULL)) {
-			SOCK_LOG_INFO("pthread join failed\n");
-		}
-
-		close(sock_ep->cm.signal_fds[0]);
-		close(sock_ep->cm.signal_fds[1]);
-	}
+	if (sock_ep->ep_type == FI_EP_MSG)
+		sock_cm_unregister(sock_ep->domain->fab, &sock_ep->cm);
 	
 	atomic_dec(&sock_ep->domain->ref);
 	free(sock_ep);
@@ -757,7 +782,9 @@ static int sock_ep_bind(struct fid *fid, struct fid *bfid, uint64_t flags)
 
 	case FI_CLASS_SRX_CTX:
 		rx_ctx = container_of(bfid, struct sock_rx_ctx, ctx);
-		dlist_insert_tail(&ep->rx_ctx_entry, &rx_ctx->ep_list);
+		ret = sock_pe_add_srx_ep(rx_ctx, ep);
+		if (ret)
+			return ret;
 		ep->rx_ctx = rx_ctx;
 		ep->rx_array[0] = rx_ctx;
 		break;
@@ -822,7 +849,7 @@ struct fi_ops sock_ep_fi_ops = {
 	.close = sock_ep_close,
 	.bind = sock_ep_bind,
 	.control = sock_ep_control,
-	.ops_open = fi_no_ops_open,
+	.ops_open = sock_ops_open,
 };
 
 int sock_ep_enable(struct fid_ep *ep)
@@ -869,6 +896,8 @@ int sock_ep_enable(struct fid_ep *ep)
 			}
 		}
 	}
+
+	sock_ep_set_tx_ops(sock_ep);
 	return 0;
 }
 
@@ -994,7 +1023,7 @@ static int sock_ep_rx_ctx(struct fid_ep *ep, int index, struct fi_rx_attr *attr,
 	if (index >= sock_ep->ep_attr.rx_ctx_cnt)
 		return -FI_EINVAL;
 
-	rx_ctx = sock_rx_ctx_alloc(attr, context);
+	rx_ctx = sock_rx_ctx_alloc(attr ? attr : &sock_ep->rx_attr, context);
 	if (!rx_ctx)
 		return -FI_ENOMEM;
 
@@ -1125,17 +1154,18 @@ int sock_srx_ctx(struct fid_domain *domain,
 struct fi_info *sock_fi_info(enum fi_ep_type ep_type, 
 			     struct fi_info *hints, void *src_addr, void *dest_addr)
 {
-	struct fi_info *_info = fi_allocinfo();
+	struct fi_info *_info;
+	char *dom_name, *fab_name, *prov_name;
+
+	_info = fi_allocinfo_arena(sizeof(struct sockaddr_in),
+				   sizeof(struct sockaddr_in), sock_dom_name,
+				   sock_fab_name, sock_prov_name);
 	if (!_info)
 		return NULL;
-	
-	_info->src_addr = calloc(1, sizeof(struct sockaddr_in));
-	_info->dest_addr = calloc(1, sizeof(struct sockaddr_in));
-	
+
 	_info->ep_type = ep_type;
 	_info->mode = SOCK_MODE;
 	_info->addr_format = FI_SOCKADDR_IN;
-	_info->dest_addrlen =_info->src_addrlen = sizeof(struct sockaddr_in);
 
 	if (src_addr) {
 		memcpy(_info->src_addr, src_addr, sizeof(struct sockaddr_in));
@@ -1159,12 +1189,20 @@ struct fi_info *sock_fi_info(enum fi_ep_type ep_type,
 			*(_info->rx_attr) = *(hints->rx_attr);
 	}
 
+	/* the names were copied into the info's own allocation */
+	dom_name = _info->domain_attr->name;
+	fab_name = _info->fabric_attr->name;
+	prov_name = _info->fabric_attr->prov_name;
 	*(_info->domain_attr) = sock_domain_attr;
 	*(_info->fabric_attr) = sock_fabric_attr;
+	_info->domain_attr->name = dom_name;
+	_info->fabric_attr->name = fab_name;
+	_info->fabric_attr->prov_name = prov_name;
 
-	_info->domain_attr->name = strdup(sock_dom_name);
-	_info->fabric_attr->name = strdup(sock_fab_name);
-	_info->fabric_attr->prov_name = strdup(sock_prov_name);
+	/* a narrower threading model lets the domain skip locks */
+	if (hints && hints->domain_attr &&
+	    hints->domain_attr->threading != FI_THREAD_UNSPEC)
+		_info->domain_attr->threading = hints->domain_attr->threading;
 
 	return _info;
 }
@@ -1172,7 +1210,7 @@ struct fi_info *sock_fi_info(enum fi_ep_type ep_type,
 int sock_alloc_endpoint(struct fid_domain *domain, struct fi_info *info,
 		  struct sock_ep **ep, void *context, size_t fclass)
 {
-	int ret, flags;
+	int ret;
 	struct sock_ep *sock_ep;
 	struct sock_tx_ctx *tx_ctx;
 	struct sock_rx_ctx *rx_ctx;
@@ -1245,6 +1283,10 @@ int sock_alloc_endpoint(struct fid_domain *domain, struct fi_info *info,
 			memcpy(sock_ep->dest_addr, info->dest_addr, 
 			       sizeof(struct sockaddr_in));
 		}
+
+		/* the context arrays below are sized from it */
+		if (info->ep_attr)
+			sock_ep->ep_attr = *info->ep_attr;
 		
 		if (info->tx_attr) {
 			sock_ep->tx_attr = *info->tx_attr;
@@ -1317,14 +1359,9 @@ int sock_alloc_endpoint(struct fid_domain *domain, struct fi_info *info,
 	}
 
 	if (sock_ep->ep_type == FI_EP_MSG) {
-		dlist_init(&sock_ep->cm.msg_list);
-		if (socketpair(AF_UNIX, SOCK_STREAM, 0, 
-			       sock_ep->cm.signal_fds) < 0)
-			goto err;
-
-		flags = fcntl(sock_ep->cm.signal_fds[1], F_GETFL, 0);
-		if (fcntl(sock_ep->cm.signal_fds[1], F_SETFL, flags | O_NONBLOCK))
-			SOCK_LOG_ERROR("fcntl failed");
+		sock_ep->cm.sock = -1;
+		sock_ep->cm.fid = &sock_ep->ep.fid;
+		dlist_init(&sock_ep->cm.entry);
 	}
 
   	sock_ep->domain = sock_dom;
@@ -1340,7 +1377,7 @@ struct sock_conn *sock_ep_lookup_conn(struct sock_ep *ep)
 {
 	if (!ep->key) {
 		ep->key = sock_conn_map_match_or_connect(
-			ep->domain, &ep->domain->r_cmap, ep->dest_addr);
+			ep->domain, &ep->domain->r_cmap, ep->dest_addr, 0);
 		if (!ep->key) {
 			SOCK_LOG_ERROR("failed to match or connect to addr\n");
 			errno = EINVAL;
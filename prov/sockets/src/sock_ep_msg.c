@@ -41,6 +41,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -426,6 +427,7 @@ static int sock_ep_cm_getname(fid_t fid, void *addr, size_t *addrlen)
 	switch(fid->fclass) {
 
 	case FI_CLASS_EP:
+	case FI_CLASS_SEP:
 		sock_ep = container_of(fid, struct sock_ep, ep.fid);
 		memcpy(addr, sock_ep->src_addr, *addrlen);
 		break;
@@ -457,307 +459,631 @@ static int sock_ep_cm_getpeer(struct fid_ep *ep, void *addr, size_t *addrlen)
 	return 0;
 }
 
-static int sock_ep_cm_create_socket() 
+static struct fi_info * sock_ep_msg_process_info(struct sock_conn_req *req)
+{
+	req->info.src_addr = &req->src_addr;
+	req->info.dest_addr = &req->dest_addr;
+	req->info.tx_attr = &req->tx_attr;
+	req->info.rx_attr = &req->rx_attr;
+	req->info.ep_attr = &req->ep_attr;
+	req->info.domain_attr = &req->domain_attr;
+	req->info.fabric_attr = &req->fabric_attr;
+	req->info.domain_attr->name = NULL;
+	req->info.fabric_attr->name = NULL;
+	req->info.fabric_attr->prov_name = NULL;
+	if (sock_verify_info(&req->info)) {
+		SOCK_LOG_INFO("incoming conn_req not supported\n");
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return sock_fi_info(FI_EP_MSG, &req->info, 
+			    req->info.dest_addr, req->info.src_addr);
+}
+
+static int sock_cm_create_socket(void)
 {
-	int sock, optval;
+	int sock, optval, flags;
+	struct sockaddr_in addr;
+
 	sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock < 0)
-		return 0;
+		return -1;
 	
 	optval = 1;
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 
 		       &optval, sizeof optval))
 		SOCK_LOG_ERROR("setsockopt failed\n");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		SOCK_LOG_ERROR("bind failed\n");
+		close(sock);
+		return -1;
+	}
+
+	flags = fcntl(sock, F_GETFL, 0);
+	if (fcntl(sock, F_SETFL, flags | O_NONBLOCK))
+		SOCK_LOG_ERROR("fcntl failed\n");
 	return sock;
 }
 
-static int sock_ep_cm_enqueue_msg(struct sock_cm_entry *cm,
-				  const struct sockaddr_in *addr, 
-				  void *msg, size_t len)
+static void sock_cm_send_msg(struct sock_cm_service *service,
+			     struct sock_cm_msg_list_entry *msg_entry)
+{
+	int ret;
+	char sa_ip[INET_ADDRSTRLEN] = {0};
+
+	memcpy(sa_ip, inet_ntoa(msg_entry->addr.sin_addr), INET_ADDRSTRLEN);
+	SOCK_LOG_INFO("Sending message to %s:%d\n",
+		      sa_ip, ntohs(msg_entry->addr.sin_port));
+
+	ret = sendto(service->sock, (char *)&msg_entry->msg, 
+		     msg_entry->msg_len, 0, 
+		     (struct sockaddr *) &msg_entry->addr, 
+		     sizeof(msg_entry->addr));
+	SOCK_LOG_INFO("Total Sent: %d\n", ret);
+
+	msg_entry->retry++;
+	msg_entry->timeout = fi_gettime_ms() + SOCK_CM_COMM_TIMEOUT;
+}
+
+/*
+ * Messages are sent right away from the caller's context and stay on the
+ * service's msg_list until acknowledged; the CM thread only handles
+ * retransmissions, so it is woken up just when the list becomes non-empty.
+ */
+static int sock_cm_enqueue_msg(struct sock_fabric *fab,
+			       const struct sockaddr_in *addr, 
+			       void *msg, size_t len)
 {
 	char c = 0;
-	int ret = 0;
+	int ret = 0, signal;
+	struct sock_conn_hdr *hdr;
+	struct sock_cm_service *service = &fab->cm;
 	struct sock_cm_msg_list_entry *list_entry;
 
-	fastlock_acquire(&cm->lock);
 	list_entry = calloc(1, sizeof(struct sock_cm_msg_list_entry) + len);
-	if (!list_entry) {
-		ret = -FI_ENOMEM;
-		goto out;
-	}
+	if (!list_entry)
+		return -FI_ENOMEM;
 
 	list_entry->msg_len = len;
 	memcpy(&list_entry->msg, msg, len);
 	memcpy(&list_entry->addr, addr, sizeof(struct sockaddr_in));
-	dlist_insert_tail(&list_entry->entry, &cm->msg_list);
-	ret = write(cm->signal_fds[0], &c, 1);
-	if (ret != 1) {
-		SOCK_LOG_INFO("failed to signal\n");
-		ret = -FI_EIO;
-	} else {
-		ret = 0;
-		SOCK_LOG_INFO("Enqueued CM Msg\n");
+	hdr = (struct sock_conn_hdr *)&list_entry->msg;
+
+	fastlock_acquire(&service->lock);
+	if (!service->do_listen) {
+		free(list_entry);
+		ret = -FI_EINVAL;
+		goto out;
 	}
+
+	if (++service->msg_id == 0)
+		++service->msg_id;
+	hdr->msg_id = service->msg_id;
+
+	signal = dlist_empty(&service->msg_list);
+	dlist_insert_tail(&list_entry->entry, &service->msg_list);
+	sock_cm_send_msg(service, list_entry);
+
+	if (signal && write(service->signal_fds[0], &c, 1) != 1)
+		SOCK_LOG_INFO("failed to signal\n");
+	SOCK_LOG_INFO("Enqueued CM Msg\n");
 out:
-	fastlock_release(&cm->lock);
+	fastlock_release(&service->lock);
 	return ret;
 }
 
-
-
-static int sock_ep_cm_send_msg(struct sock_cm_entry *cm, 
-			       const struct sockaddr_in *addr, 
-			       void *msg, size_t len)
+/* Retransmits expired messages and returns the next epoll timeout */
+static int sock_cm_progress_msg_list(struct sock_cm_service *service)
 {
-	int ret, retry = 0;
-	unsigned char response = 0;
-	struct sockaddr_in from_addr;
-	socklen_t addr_len;
-	char sa_ip[INET_ADDRSTRLEN] = {0};
+	int timeout = -1;
+	uint64_t now;
+	struct dlist_entry *entry;
+	struct sock_cm_msg_list_entry *msg_entry;
 
-	memcpy(sa_ip, inet_ntoa(addr->sin_addr), INET_ADDRSTRLEN);
-	SOCK_LOG_INFO("Sending message to %s:%d\n",
-		      sa_ip, ntohs(addr->sin_port));
-
-	while (retry < SOCK_EP_MAX_RETRY && (volatile int)cm->do_listen) {
-		ret = sendto(cm->sock, (char *)msg, len, 0,
-			     (struct sockaddr *) addr, sizeof *addr);
-		SOCK_LOG_INFO("Total Sent: %d\n", ret);
-		if (ret < 0) 
-			return -1;
-		
-		ret = fi_poll_fd(cm->sock, SOCK_CM_COMM_TIMEOUT);
-		retry++;
-		if (ret <= 0) {
-			continue;
+	now = fi_gettime_ms();
+	for (entry = service->msg_list.next; entry != &service->msg_list;) {
+		msg_entry = container_of(entry, 
+					 struct sock_cm_msg_list_entry, entry);
+		entry = entry->next;
+
+		if (msg_entry->timeout <= now) {
+			if (msg_entry->retry >= SOCK_EP_MAX_RETRY) {
+				SOCK_LOG_ERROR("Failed to send out cm message\n");
+				dlist_remove(&msg_entry->entry);
+				free(msg_entry);
+				continue;
+			}
+			sock_cm_send_msg(service, msg_entry);
 		}
 
-		addr_len = sizeof(struct sockaddr_in);
-		ret = recvfrom(cm->sock, &response, sizeof(response), 0,
-			       (struct sockaddr *) &from_addr, &addr_len);
-		SOCK_LOG_INFO("Received ACK: %d\n", ret);
-		if (ret == sizeof(response))
-			return 0;
+		if (timeout < 0 || msg_entry->timeout - now < timeout)
+			timeout = msg_entry->timeout - now;
 	}
-	return -1;
+	return timeout;
 }
 
-static int sock_ep_cm_send_ack(struct sock_cm_entry *cm, struct sockaddr_in *addr)
+static void sock_cm_handle_ack(struct sock_cm_service *service, 
+			       uint32_t msg_id)
 {
-	int ack_sent = 0, retry = 0, ret;
-	unsigned char response = 0;
-
-	while(!ack_sent && retry < SOCK_EP_MAX_RETRY && 
-	      (volatile int) cm->do_listen) {
-		ret = sendto(cm->sock, &response, sizeof(response), 0,
-			     (struct sockaddr *) addr, sizeof *addr);
-		retry++;
+	struct dlist_entry *entry;
+	struct sock_conn_hdr *hdr;
+	struct sock_cm_msg_list_entry *msg_entry;
 
-		SOCK_LOG_INFO("ack: %d\n", ret);
-		
-		if (ret == sizeof(response)) {
-			ack_sent = 1;
-				break;
+	for (entry = service->msg_list.next; entry != &service->msg_list;
+	     entry = entry->next) {
+		msg_entry = container_of(entry, 
+					 struct sock_cm_msg_list_entry, entry);
+		hdr = (struct sock_conn_hdr *)&msg_entry->msg;
+		if (hdr->msg_id == msg_id) {
+			SOCK_LOG_INFO("Received ACK: %u\n", msg_id);
+			dlist_remove(entry);
+			free(msg_entry);
+			return;
 		}
-			
-		if (ret == EWOULDBLOCK || ret == EAGAIN)
-			usleep(SOCK_CM_COMM_TIMEOUT * 1000);
 	}
-	return ack_sent;
 }
 
-static void sock_ep_cm_flush_msg(struct sock_cm_entry *cm)
+/* Filters retransmissions whose ack got lost */
+static int sock_cm_check_duplicate(struct sock_cm_service *service,
+				   struct sock_conn_hdr *hdr,
+				   struct sockaddr_in *addr)
 {
-	struct dlist_entry *entry;
-	struct sock_cm_msg_list_entry *msg_entry;
+	int i;
+	struct sock_cm_msg_id *recent;
+
+	for (i = 0; i < SOCK_CM_RECENT_SZ; i++) {
+		recent = &service->recent[i];
+		if (recent->msg_id == hdr->msg_id &&
+		    recent->port == addr->sin_port &&
+		    recent->addr == addr->sin_addr.s_addr)
+			return 1;
+	}
 
-	fastlock_acquire(&cm->lock);
-	while (!dlist_empty(&cm->msg_list)) {
+	recent = &service->recent[service->recent_idx];
+	recent->msg_id = hdr->msg_id;
+	recent->port = addr->sin_port;
+	recent->addr = addr->sin_addr.s_addr;
+	service->recent_idx = (service->recent_idx + 1) % SOCK_CM_RECENT_SZ;
+	return 0;
+}
 
-		SOCK_LOG_INFO("Flushing CM message\n");
-		entry = cm->msg_list.next;
-		msg_entry = container_of(entry, 
-					 struct sock_cm_msg_list_entry, entry);
-		if (sock_ep_cm_send_msg(cm, &msg_entry->addr, 
-					&msg_entry->msg, msg_entry->msg_len))
-			SOCK_LOG_INFO("Failed to send out cm message\n");
-		dlist_remove(entry);
-		free(msg_entry);
+static struct sock_cm_entry *sock_cm_lookup_entry(struct sock_cm_service *service,
+						  fid_t fid)
+{
+	struct dlist_entry *entry;
+	struct sock_cm_entry *cm;
+
+	for (entry = service->entry_list.next; entry != &service->entry_list;
+	     entry = entry->next) {
+		cm = container_of(entry, struct sock_cm_entry, entry);
+		if (cm->fid == fid)
+			return cm;
 	}
-	fastlock_release(&cm->lock);
+	return NULL;
 }
-				 
 
-static void *sock_msg_ep_listener_thread (void *data)
+static struct sock_ep *sock_cm_lookup_ep(struct sock_cm_service *service,
+					 fid_t fid)
 {
-	struct pollfd poll_fds[2];
-	struct sock_ep *ep = data;
-	struct sock_conn_response *conn_response;
-	struct fi_eq_cm_entry *cm_entry;
-	struct fi_eq_err_entry *cm_err_entry;
-
-	struct sockaddr_in from_addr;
-	socklen_t addr_len;
-	int ret, user_data_sz, entry_sz;
-	struct fid_ep *fid_ep;
-	struct sock_ep *sock_ep;
-	char tmp = 0;
+	struct sock_cm_entry *cm;
 
-	ep->cm.sock = sock_ep_cm_create_socket();
-	if (!ep->cm.sock) {
-		SOCK_LOG_ERROR("Cannot open socket\n");
+	cm = sock_cm_lookup_entry(service, fid);
+	if (!cm || cm->fid->fclass != FI_CLASS_EP) {
+		SOCK_LOG_INFO("CM msg for unknown endpoint\n");
 		return NULL;
 	}
+	return container_of(cm, struct sock_ep, cm);
+}
 
-	SOCK_LOG_INFO("Starting listener thread for EP: %p\n", ep);
-	conn_response = calloc(1, sizeof(*conn_response) + SOCK_EP_MAX_CM_DATA_SZ);
-	if (!conn_response) {
-		SOCK_LOG_ERROR("cannot allocate\n");
-		return NULL;
+static void sock_cm_handle_connreq(struct sock_pep *pep, 
+				   struct sock_conn_req *msg, int len,
+				   struct sockaddr_in *from_addr,
+				   struct fi_eq_cm_entry *cm_entry)
+{
+	int user_data_sz;
+	struct sock_conn_req *conn_req;
+
+	SOCK_LOG_INFO("Received SOCK_CONN_REQ\n");
+	if (len < sizeof(*msg)) {
+		SOCK_LOG_ERROR("Invalid connection request\n");
+		return;
 	}
 
-	cm_entry = calloc(1, sizeof(*cm_entry) + SOCK_EP_MAX_CM_DATA_SZ);
-	if (!cm_entry) {
-		free (conn_response);
+	user_data_sz = len - sizeof(*msg);
+	conn_req = calloc(1, sizeof(*conn_req) + user_data_sz);
+	if (!conn_req) {
 		SOCK_LOG_ERROR("cannot allocate\n");
-		return NULL;
+		return;
 	}
+	memcpy(conn_req, msg, len);
+	memcpy(&conn_req->from_addr, from_addr, sizeof(struct sockaddr_in));
 
-	ep->cm.do_listen = 1;	
-	poll_fds[0].fd = ep->cm.sock;
-	poll_fds[1].fd = ep->cm.signal_fds[1];
-	poll_fds[0].events = poll_fds[1].events = POLLIN;
-	while((volatile int)ep->cm.do_listen) {
-
-		if (poll(poll_fds, 2, -1) > 0) {
-			if (poll_fds[1].revents & POLLIN) {
-				ret = read(ep->cm.signal_fds[1], &tmp, 1);
-				if (ret != 1) {
-					SOCK_LOG_INFO("Invalid signal\n");
-					break;
-				}
-				sock_ep_cm_flush_msg(&ep->cm);
-				continue;
-			}
-		} else {
+	memset(cm_entry, 0, sizeof *cm_entry);
+	cm_entry->info = sock_ep_msg_process_info(conn_req);
+	if (!cm_entry->info) {
+		free(conn_req);
+		return;
+	}
+	cm_entry->info->connreq = (fi_connreq_t) conn_req;
+	memcpy(&cm_entry->data, &conn_req->user_data, user_data_sz);
+
+	if (sock_eq_report_event(pep->eq, FI_CONNREQ, cm_entry,
+				 sizeof(*cm_entry) + user_data_sz, 0))
+		SOCK_LOG_ERROR("Error in writing to EQ\n");
+}
+
+static void sock_cm_handle_response(struct sock_cm_service *service,
+				    struct sock_conn_response *conn_response, 
+				    int len, struct fi_eq_cm_entry *cm_entry)
+{
+	int user_data_sz, entry_sz;
+	struct sock_ep *sock_ep;
+	struct fi_eq_err_entry *cm_err_entry;
+
+	if (len < sizeof(*conn_response))
+		return;
+
+	sock_ep = sock_cm_lookup_ep(service, conn_response->hdr.c_fid);
+	if (!sock_ep)
+		return;
+
+	user_data_sz = len - sizeof(*conn_response);
+	entry_sz = sizeof(*cm_entry) + user_data_sz;
+
+	switch (conn_response->hdr.type) {
+	case SOCK_CONN_ACCEPT:
+		SOCK_LOG_INFO("Received SOCK_CONN_ACCEPT\n");
+		if (sock_ep->is_disabled || sock_ep->cm.shutdown_received)
+			break;
+
+		memset(cm_entry, 0, sizeof *cm_entry);
+		cm_entry->fid = conn_response->hdr.c_fid;
+		memcpy(&cm_entry->data, &conn_response->user_data,
+		       user_data_sz);
+
+		sock_ep->peer_fid = conn_response->hdr.s_fid;
+		sock_ep->connected = 1;
+		((struct sockaddr_in*)sock_ep->dest_addr)->sin_port = 
+			conn_response->hdr.s_port;
+
+		sock_ep_enable(&sock_ep->ep);
+		if (sock_eq_report_event(sock_ep->eq, FI_CONNECTED, cm_entry,
+					 entry_sz, 0))
+			SOCK_LOG_ERROR("Error in writing to EQ\n");
+		break;
+
+	case SOCK_CONN_REJECT:
+		SOCK_LOG_INFO("Received SOCK_CONN_REJECT\n");
+		if (sock_ep->is_disabled || sock_ep->cm.shutdown_received)
+			break;
+
+		cm_err_entry = calloc(1, sizeof(*cm_err_entry) + user_data_sz);
+		if (!cm_err_entry) {
+			SOCK_LOG_ERROR("cannot allocate memory\n");
 			break;
 		}
 
-		addr_len = sizeof(struct sockaddr_in);
-		ret = recvfrom(ep->cm.sock, (char*)conn_response, 
-			       sizeof(*conn_response) + SOCK_EP_MAX_CM_DATA_SZ,
-			       0, (struct sockaddr *) &from_addr, &addr_len);
-		if (ret <= 0)
-			continue;
-		
-		SOCK_LOG_INFO("Total received: %d\n", ret);
+		cm_err_entry->fid = conn_response->hdr.c_fid;
+		cm_err_entry->err = -FI_ECONNREFUSED;
+		if (user_data_sz > 0)
+			memcpy(cm_err_entry->err_data, 
+			       &conn_response->user_data, user_data_sz);
 		
-		if (ret < sizeof(*conn_response) || 
-		    !sock_ep_cm_send_ack(&ep->cm, &from_addr))
-			continue;
+		if (sock_eq_report_event(sock_ep->eq, FI_ECONNREFUSED, 
+					 cm_err_entry, 
+					 sizeof(*cm_err_entry) + 
+					 user_data_sz, 0)) 
+			SOCK_LOG_ERROR("Error in writing to EQ\n");
+		free(cm_err_entry);
+		break;
 
-		user_data_sz = ret - sizeof(*conn_response);
+	case SOCK_CONN_SHUTDOWN:
+		SOCK_LOG_INFO("Received SOCK_CONN_SHUTDOWN\n");
+		if (sock_ep->cm.shutdown_received)
+			break;
 
-		switch (conn_response->hdr.type) {
-		case SOCK_CONN_ACCEPT:
-			SOCK_LOG_INFO("Received SOCK_CONN_ACCEPT\n");
+		memset(cm_entry, 0, sizeof *cm_entry);
+		cm_entry->fid = conn_response->hdr.c_fid;
+		memcpy(&cm_entry->data, &conn_response->user_data,
+		       user_data_sz);
+
+		sock_ep->cm.shutdown_received = 1;
+		if (sock_eq_report_event(sock_ep->eq, FI_SHUTDOWN, cm_entry,
+					 entry_sz, 0))
+			SOCK_LOG_ERROR("Error in writing to EQ\n");
+		break;
 
-			entry_sz = sizeof(*cm_entry) + user_data_sz;
-			memset(cm_entry, 0, sizeof *cm_entry);
-			cm_entry->fid = conn_response->hdr.c_fid;
+	default:
+		SOCK_LOG_ERROR("Invalid event\n");
+		break;
+	}
+}
 
-			memcpy(&cm_entry->data, &conn_response->user_data,
-			       user_data_sz);
+static void sock_cm_handle_msg(struct sock_cm_service *service, 
+			       struct sock_cm_entry *owner, char *buf, int len,
+			       struct sockaddr_in *from_addr,
+			       struct fi_eq_cm_entry *cm_entry)
+{
+	struct sock_conn_hdr *hdr = (struct sock_conn_hdr *)buf;
 
-			fid_ep = container_of(conn_response->hdr.c_fid, 
-					      struct fid_ep, fid);
-			sock_ep = container_of(fid_ep, struct sock_ep, ep);
+	SOCK_LOG_INFO("CM msg received: %d\n", len);
+	switch (hdr->type) {
+	case SOCK_CONN_REQ:
+		if (!owner || owner->fid->fclass != FI_CLASS_PEP) {
+			SOCK_LOG_ERROR("Invalid connection request\n");
+			break;
+		}
+		sock_cm_handle_connreq(container_of(owner, struct sock_pep, cm),
+				       (struct sock_conn_req *)buf, len,
+				       from_addr, cm_entry);
+		break;
 
-			if (sock_ep->is_disabled || 
-			    sock_ep->cm.shutdown_received)
-				break;
+	case SOCK_CONN_ACCEPT:
+	case SOCK_CONN_REJECT:
+	case SOCK_CONN_SHUTDOWN:
+		sock_cm_handle_response(service, 
+					(struct sock_conn_response *)buf, 
+					len, cm_entry);
+		break;
 
-			sock_ep->peer_fid = conn_response->hdr.s_fid;
-			sock_ep->connected = 1;
+	default:
+		SOCK_LOG_ERROR("Invalid event\n");
+		break;
+	}
+}
 
-			((struct sockaddr_in*)sock_ep->dest_addr)->sin_port = 
-				conn_response->hdr.s_port;
+/*
+ * Drains one CM socket; acks for everything received in the pass are
+ * sent back with a single sendmmsg once the batch is processed.
+ */
+static void sock_cm_recv(struct sock_cm_service *service, int sock,
+			 struct sock_cm_entry *owner, char *buf, size_t buf_len,
+			 struct fi_eq_cm_entry *cm_entry)
+{
+	int ret, i, num_acks = 0;
+	socklen_t addr_len;
+	struct sockaddr_in from_addr;
+	struct sock_conn_hdr *hdr = (struct sock_conn_hdr *)buf;
+	struct sock_conn_hdr acks[SOCK_CM_MAX_BATCH];
+	struct sockaddr_in ack_addrs[SOCK_CM_MAX_BATCH];
+	struct iovec ack_iovs[SOCK_CM_MAX_BATCH];
+	struct mmsghdr ack_msgs[SOCK_CM_MAX_BATCH];
 
-			sock_ep_enable(&ep->ep);
-			if (sock_eq_report_event(ep->eq, FI_CONNECTED, cm_entry,
-						 entry_sz, 0))
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
+	while (num_acks < SOCK_CM_MAX_BATCH) {
+		addr_len = sizeof(struct sockaddr_in);
+		ret = recvfrom(sock, buf, buf_len, MSG_DONTWAIT,
+			       (struct sockaddr *) &from_addr, &addr_len);
+		if (ret <= 0)
 			break;
 
-		case SOCK_CONN_REJECT:
-			SOCK_LOG_INFO("Received SOCK_CONN_REJECT\n");
-			
-			cm_err_entry = calloc(1, sizeof(*cm_err_entry) + user_data_sz);
-			if (!cm_err_entry) {
-				SOCK_LOG_ERROR("cannot allocate memory\n");
-				goto out;
-			}
+		if (ret < sizeof(*hdr))
+			continue;
 
-			memset(cm_err_entry, 0, sizeof(*cm_err_entry) + user_data_sz);
-			cm_err_entry->fid = conn_response->hdr.c_fid;
-			cm_err_entry->err = -FI_ECONNREFUSED;
+		if (hdr->type == SOCK_CONN_ACK) {
+			sock_cm_handle_ack(service, hdr->msg_id);
+			continue;
+		}
 
-			fid_ep = container_of(conn_response->hdr.c_fid, 
-					      struct fid_ep, fid);
-			sock_ep = container_of(fid_ep, struct sock_ep, ep);
+		memset(&acks[num_acks], 0, sizeof(acks[num_acks]));
+		acks[num_acks].type = SOCK_CONN_ACK;
+		acks[num_acks].msg_id = hdr->msg_id;
+		ack_addrs[num_acks] = from_addr;
+		num_acks++;
 
-			if (sock_ep->is_disabled || 
-			    sock_ep->cm.shutdown_received)
-				break;
+		if (sock_cm_check_duplicate(service, hdr, &from_addr))
+			continue;
+		sock_cm_handle_msg(service, owner, buf, ret, &from_addr, cm_entry);
+	}
 
-			if (user_data_sz > 0)
-				memcpy(cm_err_entry->err_data, 
-				       &conn_response->user_data, user_data_sz);
-			
-			if (sock_eq_report_event(sock_ep->eq, FI_ECONNREFUSED, 
-						 cm_err_entry, 
-						 sizeof(*cm_err_entry) + 
-						 user_data_sz, 0)) 
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
-			free(cm_err_entry);
-			goto out;
-
-		case SOCK_CONN_SHUTDOWN:
-			SOCK_LOG_INFO("Received SOCK_CONN_SHUTDOWN\n");
-
-			entry_sz = sizeof(*cm_entry) + user_data_sz;
-			memset(cm_entry, 0, sizeof *cm_entry);
-			cm_entry->fid = conn_response->hdr.c_fid;
-
-			memcpy(&cm_entry->data, &conn_response->user_data,
-			       user_data_sz);
-
-			fid_ep = container_of(conn_response->hdr.c_fid, 
-					      struct fid_ep, fid);
-			sock_ep = container_of(fid_ep, struct sock_ep, ep);
-			if (sock_ep->cm.shutdown_received)
-				break;
+	if (!num_acks)
+		return;
+
+	memset(ack_msgs, 0, sizeof(*ack_msgs) * num_acks);
+	for (i = 0; i < num_acks; i++) {
+		ack_iovs[i].iov_base = &acks[i];
+		ack_iovs[i].iov_len = sizeof(acks[i]);
+		ack_msgs[i].msg_hdr.msg_name = &ack_addrs[i];
+		ack_msgs[i].msg_hdr.msg_namelen = sizeof(ack_addrs[i]);
+		ack_msgs[i].msg_hdr.msg_iov = &ack_iovs[i];
+		ack_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-			sock_ep->cm.shutdown_received = 1;
-			if (sock_eq_report_event(ep->eq, FI_SHUTDOWN, cm_entry,
-						 entry_sz, 0))
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
-			goto out;
+	ret = sendmmsg(sock, ack_msgs, num_acks, 0);
+	SOCK_LOG_INFO("acks: %d/%d\n", ret, num_acks);
+}
 
-		default:
-			SOCK_LOG_ERROR("Invalid event\n");
+static void *sock_cm_listener_thread(void *data)
+{
+	struct sock_cm_service *service = data;
+	struct epoll_event events[SOCK_CM_MAX_EVENTS];
+	struct fi_eq_cm_entry *cm_entry;
+	struct sock_cm_entry *owner;
+	size_t buf_len;
+	char *buf, tmp;
+	int i, num_fds, timeout = -1;
+
+	buf_len = sizeof(struct sock_conn_req) + SOCK_EP_MAX_CM_DATA_SZ;
+	buf = calloc(1, buf_len);
+	cm_entry = calloc(1, sizeof(*cm_entry) + SOCK_EP_MAX_CM_DATA_SZ);
+	if (!buf || !cm_entry) {
+		SOCK_LOG_ERROR("cannot allocate\n");
+		goto out;
+	}
+
+	SOCK_LOG_INFO("Starting CM listener thread\n");
+	while ((volatile int)service->do_listen) {
+		num_fds = epoll_wait(service->epoll_fd, events, 
+				     SOCK_CM_MAX_EVENTS, timeout);
+		if (num_fds < 0 && errno != EINTR) {
+			SOCK_LOG_ERROR("epoll_wait failed\n");
 			break;
 		}
+
+		fastlock_acquire(&service->lock);
+		for (i = 0; i < num_fds; i++) {
+			if (events[i].data.ptr == service) {
+				while (read(service->signal_fds[1], &tmp, 1) == 1)
+					;
+			} else if (events[i].data.ptr == &service->sock) {
+				sock_cm_recv(service, service->sock, NULL, 
+					     buf, buf_len, cm_entry);
+			} else {
+				/* the PEP may have been closed meanwhile */
+				owner = sock_cm_lookup_entry(service, 
+							     events[i].data.ptr);
+				if (owner)
+					sock_cm_recv(service, owner->sock, owner,
+						     buf, buf_len, cm_entry);
+			}
+		}
+		timeout = sock_cm_progress_msg_list(service);
+		fastlock_release(&service->lock);
 	}
 
 out:
-	free(conn_response);
+	free(buf);
 	free(cm_entry);
-	close(ep->cm.sock);
-	ep->cm.listener_thread = 0L;
 	return NULL;
 }
 
+static int sock_cm_epoll_add(struct sock_cm_service *service, int fd, 
+			     void *ptr)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = ptr;
+	return epoll_ctl(service->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* Called with service->lock held */
+static int sock_cm_service_start(struct sock_cm_service *service)
+{
+	int flags;
+
+	if (service->do_listen)
+		return 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, service->signal_fds) < 0)
+		return -FI_EIO;
+
+	flags = fcntl(service->signal_fds[1], F_GETFL, 0);
+	if (fcntl(service->signal_fds[1], F_SETFL, flags | O_NONBLOCK))
+		SOCK_LOG_ERROR("fcntl failed\n");
+
+	service->sock = sock_cm_create_socket();
+	if (service->sock < 0) {
+		SOCK_LOG_ERROR("Cannot open socket\n");
+		goto err1;
+	}
+
+	service->epoll_fd = epoll_create(SOCK_CM_MAX_EVENTS);
+	if (service->epoll_fd < 0)
+		goto err2;
+
+	if (sock_cm_epoll_add(service, service->signal_fds[1], service) ||
+	    sock_cm_epoll_add(service, service->sock, &service->sock))
+		goto err3;
+
+	service->do_listen = 1;
+	if (pthread_create(&service->listener_thread, NULL, 
+			   sock_cm_listener_thread, (void *)service)) {
+		SOCK_LOG_ERROR("Couldn't create listener thread\n");
+		service->do_listen = 0;
+		goto err3;
+	}
+	return 0;
+
+err3:
+	close(service->epoll_fd);
+	service->epoll_fd = -1;
+err2:
+	close(service->sock);
+	service->sock = -1;
+err1:
+	close(service->signal_fds[0]);
+	close(service->signal_fds[1]);
+	return -FI_EIO;
+}
+
+void sock_cm_service_init(struct sock_cm_service *service)
+{
+	memset(service, 0, sizeof(*service));
+	service->sock = -1;
+	service->epoll_fd = -1;
+	fastlock_init(&service->lock);
+	dlist_init(&service->entry_list);
+	dlist_init(&service->msg_list);
+}
+
+void sock_cm_service_fini(struct sock_cm_service *service)
+{
+	char c = 0;
+	struct dlist_entry *entry;
+
+	if (service->do_listen) {
+		service->do_listen = 0;
+		if (write(service->signal_fds[0], &c, 1) != 1)
+			SOCK_LOG_INFO("Failed to signal\n");
+
+		if (pthread_join(service->listener_thread, NULL))
+			SOCK_LOG_INFO("pthread join failed\n");
+
+		close(service->epoll_fd);
+		close(service->sock);
+		close(service->signal_fds[0]);
+		close(service->signal_fds[1]);
+	}
+
+	while (!dlist_empty(&service->msg_list)) {
+		entry = service->msg_list.next;
+		dlist_remove(entry);
+		free(container_of(entry, struct sock_cm_msg_list_entry, entry));
+	}
+	fastlock_destroy(&service->lock);
+}
+
+int sock_cm_register(struct sock_fabric *fab, struct sock_cm_entry *cm)
+{
+	int ret;
+	struct sock_cm_service *service = &fab->cm;
+
+	fastlock_acquire(&service->lock);
+	ret = sock_cm_service_start(service);
+	if (ret)
+		goto out;
+
+	if (cm->sock >= 0 && sock_cm_epoll_add(service, cm->sock, cm->fid)) {
+		ret = -FI_EIO;
+		goto out;
+	}
+	dlist_insert_tail(&cm->entry, &service->entry_list);
+out:
+	fastlock_release(&service->lock);
+	return ret;
+}
+
+void sock_cm_unregister(struct sock_fabric *fab, struct sock_cm_entry *cm)
+{
+	struct sock_cm_service *service = &fab->cm;
+
+	fastlock_acquire(&service->lock);
+	dlist_remove(&cm->entry);
+	dlist_init(&cm->entry);
+	if (cm->sock >= 0) {
+		epoll_ctl(service->epoll_fd, EPOLL_CTL_DEL, cm->sock, NULL);
+		close(cm->sock);
+		cm->sock = -1;
+	}
+	fastlock_release(&service->lock);
+}
+
 static int sock_ep_cm_connect(struct fid_ep *ep, const void *addr,
 			   const void *param, size_t paramlen)
 {
@@ -798,7 +1124,7 @@ static int sock_ep_cm_connect(struct fid_ep *ep, const void *addr,
 		memcpy(&req->user_data, param, paramlen);
 	
 	memcpy(&_ep->cm_addr, addr, sizeof(struct sockaddr_in));
-	if (sock_ep_cm_enqueue_msg(&_ep->cm, addr, req, 
+	if (sock_cm_enqueue_msg(_ep->domain->fab, addr, req, 
 				sizeof (*req) + paramlen)) {
 		ret = -FI_EIO;
 		goto err;
@@ -855,7 +1181,7 @@ static int sock_ep_cm_accept(struct fid_ep *ep, const void *param, size_t paraml
 	response->hdr.s_fid = &ep->fid;
 	response->hdr.s_port = htons(atoi(_ep->domain->service));
 
-	if (sock_ep_cm_enqueue_msg(&_ep->cm, addr, response, 
+	if (sock_cm_enqueue_msg(_ep->domain->fab, addr, response, 
 				   sizeof (*response) + paramlen)) {
 		ret = -FI_EIO;
 		goto out;
@@ -886,7 +1212,7 @@ int sock_ep_cm_shutdown(struct fid_ep *ep, uint64_t flags)
 	response.hdr.s_fid = &ep->fid;
 	response.hdr.type = SOCK_CONN_SHUTDOWN;
 
-	if (sock_ep_cm_enqueue_msg(&_ep->cm, &_ep->cm_addr, &response, 
+	if (sock_cm_enqueue_msg(_ep->domain->fab, &_ep->cm_addr, &response, 
 				sizeof response)) {
 		return -FI_EIO;
 	}
@@ -959,10 +1285,11 @@ int sock_msg_ep(struct fid_domain *domain, struct fi_info *info,
 	if (ret)
 		return ret;
 
-	if (pthread_create(&endpoint->cm.listener_thread, NULL, 
-			   sock_msg_ep_listener_thread, (void *)endpoint)) {
-		SOCK_LOG_ERROR("Couldn't create listener thread\n");
-		return -FI_EINVAL;
+	ret = sock_cm_register(endpoint->domain->fab, &endpoint->cm);
+	if (ret) {
+		SOCK_LOG_ERROR("Couldn't register with CM service\n");
+		endpoint->ep.fid.ops->close(&endpoint->ep.fid);
+		return ret;
 	}
 		
 	*ep = &endpoint->ep;
@@ -990,24 +1317,11 @@ static int sock_pep_fi_bind(fid_t fid, struct fid *bfid, uint64_t flags)
 
 static int sock_pep_fi_close(fid_t fid)
 {
-	int ret;
-	char c = 0;
 	struct sock_pep *pep;
 
 	pep = container_of(fid, struct sock_pep, pep.fid);
-	pep->cm.do_listen = 0;
-	ret = write(pep->cm.signal_fds[0], &c, 1);
-	if (ret != 1) 
-		SOCK_LOG_INFO("Failed to signal\n");
-
-	if (pep->cm.listener_thread && 
-	    pthread_join(pep->cm.listener_thread, NULL)) {
-		SOCK_LOG_INFO("pthread join failed\n");
-	}
-
-	close(pep->cm.signal_fds[0]);
-	close(pep->cm.signal_fds[1]);
-
+	sock_cm_unregister(pep->sock_fab, &pep->cm);
+	atomic_dec(&pep->sock_fab->ref);
 	free(pep);
 	return 0;
 }
@@ -1020,146 +1334,9 @@ static struct fi_ops sock_pep_fi_ops = {
 	.ops_open = fi_no_ops_open,
 };
 
-static struct fi_info * sock_ep_msg_process_info(struct sock_conn_req *req)
-{
-	req->info.src_addr = &req->src_addr;
-	req->info.dest_addr = &req->dest_addr;
-	req->info.tx_attr = &req->tx_attr;
-	req->info.rx_attr = &req->rx_attr;
-	req->info.ep_attr = &req->ep_attr;
-	req->info.domain_attr = &req->domain_attr;
-	req->info.fabric_attr = &req->fabric_attr;
-	req->info.domain_attr->name = NULL;
-	req->info.fabric_attr->name = NULL;
-	req->info.fabric_attr->prov_name = NULL;
-	if (sock_verify_info(&req->info)) {
-		SOCK_LOG_INFO("incoming conn_req not supported\n");
-		errno = EINVAL;
-		return NULL;
-	}
-
-	return sock_fi_info(FI_EP_MSG, &req->info, 
-			    req->info.dest_addr, req->info.src_addr);
-}
-
-static void *sock_pep_listener_thread (void *data)
+static int sock_pep_create_listener(struct sock_pep *pep)
 {
-	struct sock_pep *pep = (struct sock_pep *)data;
-	struct sock_conn_req *conn_req = NULL;
-	struct sock_conn_response *conn_response = NULL;
-	struct fi_eq_cm_entry *cm_entry;
-	struct sockaddr_in from_addr;
-	struct pollfd poll_fds[2];
-	struct fid_ep *fid_ep;
-	struct sock_ep *sock_ep;
-
-	socklen_t addr_len;
-	int ret, user_data_sz, entry_sz;
-	char tmp = 0;
-
-	SOCK_LOG_INFO("Starting listener thread for PEP: %p\n", pep);
-	cm_entry = calloc(1, sizeof(*cm_entry) + SOCK_EP_MAX_CM_DATA_SZ);
-	if (!cm_entry) {
-		SOCK_LOG_ERROR("cannot allocate\n");
-		return NULL;
-	}
-
-	poll_fds[0].fd = pep->cm.sock;
-	poll_fds[1].fd = pep->cm.signal_fds[1];
-	poll_fds[0].events = poll_fds[1].events = POLLIN;
-	while((volatile int)pep->cm.do_listen) {
-		if (poll(poll_fds, 2, -1) > 0) {
-			if (poll_fds[1].revents & POLLIN) {
-				ret = read(pep->cm.signal_fds[1], &tmp, 1);
-				if (ret != 1)
-					SOCK_LOG_INFO("Invalid signal\n");
-				sock_ep_cm_flush_msg(&pep->cm);
-				continue;
-			}
-		} else {
-			break;
-		}
-
-
-		if (conn_req == NULL) {
-			conn_req = calloc(1, sizeof(*conn_req) + SOCK_EP_MAX_CM_DATA_SZ);
-			if (!conn_req) {
-				SOCK_LOG_ERROR("cannot allocate\n");
-				break;
-			}
-		}
-
-		addr_len = sizeof(struct sockaddr_in);
-		ret = recvfrom(pep->cm.sock, (char*)conn_req, 
-			       sizeof(*conn_req) + SOCK_EP_MAX_CM_DATA_SZ, 0, 
-			       (struct sockaddr *) &from_addr, &addr_len);
-		if (ret <= 0)
-			continue;
-		memcpy(&conn_req->from_addr, &from_addr, sizeof(struct sockaddr_in));
-		
-		SOCK_LOG_INFO("CM msg received: %d\n", ret);
-		memset(cm_entry, 0, sizeof *cm_entry);
-
-		switch (conn_req->hdr.type) {
-		case SOCK_CONN_REQ:
-			SOCK_LOG_INFO("Received SOCK_CONN_REQ\n");
-
-			user_data_sz = ret - sizeof(*conn_req);
-			entry_sz = sizeof(*cm_entry) + user_data_sz;
-
-			if (ret < sizeof(*conn_req) || 
-			    !sock_ep_cm_send_ack(&pep->cm, &from_addr)) {
-				SOCK_LOG_ERROR("Invalid connection request\n");
-				break;
-			}
-			
-			cm_entry->info = sock_ep_msg_process_info(conn_req);
-			cm_entry->info->connreq = (fi_connreq_t) conn_req;
-
-			memcpy(&cm_entry->data, &conn_req->user_data,
-			       user_data_sz);
-			conn_req = NULL;
-			
-			if (sock_eq_report_event(pep->eq, FI_CONNREQ, cm_entry,
-						 entry_sz, 0))
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
-			break;
-
-		case SOCK_CONN_SHUTDOWN:
-			SOCK_LOG_INFO("Received SOCK_CONN_SHUTDOWN\n");
-			conn_response = (struct sock_conn_response*)conn_req;
-
-			entry_sz = sizeof(*cm_entry);
-			cm_entry->fid = conn_response->hdr.c_fid;
-			fid_ep = container_of(conn_response->hdr.c_fid, 
-					      struct fid_ep, fid);
-			sock_ep = container_of(fid_ep, struct sock_ep, ep);
-			if (sock_ep->cm.shutdown_received)
-				break;
-			
-			sock_ep->cm.shutdown_received = 1;
-			if (sock_eq_report_event(sock_ep->eq, FI_SHUTDOWN, cm_entry,
-						 entry_sz, 0))
-				SOCK_LOG_ERROR("Error in writing to EQ\n");
-			break;
-
-		default:
-			SOCK_LOG_ERROR("Invalid event\n");
-			goto out;
-		}
-	}
-
-out:
-	if (conn_req)
-		free(conn_req);
-	free(cm_entry);
-	close(pep->cm.sock);
-	return NULL;
-}
-
-static int sock_pep_create_listener_thread(struct sock_pep *pep)
-{
-	int optval, ret;
+	int optval, ret, flags;
 	socklen_t addr_size;
 	struct sockaddr_in addr;
 	struct addrinfo *s_res = NULL, *p;
@@ -1167,7 +1344,8 @@ static int sock_pep_create_listener_thread(struct sock_pep *pep)
 	char sa_ip[INET_ADDRSTRLEN] = {0};
 	char sa_port[NI_MAXSERV] = {0};
 
-	pep->cm.do_listen = 1;
+	if (pep->cm.sock >= 0)
+		return -FI_EINVAL;
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
@@ -1212,27 +1390,38 @@ static int sock_pep_create_listener_thread(struct sock_pep *pep)
 	
 	if (pep->src_addr.sin_port == 0) {
 		addr_size = sizeof(addr);
-		if (getsockname(pep->cm.sock, (struct sockaddr*)&addr, &addr_size))
-			return -FI_EINVAL;
+		if (getsockname(pep->cm.sock, (struct sockaddr*)&addr, &addr_size)) {
+			ret = -FI_EINVAL;
+			goto err;
+		}
 		pep->src_addr.sin_port = addr.sin_port;
 	}
 	
-	SOCK_LOG_INFO("Listener thread bound to %s:%d\n",
+	flags = fcntl(pep->cm.sock, F_GETFL, 0);
+	if (fcntl(pep->cm.sock, F_SETFL, flags | O_NONBLOCK))
+		SOCK_LOG_ERROR("fcntl failed\n");
+
+	SOCK_LOG_INFO("Listener bound to %s:%d\n",
 		      sa_ip, ntohs(pep->src_addr.sin_port));
 	
-	if (pthread_create(&pep->cm.listener_thread, NULL, 
-			   sock_pep_listener_thread, (void *)pep)) {
-		SOCK_LOG_ERROR("Couldn't create listener thread\n");
-		return -FI_EINVAL;
+	ret = sock_cm_register(pep->sock_fab, &pep->cm);
+	if (ret) {
+		SOCK_LOG_ERROR("Couldn't register with CM service\n");
+		goto err;
 	}
 	return 0;
+
+err:
+	close(pep->cm.sock);
+	pep->cm.sock = -1;
+	return ret;
 }
 
 static int sock_pep_listen(struct fid_pep *pep)
 {
 	struct sock_pep *_pep;
 	_pep = container_of(pep, struct sock_pep, pep);
-	return sock_pep_create_listener_thread(_pep);
+	return sock_pep_create_listener(_pep);
 }
 
 static int sock_pep_reject(struct fid_pep *pep, fi_connreq_t connreq,
@@ -1262,8 +1451,8 @@ static int sock_pep_reject(struct fid_pep *pep, fi_connreq_t connreq,
 	response->hdr.type = SOCK_CONN_REJECT;
 	response->hdr.s_fid = NULL;
 
-	if (sock_ep_cm_enqueue_msg(&_pep->cm, addr, req, 
-				sizeof(struct sock_conn_response))) {
+	if (sock_cm_enqueue_msg(_pep->sock_fab, addr, response, 
+				sizeof(*response) + paramlen)) {
 		ret = -FI_EIO;
 		goto out;
 	}
@@ -1303,7 +1492,7 @@ int sock_msg_sep(struct fid_domain *domain, struct fi_info *info,
 int sock_msg_passive_ep(struct fid_fabric *fabric, struct fi_info *info,
 			struct fid_pep **pep, void *context)
 {
-	int ret = -FI_EINVAL, flags;
+	int ret = -FI_EINVAL;
 	struct sock_pep *_pep;
 	char hostname[HOST_NAME_MAX];
 	struct addrinfo sock_hints;
@@ -1348,13 +1537,9 @@ int sock_msg_passive_ep(struct fid_fabric *fabric, struct fi_info *info,
 		goto err;
 	}
 
-	if(socketpair(AF_UNIX, SOCK_STREAM, 0, _pep->cm.signal_fds) < 0)
-		goto err;
-
-	flags = fcntl(_pep->cm.signal_fds[1], F_GETFL, 0);
-	if (fcntl(_pep->cm.signal_fds[1], F_SETFL, flags | O_NONBLOCK))
-		SOCK_LOG_ERROR("fcntl failed");
-	dlist_init(&_pep->cm.msg_list);
+	_pep->cm.sock = -1;
+	_pep->cm.fid = &_pep->pep.fid;
+	dlist_init(&_pep->cm.entry);
 
 	_pep->pep.fid.fclass = FI_CLASS_PEP;
 	_pep->pep.fid.context = context;
@@ -1363,6 +1548,7 @@ int sock_msg_passive_ep(struct fid_fabric *fabric, struct fi_info *info,
 	_pep->pep.ops = NULL;
 
 	_pep->sock_fab = container_of(fabric, struct sock_fabric, fab_fid);
+	atomic_inc(&_pep->sock_fab->ref);
 	*pep = &_pep->pep;
 	return 0;
 err:
@@ -47,44 +47,101 @@
 #include "sock.h"
 #include "sock_util.h"
 
+/* callers hold eq->lock */
+int sock_eq_empty(struct sock_eq *eq)
+{
+	return eq->ring_head == eq->ring_tail && dlistfd_empty(&eq->list);
+}
+
+/*
+ * The wait fd only needs to turn readable when someone can be blocked
+ * on it: a thread in fi_eq_sread, or an application that fetched it
+ * through FI_GETWAIT.
+ */
+static void sock_eq_signal(struct sock_eq *eq)
+{
+	if (eq->fd_waiters || eq->fd_exported)
+		dlistfd_signal(&eq->list);
+	if (eq->signal)
+		sock_wait_signal(eq->waitset);
+	sock_poll_notify(&eq->poll_list);
+}
+
+static ssize_t sock_eq_read_event(struct sock_eq *eq, uint32_t *event,
+				  void *buf, size_t len, uint64_t flags)
+{
+	struct sock_eq_slot *slot;
+	struct sock_eq_entry *entry;
+	ssize_t ret;
+
+	if (eq->ring_head != eq->ring_tail) {
+		slot = &eq->ring[eq->ring_head & eq->ring_mask];
+		if (slot->len > len)
+			return -FI_ETOOSMALL;
+
+		ret = slot->len;
+		*event = slot->type;
+		memcpy(buf, slot->event, slot->len);
+		if (!(flags & FI_PEEK))
+			eq->ring_head++;
+	} else {
+		entry = container_of(eq->list.list.next,
+				     struct sock_eq_entry, entry);
+		if (entry->len > len)
+			return -FI_ETOOSMALL;
+
+		ret = entry->len;
+		*event = entry->type;
+		memcpy(buf, entry->event, entry->len);
+		if (!(flags & FI_PEEK)) {
+			dlist_remove(&entry->entry);
+			free(entry);
+		}
+	}
+
+	if (sock_eq_empty(eq) && dlist_empty(&eq->err_list))
+		dlistfd_reset(&eq->list);
+	return ret;
+}
+
 ssize_t sock_eq_sread(struct fid_eq *eq, uint32_t *event, void *buf, size_t len,
 		      int timeout, uint64_t flags)
 {
-	int ret;
+	ssize_t ret;
 	struct sock_eq *sock_eq;
-	struct dlist_entry *list;
-	struct sock_eq_entry *entry;
 
 	sock_eq = container_of(eq, struct sock_eq, eq);
 
-	if(!dlistfd_empty(&sock_eq->err_list)) {
-		return -FI_EAVAIL;
-	}
-	
-	if(dlistfd_empty(&sock_eq->list)) {
-		ret = dlistfd_wait_avail(&sock_eq->list, timeout);
-		if(ret <= 0)
-			return ret;
-	}
-
 	fastlock_acquire(&sock_eq->lock);
-	list = sock_eq->list.list.next;
-	entry = container_of(list, struct sock_eq_entry, entry);
-
-	if(entry->len > len) {
-		ret = -FI_ETOOSMALL;
-		goto out;
-	}
-
-	ret = entry->len;
-	*event = entry->type;
-	memcpy(buf, entry->event, entry->len);
+	while (sock_eq_empty(sock_eq)) {
+		if (!dlist_empty(&sock_eq->err_list)) {
+			ret = -FI_EAVAIL;
+			goto out;
+		}
+		if (timeout == 0) {
+			ret = -FI_ETIMEDOUT;
+			goto out;
+		}
 
-	if(!(flags & FI_PEEK)) {
-		dlistfd_remove(list, &sock_eq->list);
-		free(entry);
+		sock_eq->fd_waiters++;
+		fastlock_release(&sock_eq->lock);
+		ret = fi_poll_fd(sock_eq->list.fd[LIST_READ_FD], timeout);
+		fastlock_acquire(&sock_eq->lock);
+		sock_eq->fd_waiters--;
+
+		if (ret < 0)
+			goto out;
+		if (ret == 0 && sock_eq_empty(sock_eq)) {
+			ret = dlist_empty(&sock_eq->err_list) ?
+				-FI_ETIMEDOUT : -FI_EAVAIL;
+			goto out;
+		}
 	}
 
+	if (!dlist_empty(&sock_eq->err_list))
+		ret = -FI_EAVAIL;
+	else
+		ret = sock_eq_read_event(sock_eq, event, buf, len, flags);
 out:
 	fastlock_release(&sock_eq->lock);
 	return ret;
@@ -108,20 +165,22 @@ ssize_t sock_eq_readerr(struct fid_eq *eq, struct fi_eq_err_entry *buf,
 	sock_eq = container_of(eq, struct sock_eq, eq);
 
 	fastlock_acquire(&sock_eq->lock);
-	if(dlistfd_empty(&sock_eq->err_list)) {
+	if(dlist_empty(&sock_eq->err_list)) {
 		ret = 0;
 		goto out;
 	}
 
-	list = sock_eq->err_list.list.next;
+	list = sock_eq->err_list.next;
 	entry = container_of(list, struct sock_eq_entry, entry);
 
 	ret = entry->len;
 	memcpy(buf, entry->event, entry->len);
 
 	if(!(flags & FI_PEEK)) {
-		dlistfd_remove(list, &sock_eq->err_list);
+		dlist_remove(list);
 		free(entry);
+		if (sock_eq_empty(sock_eq) && dlist_empty(&sock_eq->err_list))
+			dlistfd_reset(&sock_eq->list);
 	}
 
 out:
@@ -129,25 +188,43 @@ out:
 	return ret;
 }
 
+/*
+ * Events are copied into the preallocated ring. Events larger than a
+ * slot, or arriving while the ring is full, spill to a heap allocated
+ * overflow list; once it is in use, later events queue behind it until
+ * the reader drains it, which keeps delivery in order.
+ */
 ssize_t sock_eq_report_event(struct sock_eq *sock_eq, uint32_t event, 
 			     const void *buf, size_t len, uint64_t flags)
 {
-	struct sock_eq_entry *entry = calloc(1, len + 
-					     sizeof(struct sock_eq_entry));
-	if(!entry)
-		return -FI_ENOMEM;
+	struct sock_eq_slot *slot;
+	struct sock_eq_entry *entry;
 
 	fastlock_acquire(&sock_eq->lock);
-	
-	entry->type = event;
-	entry->len = len;
-	entry->flags = flags;
-	memcpy(entry->event, buf, len);
-	dlistfd_insert_tail(&entry->entry, &sock_eq->list);
 
-	if (sock_eq->signal) 
-		sock_wait_signal(sock_eq->waitset);
+	if (len <= SOCK_EQ_INLINE_SZ && dlistfd_empty(&sock_eq->list) &&
+	    sock_eq->ring_tail - sock_eq->ring_head <= sock_eq->ring_mask) {
+		slot = &sock_eq->ring[sock_eq->ring_tail & sock_eq->ring_mask];
+		slot->type = event;
+		slot->len = len;
+		slot->flags = flags;
+		memcpy(slot->event, buf, len);
+		sock_eq->ring_tail++;
+	} else {
+		entry = calloc(1, len + sizeof(struct sock_eq_entry));
+		if (!entry) {
+			fastlock_release(&sock_eq->lock);
+			return -FI_ENOMEM;
+		}
+
+		entry->type = event;
+		entry->len = len;
+		entry->flags = flags;
+		memcpy(entry->event, buf, len);
+		dlist_insert_tail(&entry->entry, &sock_eq->list.list);
+	}
 
+	sock_eq_signal(sock_eq);
 	fastlock_release(&sock_eq->lock);
 	return 0;
 }
@@ -170,10 +247,10 @@ ssize_t sock_eq_report_error(struct sock_eq *sock_eq, fid_t fid, void *context,
 	err_entry->prov_errno = prov_errno;
 	err_entry->err_data = err_data;
 	entry->len = sizeof(struct fi_eq_err_entry);
-	dlistfd_insert_tail(&entry->entry, &sock_eq->err_list);
+	dlist_insert_tail(&entry->entry, &sock_eq->err_list);
 
-	if (sock_eq->signal) 
-		sock_wait_signal(sock_eq->waitset);
+	/* errors are reported through the event fd as well */
+	sock_eq_signal(sock_eq);
 
 	fastlock_release(&sock_eq->lock);
 	return 0;
@@ -208,18 +285,33 @@ static struct fi_ops_eq sock_eq_ops = {
 	.strerror = sock_eq_strerror,
 };
 
+static void sock_eq_free_list(struct dlist_entry *list)
+{
+	struct sock_eq_entry *entry;
+
+	while (!dlist_empty(list)) {
+		entry = container_of(list->next, struct sock_eq_entry, entry);
+		dlist_remove(&entry->entry);
+		free(entry);
+	}
+}
+
 int sock_eq_fi_close(struct fid *fid)
 {
 	struct sock_eq *sock_eq;
 	sock_eq = container_of(fid, struct sock_eq, eq);
 
+	sock_eq_free_list(&sock_eq->list.list);
+	sock_eq_free_list(&sock_eq->err_list);
 	dlistfd_head_free(&sock_eq->list);
-	dlistfd_head_free(&sock_eq->err_list);
+	free(sock_eq->ring);
 	fastlock_destroy(&sock_eq->lock);
 	atomic_dec(&sock_eq->sock_fab->ref);
 
 	if (sock_eq->signal && sock_eq->attr.wait_obj == FI_WAIT_MUTEX_COND)
 		sock_wait_close(&sock_eq->waitset->fid);
+	if (sock_eq->attr.wait_obj == FI_WAIT_SET)
+		sock_wait_del_fid(sock_eq->waitset, &sock_eq->eq.fid);
 	
 	free(sock_eq);
 	return 0;
@@ -237,6 +329,14 @@ int sock_eq_control(struct fid *fid, int command, void *arg)
 		case FI_WAIT_NONE:
 		case FI_WAIT_UNSPEC:
 		case FI_WAIT_FD:
+			fastlock_acquire(&eq->lock);
+			if (!eq->fd_exported) {
+				eq->fd_exported = 1;
+				if (!sock_eq_empty(eq) ||
+				    !dlist_empty(&eq->err_list))
+					dlistfd_signal(&eq->list);
+			}
+			fastlock_release(&eq->lock);
 			memcpy(arg, &eq->list.fd[LIST_READ_FD], sizeof(int));
 			break;
 
@@ -383,13 +483,21 @@ int sock_eq_open(struct fid_fabric *fabric, struct fi_eq_attr *attr,
 	else 
 		memcpy(&sock_eq->attr, attr, sizeof(struct fi_eq_attr));
 
-	ret = dlistfd_head_init(&sock_eq->list);
-	if(ret)
+	if (sock_eq->attr.size == 0)
+		sock_eq->attr.size = SOCK_EQ_DEF_SZ;
+	sock_eq->ring_mask = roundup_power_of_two(sock_eq->attr.size) - 1;
+	sock_eq->ring = calloc(sock_eq->ring_mask + 1,
+			       sizeof(struct sock_eq_slot));
+	if (!sock_eq->ring) {
+		ret = -FI_ENOMEM;
 		goto err1;
+	}
 
-	ret = dlistfd_head_init(&sock_eq->err_list);
+	dlist_init(&sock_eq->poll_list);
+	dlist_init(&sock_eq->err_list);
+	ret = dlistfd_head_init(&sock_eq->list);
 	if(ret)
-		goto err2;
+		goto err1;
 	
 	fastlock_init(&sock_eq->lock);
 	atomic_inc(&sock_eq->sock_fab->ref);
@@ -421,6 +529,9 @@ int sock_eq_open(struct fid_fabric *fabric, struct fi_eq_attr *attr,
 
 		sock_eq->waitset = attr->wait_set;
 		sock_eq->signal = 1;
+		ret = sock_wait_add_fid(attr->wait_set, &sock_eq->eq.fid);
+		if (ret)
+			goto err2;
 		break;
 
 	default:
@@ -434,6 +545,7 @@ int sock_eq_open(struct fid_fabric *fabric, struct fi_eq_attr *attr,
 err2:
 	dlistfd_head_free(&sock_eq->list);
 err1:
+	free(sock_eq->ring);
 	free(sock_eq);
 	return ret;
 }
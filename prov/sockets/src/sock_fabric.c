@@ -139,6 +139,7 @@ static int sock_fabric_close(fid_t fid)
 		return -FI_EBUSY;
 	}
 
+	sock_cm_service_fini(&fab->cm);
 	free(fab);
 	return 0;
 }
@@ -169,6 +170,7 @@ static int sock_fabric(struct fi_fabric_attr *attr,
 	fab->fab_fid.ops = &sock_fab_ops;
 	*fabric = &fab->fab_fid;
 	atomic_init(&fab->ref, 0);
+	sock_cm_service_init(&fab->cm);
 	return 0;
 }
 
@@ -235,8 +237,22 @@ static int sock_getinfo(uint32_t version, const char *node, const char *service,
 	return ret;
 }
 
+/* provider specific interfaces, see fi_ext_sockets.h */
+int sock_ops_open(struct fid *fid, const char *name, uint64_t flags,
+		  void **ops, void *context)
+{
+	if (!strcmp(name, FI_SOCK_STATS_OPS_1))
+		return sock_stats_ops_open(fid, ops);
+	if (!strcmp(name, FI_SOCK_TRACE_OPS_1))
+		return sock_trace_ops_open(fid, ops);
+	if (!strcmp(name, FI_SOCK_EP_OPS_1))
+		return sock_ep_ops_open(fid, ops);
+	return -FI_ENOSYS;
+}
+
 static void fi_sockets_fini(void)
 {
+	sock_trace_fini();
 }
 
 struct fi_provider sock_prov = {
@@ -258,5 +274,8 @@ SOCKETS_INI
 	if (tmp)
 		sock_progress_thread_wait = atoi(tmp);
 
+	sock_stats_latency = getenv("OFI_SOCK_STATS_LATENCY") != NULL;
+	sock_trace_init();
+
 	return (&sock_prov);
 }
@@ -75,6 +75,7 @@ static ssize_t sock_ep_recvmsg(struct fid_ep *ep, const struct fi_msg *msg,
 	case FI_CLASS_RX_CTX:
 	case FI_CLASS_SRX_CTX:
 		rx_ctx = container_of(ep, struct sock_rx_ctx, ctx);
+		sock_ep = rx_ctx->ep;
 		break;
 
 	default:
@@ -105,12 +106,18 @@ static ssize_t sock_ep_recvmsg(struct fid_ep *ep, const struct fi_msg *msg,
 		rx_entry->total_len += rx_entry->iov[i].iov.len;
 	}
 
-	fastlock_acquire(&rx_ctx->lock);
+	if (sock_stats_latency)
+		rx_entry->post_ns = sock_stats_now();
+	sock_stats_rx_inc(rx_ctx, sock_ep, FI_SOCK_STAT_RX_POSTED);
+	SOCK_TRACE(SOCK_TRACE_RX_POST, rx_ctx, msg->context,
+		   rx_entry->total_len);
+
+	sock_lock_acquire(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
 
 	SOCK_LOG_INFO("New rx_entry: %p (ctx: %p)\n", rx_entry, rx_ctx);
 
-	dlist_insert_tail(&rx_entry->entry, &rx_ctx->rx_entry_list);
-	fastlock_release(&rx_ctx->lock);
+	sock_rx_ctx_post_entry(rx_ctx, rx_entry);
+	sock_lock_release(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
 	return 0;
 }
 
@@ -147,104 +154,166 @@ static ssize_t sock_ep_recvv(struct fid_ep *ep, const struct iovec *iov,
 	return sock_ep_recvmsg(ep, &msg, 0);
 }
 
-static ssize_t sock_ep_sendmsg(struct fid_ep *ep, const struct fi_msg *msg, 
-				uint64_t flags)
+/*
+ * Send data path.  sock_tx_send holds the only copy of the body: the
+ * generic entry points pass it what they resolve per call, while the
+ * op tables generated by SOCK_EP_SEND_OPS fix the fid class, connection
+ * model, op and flags at compile time, so those branches fold away.
+ */
+enum {
+	SOCK_TX_ANY,		/* decided per call from ep->connected */
+	SOCK_TX_AV,		/* connectionless, resolved through the AV */
+	SOCK_TX_CONNECTED,	/* the MSG endpoint's own connection */
+};
+
+static inline struct sock_conn *sock_tx_conn(struct sock_tx_ctx *tx_ctx,
+					     struct sock_ep *sock_ep,
+					     fi_addr_t addr, int mode)
 {
-	int ret, i;
+	switch (mode) {
+	case SOCK_TX_AV:
+		return sock_av_lookup_addr(tx_ctx->av, addr);
+	case SOCK_TX_CONNECTED:
+		return sock_ep->connected ? sock_ep_lookup_conn(sock_ep) : NULL;
+	default:
+		return sock_ep->connected ? sock_ep_lookup_conn(sock_ep) :
+			sock_av_lookup_addr(tx_ctx->av, addr);
+	}
+}
+
+static inline __attribute__((always_inline))
+ssize_t sock_tx_send(struct sock_tx_ctx *tx_ctx, struct sock_ep *sock_ep,
+		     int mode, uint8_t op, const struct iovec *iov,
+		     size_t count, fi_addr_t addr, void *context,
+		     uint64_t data, uint64_t tag, uint64_t flags)
+{
+	int i;
 	uint64_t total_len;
 	struct sock_op tx_op;
 	union sock_iov tx_iov;
 	struct sock_conn *conn;
-	struct sock_tx_ctx *tx_ctx;
-	struct sock_ep *sock_ep;
-
-	switch (ep->fid.fclass) {
-	case FI_CLASS_EP:
-		sock_ep = container_of(ep, struct sock_ep, ep);
-		tx_ctx = sock_ep->tx_ctx;
-		break;
+	struct iovec bounce_iov;
 
-	case FI_CLASS_TX_CTX:
-		tx_ctx = container_of(ep, struct sock_tx_ctx, fid.ctx);
-		sock_ep = tx_ctx->ep;
-		break;
-
-	default:
-		SOCK_LOG_ERROR("Invalid EP type\n");
-		return -FI_EINVAL;
-	}
-
-	assert(tx_ctx->enabled && msg->iov_count <= SOCK_EP_MAX_IOV_LIMIT);
-	if (sock_ep->connected) {
-		conn = sock_ep_lookup_conn(sock_ep);
-	} else {
-		conn = sock_av_lookup_addr(tx_ctx->av, msg->addr);
-	}
-	if (!conn)
+	assert(tx_ctx->enabled && count <= SOCK_EP_MAX_IOV_LIMIT);
+	conn = sock_tx_conn(tx_ctx, sock_ep, addr, mode);
+	if (!conn) {
+		sock_stats_tx_inc(tx_ctx, sock_ep, FI_SOCK_STAT_EAGAIN);
 		return -FI_EAGAIN;
+	}
 
 	SOCK_LOG_INFO("New sendmsg on TX: %p using conn: %p\n", 
 		      tx_ctx, conn);
 
-	flags |= tx_ctx->attr.op_flags;
 	memset(&tx_op, 0, sizeof(struct sock_op));
-	tx_op.op = SOCK_OP_SEND;
+	tx_op.op = op;
 
 	total_len = 0;
 	if (SOCK_INJECT_OK(flags)) {
-		for (i=0; i< msg->iov_count; i++) {
-			total_len += msg->msg_iov[i].iov_len;
+		for (i=0; i< count; i++) {
+			total_len += iov[i].iov_len;
 		}
-		assert(total_len <= SOCK_EP_MAX_INJECT_SZ);
+		if (total_len > tx_ctx->attr.inject_size)
+			return -FI_EINVAL;
+		if (total_len > SOCK_EP_MAX_INLINE_SZ) {
+			bounce_iov.iov_base = sock_tx_ctx_bounce_get(tx_ctx,
+								     iov, count);
+			if (!bounce_iov.iov_base) {
+				sock_stats_tx_inc(tx_ctx, sock_ep,
+						  FI_SOCK_STAT_EAGAIN);
+				return -FI_EAGAIN;
+			}
+			bounce_iov.iov_len = total_len;
+			iov = &bounce_iov;
+			count = 1;
+			flags |= SOCK_INJECT_BOUNCE;
+		}
+	}
+
+	if (SOCK_INJECT_OK(flags)) {
 		tx_op.src_iov_len = total_len;
 	} else {
-		tx_op.src_iov_len = msg->iov_count;
-		total_len = msg->iov_count * sizeof(union sock_iov);
+		tx_op.src_iov_len = count;
+		total_len = count * sizeof(union sock_iov);
 	}
 
-	total_len += sizeof(struct sock_op_send);
-	
+	total_len += (op == SOCK_OP_TSEND) ? sizeof(struct sock_op_tsend) :
+		sizeof(struct sock_op_send);
 	if (flags & FI_REMOTE_CQ_DATA)
 		total_len += sizeof(uint64_t);
 
 	sock_tx_ctx_start(tx_ctx);
-	if (rbfdavail(&tx_ctx->rbfd) < total_len) {
-		ret = -FI_EAGAIN;
-		goto err;
+	if (sock_tx_ctx_avail(tx_ctx) < total_len) {
+		SOCK_LOG_INFO("Not enough space for TX entry, try again\n");
+		sock_tx_ctx_abort(tx_ctx, sock_ep);
+		if (flags & SOCK_INJECT_BOUNCE)
+			sock_tx_ctx_bounce_put(tx_ctx, iov[0].iov_base);
+		return -FI_EAGAIN;
 	}
 
-	sock_tx_ctx_write(tx_ctx, &tx_op, sizeof(struct sock_op));
-	sock_tx_ctx_write(tx_ctx, &flags, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->context, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->addr, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &conn, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->msg_iov[0].iov_base, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &sock_ep, sizeof(uint64_t));
+	sock_tx_ctx_write_op(tx_ctx, &tx_op, flags, (uintptr_t) context,
+			     addr, (uintptr_t) iov[0].iov_base, sock_ep, conn);
 
 	if (flags & FI_REMOTE_CQ_DATA) {
-		sock_tx_ctx_write(tx_ctx, &msg->data, sizeof(uint64_t));
+		sock_tx_ctx_write(tx_ctx, &data, sizeof(uint64_t));
 	}
+	if (op == SOCK_OP_TSEND)
+		sock_tx_ctx_write(tx_ctx, &tag, sizeof(uint64_t));
 
 	if (SOCK_INJECT_OK(flags)) {
-		for (i=0; i< msg->iov_count; i++) {
-			sock_tx_ctx_write(tx_ctx, msg->msg_iov[i].iov_base, 
-					  msg->msg_iov[i].iov_len);
+		for (i=0; i< count; i++) {
+			sock_tx_ctx_write(tx_ctx, iov[i].iov_base, 
+					  iov[i].iov_len);
 		}
 	} else {
-		for (i=0; i< msg->iov_count; i++) {
-			tx_iov.iov.addr = (uint64_t)msg->msg_iov[i].iov_base;
-			tx_iov.iov.len = msg->msg_iov[i].iov_len;
+		for (i=0; i< count; i++) {
+			tx_iov.iov.addr = (uint64_t)iov[i].iov_base;
+			tx_iov.iov.len = iov[i].iov_len;
 			sock_tx_ctx_write(tx_ctx, &tx_iov, sizeof(union sock_iov));
 		}
 	}
 
-	sock_tx_ctx_commit(tx_ctx);
+	sock_tx_ctx_commit(tx_ctx, sock_ep, flags);
 	return 0;
+}
 
-err:
-	SOCK_LOG_INFO("Not enough space for TX entry, try again\n");
-	sock_tx_ctx_abort(tx_ctx);
-	return ret;
+static int sock_tx_resolve(struct fid_ep *ep, struct sock_tx_ctx **tx_ctx,
+			   struct sock_ep **sock_ep)
+{
+	switch (ep->fid.fclass) {
+	case FI_CLASS_EP:
+		*sock_ep = container_of(ep, struct sock_ep, ep);
+		*tx_ctx = (*sock_ep)->tx_ctx;
+		return 0;
+
+	case FI_CLASS_TX_CTX:
+		*tx_ctx = container_of(ep, struct sock_tx_ctx, fid.ctx);
+		*sock_ep = (*tx_ctx)->ep;
+		return 0;
+
+	default:
+		SOCK_LOG_ERROR("Invalid EP type\n");
+		return -FI_EINVAL;
+	}
+}
+
+ssize_t sock_ep_sendmsg(struct fid_ep *ep, const struct fi_msg *msg, 
+			uint64_t flags)
+{
+	int ret;
+	struct sock_tx_ctx *tx_ctx;
+	struct sock_ep *sock_ep;
+
+	ret = sock_tx_resolve(ep, &tx_ctx, &sock_ep);
+	if (ret)
+		return ret;
+
+	if (flags & FI_TRIGGER)
+		return sock_queue_msg_op(ep, msg, flags);
+
+	return sock_tx_send(tx_ctx, sock_ep, SOCK_TX_ANY, SOCK_OP_SEND,
+			    msg->msg_iov, msg->iov_count, msg->addr,
+			    msg->context, msg->data, 0,
+			    flags | tx_ctx->attr.op_flags);
 }
 
 static ssize_t sock_ep_send(struct fid_ep *ep, const void *buf, size_t len, 
@@ -341,6 +410,7 @@ static ssize_t sock_ep_trecvmsg(struct fid_ep *ep,
 	case FI_CLASS_RX_CTX:
 	case FI_CLASS_SRX_CTX:
 		rx_ctx = container_of(ep, struct sock_rx_ctx, ctx);
+		sock_ep = rx_ctx->ep;
 		break;
 
 	default:
@@ -372,9 +442,15 @@ static ssize_t sock_ep_trecvmsg(struct fid_ep *ep,
 		rx_entry->total_len += rx_entry->iov[i].iov.len;
 	}
 
-	fastlock_acquire(&rx_ctx->lock);
-	dlist_insert_tail(&rx_entry->entry, &rx_ctx->rx_entry_list);
-	fastlock_release(&rx_ctx->lock);
+	if (sock_stats_latency)
+		rx_entry->post_ns = sock_stats_now();
+	sock_stats_rx_inc(rx_ctx, sock_ep, FI_SOCK_STAT_RX_POSTED);
+	SOCK_TRACE(SOCK_TRACE_RX_POST, rx_ctx, msg->context,
+		   rx_entry->total_len);
+
+	sock_lock_acquire(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
+	sock_rx_ctx_post_entry(rx_ctx, rx_entry);
+	sock_lock_release(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
 	return 0;
 }
 
@@ -415,101 +491,24 @@ static ssize_t sock_ep_trecvv(struct fid_ep *ep, const struct iovec *iov,
 	return sock_ep_trecvmsg(ep, &msg, 0);
 }
 
-static ssize_t sock_ep_tsendmsg(struct fid_ep *ep, 
-				 const struct fi_msg_tagged *msg, uint64_t flags)
+ssize_t sock_ep_tsendmsg(struct fid_ep *ep, 
+			 const struct fi_msg_tagged *msg, uint64_t flags)
 {
-	int ret, i;
-	uint64_t total_len;
-	struct sock_op tx_op;
-	union sock_iov tx_iov;
-	struct sock_conn *conn;
+	int ret;
 	struct sock_tx_ctx *tx_ctx;
 	struct sock_ep *sock_ep;
 
-	switch (ep->fid.fclass) {
-	case FI_CLASS_EP:
-		sock_ep = container_of(ep, struct sock_ep, ep);
-		tx_ctx = sock_ep->tx_ctx;
-		break;
-
-	case FI_CLASS_TX_CTX:
-		tx_ctx = container_of(ep, struct sock_tx_ctx, fid.ctx);
-		sock_ep = tx_ctx->ep;
-		break;
-
-	default:
-		SOCK_LOG_ERROR("Invalid EP type\n");
-		return -FI_EINVAL;
-	}
-
-	assert(tx_ctx->enabled && msg->iov_count <= SOCK_EP_MAX_IOV_LIMIT);
-	if (sock_ep->connected) {
-		conn = sock_ep_lookup_conn(sock_ep);
-	} else {
-		conn = sock_av_lookup_addr(tx_ctx->av, msg->addr);
-	}
-	if (!conn)
-		return -FI_EAGAIN;
-
-	memset(&tx_op, 0, sizeof(struct sock_op));
-	tx_op.op = SOCK_OP_TSEND;
-
-	total_len = 0;
-	if (SOCK_INJECT_OK(flags)) {
-		for (i=0; i< msg->iov_count; i++) {
-			total_len += msg->msg_iov[i].iov_len;
-		}
-		tx_op.src_iov_len = total_len;
-		assert(total_len <= SOCK_EP_MAX_INJECT_SZ);
-	} else {
-		total_len = msg->iov_count * sizeof(union sock_iov);
-		tx_op.src_iov_len = msg->iov_count;
-	}
-
-	total_len += sizeof(struct sock_op_tsend);
-	if (flags & FI_REMOTE_CQ_DATA)
-		total_len += sizeof(uint64_t);
-	
-	sock_tx_ctx_start(tx_ctx);
-	if (rbfdavail(&tx_ctx->rbfd) < total_len) {
-		ret = -FI_EAGAIN;
-		goto err;
-	}
-
-	flags |= tx_ctx->attr.op_flags;
-	sock_tx_ctx_write(tx_ctx, &tx_op, sizeof(struct sock_op));
-	sock_tx_ctx_write(tx_ctx, &flags, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->context, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->addr, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &conn, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->msg_iov[0].iov_base, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &sock_ep, sizeof(uint64_t));
+	ret = sock_tx_resolve(ep, &tx_ctx, &sock_ep);
+	if (ret)
+		return ret;
 
-	if (flags & FI_REMOTE_CQ_DATA) {
-		sock_tx_ctx_write(tx_ctx, &msg->data, sizeof(uint64_t));
-	}
-	sock_tx_ctx_write(tx_ctx, &msg->tag, sizeof(uint64_t));
-
-	if (SOCK_INJECT_OK(flags)) {
-		for (i=0; i< msg->iov_count; i++) {
-			sock_tx_ctx_write(tx_ctx, msg->msg_iov[i].iov_base,
-					  msg->msg_iov[i].iov_len);
-		}
-	} else {
-		for (i=0; i< msg->iov_count; i++) {
-			tx_iov.iov.addr = (uint64_t)msg->msg_iov[i].iov_base;
-			tx_iov.iov.len = msg->msg_iov[i].iov_len;
-			sock_tx_ctx_write(tx_ctx, &tx_iov, sizeof(union sock_iov));
-		}
-	}
-	
-	sock_tx_ctx_commit(tx_ctx);
-	return 0;
+	if (flags & FI_TRIGGER)
+		return sock_queue_tmsg_op(ep, msg, flags);
 
-err:
-	SOCK_LOG_INFO("Not enough space for TX entry, try again\n");
-	sock_tx_ctx_abort(tx_ctx);
-	return ret;
+	return sock_tx_send(tx_ctx, sock_ep, SOCK_TX_ANY, SOCK_OP_TSEND,
+			    msg->msg_iov, msg->iov_count, msg->addr,
+			    msg->context, msg->data, msg->tag,
+			    flags | tx_ctx->attr.op_flags);
 }
 
 static ssize_t sock_ep_tsend(struct fid_ep *ep, const void *buf, size_t len, 
@@ -606,7 +605,7 @@ static ssize_t sock_ep_tsearch(struct fid_ep *ep, uint64_t *tag, uint64_t ignore
 	}
 
 	ret = -FI_ENOMSG;
-	fastlock_acquire(&rx_ctx->lock);
+	sock_lock_acquire(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
 	for (entry = rx_ctx->rx_buffered_list.next;
 	     entry != &rx_ctx->rx_buffered_list; entry = entry->next) {
 
@@ -633,7 +632,7 @@ static ssize_t sock_ep_tsearch(struct fid_ep *ep, uint64_t *tag, uint64_t ignore
 		}
 	}
 
-	fastlock_release(&rx_ctx->lock);
+	sock_lock_release(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
 	return ret;
 }
 
@@ -650,3 +649,175 @@ struct fi_ops_tagged sock_ep_tagged = {
 	.search = sock_ep_tsearch,
 };
 
+
+/*
+ * Send ops specialized for an endpoint's own tx context.  The tables are
+ * only installed when op_flags has none of SOCK_TX_FIXED_FLAGS set, so
+ * masking them out and or-ing in the per-op constant is exact and lets
+ * the compiler resolve FI_INJECT and FI_REMOTE_CQ_DATA statically.
+ * sendmsg keeps the generic path, which handles FI_TRIGGER.
+ */
+#define SOCK_TX_FIXED_FLAGS (FI_INJECT | FI_REMOTE_CQ_DATA | FI_TRIGGER)
+#define SOCK_TX_FLAGS(_tx_ctx, _flags) \
+	(((_tx_ctx)->attr.op_flags & ~SOCK_TX_FIXED_FLAGS) | (_flags))
+
+#define SOCK_EP_SEND_OPS(_sfx, _mode)					\
+static ssize_t sock_ep_send_##_sfx(struct fid_ep *ep, const void *buf,	\
+				   size_t len, void *desc,		\
+				   fi_addr_t dest_addr, void *context)	\
+{									\
+	struct sock_ep *sock_ep = container_of(ep, struct sock_ep, ep);	\
+	struct iovec iov = { (void *) buf, len };			\
+									\
+	return sock_tx_send(sock_ep->tx_ctx, sock_ep, _mode,		\
+			    SOCK_OP_SEND, &iov, 1, dest_addr, context,	\
+			    0, 0, SOCK_TX_FLAGS(sock_ep->tx_ctx, 0));	\
+}									\
+									\
+static ssize_t sock_ep_sendv_##_sfx(struct fid_ep *ep,			\
+				    const struct iovec *iov,		\
+				    void **desc, size_t count,		\
+				    fi_addr_t dest_addr, void *context)	\
+{									\
+	struct sock_ep *sock_ep = container_of(ep, struct sock_ep, ep);	\
+									\
+	return sock_tx_send(sock_ep->tx_ctx, sock_ep, _mode,		\
+			    SOCK_OP_SEND, iov, count, dest_addr,	\
+			    context, 0, 0,				\
+			    SOCK_TX_FLAGS(sock_ep->tx_ctx, 0));		\
+}									\
+									\
+static ssize_t sock_ep_senddata_##_sfx(struct fid_ep *ep,		\
+				       const void *buf, size_t len,	\
+				       void *desc, uint64_t data,	\
+				       fi_addr_t dest_addr,		\
+				       void *context)			\
+{									\
+	struct sock_ep *sock_ep = container_of(ep, struct sock_ep, ep);	\
+	struct iovec iov = { (void *) buf, len };			\
+									\
+	return sock_tx_send(sock_ep->tx_ctx, sock_ep, _mode,		\
+			    SOCK_OP_SEND, &iov, 1, dest_addr, context,	\
+			    data, 0,					\
+			    SOCK_TX_FLAGS(sock_ep->tx_ctx,		\
+					  FI_REMOTE_CQ_DATA));		\
+}									\
+									\
+static ssize_t sock_ep_inject_##_sfx(struct fid_ep *ep, const void *buf,\
+				     size_t len, fi_addr_t dest_addr)	\
+{									\
+	struct sock_ep *sock_ep = container_of(ep, struct sock_ep, ep);	\
+	struct iovec iov = { (void *) buf, len };			\
+									\
+	return sock_tx_send(sock_ep->tx_ctx, sock_ep, _mode,		\
+			    SOCK_OP_SEND, &iov, 1, dest_addr, NULL,	\
+			    0, 0, SOCK_TX_FLAGS(sock_ep->tx_ctx,	\
+						FI_INJECT));		\
+}									\
+									\
+static ssize_t sock_ep_tsend_##_sfx(struct fid_ep *ep, const void *buf,	\
+				    size_t len, void *desc,		\
+				    fi_addr_t dest_addr, uint64_t tag,	\
+				    void *context)			\
+{									\
+	struct sock_ep *sock_ep = container_of(ep, struct sock_ep, ep);	\
+	struct iovec iov = { (void *) buf, len };			\
+									\
+	return sock_tx_send(sock_ep->tx_ctx, sock_ep, _mode,		\
+			    SOCK_OP_TSEND, &iov, 1, dest_addr, context,	\
+			    0, tag, SOCK_TX_FLAGS(sock_ep->tx_ctx, 0));	\
+}									\
+									\
+static ssize_t sock_ep_tsendv_##_sfx(struct fid_ep *ep,			\
+				     const struct iovec *iov,		\
+				     void **desc, size_t count,		\
+				     fi_addr_t dest_addr, uint64_t tag,	\
+				     void *context)			\
+{									\
+	struct sock_ep *sock_ep = container_of(ep, struct sock_ep, ep);	\
+									\
+	return sock_tx_send(sock_ep->tx_ctx, sock_ep, _mode,		\
+			    SOCK_OP_TSEND, iov, count, dest_addr,	\
+			    context, 0, tag,				\
+			    SOCK_TX_FLAGS(sock_ep->tx_ctx, 0));		\
+}									\
+									\
+static ssize_t sock_ep_tsenddata_##_sfx(struct fid_ep *ep,		\
+					const void *buf, size_t len,	\
+					void *desc, uint64_t data,	\
+					fi_addr_t dest_addr,		\
+					uint64_t tag, void *context)	\
+{									\
+	struct sock_ep *sock_ep = container_of(ep, struct sock_ep, ep);	\
+	struct iovec iov = { (void *) buf, len };			\
+									\
+	return sock_tx_send(sock_ep->tx_ctx, sock_ep, _mode,		\
+			    SOCK_OP_TSEND, &iov, 1, dest_addr, context,	\
+			    data, tag,					\
+			    SOCK_TX_FLAGS(sock_ep->tx_ctx,		\
+					  FI_REMOTE_CQ_DATA));		\
+}									\
+									\
+static ssize_t sock_ep_tinject_##_sfx(struct fid_ep *ep,		\
+				      const void *buf, size_t len,	\
+				      fi_addr_t dest_addr, uint64_t tag)\
+{									\
+	struct sock_ep *sock_ep = container_of(ep, struct sock_ep, ep);	\
+	struct iovec iov = { (void *) buf, len };			\
+									\
+	return sock_tx_send(sock_ep->tx_ctx, sock_ep, _mode,		\
+			    SOCK_OP_TSEND, &iov, 1, dest_addr, NULL,	\
+			    0, tag, SOCK_TX_FLAGS(sock_ep->tx_ctx,	\
+						  FI_INJECT));		\
+}									\
+									\
+static struct fi_ops_msg sock_ep_msg_ops_##_sfx = {			\
+	.size = sizeof(struct fi_ops_msg),				\
+	.recv = sock_ep_recv,						\
+	.recvv = sock_ep_recvv,						\
+	.recvmsg = sock_ep_recvmsg,					\
+	.send = sock_ep_send_##_sfx,					\
+	.sendv = sock_ep_sendv_##_sfx,					\
+	.sendmsg = sock_ep_sendmsg,					\
+	.inject = sock_ep_inject_##_sfx,				\
+	.senddata = sock_ep_senddata_##_sfx,				\
+};									\
+									\
+static struct fi_ops_tagged sock_ep_tagged_##_sfx = {			\
+	.size = sizeof(struct fi_ops_tagged),				\
+	.recv = sock_ep_trecv,						\
+	.recvv = sock_ep_trecvv,					\
+	.recvmsg = sock_ep_trecvmsg,					\
+	.send = sock_ep_tsend_##_sfx,					\
+	.sendv = sock_ep_tsendv_##_sfx,					\
+	.sendmsg = sock_ep_tsendmsg,					\
+	.inject = sock_ep_tinject_##_sfx,				\
+	.senddata = sock_ep_tsenddata_##_sfx,				\
+	.search = sock_ep_tsearch,					\
+};
+
+SOCK_EP_SEND_OPS(av, SOCK_TX_AV)
+SOCK_EP_SEND_OPS(conn, SOCK_TX_CONNECTED)
+
+/*
+ * Called at enable time.  Endpoints on a shared tx context keep the
+ * generic tables, since FI_SETOPSFLAG on the STX may change its
+ * op_flags afterwards.
+ */
+void sock_ep_set_tx_ops(struct sock_ep *sock_ep)
+{
+	struct sock_tx_ctx *tx_ctx = sock_ep->tx_ctx;
+
+	if (sock_ep->ep.fid.fclass != FI_CLASS_EP || !tx_ctx ||
+	    tx_ctx->fid.ctx.fid.fclass != FI_CLASS_TX_CTX ||
+	    (tx_ctx->attr.op_flags & SOCK_TX_FIXED_FLAGS))
+		return;
+
+	if (sock_ep->ep_type == FI_EP_MSG) {
+		sock_ep->ep.msg = &sock_ep_msg_ops_conn;
+		sock_ep->ep.tagged = &sock_ep_tagged_conn;
+	} else {
+		sock_ep->ep.msg = &sock_ep_msg_ops_av;
+		sock_ep->ep.tagged = &sock_ep_tagged_av;
+	}
+}
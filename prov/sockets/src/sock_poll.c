@@ -41,94 +41,227 @@
 #include "sock_util.h"
 
 
+/*
+ * Objects attached to a poll set queue themselves on the set's ready
+ * list when they become non-empty, so fi_poll only has to look at the
+ * objects that actually have something to report. Called with the
+ * object's lock held.
+ */
+void sock_poll_notify(struct dlist_entry *poll_list)
+{
+	struct dlist_entry *p;
+	struct sock_poll_item *item;
+
+	for (p = poll_list->next; p != poll_list; p = p->next) {
+		item = container_of(p, struct sock_poll_item, obj_entry);
+		fastlock_acquire(&item->poll->lock);
+		if (!item->ready) {
+			item->ready = 1;
+			dlist_insert_tail(&item->ready_entry,
+					  &item->poll->ready_list);
+		}
+		fastlock_release(&item->poll->lock);
+	}
+}
+
+static int sock_poll_item_ready(struct sock_poll_item *item)
+{
+	int ready = 0;
+	struct sock_cq *cq;
+	struct sock_eq *eq;
+
+	switch (item->fid->fclass) {
+	case FI_CLASS_CQ:
+		cq = container_of(item->fid, struct sock_cq, cq_fid);
+		fastlock_acquire(&cq->lock);
+		ready = rbfdused(&cq->cq_rbfd) || rbused(&cq->cqerr_rb);
+		fastlock_release(&cq->lock);
+		break;
+
+	case FI_CLASS_EQ:
+		eq = container_of(item->fid, struct sock_eq, eq);
+		fastlock_acquire(&eq->lock);
+		ready = !sock_eq_empty(eq) || !dlist_empty(&eq->err_list);
+		fastlock_release(&eq->lock);
+		break;
+
+	default:
+		break;
+	}
+	return ready;
+}
+
 int sock_poll_add(struct fid_poll *pollset, struct fid *event_fid, 
 			 uint64_t flags)
 {
 	struct sock_poll *poll;
-	struct sock_fid_list *list_item;
+	struct sock_poll_item *item;
+	struct sock_cq *cq;
+	struct sock_eq *eq;
+	struct sock_cntr *cntr;
 
 	poll = container_of(pollset, struct sock_poll, poll_fid.fid);
-	list_item = calloc(1, sizeof(*list_item));
-	if (!list_item)
+	item = calloc(1, sizeof(*item));
+	if (!item)
 		return -FI_ENOMEM;
 
-	list_item->fid = event_fid;
-	dlist_init(&list_item->entry);
-	dlist_insert_after(&list_item->entry, &poll->fid_list);
+	item->fid = event_fid;
+	item->poll = poll;
+	dlist_init(&item->entry);
+	dlist_init(&item->ready_entry);
+
+	switch (event_fid->fclass) {
+	case FI_CLASS_CQ:
+		cq = container_of(event_fid, struct sock_cq, cq_fid);
+		fastlock_acquire(&cq->lock);
+		dlist_insert_tail(&item->obj_entry, &cq->poll_list);
+		fastlock_release(&cq->lock);
+		break;
+
+	case FI_CLASS_CNTR:
+		cntr = container_of(event_fid, struct sock_cntr, cntr_fid);
+		pthread_mutex_lock(&cntr->mut);
+		dlist_insert_tail(&item->obj_entry, &cntr->poll_list);
+		pthread_mutex_unlock(&cntr->mut);
+		break;
+
+	case FI_CLASS_EQ:
+		eq = container_of(event_fid, struct sock_eq, eq);
+		fastlock_acquire(&eq->lock);
+		dlist_insert_tail(&item->obj_entry, &eq->poll_list);
+		fastlock_release(&eq->lock);
+		break;
+
+	default:
+		free(item);
+		return -FI_EINVAL;
+	}
+
+	dlist_insert_after(&item->entry, &poll->fid_list);
+
+	/* pick up anything that was queued before the object was added */
+	fastlock_acquire(&poll->lock);
+	if (event_fid->fclass != FI_CLASS_CNTR && !item->ready) {
+		item->ready = 1;
+		dlist_insert_tail(&item->ready_entry, &poll->ready_list);
+	}
+	fastlock_release(&poll->lock);
 	return 0;
 }
 
+static void sock_poll_item_free(struct sock_poll *poll,
+				struct sock_poll_item *item)
+{
+	struct sock_cq *cq;
+	struct sock_eq *eq;
+	struct sock_cntr *cntr;
+
+	switch (item->fid->fclass) {
+	case FI_CLASS_CQ:
+		cq = container_of(item->fid, struct sock_cq, cq_fid);
+		fastlock_acquire(&cq->lock);
+		dlist_remove(&item->obj_entry);
+		fastlock_release(&cq->lock);
+		break;
+
+	case FI_CLASS_CNTR:
+		cntr = container_of(item->fid, struct sock_cntr, cntr_fid);
+		pthread_mutex_lock(&cntr->mut);
+		dlist_remove(&item->obj_entry);
+		pthread_mutex_unlock(&cntr->mut);
+		break;
+
+	case FI_CLASS_EQ:
+		eq = container_of(item->fid, struct sock_eq, eq);
+		fastlock_acquire(&eq->lock);
+		dlist_remove(&item->obj_entry);
+		fastlock_release(&eq->lock);
+		break;
+	}
+
+	fastlock_acquire(&poll->lock);
+	if (item->ready)
+		dlist_remove(&item->ready_entry);
+	fastlock_release(&poll->lock);
+
+	dlist_remove(&item->entry);
+	free(item);
+}
+
 int sock_poll_del(struct fid_poll *pollset, struct fid *event_fid, 
 			 uint64_t flags)
 {
 	struct sock_poll *poll;
-	struct sock_fid_list *list_item;
+	struct sock_poll_item *item;
 	struct dlist_entry *p, *head;
 
 	poll = container_of(pollset, struct sock_poll, poll_fid.fid);
 	head = &poll->fid_list;
 	for (p = head->next; p != head; p = p->next) {
-		list_item = container_of(p, struct sock_fid_list, entry);
-		if (list_item->fid == event_fid) {
-			dlist_remove(p);
-			free(list_item);
+		item = container_of(p, struct sock_poll_item, entry);
+		if (item->fid == event_fid) {
+			sock_poll_item_free(poll, item);
 			break;
 		}
 	}
 	return 0;
 }
 
+static void sock_poll_requeue(struct sock_poll *poll,
+			      struct sock_poll_item *item)
+{
+	fastlock_acquire(&poll->lock);
+	if (!item->ready) {
+		item->ready = 1;
+		dlist_insert_tail(&item->ready_entry, &poll->ready_list);
+	}
+	fastlock_release(&poll->lock);
+}
+
 static int sock_poll_poll(struct fid_poll *pollset, void **context, int count)
 {
 	struct sock_poll *poll;
-	struct sock_cq *cq;
-	struct sock_eq *eq;
-	struct sock_cntr *cntr;
-	struct sock_fid_list *list_item;
-	struct dlist_entry *p, *head;
-	int ret_count = 0;
+	struct sock_poll_item *item;
+	struct dlist_entry ready;
+	int ret_count = 0, is_cntr;
 
 	poll = container_of(pollset, struct sock_poll, poll_fid.fid);
-	head = &poll->fid_list;
 
-	for (p = head->next; p != head && ret_count < count; p = p->next) {
-		list_item = container_of(p, struct sock_fid_list, entry);
-		switch (list_item->fid->fclass) {
-		case FI_CLASS_CQ:
-			cq = container_of(list_item->fid, struct sock_cq, cq_fid);
-			sock_cq_progress(cq);
-			fastlock_acquire(&cq->lock);
-			if (rbfdused(&cq->cq_rbfd)) {
-				*context++ = cq->cq_fid.fid.context;
-				ret_count++;
-			}
-			fastlock_release(&cq->lock);
-			break;
+	if (poll->domain->progress_mode == FI_PROGRESS_MANUAL ||
+	    sock_progress_thread_wait)
+		sock_pe_progress(poll->domain->pe);
 
-		case FI_CLASS_CNTR:
-			cntr = container_of(list_item->fid, struct sock_cntr, cntr_fid);
-			sock_cntr_progress(cntr);
-			fastlock_acquire(&cntr->mut);
-			if (atomic_get(&cntr->value) >= atomic_get(&cntr->threshold)) {
-				*context++ = cntr->cntr_fid.fid.context;
-				ret_count++;
-			}
-			fastlock_release(&cntr->mut);
-			break;
+	dlist_init(&ready);
+	fastlock_acquire(&poll->lock);
+	while (!dlist_empty(&poll->ready_list)) {
+		item = container_of(poll->ready_list.next,
+				    struct sock_poll_item, ready_entry);
+		dlist_remove(&item->ready_entry);
+		item->ready = 0;
+		dlist_insert_tail(&item->ready_entry, &ready);
+	}
+	fastlock_release(&poll->lock);
 
-		case FI_CLASS_EQ:
-			eq = container_of(list_item->fid, struct sock_eq, eq);
-			fastlock_acquire(&eq->lock);
-			if (!dlistfd_empty(&eq->list)) {
-				*context++ = eq->eq.fid.context;
-				ret_count++;
-			}
-			fastlock_release(&eq->lock);
-			break;
+	/*
+	 * Queues and EQs stay on the ready list for as long as they are
+	 * non-empty; counters are reported once per update.
+	 */
+	while (!dlist_empty(&ready)) {
+		item = container_of(ready.next, struct sock_poll_item,
+				    ready_entry);
+		dlist_remove(&item->ready_entry);
 
-		default:
-			break;
+		is_cntr = (item->fid->fclass == FI_CLASS_CNTR);
+		if (!is_cntr && !sock_poll_item_ready(item))
+			continue;
+
+		if (ret_count < count) {
+			*context++ = item->fid->context;
+			ret_count++;
+			if (is_cntr)
+				continue;
 		}
+		sock_poll_requeue(poll, item);
 	}
 
 	return ret_count;
@@ -137,19 +270,18 @@ static int sock_poll_poll(struct fid_poll *pollset, void **context, int count)
 static int sock_poll_close(fid_t fid)
 {
 	struct sock_poll *poll;
-	struct sock_fid_list *list_item;
-	struct dlist_entry *p, *head;
+	struct sock_poll_item *item;
+	struct dlist_entry *head;
 
 	poll = container_of(fid, struct sock_poll, poll_fid.fid);
 
 	head = &poll->fid_list;
 	while (!dlist_empty(head)) {
-		p = head->next;
-		list_item = container_of(p, struct sock_fid_list, entry);
-		dlist_remove(p);
-		free(list_item);
+		item = container_of(head->next, struct sock_poll_item, entry);
+		sock_poll_item_free(poll, item);
 	}
 
+	fastlock_destroy(&poll->lock);
 	atomic_dec(&poll->domain->ref);
 	free(poll);
 	return 0;
@@ -192,6 +324,8 @@ int sock_poll_open(struct fid_domain *domain, struct fi_poll_attr *attr,
 		return -FI_ENOMEM;
 	
 	dlist_init(&poll->fid_list);
+	dlist_init(&poll->ready_list);
+	fastlock_init(&poll->lock);
 	poll->poll_fid.fid.fclass = FI_CLASS_POLL;
 	poll->poll_fid.fid.context = 0;
 	poll->poll_fid.fid.ops = &sock_poll_fi_ops;
@@ -46,6 +46,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -59,8 +60,6 @@
 
 
 #define PE_INDEX(_pe, _e) (_e - &_pe->pe_table[0])
-#define SOCK_GET_RX_ID(_addr, _bits) ((_bits) == 0) ? 0 : \
-	(((uint64_t)_addr) >> (64 - _bits))
 
 static inline ssize_t sock_pe_send_field(struct sock_pe_entry *pe_entry,
 					 void * field, size_t field_len, 
@@ -106,6 +105,8 @@ static inline ssize_t sock_pe_recv_field(struct sock_pe_entry *pe_entry,
 static void sock_pe_release_entry(struct sock_pe *pe, 
 				  struct sock_pe_entry *pe_entry)
 {
+	struct sock_cq *cq;
+
 	dlist_remove(&pe_entry->ctx_entry);
 
 	if (pe_entry->type == SOCK_PE_TX)
@@ -119,6 +120,24 @@ static void sock_pe_release_entry(struct sock_pe *pe,
 	pe->num_free_entries++;
 	pe_entry->conn = NULL;
 
+	if (pe_entry->type == SOCK_PE_TX) {
+		if (pe_entry->flags & SOCK_INJECT_BOUNCE)
+			sock_tx_ctx_bounce_put(pe_entry->pe.tx.tx_ctx,
+				(void *) (uintptr_t)
+				pe_entry->pe.tx.data.tx_iov[0].src.iov.addr);
+		sock_stats_inc(pe->domain, FI_SOCK_STAT_TX_DONE);
+		cq = pe_entry->comp ? pe_entry->comp->send_cq : NULL;
+		sock_stats_obj_add(pe_entry->ep, cq, FI_SOCK_STAT_TX_DONE, 1);
+		sock_stats_obj_add(pe_entry->ep, cq, FI_SOCK_STAT_TX_BYTES,
+				   pe_entry->data_len);
+		if (pe_entry->post_ns)
+			sock_stats_record_latency(pe->domain, 0,
+						  pe_entry->post_ns);
+	} else {
+		sock_stats_inc(pe->domain, FI_SOCK_STAT_RX_DONE);
+	}
+	pe_entry->post_ns = 0;
+
 	memset(&pe_entry->pe.rx, 0, sizeof(pe_entry->pe.rx));
 	memset(&pe_entry->pe.tx, 0, sizeof(pe_entry->pe.tx));
 	memset(&pe_entry->msg_hdr, 0, sizeof(pe_entry->msg_hdr));
@@ -147,6 +166,9 @@ static struct sock_pe_entry *sock_pe_acquire_entry(struct sock_pe *pe)
 		return NULL;
 
 	pe->num_free_entries--;
+	if (SOCK_PE_MAX_ENTRIES - pe->num_free_entries > pe->max_used_entries)
+		pe->max_used_entries =
+			SOCK_PE_MAX_ENTRIES - pe->num_free_entries;
 	entry = pe->free_list.next;
 	pe_entry = container_of(entry, struct sock_pe_entry, entry);
 	dlist_remove(&pe_entry->entry);
@@ -160,6 +182,9 @@ static void sock_pe_report_tx_completion(struct sock_pe_entry *pe_entry)
 {
 	int ret1 = 0, ret2 = 0;
 
+	SOCK_TRACE(SOCK_TRACE_TX_COMP, pe_entry->context, pe_entry->data_len,
+		   pe_entry->flags);
+
 	if (!(pe_entry->flags & FI_INJECT)) {
 		if (pe_entry->comp->send_cq && 
 		    (!pe_entry->comp->send_cq_event || 
@@ -189,6 +214,13 @@ static void sock_pe_report_rx_completion(struct sock_pe_entry *pe_entry)
 {
 	int ret1 = 0, ret2 = 0;
 
+	SOCK_TRACE(SOCK_TRACE_RX_COMP, pe_entry->context, pe_entry->data_len,
+		   pe_entry->tag);
+	sock_stats_obj_add(pe_entry->ep, pe_entry->comp->recv_cq,
+			   FI_SOCK_STAT_RX_DONE, 1);
+	sock_stats_obj_add(pe_entry->ep, pe_entry->comp->recv_cq,
+			   FI_SOCK_STAT_RX_BYTES, pe_entry->data_len);
+
 	if (pe_entry->comp->recv_cq && 
 	    (!pe_entry->comp->recv_cq_event || 
 	     (pe_entry->comp->recv_cq_event && 
@@ -416,8 +448,9 @@ static void sock_pe_send_response(struct sock_pe *pe,
 	if (pe_entry->ep && pe_entry->ep->connected)
 		response->msg_hdr.ep_id = pe_entry->ep->rem_ep_id;
 	else
-		response->msg_hdr.ep_id = 
-			sock_av_lookup_ep_id(rx_ctx->av, pe_entry->addr);
+		response->msg_hdr.ep_id = sock_av_lookup_ep_id(
+			rx_ctx->av ? rx_ctx->av : pe_entry->ep->av,
+			pe_entry->addr);
 	response->msg_hdr.ep_id = htons(response->msg_hdr.ep_id);
 
 	pe->pe_atomic = NULL;
@@ -566,6 +599,19 @@ static int sock_pe_handle_atomic_complete(struct sock_pe *pe,
 	return 0;
 }
 
+static int sock_pe_handle_credit(struct sock_pe *pe,
+				 struct sock_pe_entry *pe_entry)
+{
+	if (sock_pe_recv_field(pe_entry, &pe_entry->data, sizeof(uint64_t),
+			       sizeof(struct sock_msg_hdr)))
+		return 0;
+
+	pe_entry->conn->tx_credits += ntohll(pe_entry->data);
+	pe_entry->conn->credit_wait = 0;
+	pe_entry->is_complete = 1;
+	return 0;
+}
+
 static int sock_pe_process_rx_read(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 				   struct sock_pe_entry *pe_entry)
 {
@@ -1138,6 +1184,8 @@ int sock_pe_progress_buffered_rx(struct sock_rx_ctx *rx_ctx)
 					      rx_buffered->tag);
 		if (!rx_posted) 
 			continue;
+		SOCK_TRACE(SOCK_TRACE_MATCH, rx_ctx, rx_buffered->tag,
+			   rx_posted->context);
 
 		SOCK_LOG_INFO("Consuming buffered entry: %p, ctx: %p\n", 
 			      rx_buffered, rx_ctx);
@@ -1147,25 +1195,32 @@ int sock_pe_progress_buffered_rx(struct sock_rx_ctx *rx_ctx)
 		offset = 0;
 		rem = rx_buffered->iov[0].iov.len;
 		rx_ctx->buffered_len -= rem;
-		used_len = rx_posted->used;
+		if (rx_posted->flags & FI_MULTI_RECV)
+			used_len = sock_rx_claim_multi_recv(rx_ctx, rx_posted,
+							    rem);
+		else
+			used_len = rx_posted->used;
 		pe_entry.data_len = 0;
 		pe_entry.buf = 0L;
 		for (i = 0; i < rx_posted->rx_op.dest_iov_len && rem > 0; i++) {
-			if (used_len >= rx_posted->rx_op.dest_iov_len) {
-				used_len -= rx_posted->rx_op.dest_iov_len;
+			if (used_len >= rx_posted->iov[i].iov.len) {
+				used_len -= rx_posted->iov[i].iov.len;
 				continue;
 			}
 
 			dst_offset = used_len;
-			len = MIN(rx_posted->iov[i].iov.len, rem);
-			pe_entry.buf = (uint64_t)
-				(char*)rx_posted->iov[i].iov.addr + dst_offset;
+			len = MIN(rx_posted->iov[i].iov.len - dst_offset, rem);
+			if (!pe_entry.buf)
+				pe_entry.buf = (uint64_t)
+					(char*)rx_posted->iov[i].iov.addr +
+					dst_offset;
 			memcpy((char*)rx_posted->iov[i].iov.addr + dst_offset,
 			       (char*)rx_buffered->iov[0].iov.addr + offset, len);
 			offset += len;
 			rem -= len;
 			dst_offset = used_len = 0;
-			rx_posted->used += len;
+			if (!(rx_posted->flags & FI_MULTI_RECV))
+				rx_posted->used += len;
 			pe_entry.data_len = rx_buffered->used;
 		}
 		
@@ -1176,29 +1231,34 @@ int sock_pe_progress_buffered_rx(struct sock_rx_ctx *rx_ctx)
 		pe_entry.pe.rx.rx_iov[0].iov.addr = rx_posted->iov[0].iov.addr;
 		pe_entry.type = SOCK_PE_RX;
 		pe_entry.comp = rx_buffered->comp;
+		pe_entry.ep = rx_buffered->ep;
+		pe_entry.addr = rx_buffered->addr;
 		pe_entry.flags = 0;
 
 		if (rx_posted->flags & FI_MULTI_RECV) {
-			if (sock_rx_avail_len(rx_posted) < rx_ctx->min_multi_recv) {
+			if (--rx_posted->pending == 0 && rx_posted->is_retired)
 				pe_entry.flags |= FI_MULTI_RECV;
-				dlist_remove(&rx_posted->entry);
-			}
 		} else {
-			dlist_remove(&rx_posted->entry);
+			sock_rx_ctx_unlink_entry(rx_ctx, rx_posted);
 		}
 	
 		if (rem) {
 			SOCK_LOG_INFO("Not enough space in posted recv buffer\n");
 			sock_pe_report_error(&pe_entry, rem);
-			return 0;
 		} else {
 			sock_pe_report_rx_completion(&pe_entry);
+			if (rx_posted->post_ns)
+				sock_stats_record_latency(rx_ctx->domain, 1,
+							  rx_posted->post_ns);
 		}
 
+		if (rx_buffered->conn)
+			rx_buffered->conn->rx_credits += rx_buffered->credits;
 		dlist_remove(&rx_buffered->entry);
 		sock_rx_release_entry(rx_buffered);
 
-		if (pe_entry.flags & FI_MULTI_RECV)
+		if (!(rx_posted->flags & FI_MULTI_RECV) ||
+		    (pe_entry.flags & FI_MULTI_RECV))
 			sock_rx_release_entry(rx_posted);
 	}
 	return 0;
@@ -1233,30 +1293,67 @@ static int sock_pe_process_rx_send(struct sock_pe *pe, struct sock_rx_ctx *rx_ct
 		data_len = pe_entry->msg_hdr.msg_len - len;
 
 		/* progress buffered recvs, if any  */
-		fastlock_acquire(&rx_ctx->lock);
+		sock_lock_acquire(rx_ctx->domain->elide_ctx_locks,
+				  &rx_ctx->lock);
 		sock_pe_progress_buffered_rx(rx_ctx);
 		rx_entry = sock_rx_get_entry(rx_ctx, pe_entry->addr, pe_entry->tag);
 
 		SOCK_LOG_INFO("Consuming posted entry: %p\n", rx_entry);
+		if (rx_entry)
+			SOCK_TRACE(SOCK_TRACE_MATCH, rx_ctx, pe_entry->tag,
+				   rx_entry->context);
+
+		/* land straight in the next free slot of a multi-recv buffer */
+		if (rx_entry && (rx_entry->flags & FI_MULTI_RECV))
+			pe_entry->pe.rx.rx_offset =
+				sock_rx_claim_multi_recv(rx_ctx, rx_entry,
+							 data_len);
 		
 		if (!rx_entry) {
 			SOCK_LOG_INFO("%p: No matching recv, buffering recv (len=%llu)\n", 
 				      pe_entry, (long long unsigned int)data_len);
+			SOCK_TRACE(SOCK_TRACE_UNEXPECTED, rx_ctx,
+				   pe_entry->tag, data_len);
+
+			/*
+			 * At the buffering limit, leave the message in the
+			 * socket and retry once buffered data drains; the
+			 * connection stays claimed, so the peer is held back
+			 * by TCP rather than the receive failing.
+			 */
+			if (rx_ctx->buffered_len &&
+			    rx_ctx->buffered_len + data_len >=
+			    rx_ctx->attr.total_buffered_recv) {
+				sock_lock_release(rx_ctx->domain->elide_ctx_locks,
+						  &rx_ctx->lock);
+				if (!pe_entry->pe.rx.held) {
+					pe_entry->pe.rx.held = 1;
+					sock_stats_inc(pe->domain,
+						       FI_SOCK_STAT_RX_STALL);
+				}
+				return 0;
+			}
 
 			rx_entry = sock_rx_new_buffered_entry(rx_ctx, data_len);
 			if (!rx_entry) {
-				fastlock_release(&rx_ctx->lock);
+				sock_lock_release(rx_ctx->domain->elide_ctx_locks,
+						  &rx_ctx->lock);
 				return -FI_ENOMEM;
 			}
 			
+			rx_entry->conn = pe_entry->conn;
+			rx_entry->credits = MIN(pe_entry->msg_hdr.msg_len,
+						pe_entry->conn->rx_window);
 			rx_entry->addr = pe_entry->addr;
 			rx_entry->tag = pe_entry->tag;
 			rx_entry->data = pe_entry->data;
 			rx_entry->ignore = 0;
 			rx_entry->comp = pe_entry->comp;
+			rx_entry->ep = pe_entry->ep;
 			pe_entry->context = rx_entry->context;
 		}
-		fastlock_release(&rx_ctx->lock);
+		sock_lock_release(rx_ctx->domain->elide_ctx_locks,
+				  &rx_ctx->lock);
 		pe_entry->context = rx_entry->context;
 		pe_entry->pe.rx.rx_entry = rx_entry;
 	}
@@ -1265,7 +1362,7 @@ static int sock_pe_process_rx_send(struct sock_pe *pe, struct sock_rx_ctx *rx_ct
 	done_data = pe_entry->done_len - len;
 	pe_entry->data_len = pe_entry->msg_hdr.msg_len - len;
 	rem = pe_entry->data_len - done_data;
-	used = rx_entry->used;
+	used = pe_entry->pe.rx.rx_offset + done_data;
 
 	for (i = 0; rem > 0 && i < rx_entry->rx_op.dest_iov_len; i++) {
 
@@ -1289,35 +1386,39 @@ static int sock_pe_process_rx_send(struct sock_pe *pe, struct sock_rx_ctx *rx_ct
 		rem -= ret;
 		used = 0;
 		pe_entry->done_len += ret;
-		rx_entry->used += ret;
+		if (!(rx_entry->flags & FI_MULTI_RECV))
+			rx_entry->used += ret;
 		if (ret != data_len)
 			return 0;
 	}
 
-	fastlock_acquire(&rx_ctx->lock);
+	sock_lock_acquire(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
 	if (rx_entry->flags & FI_MULTI_RECV) {
-		if (sock_rx_avail_len(rx_entry) < rx_ctx->min_multi_recv) {
+		if (--rx_entry->pending == 0 && rx_entry->is_retired)
 			pe_entry->flags |= FI_MULTI_RECV;
-			dlist_remove(&rx_entry->entry);
-		}
 	} else {
 		if (!rx_entry->is_buffered)
-			dlist_remove(&rx_entry->entry);
+			sock_rx_ctx_unlink_entry(rx_ctx, rx_entry);
 	}
-	fastlock_release(&rx_ctx->lock);
+	sock_lock_release(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
 
 	pe_entry->is_complete = 1;
 	rx_entry->is_complete = 1;
 	rx_entry->is_busy = 0;
+	if (!rx_entry->is_buffered)
+		pe_entry->conn->rx_credits += MIN(pe_entry->msg_hdr.msg_len,
+						  pe_entry->conn->rx_window);
 
 	/* report error, if any */
 	if (rem) {
 		SOCK_LOG_ERROR("Not enough space in posted recv buffer\n");
 		sock_pe_report_error(pe_entry, rem);
 		goto out;
-	} else {
-		if (!rx_entry->is_buffered)
-			sock_pe_report_rx_completion(pe_entry);
+	} else if (!rx_entry->is_buffered) {
+		sock_pe_report_rx_completion(pe_entry);
+		if (rx_entry->post_ns)
+			sock_stats_record_latency(rx_ctx->domain, 1,
+						  rx_entry->post_ns);
 	}
 
 out:
@@ -1388,6 +1489,10 @@ static int sock_pe_process_recv(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 		ret = sock_pe_handle_ack(pe, pe_entry);
 		break;
 
+	case SOCK_OP_CREDIT:
+		ret = sock_pe_handle_credit(pe, pe_entry);
+		break;
+
 	default:
 		ret = -FI_ENOSYS;
 		SOCK_LOG_ERROR("Operation not supported\n");
@@ -1427,12 +1532,60 @@ static int sock_pe_peek_hdr(struct sock_pe *pe,
 	return 0;
 }
 
+static inline int sock_pe_is_response(uint8_t op_type)
+{
+	switch (op_type) {
+	case SOCK_OP_SEND_COMPLETE:
+	case SOCK_OP_WRITE_COMPLETE:
+	case SOCK_OP_WRITE_ERROR:
+	case SOCK_OP_READ_COMPLETE:
+	case SOCK_OP_READ_ERROR:
+	case SOCK_OP_ATOMIC_COMPLETE:
+	case SOCK_OP_ATOMIC_ERROR:
+	case SOCK_OP_CREDIT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int sock_pe_match_hdr(struct sock_rx_ctx *rx_ctx,
+			     struct sock_msg_hdr *msg_hdr)
+{
+	if (msg_hdr->rx_id != rx_ctx->rx_id)
+		return 0;
+
+	if (rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX)
+		return idm_lookup(&rx_ctx->ep_map, msg_hdr->ep_id) != NULL;
+
+	if (msg_hdr->ep_id != rx_ctx->ep->ep_id) {
+		SOCK_LOG_INFO("Mismatch: %d:%d\n", 
+			      msg_hdr->ep_id,rx_ctx->ep->ep_id);
+		return 0;
+	}
+	return 1;
+}
+
+static void sock_pe_set_rx_ep(struct sock_pe_entry *pe_entry,
+			      struct sock_rx_ctx *rx_ctx, struct sock_ep *ep)
+{
+	pe_entry->ep = ep;
+
+	if (!ep || ep->ep_type == FI_EP_MSG || !ep->av)
+		pe_entry->addr = FI_ADDR_NOTAVAIL;
+	else
+		pe_entry->addr = sock_av_lookup_key(ep->av, 
+				pe_entry->conn - ep->domain->r_cmap.table);
+
+	if (ep && rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX) 
+		pe_entry->comp = &ep->comp;
+	else
+		pe_entry->comp = &rx_ctx->comp;
+}
+
 static int sock_pe_read_hdr(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 			     struct sock_pe_entry *pe_entry)
 {
-	int match;
-	struct sock_ep *ep;
-	struct dlist_entry *entry;
 	struct sock_msg_hdr *msg_hdr;
 	struct sock_conn *conn = pe_entry->conn;
 
@@ -1446,29 +1599,19 @@ static int sock_pe_read_hdr(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 	msg_hdr = &pe_entry->msg_hdr;
 	if (sock_pe_peek_hdr(pe, pe_entry))
 		return 0;
-	
-	if (msg_hdr->rx_id != rx_ctx->rx_id)
+
+	/*
+	 * Responses find their request through the PE table and credit
+	 * returns belong to the connection, so any context takes them.
+	 */
+	if (!sock_pe_is_response(msg_hdr->op_type) &&
+	    !sock_pe_match_hdr(rx_ctx, msg_hdr))
 		return -1;
 
-	if (rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX) {
-		match = 0;
-		for (entry = rx_ctx->ep_list.next;
-		     entry != &rx_ctx->ep_list; entry = entry->next) {
-			ep = container_of(entry, struct sock_ep, rx_ctx_entry);
-			if (ep->ep_id == msg_hdr->ep_id) {
-				match = 1;
-				break;
-			}
-		}
-		if (!match)
-			return -1;
-	} else {
-		if (msg_hdr->ep_id != rx_ctx->ep->ep_id) {
-			SOCK_LOG_INFO("Mismatch: %d:%d\n", 
-				       msg_hdr->ep_id,rx_ctx->ep->ep_id);
-			return -1;
-		}
-	}
+	/* a shared context learns the endpoint from the header */
+	if (rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX)
+		sock_pe_set_rx_ep(pe_entry, rx_ctx,
+				  idm_lookup(&rx_ctx->ep_map, msg_hdr->ep_id));
 	
 	if (sock_pe_recv_field(pe_entry, (void*)msg_hdr, 
 			       sizeof(struct sock_msg_hdr), 0)) {
@@ -1559,7 +1702,6 @@ static int sock_pe_progress_tx_atomic(struct sock_pe *pe,
 		pe_entry->conn->tx_pe_entry = NULL;
 		SOCK_LOG_INFO("Send complete\n");		
 	}
-	sock_comm_flush(pe_entry->conn);
 	return 0;
 }
 
@@ -1617,7 +1759,6 @@ static int sock_pe_progress_tx_write(struct sock_pe *pe,
 		pe_entry->conn->tx_pe_entry = NULL;
 		SOCK_LOG_INFO("Send complete\n");		
 	}
-	sock_comm_flush(pe_entry->conn);
 	return 0;
 }
 
@@ -1652,7 +1793,6 @@ static int sock_pe_progress_tx_read(struct sock_pe *pe,
 		pe_entry->conn->tx_pe_entry = NULL;
 		SOCK_LOG_INFO("Send complete\n");		
 	}
-	sock_comm_flush(pe_entry->conn);
 	return 0;
 }
 
@@ -1699,7 +1839,6 @@ static int sock_pe_progress_tx_send(struct sock_pe *pe,
 		}
 	}
 	
-	sock_comm_flush(pe_entry->conn);
 	if (pe_entry->done_len == pe_entry->total_len) {
 		pe_entry->pe.tx.send_done = 1;
 		pe_entry->conn->tx_pe_entry = NULL;
@@ -1714,6 +1853,68 @@ static int sock_pe_progress_tx_send(struct sock_pe *pe,
 	return 0;
 }
 
+/*
+ * Eager sends are charged against the buffer space the peer advertised
+ * at connection setup, capped at the whole window so that any message
+ * can go once nothing else is outstanding.  The receiver returns the
+ * credits when the data lands in a posted buffer or, if it had to be
+ * buffered, once the application consumes it; until then sends are held
+ * in the tx queue rather than pushed at a receiver with nowhere to put
+ * them.  Later requests to the same peer queue behind a held send to keep
+ * ordering.  Responses and credit returns go out from rx entries and
+ * never wait, and a held send never claims the connection, so neither
+ * can block the credits it waits for.
+ */
+static int sock_pe_tx_credit(struct sock_pe *pe,
+			     struct sock_pe_entry *pe_entry,
+			     struct sock_conn *conn)
+{
+	uint64_t cost;
+
+	switch (pe_entry->msg_hdr.op_type) {
+	case SOCK_OP_SEND:
+	case SOCK_OP_TSEND:
+		cost = MIN(pe_entry->total_len, conn->tx_window);
+		if (conn->tx_credits < cost) {
+			if (!conn->credit_wait)
+				sock_stats_inc(pe->domain,
+					       FI_SOCK_STAT_CREDIT_WAIT);
+			conn->credit_wait = 1;
+			return 0;
+		}
+		conn->tx_credits -= cost;
+		conn->credit_wait = 0;
+		return 1;
+
+	default:
+		return !conn->credit_wait;
+	}
+}
+
+static void sock_pe_return_credits(struct sock_conn *conn)
+{
+	struct sock_msg_credit msg;
+
+	/* only between messages, and only as a single write */
+	if (conn->tx_pe_entry != NULL)
+		return;
+	if (rbavail(&conn->outbuf) < sizeof(msg)) {
+		sock_comm_flush(conn);
+		if (rbavail(&conn->outbuf) < sizeof(msg))
+			return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_hdr.version = SOCK_WIRE_PROTO_VERSION;
+	msg.msg_hdr.op_type = SOCK_OP_CREDIT;
+	msg.msg_hdr.msg_len = htonll(sizeof(msg));
+	msg.credits = htonll(conn->rx_credits);
+	rbwrite(&conn->outbuf, &msg, sizeof(msg));
+	rbcommit(&conn->outbuf);
+	sock_comm_flush(conn);
+	conn->rx_credits = 0;
+}
+
 static int sock_pe_progress_tx_entry(struct sock_pe *pe,
 				     struct sock_tx_ctx *tx_ctx,
 				     struct sock_pe_entry *pe_entry)
@@ -1731,6 +1932,9 @@ static int sock_pe_progress_tx_entry(struct sock_pe *pe,
 	}
 
 	if (conn->tx_pe_entry == NULL) {
+		if (!pe_entry->pe.tx.header_sent &&
+		    !sock_pe_tx_credit(pe, pe_entry, conn))
+			return 0;
 		SOCK_LOG_INFO("Connection %p grabbed by %p\n", conn, pe_entry);
 		conn->tx_pe_entry = pe_entry;
 	}
@@ -1812,8 +2016,7 @@ static int sock_pe_progress_rx_pe_entry(struct sock_pe *pe,
 }
 
 static int sock_pe_new_rx_entry(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
-				struct sock_ep *ep, struct sock_conn *conn, 
-				int key)
+				struct sock_ep *ep, struct sock_conn *conn)
 {
 	int ret;
 	struct sock_pe_entry *pe_entry;	
@@ -1827,19 +2030,9 @@ static int sock_pe_new_rx_entry(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx,
 
 	pe_entry->conn = conn;
 	pe_entry->type = SOCK_PE_RX;
-	pe_entry->ep = ep;
 	pe_entry->is_complete = 0;
 	pe_entry->done_len = 0;
-
-	if (ep->ep_type == FI_EP_MSG || !ep->av)
-		pe_entry->addr = FI_ADDR_NOTAVAIL;
-	else
-		pe_entry->addr = sock_av_lookup_key(ep->av, key);
-
-	if (rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX) 
-		pe_entry->comp = &ep->comp;
-	else
-		pe_entry->comp = &rx_ctx->comp;
+	sock_pe_set_rx_ep(pe_entry, rx_ctx, ep);
 
 	SOCK_LOG_INFO("New RX on PE entry %p (%ld)\n", 
 		      pe_entry, PE_INDEX(pe, pe_entry));
@@ -1860,6 +2053,7 @@ static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 	int i, datatype_sz;
 	struct sock_msg_hdr *msg_hdr;
 	struct sock_pe_entry *pe_entry;
+	struct sock_op_send *send_op, send_buf;
 	struct sock_ep *ep;
 
 	pe_entry = sock_pe_acquire_entry(pe);
@@ -1890,13 +2084,24 @@ static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 	SOCK_LOG_INFO("New TX on PE entry %p (%d)\n", 
 		      pe_entry, msg_hdr->pe_entry_id);
 
-	rbfdread(&tx_ctx->rbfd, &pe_entry->pe.tx.tx_op, sizeof(struct sock_op));
-	rbfdread(&tx_ctx->rbfd, &pe_entry->flags, sizeof(uint64_t));
-	rbfdread(&tx_ctx->rbfd, &pe_entry->context, sizeof(uint64_t));
-	rbfdread(&tx_ctx->rbfd, &pe_entry->addr, sizeof(uint64_t));
-	rbfdread(&tx_ctx->rbfd, &pe_entry->conn, sizeof(uint64_t));
-	rbfdread(&tx_ctx->rbfd, &pe_entry->buf, sizeof(uint64_t));
-	rbfdread(&tx_ctx->rbfd, &ep, sizeof(uint64_t));
+	send_op = (tx_ctx->rbfd.rb.rcnt & (sizeof(uint64_t) - 1)) ? NULL :
+		rbpeekptr(&tx_ctx->rbfd.rb, sizeof(*send_op));
+	if (!send_op) {
+		rbpeek(&tx_ctx->rbfd.rb, &send_buf, sizeof(send_buf));
+		send_op = &send_buf;
+	}
+	pe_entry->pe.tx.tx_op = send_op->op;
+	pe_entry->flags = send_op->flags;
+	pe_entry->context = send_op->context;
+	pe_entry->addr = send_op->dest_addr;
+	pe_entry->conn = send_op->conn;
+	pe_entry->buf = send_op->buf;
+	ep = send_op->ep;
+	rbfdconsume(&tx_ctx->rbfd, sizeof(*send_op));
+
+	if (tx_ctx->post_ns)
+		pe_entry->post_ns =
+			tx_ctx->post_ns[tx_ctx->pick_seq++ & tx_ctx->post_mask];
 
 	if (ep && tx_ctx->fid.stx.fid.fclass == FI_CLASS_STX_CTX)
 		pe_entry->comp = &ep->comp;
@@ -2035,7 +2240,7 @@ static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 	}
 
 	msg_hdr->dest_iov_len = pe_entry->pe.tx.tx_op.dest_iov_len;
-	msg_hdr->flags = htonll(pe_entry->flags);
+	msg_hdr->flags = htonll(pe_entry->flags & ~SOCK_INJECT_BOUNCE);
 	pe_entry->total_len = msg_hdr->msg_len;
 	msg_hdr->msg_len = htonll(msg_hdr->msg_len);
 	msg_hdr->pe_entry_id = htons(msg_hdr->pe_entry_id);
@@ -2043,11 +2248,107 @@ static int sock_pe_new_tx_entry(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 	return sock_pe_progress_tx_entry(pe, tx_ctx, pe_entry);
 }
 
+void sock_pe_poll_add(struct sock_pe *pe, int fd)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(pe->epoll_fd, EPOLL_CTL_ADD, fd, &event))
+		SOCK_LOG_ERROR("failed to add fd to PE poll set: %d\n", errno);
+}
+
+void sock_pe_poll_del(struct sock_pe *pe, int fd)
+{
+	epoll_ctl(pe->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void sock_pe_signal(struct sock_pe *pe)
+{
+	char c = 0;
+	if (write(pe->signal_fds[0], &c, 1) != 1)
+		SOCK_LOG_INFO("failed to signal PE\n");
+}
+
+/* called by a waiter woken through the PE poll set */
+void sock_pe_drain_signal(struct sock_pe *pe)
+{
+	char tmp[16];
+
+	while (read(pe->signal_fds[1], tmp, sizeof tmp) > 0)
+		;
+}
+
+/*
+ * Opens an epoll set for a manual progress waiter: the PE poll set,
+ * nested edge-triggered, next to fd when it is not -1. The PE set is
+ * level-triggered and holds every connection of the domain, so it stays
+ * readable while input for other endpoints, a peer's EOF or a message
+ * held back for credits is pending. Nested edge-triggered, it only
+ * wakes the waiter when one of its fds signals anew.
+ */
+int sock_pe_wait_open(struct sock_pe *pe, int fd)
+{
+	struct epoll_event event;
+	int epoll_fd, ret;
+
+	epoll_fd = epoll_create(2);
+	if (epoll_fd < 0)
+		return -errno;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.fd = pe->epoll_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event))
+		goto err;
+
+	if (fd != -1) {
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event))
+			goto err;
+	}
+	return epoll_fd;
+
+err:
+	ret = -errno;
+	close(epoll_fd);
+	return ret;
+}
+
+/*
+ * Blocks on a set from sock_pe_wait_open until a tx ring or connection
+ * of the domain signals, the PE is signaled or the set's own fd becomes
+ * readable. Entries in flight may be waiting for socket space rather
+ * than for input, so only nap briefly then.
+ */
+int sock_pe_wait_set(struct sock_pe *pe, int epoll_fd, int timeout)
+{
+	int i, ret;
+	struct epoll_event events[2];
+
+	if (!dlist_empty(&pe->busy_list))
+		timeout = (timeout < 0) ? 1 : MIN(timeout, 1);
+
+	ret = epoll_wait(epoll_fd, events, 2, timeout);
+	if (ret < 0)
+		return (errno == EINTR) ? 0 : -errno;
+
+	for (i = 0; i < ret; i++) {
+		if (events[i].data.fd == pe->signal_fds[1] ||
+		    events[i].data.fd == pe->epoll_fd)
+			sock_pe_drain_signal(pe);
+	}
+	return ret;
+}
+
 void sock_pe_add_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *ctx)
 {
 	fastlock_acquire(&pe->lock);
 	dlistfd_insert_tail(&ctx->pe_entry, &pe->tx_list);
 	fastlock_release(&pe->lock);
+	sock_pe_poll_add(pe, ctx->rbfd.fd[RB_READ_FD]);
 	SOCK_LOG_INFO("TX ctx added to PE\n");
 }
 
@@ -2064,6 +2365,7 @@ void sock_pe_remove_tx_ctx(struct sock_tx_ctx *tx_ctx)
 	fastlock_acquire(&tx_ctx->domain->pe->lock);
 	dlist_remove(&tx_ctx->pe_entry);
 	fastlock_release(&tx_ctx->domain->pe->lock);
+	sock_pe_poll_del(tx_ctx->domain->pe, tx_ctx->rbfd.fd[RB_READ_FD]);
 }
 
 void sock_pe_remove_rx_ctx(struct sock_rx_ctx *rx_ctx)
@@ -2073,18 +2375,44 @@ void sock_pe_remove_rx_ctx(struct sock_rx_ctx *rx_ctx)
 	fastlock_release(&rx_ctx->domain->pe->lock);
 }
 
+int sock_pe_add_srx_ep(struct sock_rx_ctx *rx_ctx, struct sock_ep *ep)
+{
+	int ret;
+
+	fastlock_acquire(&rx_ctx->domain->pe->lock);
+	ret = idm_set(&rx_ctx->ep_map, ep->ep_id, ep);
+	if (ret >= 0)
+		dlist_insert_tail(&ep->rx_ctx_entry, &rx_ctx->ep_list);
+	fastlock_release(&rx_ctx->domain->pe->lock);
+	return (ret < 0) ? -errno : 0;
+}
+
+void sock_pe_remove_srx_ep(struct sock_rx_ctx *rx_ctx, struct sock_ep *ep)
+{
+	fastlock_acquire(&rx_ctx->domain->pe->lock);
+	dlist_remove(&ep->rx_ctx_entry);
+	idm_clear(&rx_ctx->ep_map, ep->ep_id);
+	fastlock_release(&rx_ctx->domain->pe->lock);
+}
+
 int sock_pe_progress_rx_ep(struct sock_pe *pe, struct sock_ep *ep,
 			   struct sock_rx_ctx *rx_ctx)
 {
 	struct sock_conn *conn;
 	struct sock_conn_map *map;
 	int i, ret = 0, data_avail;
+	size_t lanes;
 	
-	map = &ep->domain->r_cmap;
+	map = &rx_ctx->domain->r_cmap;
 	assert(map != NULL);
 
+	/* a receive context of a scalable endpoint only polls its lanes */
+	lanes = (ep && ep->fclass == FI_CLASS_SEP) ? ep->ep_attr.rx_ctx_cnt : 0;
+
 	for (i=0; i<map->used; i++) {
 		conn = &map->table[i];
+		if (lanes && conn->lane % lanes != rx_ctx->rx_id)
+			continue;
 		
 		if (rbused(&conn->outbuf))
 			sock_comm_flush(conn);
@@ -2094,6 +2422,7 @@ int sock_pe_progress_rx_ep(struct sock_pe *pe, struct sock_ep *ep,
 			data_avail = 1;
 		} else {
 			ret = fi_poll_fd(conn->sock_fd, 0);
+			conn->syscalls++;
 			if (ret < 0 && errno != EINTR) {
 				SOCK_LOG_INFO("Error polling fd: %d\n", 
 					      conn->sock_fd);
@@ -2102,10 +2431,14 @@ int sock_pe_progress_rx_ep(struct sock_pe *pe, struct sock_ep *ep,
 			data_avail = (ret == 1);
 		}
 		
+		if (conn->rx_credits &&
+		    (!data_avail || conn->rx_credits >= conn->rx_window / 2))
+			sock_pe_return_credits(conn);
+
 		if (data_avail && conn->rx_pe_entry == NULL &&
 				!dlist_empty(&pe->free_list)) {
 			/* new RX PE entry */
-			ret = sock_pe_new_rx_entry(pe, rx_ctx, ep, conn, i);
+			ret = sock_pe_new_rx_entry(pe, rx_ctx, ep, conn);
 			if (ret < 0)
 				return ret;
 		}
@@ -2113,38 +2446,28 @@ int sock_pe_progress_rx_ep(struct sock_pe *pe, struct sock_ep *ep,
 	return 0;
 }
 
-int sock_pe_progress_rx_ctx(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx)
+static int _sock_pe_progress_rx_ctx(struct sock_pe *pe,
+				    struct sock_rx_ctx *rx_ctx)
 {
 	int ret = 0;
 	struct sock_ep *ep;
 	struct dlist_entry *entry;
 	struct sock_pe_entry *pe_entry;
 
-	if (fastlock_acquire(&pe->lock))
-		return 0;
-
 	/* progress buffered recvs */
-	fastlock_acquire(&rx_ctx->lock);
+	sock_lock_acquire(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
 	sock_pe_progress_buffered_rx(rx_ctx);
-	fastlock_release(&rx_ctx->lock);
-
-	/* check for incoming data */
-	if (rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX) {
-		for (entry = rx_ctx->ep_list.next;
-		     entry != &rx_ctx->ep_list; ) {
-			
-			ep = container_of(entry, struct sock_ep, rx_ctx_entry);
-			entry = entry->next;
-			ret = sock_pe_progress_rx_ep(pe, ep, rx_ctx);
-			if (ret < 0)
-				goto out;
-		}
-	} else {
-		ep = rx_ctx->ep;
-		ret = sock_pe_progress_rx_ep(pe, ep, rx_ctx);
-		if (ret < 0)
-			goto out;
-	}
+	sock_lock_release(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
+
+	/*
+	 * Check for incoming data. The endpoints of a shared context use
+	 * the same connections, so poll them once and let the header pick
+	 * the endpoint.
+	 */
+	ep = (rx_ctx->ctx.fid.fclass == FI_CLASS_SRX_CTX) ? NULL : rx_ctx->ep;
+	ret = sock_pe_progress_rx_ep(pe, ep, rx_ctx);
+	if (ret < 0)
+		goto out;
 
 	/* progress rx_ctx in PE table */
 	for (entry = rx_ctx->pe_entry_list.next;
@@ -2160,7 +2483,18 @@ int sock_pe_progress_rx_ctx(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx)
 out:	
 	if (ret < 0) 
 		SOCK_LOG_ERROR("failed to progress RX ctx\n");
-	fastlock_release(&pe->lock);
+	return ret;
+}
+
+int sock_pe_progress_rx_ctx(struct sock_pe *pe, struct sock_rx_ctx *rx_ctx)
+{
+	int ret;
+
+	if (sock_lock_acquire(pe->domain->elide_pe_lock, &pe->lock))
+		return 0;
+	sock_stats_inc(pe->domain, FI_SOCK_STAT_PROGRESS);
+	ret = _sock_pe_progress_rx_ctx(pe, rx_ctx);
+	sock_lock_release(pe->domain->elide_pe_lock, &pe->lock);
 	return ret;
 }
 
@@ -2169,30 +2503,62 @@ int sock_pe_progress_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 	int ret = 0;
 	struct dlist_entry *entry;
 	struct sock_pe_entry *pe_entry;
+	struct sock_conn *last_conn = NULL;
+	int credit_wait = 0;
 
-	if (fastlock_acquire(&pe->lock))
+	if (sock_lock_acquire(pe->domain->elide_pe_lock, &pe->lock))
 		return 0;
+	sock_stats_inc(pe->domain, FI_SOCK_STAT_PROGRESS);
+
+	/* repost triggered ops that found the tx ring full */
+	if (!dlist_empty(&tx_ctx->trigger_list))
+		sock_tx_ctx_progress_triggers(tx_ctx);
+
+	/*
+	 * Commit an FI_MORE sequence that has not grown since the last
+	 * pass, in case the application stopped posting.
+	 */
+	if (tx_ctx->rbfd.rb.wpos != tx_ctx->rbfd.rb.wcnt) {
+		if (tx_ctx->batch_seen == tx_ctx->rbfd.rb.wpos) {
+			sock_lock_acquire(tx_ctx->domain->elide_ctx_locks,
+					  &tx_ctx->wlock);
+			sock_tx_ctx_flush(tx_ctx);
+			sock_lock_release(tx_ctx->domain->elide_ctx_locks,
+					  &tx_ctx->wlock);
+		} else {
+			tx_ctx->batch_seen = tx_ctx->rbfd.rb.wpos;
+		}
+	}
 
 	/* check tx_ctx rbuf */
-	fastlock_acquire(&tx_ctx->rlock);
-	if (!rbfdempty(&tx_ctx->rbfd) && 
-	    pe->num_free_entries > SOCK_PE_MIN_ENTRIES) {
+	sock_lock_acquire(tx_ctx->domain->elide_ctx_locks, &tx_ctx->rlock);
+	while (!rbfdempty(&tx_ctx->rbfd) && 
+	       pe->num_free_entries > SOCK_PE_MIN_ENTRIES) {
 		/* new TX PE entry */
 		ret = sock_pe_new_tx_entry(pe, tx_ctx);
 		if (ret < 0) {
-			fastlock_release(&tx_ctx->rlock);
+			sock_lock_release(tx_ctx->domain->elide_ctx_locks,
+					  &tx_ctx->rlock);
 			goto out;
 		}
 	}
-	fastlock_release(&tx_ctx->rlock);
+	sock_lock_release(tx_ctx->domain->elide_ctx_locks, &tx_ctx->rlock);
 
-	/* progress tx_ctx in PE table */
+	/*
+	 * Small sends are only buffered in the connection while the entries
+	 * are progressed; flush when moving on to another connection so that
+	 * consecutive sends to the same peer go out in a single write.
+	 */
 	for (entry = tx_ctx->pe_entry_list.next;
 	    entry != &tx_ctx->pe_entry_list;) {
 		
 		pe_entry = container_of(entry, struct sock_pe_entry, ctx_entry);
 		entry = entry->next;
 
+		if (last_conn && pe_entry->conn != last_conn)
+			sock_comm_flush(last_conn);
+		last_conn = pe_entry->conn;
+
 		ret = sock_pe_progress_tx_entry(pe, tx_ctx, pe_entry);
 		if (ret < 0) {
 			SOCK_LOG_ERROR("Error in progressing %p\n", pe_entry);
@@ -2202,22 +2568,67 @@ int sock_pe_progress_tx_ctx(struct sock_pe *pe, struct sock_tx_ctx *tx_ctx)
 		if (pe_entry->is_complete) {
 			sock_pe_release_entry(pe, pe_entry);
 			SOCK_LOG_INFO("[%p] TX done\n", pe_entry);
+		} else if (pe_entry->conn && pe_entry->conn->credit_wait) {
+			credit_wait = 1;
 		}
 	}
+	if (last_conn)
+		sock_comm_flush(last_conn);
+
+	/*
+	 * Credits come back on the receive side; under manual progress make
+	 * sure they are read even if only the send queue is being polled.
+	 */
+	if (credit_wait && pe->domain->progress_mode == FI_PROGRESS_MANUAL &&
+	    tx_ctx->ep && tx_ctx->ep->rx_ctx && tx_ctx->ep->rx_ctx->enabled)
+		ret = _sock_pe_progress_rx_ctx(pe, tx_ctx->ep->rx_ctx);
 		
 out:	
 	if (ret < 0) 
 		SOCK_LOG_ERROR("failed to progress TX ctx\n");
-	fastlock_release(&pe->lock);
+	sock_lock_release(pe->domain->elide_pe_lock, &pe->lock);
 	return ret;
 }
 
-static void *sock_pe_progress_thread(void *data)
+int sock_pe_progress(struct sock_pe *pe)
 {
 	int ret;
 	struct dlist_entry *entry;
 	struct sock_tx_ctx *tx_ctx;
 	struct sock_rx_ctx *rx_ctx;
+
+	/* progress tx */
+	if (!dlistfd_empty(&pe->tx_list)) {
+		for (entry = pe->tx_list.list.next;
+		    entry != &pe->tx_list.list; entry = entry->next) {
+			tx_ctx = container_of(entry, struct sock_tx_ctx,
+					      pe_entry);
+			ret = sock_pe_progress_tx_ctx(pe, tx_ctx);
+			if (ret < 0) {
+				SOCK_LOG_ERROR("failed to progress TX\n");
+				return ret;
+			}
+		}
+	}
+
+	/* progress rx */
+	if (!dlistfd_empty(&pe->rx_list)) {
+		for (entry = pe->rx_list.list.next;
+		    entry != &pe->rx_list.list; entry = entry->next) {
+			rx_ctx = container_of(entry, struct sock_rx_ctx,
+					      pe_entry);
+			ret = sock_pe_progress_rx_ctx(pe, rx_ctx);
+			if (ret < 0) {
+				SOCK_LOG_ERROR("failed to progress RX\n");
+				return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+static void *sock_pe_progress_thread(void *data)
+{
 	struct sock_pe *pe = (struct sock_pe *)data;
 
 	SOCK_LOG_INFO("Progress thread started\n");
@@ -2227,36 +2638,9 @@ static void *sock_pe_progress_thread(void *data)
 			pthread_yield();
 			usleep(sock_progress_thread_wait * 1000);
 		}
-		
-		/* progress tx */
-		if (!dlistfd_empty(&pe->tx_list)) {
-			for (entry = pe->tx_list.list.next;
-			    entry != &pe->tx_list.list; entry = entry->next) {
-				tx_ctx = container_of(entry, struct sock_tx_ctx,
-						      pe_entry);
-				ret = sock_pe_progress_tx_ctx(pe, tx_ctx);
-				if (ret < 0) {
-					SOCK_LOG_ERROR(
-						   "failed to progress TX\n");
-					return NULL;
-				}
-			}
-		}
 
-		/* progress rx */
-		if (!dlistfd_empty(&pe->rx_list)) {
-			for (entry = pe->rx_list.list.next;
-			    entry != &pe->rx_list.list; entry = entry->next) {
-				rx_ctx = container_of(entry, struct sock_rx_ctx,
-						      pe_entry);
-				ret = sock_pe_progress_rx_ctx(pe, rx_ctx);
-				if (ret < 0) {
-					SOCK_LOG_ERROR(
-						   "failed to progress RX\n");
-					return NULL;
-				}
-			}
-		}
+		if (sock_pe_progress(pe) < 0)
+			return NULL;
 	}
 	
 	SOCK_LOG_INFO("Progress thread terminated\n");
@@ -2284,6 +2668,7 @@ static void sock_pe_init_table(
 
 struct sock_pe *sock_pe_init(struct sock_domain *domain)
 {
+	int flags;
 	struct sock_pe *pe = calloc(1, sizeof(struct sock_pe));
 	if (!pe)
 		return NULL;
@@ -2294,18 +2679,38 @@ struct sock_pe *sock_pe_init(struct sock_domain *domain)
 	fastlock_init(&pe->lock);
 	pe->domain = domain;
 
+	pe->epoll_fd = epoll_create(SOCK_PE_MAX_ENTRIES);
+	if (pe->epoll_fd < 0)
+		goto err1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pe->signal_fds) < 0)
+		goto err2;
+
+	flags = fcntl(pe->signal_fds[0], F_GETFL, 0);
+	if (fcntl(pe->signal_fds[0], F_SETFL, flags | O_NONBLOCK))
+		SOCK_LOG_ERROR("fcntl failed\n");
+	flags = fcntl(pe->signal_fds[1], F_GETFL, 0);
+	if (fcntl(pe->signal_fds[1], F_SETFL, flags | O_NONBLOCK))
+		SOCK_LOG_ERROR("fcntl failed\n");
+	sock_pe_poll_add(pe, pe->signal_fds[1]);
+
 	if (domain->progress_mode == FI_PROGRESS_AUTO) {
 		pe->do_progress = 1;
 		if (pthread_create(&pe->progress_thread, NULL, 
 				   sock_pe_progress_thread, (void *)pe)) {
 			SOCK_LOG_ERROR("Couldn't create progress thread\n");
-			goto err;
+			goto err3;
 		}
 	}
 	SOCK_LOG_INFO("PE init: OK\n");
 	return pe;
 
-err:
+err3:
+	close(pe->signal_fds[0]);
+	close(pe->signal_fds[1]);
+err2:
+	close(pe->epoll_fd);
+err1:
 	dlistfd_head_free(&pe->tx_list);
 	dlistfd_head_free(&pe->rx_list);
 
@@ -2321,6 +2726,9 @@ void sock_pe_finalize(struct sock_pe *pe)
 	}
 	
 	fastlock_destroy(&pe->lock);
+	close(pe->signal_fds[0]);
+	close(pe->signal_fds[1]);
+	close(pe->epoll_fd);
 
 	dlistfd_head_free(&pe->tx_list);
 	dlistfd_head_free(&pe->rx_list);
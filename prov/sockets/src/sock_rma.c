@@ -58,9 +58,9 @@
 #include "sock.h"
 #include "sock_util.h"
 
-static ssize_t sock_ep_rma_readmsg(struct fid_ep *ep, 
-					const struct fi_msg_rma *msg, 
-					uint64_t flags)
+ssize_t sock_ep_rma_readmsg(struct fid_ep *ep, 
+			    const struct fi_msg_rma *msg, 
+			    uint64_t flags)
 {
 	int ret, i;
 	struct sock_op tx_op;
@@ -86,6 +86,9 @@ static ssize_t sock_ep_rma_readmsg(struct fid_ep *ep,
 		return -FI_EINVAL;
 	}
 
+	if (flags & FI_TRIGGER)
+		return sock_queue_rma_op(ep, msg, flags, SOCK_OP_READ);
+
 	assert(tx_ctx->enabled && 
 	       msg->iov_count <= SOCK_EP_MAX_IOV_LIMIT &&
 	       msg->rma_iov_count <= SOCK_EP_MAX_IOV_LIMIT);
@@ -96,15 +99,17 @@ static ssize_t sock_ep_rma_readmsg(struct fid_ep *ep,
 		conn = sock_av_lookup_addr(tx_ctx->av, msg->addr);
 	}
 
-	if (!conn)
+	if (!conn) {
+		sock_stats_tx_inc(tx_ctx, sock_ep, FI_SOCK_STAT_EAGAIN);
 		return -FI_EAGAIN;
+	}
 
 	total_len = sizeof(struct sock_op_send) + 
 		(msg->iov_count * sizeof(union sock_iov)) +
 		(msg->rma_iov_count * sizeof(union sock_iov));
 
 	sock_tx_ctx_start(tx_ctx);
-	if (rbfdavail(&tx_ctx->rbfd) < total_len) {
+	if (sock_tx_ctx_avail(tx_ctx) < total_len) {
 		ret = -FI_EAGAIN;
 		goto err;
 	}
@@ -115,13 +120,8 @@ static ssize_t sock_ep_rma_readmsg(struct fid_ep *ep,
 	tx_op.src_iov_len = msg->rma_iov_count;
 	tx_op.dest_iov_len = msg->iov_count;
 
-	sock_tx_ctx_write(tx_ctx, &tx_op, sizeof(struct sock_op));
-	sock_tx_ctx_write(tx_ctx, &flags, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->context, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->addr, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &conn, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->msg_iov[0].iov_base, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &sock_ep, sizeof(uint64_t));
+	sock_tx_ctx_write_op(tx_ctx, &tx_op, flags, (uintptr_t) msg->context,
+			     msg->addr, (uintptr_t) msg->msg_iov[0].iov_base, sock_ep, conn);
 
 	if (flags & FI_REMOTE_CQ_DATA) {
 		sock_tx_ctx_write(tx_ctx, &msg->data, sizeof(uint64_t));
@@ -151,12 +151,12 @@ static ssize_t sock_ep_rma_readmsg(struct fid_ep *ep,
 		goto err;
 	}
 	
-	sock_tx_ctx_commit(tx_ctx);
+	sock_tx_ctx_commit(tx_ctx, sock_ep, flags);
 	return 0;
 
 err:
 	SOCK_LOG_INFO("Not enough space for TX entry, try again\n");
-	sock_tx_ctx_abort(tx_ctx);
+	sock_tx_ctx_abort(tx_ctx, sock_ep);
 	return ret;
 }
 
@@ -213,9 +213,9 @@ static ssize_t sock_ep_rma_readv(struct fid_ep *ep, const struct iovec *iov,
 	return sock_ep_rma_readmsg(ep, &msg, 0);
 }
 
-static ssize_t sock_ep_rma_writemsg(struct fid_ep *ep, 
-				     const struct fi_msg_rma *msg, 
-				     uint64_t flags)
+ssize_t sock_ep_rma_writemsg(struct fid_ep *ep, 
+			     const struct fi_msg_rma *msg, 
+			     uint64_t flags)
 {
 	int ret, i;
 	struct sock_op tx_op;
@@ -224,6 +224,9 @@ static ssize_t sock_ep_rma_writemsg(struct fid_ep *ep,
 	struct sock_tx_ctx *tx_ctx;
 	uint64_t total_len, src_len, dst_len;
 	struct sock_ep *sock_ep;
+	const struct iovec *src_iov = msg->msg_iov;
+	size_t src_count = msg->iov_count;
+	struct iovec bounce_iov;
 
 	switch (ep->fid.fclass) {
 	case FI_CLASS_EP:
@@ -241,6 +244,9 @@ static ssize_t sock_ep_rma_writemsg(struct fid_ep *ep,
 		return -FI_EINVAL;
 	}
 
+	if (flags & FI_TRIGGER)
+		return sock_queue_rma_op(ep, msg, flags, SOCK_OP_WRITE);
+
 	assert(tx_ctx->enabled && 
 	       msg->iov_count <= SOCK_EP_MAX_IOV_LIMIT &&
 	       msg->rma_iov_count <= SOCK_EP_MAX_IOV_LIMIT);
@@ -250,8 +256,10 @@ static ssize_t sock_ep_rma_writemsg(struct fid_ep *ep,
 		conn = sock_av_lookup_addr(tx_ctx->av, msg->addr);
 	}
 
-	if (!conn)
+	if (!conn) {
+		sock_stats_tx_inc(tx_ctx, sock_ep, FI_SOCK_STAT_EAGAIN);
 		return -FI_EAGAIN;
+	}
 
 	flags |= tx_ctx->attr.op_flags;
 	memset(&tx_op, 0, sizeof(struct sock_op));
@@ -263,29 +271,41 @@ static ssize_t sock_ep_rma_writemsg(struct fid_ep *ep,
 		for (i=0; i< msg->iov_count; i++) {
 			total_len += msg->msg_iov[i].iov_len;
 		}
-		assert(total_len <= SOCK_EP_MAX_INJECT_SZ);
+		if (total_len > tx_ctx->attr.inject_size)
+			return -FI_EINVAL;
+		if (total_len > SOCK_EP_MAX_INLINE_SZ) {
+			bounce_iov.iov_base = sock_tx_ctx_bounce_get(tx_ctx,
+					msg->msg_iov, msg->iov_count);
+			if (!bounce_iov.iov_base) {
+				sock_stats_tx_inc(tx_ctx, sock_ep,
+						  FI_SOCK_STAT_EAGAIN);
+				return -FI_EAGAIN;
+			}
+			bounce_iov.iov_len = total_len;
+			src_iov = &bounce_iov;
+			src_count = 1;
+			flags |= SOCK_INJECT_BOUNCE;
+		}
+	}
+
+	if (SOCK_INJECT_OK(flags)) {
 		tx_op.src_iov_len = total_len;
 	} else {
-		total_len += msg->iov_count * sizeof(union sock_iov);
-		tx_op.src_iov_len = msg->iov_count;
+		total_len = src_count * sizeof(union sock_iov);
+		tx_op.src_iov_len = src_count;
 	}
 
 	total_len += (sizeof(struct sock_op_send) +
 		      (msg->rma_iov_count * sizeof(union sock_iov)));
 
 	sock_tx_ctx_start(tx_ctx);
-	if (rbfdavail(&tx_ctx->rbfd) < total_len) {
+	if (sock_tx_ctx_avail(tx_ctx) < total_len) {
 		ret = -FI_EAGAIN;
 		goto err;
 	}
 	
-	sock_tx_ctx_write(tx_ctx, &tx_op, sizeof(struct sock_op));
-	sock_tx_ctx_write(tx_ctx, &flags, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->context, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->addr, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &conn, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &msg->msg_iov[0].iov_base, sizeof(uint64_t));
-	sock_tx_ctx_write(tx_ctx, &sock_ep, sizeof(uint64_t));
+	sock_tx_ctx_write_op(tx_ctx, &tx_op, flags, (uintptr_t) msg->context,
+			     msg->addr, (uintptr_t) src_iov[0].iov_base, sock_ep, conn);
 
 	if (flags & FI_REMOTE_CQ_DATA) {
 		sock_tx_ctx_write(tx_ctx, &msg->data, sizeof(uint64_t));
@@ -299,10 +319,11 @@ static ssize_t sock_ep_rma_writemsg(struct fid_ep *ep,
 			src_len += msg->msg_iov[i].iov_len;
 		}
 	} else {
-		for (i = 0; i< msg->iov_count; i++) {
-			tx_iov.iov.addr = (uint64_t)msg->msg_iov[i].iov_base;
-			tx_iov.iov.len = msg->msg_iov[i].iov_len;
-			tx_iov.iov.key = (uint64_t)msg->desc[i];
+		for (i = 0; i< src_count; i++) {
+			tx_iov.iov.addr = (uint64_t)src_iov[i].iov_base;
+			tx_iov.iov.len = src_iov[i].iov_len;
+			tx_iov.iov.key = (flags & SOCK_INJECT_BOUNCE) ? 0 :
+				(uint64_t)msg->desc[i];
 			sock_tx_ctx_write(tx_ctx, &tx_iov, sizeof(union sock_iov));
 			src_len += tx_iov.iov.len;
 		}
@@ -323,12 +344,14 @@ static ssize_t sock_ep_rma_writemsg(struct fid_ep *ep,
 		goto err;
 	}
 	
-	sock_tx_ctx_commit(tx_ctx);
+	sock_tx_ctx_commit(tx_ctx, sock_ep, flags);
 	return 0;
 
 err:
 	SOCK_LOG_INFO("Not enough space for TX entry, try again\n");
-	sock_tx_ctx_abort(tx_ctx);
+	sock_tx_ctx_abort(tx_ctx, sock_ep);
+	if (flags & SOCK_INJECT_BOUNCE)
+		sock_tx_ctx_bounce_put(tx_ctx, src_iov[0].iov_base);
 	return ret;
 }
 
@@ -66,17 +66,146 @@ void sock_rx_release_entry(struct sock_rx_entry *rx_entry)
 	free(rx_entry);
 }
 
+static struct dlist_entry *sock_rx_ctx_bucket(struct sock_rx_ctx *rx_ctx,
+					      uint64_t context)
+{
+	uint64_t hash = (context >> 3) * 0x9E3779B97F4A7C15ULL;
+	return &rx_ctx->ctx_hash[(hash >> 32) & rx_ctx->ctx_hash_mask];
+}
 
-struct sock_rx_entry *sock_rx_new_buffered_entry(struct sock_rx_ctx *rx_ctx,
-						 size_t len)
+/*
+ * Doubles the context hash once it holds more receives than buckets.
+ * Walking the old buckets in order keeps receives that share a context
+ * oldest first. If memory is short the chains just grow longer.
+ */
+static void sock_rx_ctx_grow_hash(struct sock_rx_ctx *rx_ctx)
 {
+	struct dlist_entry *old_hash, *bucket;
 	struct sock_rx_entry *rx_entry;
+	uint64_t i, old_mask;
 
-	if (rx_ctx->buffered_len + len >= rx_ctx->attr.total_buffered_recv) {
-		SOCK_LOG_ERROR("Reached max buffered recv limit\n");
-		return NULL;
+	old_hash = rx_ctx->ctx_hash;
+	old_mask = rx_ctx->ctx_hash_mask;
+	rx_ctx->ctx_hash = calloc(2 * (old_mask + 1), sizeof(*old_hash));
+	if (!rx_ctx->ctx_hash) {
+		rx_ctx->ctx_hash = old_hash;
+		return;
 	}
 
+	rx_ctx->ctx_hash_mask = 2 * old_mask + 1;
+	for (i = 0; i <= rx_ctx->ctx_hash_mask; i++)
+		dlist_init(&rx_ctx->ctx_hash[i]);
+
+	for (i = 0; i <= old_mask; i++) {
+		bucket = &old_hash[i];
+		while (!dlist_empty(bucket)) {
+			rx_entry = container_of(bucket->next,
+						struct sock_rx_entry, ctx_entry);
+			dlist_remove(&rx_entry->ctx_entry);
+			dlist_insert_tail(&rx_entry->ctx_entry,
+					  sock_rx_ctx_bucket(rx_ctx,
+							     rx_entry->context));
+		}
+	}
+	free(old_hash);
+}
+
+/* callers hold rx_ctx->lock */
+void sock_rx_ctx_post_entry(struct sock_rx_ctx *rx_ctx,
+			    struct sock_rx_entry *rx_entry)
+{
+	if (++rx_ctx->ctx_hash_cnt > rx_ctx->ctx_hash_mask + 1)
+		sock_rx_ctx_grow_hash(rx_ctx);
+
+	dlist_insert_tail(&rx_entry->entry, &rx_ctx->rx_entry_list);
+	dlist_insert_tail(&rx_entry->ctx_entry,
+			  sock_rx_ctx_bucket(rx_ctx, rx_entry->context));
+}
+
+/* takes a posted receive off the match list; callers hold rx_ctx->lock */
+void sock_rx_ctx_unlink_entry(struct sock_rx_ctx *rx_ctx,
+			      struct sock_rx_entry *rx_entry)
+{
+	dlist_remove(&rx_entry->entry);
+	dlist_remove(&rx_entry->ctx_entry);
+	rx_ctx->ctx_hash_cnt--;
+}
+
+static int sock_rx_cancelable(struct sock_rx_entry *rx_entry)
+{
+	return !rx_entry->is_busy && !rx_entry->pending;
+}
+
+/*
+ * Cancels the oldest posted receive with the given context, or every
+ * idle posted receive when all is set. Receives that have started to
+ * match stay in place. The FI_ECANCELED completions are written to the
+ * CQ in one batch once the receives are off the match lists.
+ */
+ssize_t sock_rx_ctx_cancel(struct sock_rx_ctx *rx_ctx, struct sock_comp *comp,
+			   void *context, int all)
+{
+	struct dlist_entry canceled, *bucket, *entry, *next;
+	struct sock_rx_entry *rx_entry;
+	ssize_t count = 0;
+
+	dlist_init(&canceled);
+	sock_lock_acquire(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
+	if (all) {
+		for (entry = rx_ctx->rx_entry_list.next;
+		     entry != &rx_ctx->rx_entry_list; entry = next) {
+			next = entry->next;
+			rx_entry = container_of(entry, struct sock_rx_entry,
+						entry);
+			if (!sock_rx_cancelable(rx_entry))
+				continue;
+
+			sock_rx_ctx_unlink_entry(rx_ctx, rx_entry);
+			dlist_insert_tail(&rx_entry->entry, &canceled);
+			count++;
+		}
+	} else {
+		bucket = sock_rx_ctx_bucket(rx_ctx, (uint64_t) context);
+		for (entry = bucket->next; entry != bucket;
+		     entry = entry->next) {
+			rx_entry = container_of(entry, struct sock_rx_entry,
+						ctx_entry);
+			if (rx_entry->context != (uint64_t) context ||
+			    !sock_rx_cancelable(rx_entry))
+				continue;
+
+			sock_rx_ctx_unlink_entry(rx_ctx, rx_entry);
+			dlist_insert_tail(&rx_entry->entry, &canceled);
+			count++;
+			break;
+		}
+	}
+	sock_lock_release(rx_ctx->domain->elide_ctx_locks, &rx_ctx->lock);
+
+	if (!count)
+		return all ? 0 : -FI_ENOENT;
+
+	if (comp && comp->recv_cq &&
+	    sock_cq_report_cancel(comp->recv_cq, &canceled) < count)
+		SOCK_LOG_ERROR("CQ overrun reporting canceled receives\n");
+
+	while (!dlist_empty(&canceled)) {
+		rx_entry = container_of(canceled.next, struct sock_rx_entry,
+					entry);
+		dlist_remove(&rx_entry->entry);
+		if (comp && comp->recv_cntr)
+			sock_cntr_err_inc(comp->recv_cntr);
+		sock_rx_release_entry(rx_entry);
+	}
+	return all ? count : 0;
+}
+
+
+struct sock_rx_entry *sock_rx_new_buffered_entry(struct sock_rx_ctx *rx_ctx,
+						 size_t len)
+{
+	struct sock_rx_entry *rx_entry;
+
 	rx_entry = calloc(1, sizeof(struct sock_rx_entry) + len);
 	if (!rx_entry)
 		return NULL;
@@ -102,6 +231,31 @@ inline size_t sock_rx_avail_len(struct sock_rx_entry *rx_entry)
 	return rx_entry->total_len - rx_entry->used;
 }
 
+/*
+ * Carves room for one message of len bytes out of a multi-recv buffer
+ * and returns its offset. Messages start SOCK_MULTI_RECV_ALIGN aligned
+ * and several may land at once, so the buffer is never marked busy;
+ * it stops matching once too little is left and the last message to
+ * finish releases it.
+ */
+uint64_t sock_rx_claim_multi_recv(struct sock_rx_ctx *rx_ctx,
+				  struct sock_rx_entry *rx_entry, size_t len)
+{
+	uint64_t offset = rx_entry->used;
+
+	rx_entry->used = MIN((offset + len + SOCK_MULTI_RECV_ALIGN - 1) &
+			     ~((uint64_t)SOCK_MULTI_RECV_ALIGN - 1),
+			     rx_entry->total_len);
+	rx_entry->pending++;
+
+	if (!sock_rx_avail_len(rx_entry) ||
+	    sock_rx_avail_len(rx_entry) < rx_ctx->min_multi_recv) {
+		sock_rx_ctx_unlink_entry(rx_ctx, rx_entry);
+		rx_entry->is_retired = 1;
+	}
+	return offset;
+}
+
 struct sock_rx_entry *sock_rx_get_entry(struct sock_rx_ctx *rx_ctx, 
 					uint64_t addr, uint64_t tag)
 {
@@ -127,7 +281,7 @@ struct sock_rx_entry *sock_rx_get_entry(struct sock_rx_ctx *rx_ctx,
 
 	if (entry == &rx_ctx->rx_entry_list)
 		rx_entry = NULL;
-	else
+	else if (!(rx_entry->flags & FI_MULTI_RECV))
 		rx_entry->is_busy = 1;
 	return rx_entry;
 }
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sock.h"
+#include "sock_util.h"
+
+int sock_stats_latency = 0;
+__thread int sock_stats_tid = -1;
+static int sock_stats_tids;
+
+int sock_stats_next_tid(void)
+{
+	return __atomic_fetch_add(&sock_stats_tids, 1, __ATOMIC_RELAXED) %
+		SOCK_STATS_SHARDS;
+}
+
+uint64_t sock_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sock_stats_record_latency(struct sock_domain *domain, int rx,
+			       uint64_t post_ns)
+{
+	struct sock_stats_shard *shard;
+	uint64_t *hist;
+	int bucket;
+
+	if (sock_stats_tid < 0)
+		sock_stats_tid = sock_stats_next_tid();
+	shard = &domain->stats.shard[sock_stats_tid];
+	hist = rx ? shard->rx_latency : shard->tx_latency;
+
+	bucket = fi_flsll(sock_stats_now() - post_ns) - 1;
+	if (bucket < 0)
+		bucket = 0;
+	else if (bucket >= FI_SOCK_STATS_HIST_SZ)
+		bucket = FI_SOCK_STATS_HIST_SZ - 1;
+	if (domain->elide_pe_lock)
+		hist[bucket]++;
+	else
+		__atomic_fetch_add(&hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static struct sock_domain *sock_stats_domain(struct fid *fid)
+{
+	if (fid->fclass != FI_CLASS_DOMAIN)
+		return NULL;
+	return container_of(fid, struct sock_domain, dom_fid.fid);
+}
+
+/* endpoints and CQs keep a plain counter array, no shards or gauges */
+static uint64_t *sock_stats_obj(struct fid *fid)
+{
+	switch (fid->fclass) {
+	case FI_CLASS_EP:
+	case FI_CLASS_SEP:
+		return container_of(fid, struct sock_ep, ep.fid)->stats;
+	case FI_CLASS_CQ:
+		return container_of(fid, struct sock_cq, cq_fid.fid)->stats;
+	default:
+		return NULL;
+	}
+}
+
+/* gauges are sampled from the progress engine state when read */
+static void sock_stats_read_pe(struct sock_domain *domain,
+			       struct fi_sock_stats *stats)
+{
+	struct sock_pe *pe = domain->pe;
+	struct sock_tx_ctx *tx_ctx;
+	struct sock_rx_ctx *rx_ctx;
+	struct sock_conn *conn;
+	struct dlist_entry *entry;
+	int i;
+
+	fastlock_acquire(&pe->lock);
+	stats->counter[FI_SOCK_STAT_PE_USED] =
+		SOCK_PE_MAX_ENTRIES - pe->num_free_entries;
+	stats->counter[FI_SOCK_STAT_PE_HIGH] = pe->max_used_entries;
+
+	for (entry = pe->tx_list.list.next; entry != &pe->tx_list.list;
+	     entry = entry->next) {
+		tx_ctx = container_of(entry, struct sock_tx_ctx, pe_entry);
+		stats->counter[FI_SOCK_STAT_TX_QUEUED] +=
+			tx_ctx->rbfd.rb.wpos - tx_ctx->rbfd.rb.rcnt;
+	}
+
+	for (entry = pe->rx_list.list.next; entry != &pe->rx_list.list;
+	     entry = entry->next) {
+		rx_ctx = container_of(entry, struct sock_rx_ctx, pe_entry);
+		stats->counter[FI_SOCK_STAT_BUFFERED] += rx_ctx->buffered_len;
+	}
+
+	fastlock_acquire(&domain->r_cmap.lock);
+	stats->counter[FI_SOCK_STAT_CONNS] = domain->r_cmap.used;
+	for (i = 0; i < domain->r_cmap.used; i++) {
+		conn = &domain->r_cmap.table[i];
+		stats->counter[FI_SOCK_STAT_TX_BYTES] += conn->tx_bytes;
+		stats->counter[FI_SOCK_STAT_RX_BYTES] += conn->rx_bytes;
+		stats->counter[FI_SOCK_STAT_SYSCALLS] += conn->syscalls;
+	}
+	fastlock_release(&domain->r_cmap.lock);
+	fastlock_release(&pe->lock);
+}
+
+static int sock_stats_read(struct fid *fid, struct fi_sock_stats *stats)
+{
+	struct sock_domain *domain;
+	struct sock_stats_shard *shard;
+	uint64_t *obj;
+	int i, j;
+
+	memset(stats, 0, sizeof *stats);
+	obj = sock_stats_obj(fid);
+	if (obj) {
+		for (j = 0; j < FI_SOCK_STAT_MAX; j++)
+			stats->counter[j] = obj[j];
+		return 0;
+	}
+
+	domain = sock_stats_domain(fid);
+	if (!domain)
+		return -FI_EINVAL;
+
+	for (i = 0; i < SOCK_STATS_SHARDS; i++) {
+		shard = &domain->stats.shard[i];
+		for (j = 0; j < FI_SOCK_STAT_MAX; j++)
+			stats->counter[j] += shard->counter[j];
+		for (j = 0; j < FI_SOCK_STATS_HIST_SZ; j++) {
+			stats->tx_latency[j] += shard->tx_latency[j];
+			stats->rx_latency[j] += shard->rx_latency[j];
+		}
+	}
+	sock_stats_read_pe(domain, stats);
+	return 0;
+}
+
+/* concurrent updates may survive a reset, which is fine for monitoring */
+static int sock_stats_reset(struct fid *fid)
+{
+	struct sock_domain *domain;
+	uint64_t *obj;
+	int i;
+
+	obj = sock_stats_obj(fid);
+	if (obj) {
+		memset(obj, 0, sizeof(*obj) * FI_SOCK_STAT_MAX);
+		return 0;
+	}
+
+	domain = sock_stats_domain(fid);
+	if (!domain)
+		return -FI_EINVAL;
+
+	memset(&domain->stats, 0, sizeof domain->stats);
+
+	fastlock_acquire(&domain->pe->lock);
+	domain->pe->max_used_entries =
+		SOCK_PE_MAX_ENTRIES - domain->pe->num_free_entries;
+	fastlock_acquire(&domain->r_cmap.lock);
+	for (i = 0; i < domain->r_cmap.used; i++) {
+		domain->r_cmap.table[i].tx_bytes = 0;
+		domain->r_cmap.table[i].rx_bytes = 0;
+		domain->r_cmap.table[i].syscalls = 0;
+	}
+	fastlock_release(&domain->r_cmap.lock);
+	fastlock_release(&domain->pe->lock);
+	return 0;
+}
+
+static int sock_stats_read_conn(struct fid *fid,
+				struct fi_sock_conn_stats *stats, size_t *count)
+{
+	struct sock_domain *domain;
+	struct sock_conn *conn;
+	int i;
+
+	domain = sock_stats_domain(fid);
+	if (!domain)
+		return -FI_EINVAL;
+
+	fastlock_acquire(&domain->pe->lock);
+	fastlock_acquire(&domain->r_cmap.lock);
+	for (i = 0; i < domain->r_cmap.used && i < *count; i++) {
+		conn = &domain->r_cmap.table[i];
+		memset(&stats[i].addr, 0, sizeof stats[i].addr);
+		memcpy(&stats[i].addr, &conn->addr, sizeof conn->addr);
+		stats[i].tx_bytes = conn->tx_bytes;
+		stats[i].rx_bytes = conn->rx_bytes;
+		stats[i].syscalls = conn->syscalls;
+	}
+	*count = domain->r_cmap.used;
+	fastlock_release(&domain->r_cmap.lock);
+	fastlock_release(&domain->pe->lock);
+	return 0;
+}
+
+static struct fi_sock_ops_stats sock_stats_ops = {
+	.size = sizeof(struct fi_sock_ops_stats),
+	.read = sock_stats_read,
+	.reset = sock_stats_reset,
+	.read_conn = sock_stats_read_conn,
+};
+
+int sock_stats_ops_open(struct fid *fid, void **ops)
+{
+	if (!sock_stats_domain(fid) && !sock_stats_obj(fid))
+		return -FI_ENOSYS;
+
+	*ops = &sock_stats_ops;
+	return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sock.h"
+#include "sock_util.h"
+
+int sock_trace_enabled = 0;
+uint64_t sock_trace_gen;
+__thread struct sock_trace_buf *sock_trace_buf;
+__thread uint64_t sock_trace_buf_gen;
+
+static char *sock_trace_path;
+static uint64_t sock_trace_tids;
+static struct dlist_entry sock_trace_list;
+static pthread_mutex_t sock_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Buffers outlive their threads so that the history of a thread that
+ * has exited is still in the dump; they are freed with the provider.
+ * Freeing them bumps the generation, so a thread that is still alive
+ * drops its stale pointer and allocates a new buffer on its next record.
+ */
+struct sock_trace_buf *sock_trace_buf_alloc(void)
+{
+	struct sock_trace_buf *buf;
+
+	sock_trace_buf = NULL;
+	buf = calloc(1, sizeof(*buf));
+	if (!buf) {
+		sock_trace_enabled = 0;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&sock_trace_lock);
+	buf->tid = ++sock_trace_tids;
+	dlist_insert_tail(&buf->entry, &sock_trace_list);
+	sock_trace_buf_gen = sock_trace_gen;
+	pthread_mutex_unlock(&sock_trace_lock);
+
+	sock_trace_buf = buf;
+	return buf;
+}
+
+/*
+ * Copies the records of a ring that may still be written: whatever the
+ * writer overwrote while the copy was taken is dropped, and so is the
+ * record in the slot it may be writing now, the one at index end.
+ */
+static int sock_trace_dump_buf(FILE *file, struct sock_trace_buf *buf,
+			       struct sock_trace_rec *copy)
+{
+	struct sock_trace_thread_hdr hdr;
+	uint64_t head, start, end, i;
+
+	head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+	start = (head > SOCK_TRACE_SZ) ? head - SOCK_TRACE_SZ : 0;
+	for (i = start; i < head; i++)
+		copy[i - start] = buf->rec[i & (SOCK_TRACE_SZ - 1)];
+
+	end = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+	hdr.tid = buf->tid;
+	hdr.dropped = start;
+	if (end >= SOCK_TRACE_SZ && end + 1 - SOCK_TRACE_SZ > start) {
+		hdr.dropped = MIN(end + 1 - SOCK_TRACE_SZ, head);
+		copy += hdr.dropped - start;
+	}
+	hdr.count = head - hdr.dropped;
+
+	if (fwrite(&hdr, sizeof hdr, 1, file) != 1 ||
+	    fwrite(copy, sizeof(*copy), hdr.count, file) != hdr.count)
+		return -FI_EIO;
+	return 0;
+}
+
+int sock_trace_dump(const char *path)
+{
+	struct sock_trace_file_hdr hdr;
+	struct sock_trace_rec *copy;
+	struct dlist_entry *entry;
+	FILE *file;
+	int ret = 0;
+
+	if (!path)
+		path = sock_trace_path;
+	if (!path)
+		return -FI_EINVAL;
+
+	copy = malloc(sizeof(*copy) * SOCK_TRACE_SZ);
+	if (!copy)
+		return -FI_ENOMEM;
+
+	file = fopen(path, "w");
+	if (!file) {
+		ret = -errno;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, SOCK_TRACE_MAGIC, sizeof hdr.magic);
+	hdr.version = SOCK_TRACE_VERSION;
+	hdr.rec_size = sizeof(struct sock_trace_rec);
+
+	pthread_mutex_lock(&sock_trace_lock);
+	for (entry = sock_trace_list.next; entry != &sock_trace_list;
+	     entry = entry->next)
+		hdr.num_threads++;
+
+	if (fwrite(&hdr, sizeof hdr, 1, file) != 1)
+		ret = -FI_EIO;
+	for (entry = sock_trace_list.next;
+	     !ret && entry != &sock_trace_list; entry = entry->next)
+		ret = sock_trace_dump_buf(file, container_of(entry,
+					  struct sock_trace_buf, entry), copy);
+	pthread_mutex_unlock(&sock_trace_lock);
+
+	if (fclose(file) && !ret)
+		ret = -FI_EIO;
+out:
+	free(copy);
+	if (ret)
+		SOCK_LOG_ERROR("failed to write trace to %s\n", path);
+	return ret;
+}
+
+static struct fi_sock_ops_trace sock_trace_ops = {
+	.size = sizeof(struct fi_sock_ops_trace),
+	.dump = sock_trace_dump,
+};
+
+int sock_trace_ops_open(struct fid *fid, void **ops)
+{
+	*ops = &sock_trace_ops;
+	return 0;
+}
+
+/* OFI_SOCK_TRACE=<file> enables tracing and names the dump at exit */
+void sock_trace_init(void)
+{
+	dlist_init(&sock_trace_list);
+	sock_trace_path = getenv("OFI_SOCK_TRACE");
+	sock_trace_enabled = sock_trace_path != NULL;
+}
+
+void sock_trace_fini(void)
+{
+	struct sock_trace_buf *buf;
+
+	if (!sock_trace_path)
+		return;
+
+	sock_trace_enabled = 0;
+	sock_trace_dump(NULL);
+
+	pthread_mutex_lock(&sock_trace_lock);
+	__atomic_store_n(&sock_trace_gen, sock_trace_gen + 1,
+			 __ATOMIC_RELEASE);
+	while (!dlist_empty(&sock_trace_list)) {
+		buf = container_of(sock_trace_list.next,
+				   struct sock_trace_buf, entry);
+		dlist_remove(&buf->entry);
+		free(buf);
+	}
+	pthread_mutex_unlock(&sock_trace_lock);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _SOCK_TRACE_H_
+#define _SOCK_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * On-disk format of the data path trace, shared with the fi_sock_trace
+ * decoder: a file header, then for every thread a thread header followed
+ * by its records, oldest first.
+ */
+#define SOCK_TRACE_MAGIC "SOCKTRC1"
+#define SOCK_TRACE_VERSION (1)
+
+enum {
+	SOCK_TRACE_TX_POST = 1,		/* tx_ctx, flags, bytes queued */
+	SOCK_TRACE_RX_POST,		/* rx_ctx, context, length */
+	SOCK_TRACE_WIRE_SEND,		/* fd, length, bytes sent */
+	SOCK_TRACE_WIRE_RECV,		/* fd, length, bytes received */
+	SOCK_TRACE_MATCH,		/* rx_ctx, tag, context */
+	SOCK_TRACE_UNEXPECTED,		/* rx_ctx, tag, length */
+	SOCK_TRACE_TX_COMP,		/* context, length, flags */
+	SOCK_TRACE_RX_COMP,		/* context, length, tag */
+	SOCK_TRACE_MAX
+};
+
+struct sock_trace_rec {
+	uint64_t ts;			/* CLOCK_MONOTONIC, ns */
+	uint32_t event;
+	uint32_t reserved;
+	uint64_t arg[3];
+};
+
+struct sock_trace_file_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+	uint64_t num_threads;
+};
+
+struct sock_trace_thread_hdr {
+	uint64_t tid;
+	uint64_t count;
+	uint64_t dropped;		/* overwritten before the dump */
+};
+
+#endif /* _SOCK_TRACE_H_ */
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sock.h"
+#include "sock_util.h"
+
+static struct sock_cntr *sock_trigger_get_cntr(void *context, size_t *threshold)
+{
+	struct fi_triggered_context *trigger_context = context;
+
+	if (!trigger_context || 
+	    trigger_context->event_type != FI_TRIGGER_THRESHOLD ||
+	    !trigger_context->trigger.threshold.cntr)
+		return NULL;
+
+	*threshold = trigger_context->trigger.threshold.threshold;
+	return container_of(trigger_context->trigger.threshold.cntr,
+			    struct sock_cntr, cntr_fid);
+}
+
+static struct sock_tx_ctx *sock_trigger_get_tx_ctx(struct fid_ep *ep)
+{
+	switch (ep->fid.fclass) {
+	case FI_CLASS_EP:
+		return container_of(ep, struct sock_ep, ep)->tx_ctx;
+	case FI_CLASS_TX_CTX:
+		return container_of(ep, struct sock_tx_ctx, fid.ctx);
+	default:
+		SOCK_LOG_ERROR("Invalid EP type\n");
+		return NULL;
+	}
+}
+
+/*
+ * An inject payload is copied when the op is queued, into space
+ * allocated behind the trigger; len is the payload length.
+ */
+static int sock_trigger_alloc(struct fid_ep *ep, uint64_t flags,
+			      uint8_t op_type, size_t len,
+			      struct sock_trigger **trigger)
+{
+	struct sock_tx_ctx *tx_ctx;
+
+	tx_ctx = sock_trigger_get_tx_ctx(ep);
+	if (!tx_ctx)
+		return -FI_EINVAL;
+
+	flags = (flags | tx_ctx->attr.op_flags) & ~FI_TRIGGER;
+	if (!SOCK_INJECT_OK(flags))
+		len = 0;
+	else if (len > tx_ctx->attr.inject_size)
+		return -FI_EINVAL;
+
+	*trigger = calloc(1, sizeof(**trigger) + len);
+	if (!*trigger)
+		return -FI_ENOMEM;
+
+	(*trigger)->op_type = op_type;
+	(*trigger)->ep = ep;
+	(*trigger)->tx_ctx = tx_ctx;
+	(*trigger)->flags = flags;
+	dlist_init(&(*trigger)->entry);
+	return 0;
+}
+
+static ssize_t sock_trigger_post(struct sock_trigger *trigger)
+{
+	switch (trigger->op_type) {
+	case SOCK_OP_SEND:
+		return sock_ep_sendmsg(trigger->ep, &trigger->op.msg, 
+				       trigger->flags);
+	case SOCK_OP_TSEND:
+		return sock_ep_tsendmsg(trigger->ep, &trigger->op.tmsg, 
+					trigger->flags);
+	case SOCK_OP_WRITE:
+		return sock_ep_rma_writemsg(trigger->ep, &trigger->op.rma, 
+					    trigger->flags);
+	case SOCK_OP_READ:
+		return sock_ep_rma_readmsg(trigger->ep, &trigger->op.rma, 
+					   trigger->flags);
+	case SOCK_OP_ATOMIC:
+		return sock_ep_tx_atomic(trigger->ep, &trigger->op.atomic,
+					 trigger->compare_count ? 
+					 trigger->comparev : NULL, NULL,
+					 trigger->compare_count,
+					 trigger->result_count ?
+					 trigger->resultv : NULL, NULL,
+					 trigger->result_count, trigger->flags);
+	default:
+		SOCK_LOG_ERROR("Invalid triggered op\n");
+		return -FI_EINVAL;
+	}
+}
+
+/*
+ * Operations released while the tx ring is full are parked on the tx
+ * context, in order, and reposted by the progress engine.
+ */
+void sock_trigger_release(struct sock_trigger *trigger)
+{
+	ssize_t ret;
+	struct sock_tx_ctx *tx_ctx = trigger->tx_ctx;
+
+	sock_lock_acquire(tx_ctx->domain->elide_ctx_locks, &tx_ctx->wlock);
+	if (!dlist_empty(&tx_ctx->trigger_list)) {
+		dlist_insert_tail(&trigger->entry, &tx_ctx->trigger_list);
+		sock_lock_release(tx_ctx->domain->elide_ctx_locks,
+				  &tx_ctx->wlock);
+		return;
+	}
+	sock_lock_release(tx_ctx->domain->elide_ctx_locks, &tx_ctx->wlock);
+
+	ret = sock_trigger_post(trigger);
+	if (ret == -FI_EAGAIN) {
+		sock_lock_acquire(tx_ctx->domain->elide_ctx_locks,
+				  &tx_ctx->wlock);
+		dlist_insert_head(&trigger->entry, &tx_ctx->trigger_list);
+		sock_lock_release(tx_ctx->domain->elide_ctx_locks,
+				  &tx_ctx->wlock);
+		return;
+	}
+
+	if (ret)
+		SOCK_LOG_ERROR("Failed to post triggered op: %zd\n", ret);
+	free(trigger);
+}
+
+void sock_tx_ctx_progress_triggers(struct sock_tx_ctx *tx_ctx)
+{
+	ssize_t ret;
+	struct sock_trigger *trigger;
+
+	sock_lock_acquire(tx_ctx->domain->elide_ctx_locks, &tx_ctx->wlock);
+	while (!dlist_empty(&tx_ctx->trigger_list)) {
+		trigger = container_of(tx_ctx->trigger_list.next, 
+				       struct sock_trigger, entry);
+		dlist_remove(&trigger->entry);
+		sock_lock_release(tx_ctx->domain->elide_ctx_locks,
+				  &tx_ctx->wlock);
+
+		ret = sock_trigger_post(trigger);
+
+		sock_lock_acquire(tx_ctx->domain->elide_ctx_locks,
+				  &tx_ctx->wlock);
+		if (ret == -FI_EAGAIN) {
+			dlist_insert_head(&trigger->entry, &tx_ctx->trigger_list);
+			break;
+		}
+
+		if (ret)
+			SOCK_LOG_ERROR("Failed to post triggered op: %zd\n", ret);
+		free(trigger);
+	}
+	sock_lock_release(tx_ctx->domain->elide_ctx_locks, &tx_ctx->wlock);
+}
+
+void sock_trigger_free_list(struct dlist_entry *list)
+{
+	struct dlist_entry *entry;
+
+	while (!dlist_empty(list)) {
+		entry = list->next;
+		dlist_remove(entry);
+		free(container_of(entry, struct sock_trigger, entry));
+	}
+}
+
+/* 
+ * Triggers are kept sorted by threshold, FIFO among equal thresholds;
+ * the list is protected by the counter's mutex so that sock_cntr_inc()
+ * can never miss a newly queued op.
+ */
+static ssize_t sock_trigger_queue(struct sock_trigger *trigger, void *context)
+{
+	ssize_t ret;
+	struct dlist_entry *entry;
+	struct sock_trigger *curr;
+	struct sock_cntr *cntr;
+
+	cntr = sock_trigger_get_cntr(context, &trigger->threshold);
+	if (!cntr) {
+		free(trigger);
+		return -FI_EINVAL;
+	}
+
+	pthread_mutex_lock(&cntr->mut);
+	if (atomic_get(&cntr->value) >= trigger->threshold) {
+		pthread_mutex_unlock(&cntr->mut);
+		ret = sock_trigger_post(trigger);
+		free(trigger);
+		return ret;
+	}
+
+	for (entry = cntr->trigger_list.prev; entry != &cntr->trigger_list;
+	     entry = entry->prev) {
+		curr = container_of(entry, struct sock_trigger, entry);
+		if (curr->threshold <= trigger->threshold)
+			break;
+	}
+	dlist_insert_after(&trigger->entry, entry);
+	pthread_mutex_unlock(&cntr->mut);
+	return 0;
+}
+
+static size_t sock_trigger_iov_len(const struct iovec *iov, size_t count)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < count; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static size_t sock_trigger_copy_inject(struct sock_trigger *trigger,
+				       const struct iovec *iov, size_t count)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < count; i++) {
+		memcpy(trigger->inject + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	trigger->msg_iov.iov[0].iov_base = trigger->inject;
+	trigger->msg_iov.iov[0].iov_len = len;
+	return 1;
+}
+
+static size_t sock_trigger_copy_iov(struct sock_trigger *trigger, 
+				    const struct iovec *iov, void **desc,
+				    size_t count)
+{
+	if (SOCK_INJECT_OK(trigger->flags))
+		return sock_trigger_copy_inject(trigger, iov, count);
+
+	memcpy(trigger->msg_iov.iov, iov, count * sizeof(*iov));
+	if (desc)
+		memcpy(trigger->desc, desc, count * sizeof(*desc));
+	return count;
+}
+
+ssize_t sock_queue_msg_op(struct fid_ep *ep, const struct fi_msg *msg,
+			  uint64_t flags)
+{
+	struct sock_trigger *trigger;
+	int ret;
+
+	if (msg->iov_count > SOCK_EP_MAX_IOV_LIMIT)
+		return -FI_EINVAL;
+
+	ret = sock_trigger_alloc(ep, flags, SOCK_OP_SEND,
+				 sock_trigger_iov_len(msg->msg_iov,
+						      msg->iov_count),
+				 &trigger);
+	if (ret)
+		return ret;
+
+	trigger->op.msg = *msg;
+	trigger->op.msg.msg_iov = trigger->msg_iov.iov;
+	trigger->op.msg.desc = trigger->desc;
+	trigger->op.msg.iov_count = sock_trigger_copy_iov(trigger, msg->msg_iov,
+							  msg->desc, 
+							  msg->iov_count);
+	return sock_trigger_queue(trigger, msg->context);
+}
+
+ssize_t sock_queue_tmsg_op(struct fid_ep *ep, const struct fi_msg_tagged *msg,
+			   uint64_t flags)
+{
+	struct sock_trigger *trigger;
+	int ret;
+
+	if (msg->iov_count > SOCK_EP_MAX_IOV_LIMIT)
+		return -FI_EINVAL;
+
+	ret = sock_trigger_alloc(ep, flags, SOCK_OP_TSEND,
+				 sock_trigger_iov_len(msg->msg_iov,
+						      msg->iov_count),
+				 &trigger);
+	if (ret)
+		return ret;
+
+	trigger->op.tmsg = *msg;
+	trigger->op.tmsg.msg_iov = trigger->msg_iov.iov;
+	trigger->op.tmsg.desc = trigger->desc;
+	trigger->op.tmsg.iov_count = sock_trigger_copy_iov(trigger, 
+							   msg->msg_iov,
+							   msg->desc, 
+							   msg->iov_count);
+	return sock_trigger_queue(trigger, msg->context);
+}
+
+ssize_t sock_queue_rma_op(struct fid_ep *ep, const struct fi_msg_rma *msg,
+			  uint64_t flags, uint8_t op_type)
+{
+	struct sock_trigger *trigger;
+	int ret;
+
+	if (msg->iov_count > SOCK_EP_MAX_IOV_LIMIT ||
+	    msg->rma_iov_count > SOCK_EP_MAX_IOV_LIMIT)
+		return -FI_EINVAL;
+
+	ret = sock_trigger_alloc(ep, flags, op_type,
+				 sock_trigger_iov_len(msg->msg_iov,
+						      msg->iov_count),
+				 &trigger);
+	if (ret)
+		return ret;
+
+	trigger->op.rma = *msg;
+	trigger->op.rma.msg_iov = trigger->msg_iov.iov;
+	trigger->op.rma.desc = trigger->desc;
+	trigger->op.rma.rma_iov = trigger->rma_iov.iov;
+	trigger->op.rma.iov_count = sock_trigger_copy_iov(trigger, msg->msg_iov,
+							  msg->desc, 
+							  msg->iov_count);
+	memcpy(trigger->rma_iov.iov, msg->rma_iov, 
+	       msg->rma_iov_count * sizeof(*msg->rma_iov));
+	return sock_trigger_queue(trigger, msg->context);
+}
+
+ssize_t sock_queue_atomic_op(struct fid_ep *ep, const struct fi_msg_atomic *msg,
+			     const struct fi_ioc *comparev, size_t compare_count,
+			     struct fi_ioc *resultv, size_t result_count,
+			     uint64_t flags)
+{
+	size_t i, len, datatype_sz;
+	struct sock_trigger *trigger;
+	int ret;
+
+	if (msg->iov_count > SOCK_EP_MAX_IOV_LIMIT ||
+	    msg->rma_iov_count > SOCK_EP_MAX_IOV_LIMIT ||
+	    compare_count > SOCK_EP_MAX_IOV_LIMIT ||
+	    result_count > SOCK_EP_MAX_IOV_LIMIT)
+		return -FI_EINVAL;
+
+	datatype_sz = fi_datatype_size(msg->datatype);
+	for (i = 0, len = 0; i < msg->iov_count; i++)
+		len += msg->msg_iov[i].count * datatype_sz;
+
+	ret = sock_trigger_alloc(ep, flags, SOCK_OP_ATOMIC, len, &trigger);
+	if (ret)
+		return ret;
+
+	/* atomic injects only travel inline, as in sock_ep_tx_atomic */
+	if (SOCK_INJECT_OK(trigger->flags) && len > SOCK_EP_MAX_INLINE_SZ) {
+		free(trigger);
+		return -FI_EINVAL;
+	}
+
+	trigger->op.atomic = *msg;
+	trigger->op.atomic.msg_iov = trigger->msg_iov.ioc;
+	trigger->op.atomic.desc = trigger->desc;
+	trigger->op.atomic.rma_iov = trigger->rma_iov.ioc;
+
+	if (SOCK_INJECT_OK(trigger->flags)) {
+		for (i = 0, len = 0; i < msg->iov_count; i++) {
+			memcpy(trigger->inject + len, msg->msg_iov[i].addr, 
+			       msg->msg_iov[i].count * datatype_sz);
+			len += msg->msg_iov[i].count * datatype_sz;
+		}
+		trigger->msg_iov.ioc[0].addr = trigger->inject;
+		trigger->msg_iov.ioc[0].count = len / datatype_sz;
+		trigger->op.atomic.iov_count = 1;
+	} else {
+		memcpy(trigger->msg_iov.ioc, msg->msg_iov, 
+		       msg->iov_count * sizeof(*msg->msg_iov));
+		if (msg->desc)
+			memcpy(trigger->desc, msg->desc, 
+			       msg->iov_count * sizeof(*msg->desc));
+	}
+
+	memcpy(trigger->rma_iov.ioc, msg->rma_iov, 
+	       msg->rma_iov_count * sizeof(*msg->rma_iov));
+	if (compare_count)
+		memcpy(trigger->comparev, comparev, 
+		       compare_count * sizeof(*comparev));
+	if (result_count)
+		memcpy(trigger->resultv, resultv, 
+		       result_count * sizeof(*resultv));
+	trigger->compare_count = compare_count;
+	trigger->result_count = result_count;
+	return sock_trigger_queue(trigger, msg->context);
+}
@@ -40,12 +40,23 @@
 #define SOCK_INFO (3)
 
 extern useconds_t sock_progress_thread_wait;
+extern int sock_stats_latency;
 
 extern const char sock_fab_name[];
 extern const char sock_dom_name[];
 extern const char sock_prov_name[];
 
+/* informational logging sits on the data path; keep it to debug builds */
+#if ENABLE_DEBUG
 #define SOCK_LOG_INFO(...) FI_LOG(SOCK_INFO, sock_prov_name, __VA_ARGS__)
+#else
+#define SOCK_LOG_INFO(...)						\
+	do {								\
+		if (0)							\
+			fi_log_impl(SOCK_INFO, sock_prov_name, __func__,\
+				    __LINE__, __VA_ARGS__);		\
+	} while (0)
+#endif
 
 #define SOCK_LOG_WARN(...) FI_WARN(sock_prov_name, __VA_ARGS__)
 
@@ -34,9 +34,12 @@
 #  include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "sock.h"
 #include "sock_util.h"
@@ -75,6 +78,7 @@ int sock_wait_get_obj(struct fid_wait *fid, void *arg)
 static int sock_wait_init(struct sock_wait *wait, enum fi_wait_obj type)
 {
 	long flags = 0;
+	struct epoll_event event;
 	wait->type = type;
 	
 	switch (type) {
@@ -88,6 +92,24 @@ static int sock_wait_init(struct sock_wait *wait, enum fi_wait_obj type)
 			close(wait->wobj.fd[WAIT_WRITE_FD]);
 			return -errno;
 		}
+
+		wait->epoll_fd = epoll_create(SOCK_WAIT_MAX_EVENTS);
+		if (wait->epoll_fd < 0) {
+			close(wait->wobj.fd[WAIT_READ_FD]);
+			close(wait->wobj.fd[WAIT_WRITE_FD]);
+			return -errno;
+		}
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(wait->epoll_fd, EPOLL_CTL_ADD,
+			      wait->wobj.fd[WAIT_READ_FD], &event)) {
+			close(wait->epoll_fd);
+			close(wait->wobj.fd[WAIT_READ_FD]);
+			close(wait->wobj.fd[WAIT_WRITE_FD]);
+			return -errno;
+		}
 		break;
 		
 	case FI_WAIT_MUTEX_COND:
@@ -102,6 +124,190 @@ static int sock_wait_init(struct sock_wait *wait, enum fi_wait_obj type)
 	return 0;
 }
 
+static struct sock_domain *sock_wait_fid_domain(struct fid *fid)
+{
+	switch (fid->fclass) {
+	case FI_CLASS_CQ:
+		return container_of(fid, struct sock_cq, cq_fid)->domain;
+	case FI_CLASS_CNTR:
+		return container_of(fid, struct sock_cntr, cntr_fid)->domain;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * Members needing manual progress contribute their domain's readiness
+ * set to the wait set's epoll fd, so a wait only progresses a domain
+ * once one of its rings or connections has become readable.
+ */
+static int sock_wait_add_pe(struct sock_wait *wait, struct sock_pe *pe)
+{
+	struct dlist_entry *p;
+	struct sock_wait_pe *wait_pe;
+	struct epoll_event event;
+
+	for (p = wait->pe_list.next; p != &wait->pe_list; p = p->next) {
+		wait_pe = container_of(p, struct sock_wait_pe, entry);
+		if (wait_pe->pe == pe) {
+			wait_pe->ref++;
+			return 0;
+		}
+	}
+
+	wait_pe = calloc(1, sizeof(*wait_pe));
+	if (!wait_pe)
+		return -FI_ENOMEM;
+
+	/* edge-triggered for the reasons given at sock_pe_wait_open */
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = pe;
+	if (epoll_ctl(wait->epoll_fd, EPOLL_CTL_ADD, pe->epoll_fd, &event)) {
+		free(wait_pe);
+		return -errno;
+	}
+
+	wait_pe->pe = pe;
+	wait_pe->ref = 1;
+	dlist_insert_tail(&wait_pe->entry, &wait->pe_list);
+	return 0;
+}
+
+static void sock_wait_del_pe(struct sock_wait *wait, struct sock_pe *pe)
+{
+	struct dlist_entry *p;
+	struct sock_wait_pe *wait_pe;
+
+	for (p = wait->pe_list.next; p != &wait->pe_list; p = p->next) {
+		wait_pe = container_of(p, struct sock_wait_pe, entry);
+		if (wait_pe->pe != pe)
+			continue;
+
+		if (--wait_pe->ref == 0) {
+			epoll_ctl(wait->epoll_fd, EPOLL_CTL_DEL,
+				  pe->epoll_fd, NULL);
+			dlist_remove(&wait_pe->entry);
+			free(wait_pe);
+		}
+		return;
+	}
+}
+
+int sock_wait_add_fid(struct fid_wait *wait_fid, struct fid *fid)
+{
+	int ret = 0;
+	struct sock_wait *wait;
+	struct sock_domain *domain;
+	struct sock_fid_list *list_entry;
+
+	wait = container_of(wait_fid, struct sock_wait, wait_fid);
+	list_entry = calloc(1, sizeof(*list_entry));
+	if (!list_entry)
+		return -FI_ENOMEM;
+
+	dlist_init(&list_entry->entry);
+	list_entry->fid = fid;
+
+	fastlock_acquire(&wait->lock);
+	domain = sock_wait_fid_domain(fid);
+	if (wait->type == FI_WAIT_FD && domain &&
+	    domain->progress_mode == FI_PROGRESS_MANUAL) {
+		ret = sock_wait_add_pe(wait, domain->pe);
+		if (ret) {
+			fastlock_release(&wait->lock);
+			free(list_entry);
+			return ret;
+		}
+	}
+	dlist_insert_after(&list_entry->entry, &wait->fid_list);
+	fastlock_release(&wait->lock);
+	return 0;
+}
+
+void sock_wait_del_fid(struct fid_wait *wait_fid, struct fid *fid)
+{
+	struct sock_wait *wait;
+	struct sock_domain *domain;
+	struct sock_fid_list *list_item;
+	struct dlist_entry *p, *head;
+
+	wait = container_of(wait_fid, struct sock_wait, wait_fid);
+	fastlock_acquire(&wait->lock);
+	head = &wait->fid_list;
+	for (p = head->next; p != head; p = p->next) {
+		list_item = container_of(p, struct sock_fid_list, entry);
+		if (list_item->fid != fid)
+			continue;
+
+		domain = sock_wait_fid_domain(fid);
+		if (wait->type == FI_WAIT_FD && domain &&
+		    domain->progress_mode == FI_PROGRESS_MANUAL)
+			sock_wait_del_pe(wait, domain->pe);
+		dlist_remove(p);
+		free(list_item);
+		break;
+	}
+	fastlock_release(&wait->lock);
+}
+
+static int sock_wait_wait_fd(struct sock_wait *wait, int timeout)
+{
+	int i, ret, signaled = 0, wait_ms;
+	uint64_t end_ms = 0;
+	int64_t left;
+	char tmp[SOCK_WAIT_MAX_EVENTS];
+	struct dlist_entry *p;
+	struct sock_wait_pe *wait_pe;
+	struct epoll_event events[SOCK_WAIT_MAX_EVENTS];
+
+	if (timeout >= 0)
+		end_ms = fi_gettime_ms() + timeout;
+
+	while (!signaled) {
+		wait_ms = timeout;
+		if (timeout >= 0) {
+			left = (int64_t) (end_ms - fi_gettime_ms());
+			wait_ms = left < 0 ? 0 : (int) left;
+		}
+
+		/* in-flight entries may be waiting for socket space */
+		fastlock_acquire(&wait->lock);
+		for (p = wait->pe_list.next; p != &wait->pe_list; p = p->next) {
+			wait_pe = container_of(p, struct sock_wait_pe, entry);
+			if (!dlist_empty(&wait_pe->pe->busy_list)) {
+				sock_pe_progress(wait_pe->pe);
+				wait_ms = (wait_ms < 0) ? 1 : MIN(wait_ms, 1);
+			}
+		}
+		fastlock_release(&wait->lock);
+
+		ret = epoll_wait(wait->epoll_fd, events, SOCK_WAIT_MAX_EVENTS,
+				 wait_ms);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		for (i = 0; i < ret; i++) {
+			if (events[i].data.ptr) {
+				sock_pe_drain_signal(events[i].data.ptr);
+				sock_pe_progress(events[i].data.ptr);
+			} else {
+				signaled = 1;
+			}
+		}
+
+		if (!signaled && timeout >= 0 && fi_gettime_ms() >= end_ms)
+			return -FI_ETIMEDOUT;
+	}
+
+	while (read(wait->wobj.fd[WAIT_READ_FD], tmp, sizeof(tmp)) > 0)
+		;
+	return 0;
+}
+
 static int sock_wait_wait(struct fid_wait *wait_fid, int timeout)
 {
 	int err = 0;
@@ -114,6 +320,9 @@ static int sock_wait_wait(struct fid_wait *wait_fid, int timeout)
 	struct sock_fid_list *list_item;
 	
 	wait = container_of(wait_fid, struct sock_wait, wait_fid);
+	if (wait->type == FI_WAIT_FD)
+		return sock_wait_wait_fd(wait, timeout);
+
 	if (timeout > 0) {
 		gettimeofday(&now, NULL);
 		start_ms = (double)now.tv_sec * 1000.0 +
@@ -146,14 +355,6 @@ static int sock_wait_wait(struct fid_wait *wait_fid, int timeout)
 	}
 
 	switch (wait->type) {
-	case FI_WAIT_FD:
-		err = fi_poll_fd(wait->wobj.fd[WAIT_READ_FD], timeout);
-		if (err > 0)
-			err = 0;
-		else if (err == 0)
-			err = -FI_ETIMEDOUT;
-		break;
-		
 	case FI_WAIT_MUTEX_COND:
 		err = fi_wait_cond(&wait->wobj.mutex_cond.cond,
 				   &wait->wobj.mutex_cond.mutex, timeout);
@@ -227,10 +428,19 @@ int sock_wait_close(fid_t fid)
 		free(list_item);
 	}
 
+	head = &wait->pe_list;
+	while (!dlist_empty(head)) {
+		p = head->next;
+		dlist_remove(p);
+		free(container_of(p, struct sock_wait_pe, entry));
+	}
+
 	if (wait->type == FI_WAIT_FD) {
+		close(wait->epoll_fd);
 		close(wait->wobj.fd[WAIT_READ_FD]);
 		close(wait->wobj.fd[WAIT_WRITE_FD]);
 	}
+	fastlock_destroy(&wait->lock);
 
 	atomic_dec(&wait->fab->ref);
 	free(wait);
@@ -282,9 +492,14 @@ int sock_wait_open(struct fid_fabric *fabric, struct fi_wait_attr *attr,
 	wait = calloc(1, sizeof(*wait));
 	if (!wait)
 		return -FI_ENOMEM;
+
+	dlist_init(&wait->fid_list);
+	dlist_init(&wait->pe_list);
+	fastlock_init(&wait->lock);
 	
 	err = sock_wait_init(wait, wait_obj_type);
 	if (err) {
+		fastlock_destroy(&wait->lock);
 		free(wait);
 		return err;
 	}
@@ -296,7 +511,6 @@ int sock_wait_open(struct fid_fabric *fabric, struct fi_wait_attr *attr,
 	wait->fab = fab;
 	wait->type = wait_obj_type;
 	atomic_inc(&fab->ref);
-	dlist_init(&wait->fid_list);
 
 	*waitset = &wait->wait_fid;
 	return 0;
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2014 Intel Corporation, Inc.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Decoder for the sockets provider data path trace: merges the per-thread
+ * rings of a trace file by timestamp and prints one event per line.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sock_trace.h"
+
+struct trace_event {
+	uint64_t tid;
+	struct sock_trace_rec rec;
+};
+
+static const char *event_names[SOCK_TRACE_MAX] = {
+	[SOCK_TRACE_TX_POST] = "tx_post",
+	[SOCK_TRACE_RX_POST] = "rx_post",
+	[SOCK_TRACE_WIRE_SEND] = "wire_send",
+	[SOCK_TRACE_WIRE_RECV] = "wire_recv",
+	[SOCK_TRACE_MATCH] = "match",
+	[SOCK_TRACE_UNEXPECTED] = "unexpected",
+	[SOCK_TRACE_TX_COMP] = "tx_comp",
+	[SOCK_TRACE_RX_COMP] = "rx_comp",
+};
+
+static const char *arg_names[SOCK_TRACE_MAX][3] = {
+	[SOCK_TRACE_TX_POST] = { "tx_ctx", "flags", "queued" },
+	[SOCK_TRACE_RX_POST] = { "rx_ctx", "context", "len" },
+	[SOCK_TRACE_WIRE_SEND] = { "fd", "len", "ret" },
+	[SOCK_TRACE_WIRE_RECV] = { "fd", "len", "ret" },
+	[SOCK_TRACE_MATCH] = { "rx_ctx", "tag", "context" },
+	[SOCK_TRACE_UNEXPECTED] = { "rx_ctx", "tag", "len" },
+	[SOCK_TRACE_TX_COMP] = { "context", "len", "flags" },
+	[SOCK_TRACE_RX_COMP] = { "context", "len", "tag" },
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s] <trace file>\n", name);
+	fprintf(stderr, "  -s  print event counts only\n");
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct trace_event *ea = a, *eb = b;
+
+	if (ea->rec.ts != eb->rec.ts)
+		return ea->rec.ts < eb->rec.ts ? -1 : 1;
+	return ea->tid < eb->tid ? -1 : (ea->tid > eb->tid);
+}
+
+static int is_pointer_arg(uint32_t event, int arg)
+{
+	const char *name = arg_names[event][arg];
+
+	return !strcmp(name, "tx_ctx") || !strcmp(name, "rx_ctx") ||
+	       !strcmp(name, "context") || !strcmp(name, "flags") ||
+	       !strcmp(name, "tag");
+}
+
+static void print_event(struct trace_event *ev, uint64_t start)
+{
+	uint32_t event = ev->rec.event;
+	int i;
+
+	printf("%12.3f %4llu ", (ev->rec.ts - start) / 1000.0,
+	       (unsigned long long) ev->tid);
+	if (event == 0 || event >= SOCK_TRACE_MAX) {
+		printf("event_%u %#llx %#llx %#llx\n", event,
+		       (unsigned long long) ev->rec.arg[0],
+		       (unsigned long long) ev->rec.arg[1],
+		       (unsigned long long) ev->rec.arg[2]);
+		return;
+	}
+
+	printf("%-10s", event_names[event]);
+	for (i = 0; i < 3; i++) {
+		if (is_pointer_arg(event, i))
+			printf(" %s=%#llx", arg_names[event][i],
+			       (unsigned long long) ev->rec.arg[i]);
+		else
+			printf(" %s=%lld", arg_names[event][i],
+			       (long long) ev->rec.arg[i]);
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct sock_trace_file_hdr hdr;
+	struct sock_trace_thread_hdr thdr;
+	struct trace_event *events = NULL, *tmp;
+	uint64_t counts[SOCK_TRACE_MAX + 1] = { 0 };
+	size_t num_events = 0, i;
+	uint64_t t, j, dropped = 0;
+	int op, summary = 0, ret = EXIT_FAILURE;
+	FILE *file;
+
+	while ((op = getopt(argc, argv, "sh")) != -1) {
+		switch (op) {
+		case 's':
+			summary = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	file = fopen(argv[optind], "r");
+	if (!file) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (fread(&hdr, sizeof hdr, 1, file) != 1 ||
+	    memcmp(hdr.magic, SOCK_TRACE_MAGIC, sizeof hdr.magic) ||
+	    hdr.version != SOCK_TRACE_VERSION ||
+	    hdr.rec_size != sizeof(struct sock_trace_rec)) {
+		fprintf(stderr, "%s: not a sockets trace file\n", argv[optind]);
+		goto out;
+	}
+
+	for (t = 0; t < hdr.num_threads; t++) {
+		if (fread(&thdr, sizeof thdr, 1, file) != 1)
+			goto truncated;
+		dropped += thdr.dropped;
+
+		tmp = realloc(events, (num_events + thdr.count) *
+			      sizeof(*events));
+		if (!tmp) {
+			fprintf(stderr, "out of memory\n");
+			goto out;
+		}
+		events = tmp;
+
+		for (j = 0; j < thdr.count; j++) {
+			events[num_events].tid = thdr.tid;
+			if (fread(&events[num_events].rec,
+				  sizeof(struct sock_trace_rec), 1, file) != 1)
+				goto truncated;
+			num_events++;
+		}
+	}
+
+	qsort(events, num_events, sizeof(*events), compare_events);
+	for (i = 0; i < num_events; i++) {
+		if (events[i].rec.event < SOCK_TRACE_MAX)
+			counts[events[i].rec.event]++;
+		else
+			counts[SOCK_TRACE_MAX]++;
+		if (!summary)
+			print_event(&events[i], events[0].rec.ts);
+	}
+
+	if (summary) {
+		for (i = 1; i < SOCK_TRACE_MAX; i++)
+			printf("%-10s %llu\n", event_names[i],
+			       (unsigned long long) counts[i]);
+		if (counts[SOCK_TRACE_MAX])
+			printf("%-10s %llu\n", "unknown",
+			       (unsigned long long) counts[SOCK_TRACE_MAX]);
+	}
+	printf("# %zu events from %llu threads, %llu overwritten\n",
+	       num_events, (unsigned long long) hdr.num_threads,
+	       (unsigned long long) dropped);
+	ret = EXIT_SUCCESS;
+	goto out;
+
+truncated:
+	fprintf(stderr, "%s: truncated trace file\n", argv[optind]);
+out:
+	free(events);
+	fclose(file);
+	return ret;
+}
@@ -202,3 +202,212 @@ uint64_t fi_gettime_ms(void)
 	gettimeofday(&now, NULL);
 	return now.tv_sec * 1000 + now.tv_usec / 1000;
 }
+
+/*
+ * An fi_info allocated as a single block with its attribute structures.
+ * The fi_info comes first, so the block is released with one free, and
+ * is followed by a magic word and the address of the fi_info itself,
+ * which fi_freeinfo checks to recognize the block.  Only the attribute
+ * structures live in the block: addresses and names are malloc'ed and
+ * strdup'ed on their own, so that callers may free and replace them.
+ * An attribute the caller has pointed elsewhere is freed on its own.
+ *
+ * fi_allocinfo, fi_dupinfo and the providers allocate every fi_info
+ * this way, so fi_freeinfo may read the header behind any fi_info it is
+ * given.  One that does not carry it is freed field by field.
+ */
+#define FI_INFO_ARENA_MAGIC	0x6669696e666f6172ULL
+
+struct fi_info_arena {
+	struct fi_info		info;
+	uint64_t		magic;
+	struct fi_info		*self;
+	struct fi_tx_attr	tx_attr;
+	struct fi_rx_attr	rx_attr;
+	struct fi_ep_attr	ep_attr;
+	struct fi_domain_attr	domain_attr;
+	struct fi_fabric_attr	fabric_attr;
+};
+
+static struct fi_info_arena *fi_info_arena(struct fi_info *info)
+{
+	struct fi_info_arena *arena;
+
+	arena = container_of(info, struct fi_info_arena, info);
+	if (arena->magic != FI_INFO_ARENA_MAGIC || arena->self != info)
+		return NULL;
+	return arena;
+}
+
+static void fi_info_arena_free(struct fi_info_arena *arena, void *ptr)
+{
+	if ((char *) ptr < (char *) arena ||
+	    (char *) ptr >= (char *) (arena + 1))
+		free(ptr);
+}
+
+int fi_freeinfo_arena(struct fi_info *info)
+{
+	struct fi_info_arena *arena;
+
+	arena = fi_info_arena(info);
+	if (!arena)
+		return 0;
+
+	free(info->src_addr);
+	free(info->dest_addr);
+	fi_info_arena_free(arena, info->tx_attr);
+	fi_info_arena_free(arena, info->rx_attr);
+	fi_info_arena_free(arena, info->ep_attr);
+	if (info->domain_attr) {
+		free(info->domain_attr->name);
+		fi_info_arena_free(arena, info->domain_attr);
+	}
+	if (info->fabric_attr) {
+		free(info->fabric_attr->name);
+		free(info->fabric_attr->prov_name);
+		fi_info_arena_free(arena, info->fabric_attr);
+	}
+	arena->magic = 0;
+	free(arena);
+	return 1;
+}
+
+struct fi_info *fi_allocinfo_arena(size_t src_addrlen, size_t dest_addrlen,
+				   const char *domain_name,
+				   const char *fabric_name,
+				   const char *prov_name)
+{
+	struct fi_info_arena *arena;
+	struct fi_info *info;
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+
+	info = &arena->info;
+	arena->magic = FI_INFO_ARENA_MAGIC;
+	arena->self = info;
+	info->tx_attr = &arena->tx_attr;
+	info->rx_attr = &arena->rx_attr;
+	info->ep_attr = &arena->ep_attr;
+	info->domain_attr = &arena->domain_attr;
+	info->fabric_attr = &arena->fabric_attr;
+
+	if (src_addrlen) {
+		info->src_addr = calloc(1, src_addrlen);
+		if (!info->src_addr)
+			goto fail;
+		info->src_addrlen = src_addrlen;
+	}
+	if (dest_addrlen) {
+		info->dest_addr = calloc(1, dest_addrlen);
+		if (!info->dest_addr)
+			goto fail;
+		info->dest_addrlen = dest_addrlen;
+	}
+
+	if (domain_name) {
+		info->domain_attr->name = strdup(domain_name);
+		if (!info->domain_attr->name)
+			goto fail;
+	}
+	if (fabric_name) {
+		info->fabric_attr->name = strdup(fabric_name);
+		if (!info->fabric_attr->name)
+			goto fail;
+	}
+	if (prov_name) {
+		info->fabric_attr->prov_name = strdup(prov_name);
+		if (!info->fabric_attr->prov_name)
+			goto fail;
+	}
+	return info;
+
+fail:
+	fi_freeinfo_arena(info);
+	return NULL;
+}
+
+struct fi_info *fi_dupinfo_arena(const struct fi_info *info)
+{
+	struct fi_info_arena *arena;
+	struct fi_info *dup;
+	char *dom_name, *fab_name, *prov_name;
+
+	dup = fi_allocinfo_arena(0, 0, NULL, NULL, NULL);
+	if (!dup)
+		return NULL;
+
+	arena = container_of(dup, struct fi_info_arena, info);
+	dup->caps = info->caps;
+	dup->mode = info->mode;
+	dup->ep_type = info->ep_type;
+	dup->addr_format = info->addr_format;
+	dup->src_addrlen = info->src_addrlen;
+	dup->dest_addrlen = info->dest_addrlen;
+	dup->connreq = info->connreq;
+
+	if (info->tx_attr)
+		arena->tx_attr = *info->tx_attr;
+	else
+		dup->tx_attr = NULL;
+	if (info->rx_attr)
+		arena->rx_attr = *info->rx_attr;
+	else
+		dup->rx_attr = NULL;
+	if (info->ep_attr)
+		arena->ep_attr = *info->ep_attr;
+	else
+		dup->ep_attr = NULL;
+
+	if (info->domain_attr) {
+		arena->domain_attr = *info->domain_attr;
+		arena->domain_attr.name = NULL;
+	} else {
+		dup->domain_attr = NULL;
+	}
+	if (info->fabric_attr) {
+		arena->fabric_attr = *info->fabric_attr;
+		arena->fabric_attr.name = NULL;
+		arena->fabric_attr.prov_name = NULL;
+	} else {
+		dup->fabric_attr = NULL;
+	}
+
+	if (info->src_addr) {
+		dup->src_addr = malloc(info->src_addrlen);
+		if (!dup->src_addr)
+			goto fail;
+		memcpy(dup->src_addr, info->src_addr, info->src_addrlen);
+	}
+	if (info->dest_addr) {
+		dup->dest_addr = malloc(info->dest_addrlen);
+		if (!dup->dest_addr)
+			goto fail;
+		memcpy(dup->dest_addr, info->dest_addr, info->dest_addrlen);
+	}
+	if (info->domain_attr && info->domain_attr->name) {
+		dom_name = strdup(info->domain_attr->name);
+		if (!dom_name)
+			goto fail;
+		dup->domain_attr->name = dom_name;
+	}
+	if (info->fabric_attr && info->fabric_attr->name) {
+		fab_name = strdup(info->fabric_attr->name);
+		if (!fab_name)
+			goto fail;
+		dup->fabric_attr->name = fab_name;
+	}
+	if (info->fabric_attr && info->fabric_attr->prov_name) {
+		prov_name = strdup(info->fabric_attr->prov_name);
+		if (!prov_name)
+			goto fail;
+		dup->fabric_attr->prov_name = prov_name;
+	}
+	return dup;
+
+fail:
+	fi_freeinfo_arena(dup);
+	return NULL;
+}
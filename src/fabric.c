@@ -39,7 +39,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <dirent.h>
+#include <errno.h>
 
 #include <rdma/fi_errno.h>
 #include "fi.h"
@@ -50,10 +52,24 @@
 #include <dlfcn.h>
 #endif
 
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+/*
+ * Providers found in PROVDLDIR are recorded by name and path only, and
+ * are not dlopen'ed until fi_getinfo or fi_fabric actually selects them.
+ */
 struct fi_prov {
 	struct fi_prov		*next;
 	struct fi_provider	*provider;
 	void			*dlhandle;
+	char			*name;
+	char			*path;
+	int			failed;
 };
 
 static struct fi_prov *fi_getprov(const char *prov_name);
@@ -62,6 +78,37 @@ static struct fi_prov *prov_head, *prov_tail;
 static volatile int init = 0;
 static pthread_mutex_t ini_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* FI_PROVIDER="name[,name...]" or "^name[,name...]" */
+static char **prov_filter;
+static char *prov_filter_str;
+static int prov_filter_exclude;
+
+/*
+ * fi_getinfo result cache, most recently used first.  Any rtnetlink
+ * link or address notification flushes it.
+ */
+#define FI_INFO_CACHE_SIZE	16
+
+struct fi_info_cache {
+	struct fi_info_cache	*next;
+	char			*key;
+	size_t			keylen;
+	struct fi_info		*info;
+};
+
+struct fi_info_key {
+	char			*buf;
+	size_t			len;
+	size_t			size;
+	int			err;
+};
+
+static struct fi_info_cache *cache_head;
+static int cache_cnt;
+static int cache_enabled;
+static int cache_nlfd = -1;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 static void cleanup_provider(struct fi_provider *provider, void *dlhandle)
 {
@@ -74,16 +121,62 @@ static void cleanup_provider(struct fi_provider *provider, void *dlhandle)
 #endif
 }
 
-static int fi_register_provider(struct fi_provider *provider, void *dlhandle)
+static const char *fi_prov_name(struct fi_prov *prov)
 {
-	struct fi_prov *prov;
-	int ret;
+	return prov->provider ? prov->provider->name : prov->name;
+}
 
-	if (!provider) {
-		ret = -FI_EINVAL;
-		goto cleanup;
+static void fi_filter_init(void)
+{
+	char *env, *name, *saveptr;
+	int i, n;
+
+	env = getenv("FI_PROVIDER");
+	if (!env || !*env)
+		return;
+
+	if (*env == '^') {
+		prov_filter_exclude = 1;
+		env++;
+	}
+
+	prov_filter_str = strdup(env);
+	if (!prov_filter_str)
+		return;
+
+	for (n = 2, i = 0; env[i]; i++) {
+		if (env[i] == ',')
+			n++;
+	}
+
+	prov_filter = calloc(n, sizeof(*prov_filter));
+	if (!prov_filter) {
+		free(prov_filter_str);
+		prov_filter_str = NULL;
+		return;
 	}
 
+	for (i = 0, name = strtok_r(prov_filter_str, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr))
+		prov_filter[i++] = name;
+}
+
+static int fi_prov_allowed(const char *name)
+{
+	int i;
+
+	if (!prov_filter)
+		return 1;
+
+	for (i = 0; prov_filter[i]; i++) {
+		if (!strcasecmp(prov_filter[i], name))
+			return !prov_filter_exclude;
+	}
+	return prov_filter_exclude;
+}
+
+static int fi_check_provider(struct fi_provider *provider)
+{
 	FI_LOG(2, NULL, "registering provider: %s (%d.%d)\n", provider->name,
 		FI_MAJOR(provider->version), FI_MINOR(provider->version));
 
@@ -93,13 +186,171 @@ static int fi_register_provider(struct fi_provider *provider, void *dlhandle)
 			FI_MAJOR(provider->fi_version),
 			FI_MINOR(provider->fi_version),
 			FI_MAJOR_VERSION, FI_MINOR_VERSION);
+		return -FI_ENOSYS;
+	}
+
+	if (!fi_prov_allowed(provider->name)) {
+		FI_LOG(2, NULL, "provider %s excluded by FI_PROVIDER; ignoring\n",
+			provider->name);
+		return -FI_ENODEV;
+	}
+
+	return 0;
+}
 
-		ret = -FI_ENOSYS;
+#ifdef HAVE_LIBDL
+static struct fi_prov *fi_getprov_loaded(const char *prov_name,
+					 struct fi_prov *self)
+{
+	struct fi_prov *prov;
+
+	for (prov = prov_head; prov; prov = prov->next) {
+		if (prov != self && prov->provider &&
+		    !strcmp(prov_name, prov->provider->name))
+			return prov;
+	}
+
+	return NULL;
+}
+
+static void fi_load_prov_locked(struct fi_prov *prov)
+{
+	struct fi_provider* (*inif)(void);
+	struct fi_provider *provider;
+	struct fi_prov *dup;
+	void *dlhandle;
+
+	if (prov->provider || prov->failed)
+		return;
+
+	FI_DEBUG(NULL, "opening provider lib %s\n", prov->path);
+	/* Opening is deferred, binding is not: an unresolved symbol must
+	 * reject the library here instead of aborting at its first call.
+	 */
+	dlhandle = dlopen(prov->path, RTLD_NOW);
+	if (dlhandle == NULL) {
+		FI_WARN(NULL, "dlopen(%s): %s\n", prov->path, dlerror());
+		goto fail;
+	}
+
+	inif = dlsym(dlhandle, "fi_prov_ini");
+	if (inif == NULL) {
+		FI_WARN(NULL, "dlsym: %s\n", dlerror());
+		dlclose(dlhandle);
+		goto fail;
+	}
+
+	provider = (inif)();
+	if (!provider || fi_check_provider(provider)) {
+		cleanup_provider(provider, dlhandle);
+		goto fail;
+	}
+
+	if (strcmp(provider->name, prov->name))
+		FI_LOG(2, NULL, "%s provides %s, not %s\n", prov->path,
+			provider->name, prov->name);
+
+	/* Keep only the newest of several libraries for one provider;
+	 * the surviving entry keeps its place in the list.
+	 */
+	dup = fi_getprov_loaded(provider->name, prov);
+	if (dup) {
+		if (FI_VERSION_GE(dup->provider->version, provider->version)) {
+			FI_LOG(2, NULL, "a newer %s provider was already loaded; ignoring this one\n",
+				provider->name);
+			cleanup_provider(provider, dlhandle);
+		} else {
+			FI_LOG(2, NULL, "an older %s provider was already loaded; keeping this one and ignoring the older one\n",
+				provider->name);
+			cleanup_provider(dup->provider, dup->dlhandle);
+			dup->provider = provider;
+			dup->dlhandle = dlhandle;
+		}
+		goto fail;
+	}
+
+	prov->dlhandle = dlhandle;
+	prov->provider = provider;
+	return;
+
+fail:
+	prov->failed = 1;
+}
+#endif
+
+static int fi_load_prov(struct fi_prov *prov)
+{
+	if (!prov->path)
+		return prov->provider ? 0 : -FI_ENODEV;
+
+#ifdef HAVE_LIBDL
+	pthread_mutex_lock(&ini_lock);
+	fi_load_prov_locked(prov);
+	pthread_mutex_unlock(&ini_lock);
+#endif
+	return prov->provider ? 0 : -FI_ENODEV;
+}
+
+/*
+ * Look up a provider by name, opening every deferred library if none is
+ * known by that name yet: a library may be named other than the
+ * provider it contains.
+ */
+static struct fi_prov *fi_findprov(const char *prov_name)
+{
+	struct fi_prov *prov;
+
+	prov = fi_getprov(prov_name);
+#ifdef HAVE_LIBDL
+	if (!prov) {
+		pthread_mutex_lock(&ini_lock);
+		for (prov = prov_head; prov; prov = prov->next) {
+			if (prov->path)
+				fi_load_prov_locked(prov);
+		}
+		pthread_mutex_unlock(&ini_lock);
+		prov = fi_getprov(prov_name);
+	}
+#endif
+	return prov;
+}
+
+static void fi_append_prov(struct fi_prov *prov)
+{
+	if (prov_tail)
+		prov_tail->next = prov;
+	else
+		prov_head = prov;
+	prov_tail = prov;
+}
+
+static int fi_register_provider(struct fi_provider *provider, void *dlhandle)
+{
+	struct fi_prov *prov;
+	int ret;
+
+	if (!provider) {
+		ret = -FI_EINVAL;
 		goto cleanup;
 	}
 
+	ret = fi_check_provider(provider);
+	if (ret)
+		goto cleanup;
+
 	prov = fi_getprov(provider->name);
 	if (prov) {
+#ifdef HAVE_LIBDL
+		/* Versions can only be compared once both are loaded */
+		fi_load_prov_locked(prov);
+#endif
+		if (!prov->provider) {
+			prov->dlhandle = dlhandle;
+			prov->provider = provider;
+			prov->failed = 0;
+			return 0;
+		}
+
 		/* If this provider is older than an already-loaded
 		 * provider of the same name, then discard this one.
 		 */
@@ -131,11 +382,7 @@ static int fi_register_provider(struct fi_provider *provider, void *dlhandle)
 
 	prov->dlhandle = dlhandle;
 	prov->provider = provider;
-	if (prov_tail)
-		prov_tail->next = prov;
-	else
-		prov_head = prov;
-	prov_tail = prov;
+	fi_append_prov(prov);
 	return 0;
 
 cleanup:
@@ -154,8 +401,340 @@ static int lib_filter(const struct dirent *entry)
 	else
 		return 0;
 }
+
+/*
+ * In-tree providers whose library is not named after the provider.
+ * Other libraries are expected to follow the lib<name>-fi.so rule.
+ */
+static const struct {
+	const char *lib;
+	const char *prov;
+} lib_prov_alias[] = {
+	{ "psmx", "psm" },
+	{ "gnix", "gni" },
+};
+
+/* "lib<name>-fi.so" -> provider name */
+static char *lib_prov_name(const char *lib)
+{
+	size_t len = strlen(lib) - (sizeof (FI_LIB_SUFFIX) - 1);
+	int i;
+
+	if (!strncmp(lib, "lib", 3) && len > 3) {
+		lib += 3;
+		len -= 3;
+	}
+	if (len > 1 && lib[len - 1] == '-')
+		len--;
+
+	for (i = 0; i < sizeof(lib_prov_alias) / sizeof(lib_prov_alias[0]); i++) {
+		if (strlen(lib_prov_alias[i].lib) == len &&
+		    !strncmp(lib, lib_prov_alias[i].lib, len))
+			return strdup(lib_prov_alias[i].prov);
+	}
+
+	return strndup(lib, len);
+}
+
+static void fi_add_dl_prov(char *name, char *path)
+{
+	struct fi_prov *prov;
+
+	prov = calloc(sizeof *prov, 1);
+	if (!prov) {
+		free(name);
+		free(path);
+		return;
+	}
+	prov->name = name;
+	prov->path = path;
+
+	if (!fi_getprov(name)) {
+		fi_append_prov(prov);
+		return;
+	}
+
+	/* Two libraries with the same provider name: open both now so
+	 * that fi_register_provider keeps the newer one.
+	 */
+	fi_load_prov_locked(prov);
+	if (prov->provider)
+		fi_register_provider(prov->provider, prov->dlhandle);
+	free(name);
+	free(path);
+	free(prov);
+}
+#endif
+
+static void fi_info_cache_init(void)
+{
+	char *env;
+#ifdef __linux__
+	struct sockaddr_nl addr;
 #endif
 
+	env = getenv("FI_GETINFO_CACHE");
+	if (env && !strcmp(env, "0"))
+		return;
+
+#ifdef __linux__
+	cache_nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    NETLINK_ROUTE);
+	if (cache_nlfd < 0) {
+		FI_DEBUG(NULL, "netlink socket: %s; getinfo cache disabled\n",
+			 strerror(errno));
+		return;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(cache_nlfd, (struct sockaddr *) &addr, sizeof addr)) {
+		FI_DEBUG(NULL, "netlink bind: %s; getinfo cache disabled\n",
+			 strerror(errno));
+		close(cache_nlfd);
+		cache_nlfd = -1;
+		return;
+	}
+
+	cache_enabled = 1;
+#endif
+}
+
+static void fi_info_cache_flush(void)
+{
+	struct fi_info_cache *entry;
+
+	while (cache_head) {
+		entry = cache_head;
+		cache_head = entry->next;
+		fi_freeinfo(entry->info);
+		free(entry->key);
+		free(entry);
+	}
+	cache_cnt = 0;
+}
+
+/* Drain pending interface notifications; returns 1 if any were seen */
+static int fi_info_cache_stale(void)
+{
+#ifdef __linux__
+	char buf[4096];
+	ssize_t len;
+	int stale = 0;
+
+	for (;;) {
+		len = recv(cache_nlfd, buf, sizeof buf, MSG_DONTWAIT);
+		if (len > 0) {
+			stale = 1;
+		} else if (len < 0 && errno == ENOBUFS) {
+			/* notifications were dropped */
+			stale = 1;
+		} else if (len < 0 && errno == EINTR) {
+			continue;
+		} else {
+			break;
+		}
+	}
+	return stale;
+#else
+	return 0;
+#endif
+}
+
+static void fi_info_key_add(struct fi_info_key *key, const void *data,
+			    size_t len)
+{
+	char *buf;
+	size_t size;
+
+	if (key->err)
+		return;
+
+	if (key->len + len > key->size) {
+		size = key->size ? key->size : 256;
+		while (size < key->len + len)
+			size *= 2;
+		buf = realloc(key->buf, size);
+		if (!buf) {
+			key->err = 1;
+			return;
+		}
+		key->buf = buf;
+		key->size = size;
+	}
+
+	memcpy(key->buf + key->len, data, len);
+	key->len += len;
+}
+
+static void fi_info_key_str(struct fi_info_key *key, const char *str)
+{
+	char present = str != NULL;
+
+	fi_info_key_add(key, &present, sizeof present);
+	if (str)
+		fi_info_key_add(key, str, strlen(str) + 1);
+}
+
+static void fi_info_key_attr(struct fi_info_key *key, const void *attr,
+			     size_t len)
+{
+	char present = attr != NULL;
+
+	fi_info_key_add(key, &present, sizeof present);
+	if (attr)
+		fi_info_key_add(key, attr, len);
+}
+
+/*
+ * Serialize everything fi_getinfo's result depends on.  Attribute
+ * structures are copied bytewise with their string and address
+ * pointers cleared; the pointed-to data is appended separately.
+ */
+static int fi_info_key_build(struct fi_info_key *key, uint32_t version,
+			     const char *node, const char *service,
+			     uint64_t flags, struct fi_info *hints)
+{
+	struct fi_info info;
+	struct fi_domain_attr domain_attr;
+	struct fi_fabric_attr fabric_attr;
+
+	memset(key, 0, sizeof *key);
+	fi_info_key_add(key, &version, sizeof version);
+	fi_info_key_add(key, &flags, sizeof flags);
+	fi_info_key_str(key, node);
+	fi_info_key_str(key, service);
+	if (!hints) {
+		fi_info_key_attr(key, NULL, 0);
+		return key->err ? -FI_ENOMEM : 0;
+	}
+
+	memcpy(&info, hints, sizeof info);
+	info.next = NULL;
+	info.src_addr = info.dest_addr = NULL;
+	info.tx_attr = NULL;
+	info.rx_attr = NULL;
+	info.ep_attr = NULL;
+	info.domain_attr = NULL;
+	info.fabric_attr = NULL;
+	fi_info_key_attr(key, &info, sizeof info);
+
+	if (hints->src_addr)
+		fi_info_key_add(key, hints->src_addr, hints->src_addrlen);
+	if (hints->dest_addr)
+		fi_info_key_add(key, hints->dest_addr, hints->dest_addrlen);
+	fi_info_key_attr(key, hints->tx_attr,
+			 sizeof(*hints->tx_attr));
+	fi_info_key_attr(key, hints->rx_attr,
+			 sizeof(*hints->rx_attr));
+	fi_info_key_attr(key, hints->ep_attr,
+			 sizeof(*hints->ep_attr));
+
+	if (hints->domain_attr) {
+		memcpy(&domain_attr, hints->domain_attr, sizeof domain_attr);
+		domain_attr.name = NULL;
+		fi_info_key_attr(key, &domain_attr, sizeof domain_attr);
+		fi_info_key_str(key, hints->domain_attr->name);
+	} else {
+		fi_info_key_attr(key, NULL, 0);
+	}
+
+	if (hints->fabric_attr) {
+		memcpy(&fabric_attr, hints->fabric_attr, sizeof fabric_attr);
+		fabric_attr.name = NULL;
+		fabric_attr.prov_name = NULL;
+		fi_info_key_attr(key, &fabric_attr, sizeof fabric_attr);
+		fi_info_key_str(key, hints->fabric_attr->name);
+		fi_info_key_str(key, hints->fabric_attr->prov_name);
+	} else {
+		fi_info_key_attr(key, NULL, 0);
+	}
+
+	return key->err ? -FI_ENOMEM : 0;
+}
+
+static struct fi_info *fi_dupinfo_list(const struct fi_info *info)
+{
+	struct fi_info *head = NULL, *tail = NULL, *dup;
+
+	for (; info; info = info->next) {
+		dup = fi_dupinfo(info);
+		if (!dup) {
+			fi_freeinfo(head);
+			return NULL;
+		}
+		if (tail)
+			tail->next = dup;
+		else
+			head = dup;
+		tail = dup;
+	}
+	return head;
+}
+
+static struct fi_info *fi_info_cache_get(struct fi_info_key *key)
+{
+	struct fi_info_cache *entry, *prev;
+	struct fi_info *info = NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	if (fi_info_cache_stale()) {
+		FI_DEBUG(NULL, "network interfaces changed; flushing getinfo cache\n");
+		fi_info_cache_flush();
+	}
+
+	for (prev = NULL, entry = cache_head; entry;
+	     prev = entry, entry = entry->next) {
+		if (entry->keylen != key->len ||
+		    memcmp(entry->key, key->buf, key->len))
+			continue;
+
+		if (prev) {
+			prev->next = entry->next;
+			entry->next = cache_head;
+			cache_head = entry;
+		}
+		info = fi_dupinfo_list(entry->info);
+		break;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return info;
+}
+
+static void fi_info_cache_put(struct fi_info_key *key, struct fi_info *info)
+{
+	struct fi_info_cache *entry, **last;
+
+	entry = calloc(1, sizeof *entry);
+	if (!entry)
+		return;
+
+	entry->info = fi_dupinfo_list(info);
+	if (!entry->info) {
+		free(entry);
+		return;
+	}
+	entry->key = key->buf;
+	entry->keylen = key->len;
+	key->buf = NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	entry->next = cache_head;
+	cache_head = entry;
+	if (++cache_cnt > FI_INFO_CACHE_SIZE) {
+		for (last = &cache_head; (*last)->next; last = &(*last)->next)
+			;
+		entry = *last;
+		*last = NULL;
+		cache_cnt--;
+		fi_freeinfo(entry->info);
+		free(entry->key);
+		free(entry);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
 /*
  * Initialize the sockets provider last.  This will result in it being
  * the least preferred provider.
@@ -168,13 +747,14 @@ static void fi_ini(void)
 		goto unlock;
 
 	fi_log_init();
+	fi_filter_init();
+	fi_info_cache_init();
 
 #ifdef HAVE_LIBDL
 	struct dirent **liblist = NULL;
 	int n = 0;
-	char *lib, *provdir;
+	char *lib, *name, *provdir;
 	void *dlhandle;
-	struct fi_provider* (*inif)(void);
 
 	/* If dlopen fails, assume static linking and just return
 	   without error */
@@ -190,27 +770,22 @@ static void fi_ini(void)
 		goto libdl_done;
 
 	while (n--) {
+		name = lib_prov_name(liblist[n]->d_name);
+		if (!name || !fi_prov_allowed(name)) {
+			FI_DEBUG(NULL, "skipping provider lib %s\n",
+				 liblist[n]->d_name);
+			free(liblist[n]);
+			free(name);
+			continue;
+		}
+
 		if (asprintf(&lib, "%s/%s", provdir, liblist[n]->d_name) < 0) {
 			FI_WARN(NULL, "asprintf failed to allocate memory\n");
+			free(name);
 			goto libdl_done;
 		}
-		FI_DEBUG(NULL, "opening provider lib %s\n", lib);
-
-		dlhandle = dlopen(lib, RTLD_NOW);
 		free(liblist[n]);
-		if (dlhandle == NULL) {
-			FI_WARN(NULL, "dlopen(%s): %s\n", lib, dlerror());
-			free(lib);
-			continue;
-		}
-		free(lib);
-
-		inif = dlsym(dlhandle, "fi_prov_ini");
-		if (inif == NULL) {
-			FI_WARN(NULL, "dlsym: %s\n", dlerror());
-			dlclose(dlhandle);
-		} else
-			fi_register_provider((inif)(), dlhandle);
+		fi_add_dl_prov(name, lib);
 	}
 
 libdl_done:
@@ -219,13 +794,18 @@ libdl_done:
 	free(liblist);
 #endif
 
-	fi_register_provider(PSM_INIT, NULL);
-	fi_register_provider(USNIC_INIT, NULL);
+	if (fi_prov_allowed("psm"))
+		fi_register_provider(PSM_INIT, NULL);
+	if (fi_prov_allowed("usnic"))
+		fi_register_provider(USNIC_INIT, NULL);
 
-	fi_register_provider(VERBS_INIT, NULL);
-	fi_register_provider(SOCKETS_INIT, NULL);
+	if (fi_prov_allowed("verbs"))
+		fi_register_provider(VERBS_INIT, NULL);
+	if (fi_prov_allowed("sockets"))
+		fi_register_provider(SOCKETS_INIT, NULL);
 
-	fi_register_provider(GNI_INIT, NULL);
+	if (fi_prov_allowed("gni"))
+		fi_register_provider(GNI_INIT, NULL);
 	init = 1;
 
 unlock:
@@ -240,8 +820,18 @@ static void __attribute__((destructor)) fi_fini(void)
 		prov = prov_head;
 		prov_head = prov->next;
 		cleanup_provider(prov->provider, prov->dlhandle);
+		free(prov->name);
+		free(prov->path);
 		free(prov);
 	}
+
+	fi_info_cache_flush();
+#ifdef __linux__
+	if (cache_nlfd >= 0)
+		close(cache_nlfd);
+#endif
+	free(prov_filter);
+	free(prov_filter_str);
 }
 
 static struct fi_prov *fi_getprov(const char *prov_name)
@@ -249,7 +839,7 @@ static struct fi_prov *fi_getprov(const char *prov_name)
 	struct fi_prov *prov;
 
 	for (prov = prov_head; prov; prov = prov->next) {
-		if (!strcmp(prov_name, prov->provider->name))
+		if (!prov->failed && !strcmp(prov_name, fi_prov_name(prov)))
 			return prov;
 	}
 
@@ -264,6 +854,9 @@ void DEFAULT_SYMVER_PRE(fi_freeinfo)(struct fi_info *info)
 	for (; info; info = next) {
 		next = info->next;
 
+		if (fi_freeinfo_arena(info))
+			continue;
+
 		free(info->src_addr);
 		free(info->dest_addr);
 		free(info->tx_attr);
@@ -283,24 +876,51 @@ void DEFAULT_SYMVER_PRE(fi_freeinfo)(struct fi_info *info)
 }
 DEFAULT_SYMVER(fi_freeinfo_, fi_freeinfo);
 
+static void fi_set_prov(struct fi_info *info, struct fi_provider *provider)
+{
+	char *name = info->fabric_attr->prov_name;
+
+	info->fabric_attr->prov_version = provider->version;
+	if (name && !strcmp(name, provider->name))
+		return;
+
+	free(name);
+	info->fabric_attr->prov_name = strdup(provider->name);
+}
+
 __attribute__((visibility ("default")))
 int DEFAULT_SYMVER_PRE(fi_getinfo)(uint32_t version, const char *node, const char *service,
 	       uint64_t flags, struct fi_info *hints, struct fi_info **info)
 {
 	struct fi_prov *prov;
 	struct fi_info *tail, *cur;
+	struct fi_info_key key;
 	int ret = -FI_ENOSYS;
 
 	if (!init)
 		fi_ini();
 
+	key.buf = NULL;
+	if (cache_enabled && !fi_info_key_build(&key, version, node, service,
+						flags, hints)) {
+		*info = fi_info_cache_get(&key);
+		if (*info) {
+			free(key.buf);
+			return 0;
+		}
+	}
+
+	/* opens the libraries if the name is not known without them */
+	if (hints && hints->fabric_attr && hints->fabric_attr->prov_name)
+		fi_findprov(hints->fabric_attr->prov_name);
+
 	*info = tail = NULL;
 	for (prov = prov_head; prov; prov = prov->next) {
-		if (!prov->provider->getinfo)
+		if (hints && hints->fabric_attr && hints->fabric_attr->prov_name &&
+		    strcmp(fi_prov_name(prov), hints->fabric_attr->prov_name))
 			continue;
 
-		if (hints && hints->fabric_attr && hints->fabric_attr->prov_name &&
-		    strcmp(prov->provider->name, hints->fabric_attr->prov_name))
+		if (fi_load_prov(prov) || !prov->provider->getinfo)
 			continue;
 
 		ret = prov->provider->getinfo(version, node, service, flags,
@@ -314,6 +934,7 @@ int DEFAULT_SYMVER_PRE(fi_getinfo)(uint32_t version, const char *node, const cha
 				/* a provider has an error, clean up and bail */
 				fi_freeinfo(*info);
 				*info = NULL;
+				free(key.buf);
 				return ret;
 			}
 		}
@@ -322,139 +943,25 @@ int DEFAULT_SYMVER_PRE(fi_getinfo)(uint32_t version, const char *node, const cha
 			*info = cur;
 		else
 			tail->next = cur;
-		for (tail = cur; tail->next; tail = tail->next) {
-			tail->fabric_attr->prov_name = strdup(prov->provider->name);
-			tail->fabric_attr->prov_version = prov->provider->version;
-		}
-		tail->fabric_attr->prov_name = strdup(prov->provider->name);
-		tail->fabric_attr->prov_version = prov->provider->version;
+		for (tail = cur; tail->next; tail = tail->next)
+			fi_set_prov(tail, prov->provider);
+		fi_set_prov(tail, prov->provider);
 	}
 
+	if (*info && key.buf)
+		fi_info_cache_put(&key, *info);
+	free(key.buf);
 	return *info ? 0 : ret;
 }
 DEFAULT_SYMVER(fi_getinfo_, fi_getinfo);
 
-static struct fi_info *fi_allocinfo_internal(void)
-{
-	struct fi_info *info;
-
-	info = calloc(1, sizeof(*info));
-	if (!info)
-		return NULL;
-
-	info->tx_attr = calloc(1, sizeof(*info->tx_attr));
-	info->rx_attr = calloc(1, sizeof(*info->rx_attr));
-	info->ep_attr = calloc(1, sizeof(*info->ep_attr));
-	info->domain_attr = calloc(1, sizeof(*info->domain_attr));
-	info->fabric_attr = calloc(1, sizeof(*info->fabric_attr));
-	if (!info->tx_attr|| !info->rx_attr || !info->ep_attr ||
-	    !info->domain_attr || !info->fabric_attr)
-		goto err;
-
-	return info;
-err:
-	fi_freeinfo(info);
-	return NULL;
-}
-
-
 __attribute__((visibility ("default")))
 struct fi_info *DEFAULT_SYMVER_PRE(fi_dupinfo)(const struct fi_info *info)
 {
-	struct fi_info *dup;
-
 	if (!info)
-		return fi_allocinfo_internal();
-
-	dup = malloc(sizeof(*dup));
-	if (dup == NULL) {
-		return NULL;
-	}
-	*dup = *info;
-	dup->src_addr = NULL;
-	dup->dest_addr = NULL;
-	dup->tx_attr = NULL;
-	dup->rx_attr = NULL;
-	dup->ep_attr = NULL;
-	dup->domain_attr = NULL;
-	dup->fabric_attr = NULL;
-	dup->next = NULL;
-
-	if (info->src_addr != NULL) {
-		dup->src_addr = malloc(dup->src_addrlen);
-		if (dup->src_addr == NULL) {
-			goto fail;
-		}
-		memcpy(dup->src_addr, info->src_addr, info->src_addrlen);
-	}
-	if (info->dest_addr != NULL) {
-		dup->dest_addr = malloc(dup->dest_addrlen);
-		if (dup->dest_addr == NULL) {
-			goto fail;
-		}
-		memcpy(dup->dest_addr, info->dest_addr, info->dest_addrlen);
-	}
-	if (info->tx_attr != NULL) {
-		dup->tx_attr = malloc(sizeof(*dup->tx_attr));
-		if (dup->tx_attr == NULL) {
-			goto fail;
-		}
-		*dup->tx_attr = *info->tx_attr;
-	}
-	if (info->rx_attr != NULL) {
-		dup->rx_attr = malloc(sizeof(*dup->rx_attr));
-		if (dup->rx_attr == NULL) {
-			goto fail;
-		}
-		*dup->rx_attr = *info->rx_attr;
-	}
-	if (info->ep_attr != NULL) {
-		dup->ep_attr = malloc(sizeof(*dup->ep_attr));
-		if (dup->ep_attr == NULL) {
-			goto fail;
-		}
-		*dup->ep_attr = *info->ep_attr;
-	}
-	if (info->domain_attr) {
-		dup->domain_attr = malloc(sizeof(*dup->domain_attr));
-		if (dup->domain_attr == NULL) {
-			goto fail;
-		}
-		*dup->domain_attr = *info->domain_attr;
-		if (info->domain_attr->name != NULL) {
-			dup->domain_attr->name =
-				strdup(info->domain_attr->name);
-			if (dup->domain_attr->name == NULL) {
-				goto fail;
-			}
-		}
-	}
-	if (info->fabric_attr) {
-		dup->fabric_attr = malloc(sizeof(*dup->fabric_attr));
-		if (dup->fabric_attr == NULL) {
-			goto fail;
-		}
-		*dup->fabric_attr = *info->fabric_attr;
-		if (info->fabric_attr->name != NULL) {
-			dup->fabric_attr->name =
-				strdup(info->fabric_attr->name);
-			if (dup->fabric_attr->name == NULL) {
-				goto fail;
-			}
-		}
-		if (info->fabric_attr->prov_name != NULL) {
-			dup->fabric_attr->prov_name =
-				strdup(info->fabric_attr->prov_name);
-			if (dup->fabric_attr->prov_name == NULL) {
-				goto fail;
-			}
-		}
-	}
-	return dup;
+		return fi_allocinfo_arena(0, 0, NULL, NULL, NULL);
 
-fail:
-	fi_freeinfo(dup);
-	return NULL;
+	return fi_dupinfo_arena(info);
 }
 DEFAULT_SYMVER(fi_dupinfo_, fi_dupinfo);
 
@@ -469,8 +976,8 @@ int DEFAULT_SYMVER_PRE(fi_fabric)(struct fi_fabric_attr *attr, struct fid_fabric
 	if (!init)
 		fi_ini();
 
-	prov = fi_getprov(attr->prov_name);
-	if (!prov || !prov->provider->fabric)
+	prov = fi_findprov(attr->prov_name);
+	if (!prov || fi_load_prov(prov) || !prov->provider->fabric)
 		return -FI_ENODEV;
 
 	return prov->provider->fabric(attr, fabric, context);
@@ -169,3 +169,122 @@ void *idm_clear(struct index_map *idm, int index)
 	}
 	return item;
 }
+
+
+/*
+ * Radix map
+ *
+ * Each node resolves RADIX_BITS of the index, starting at bit 'shift';
+ * leaves have shift 0 and hold the items.  The root is replaced by a
+ * taller node, holding the old root in slot 0, when an index does not
+ * fit under it.  All links are published with release stores so that
+ * lookups need no lock.
+ */
+
+static struct radix_node *radix_node_alloc(int shift)
+{
+	struct radix_node *node;
+
+	node = calloc(1, sizeof(*node));
+	if (node)
+		node->shift = shift;
+	return node;
+}
+
+static struct radix_node *radix_map_root(struct radix_map *map, uint64_t index)
+{
+	struct radix_node *root, *node;
+
+	root = __atomic_load_n(&map->root, __ATOMIC_ACQUIRE);
+	while (!root || (index >> root->shift) >> RADIX_BITS) {
+		node = radix_node_alloc(root ? root->shift + RADIX_BITS : 0);
+		if (!node)
+			return NULL;
+
+		node->slot[0] = root;
+		if (__atomic_compare_exchange_n(&map->root, &root, node, 0,
+						__ATOMIC_RELEASE,
+						__ATOMIC_ACQUIRE))
+			root = node;
+		else
+			free(node);
+	}
+	return root;
+}
+
+int radix_map_set(struct radix_map *map, uint64_t index, void *item)
+{
+	struct radix_node *node, *child, *new_node;
+	void **slot;
+
+	node = radix_map_root(map, index);
+	if (!node)
+		goto nomem;
+
+	for (;;) {
+		slot = &node->slot[(index >> node->shift) & RADIX_MASK];
+		if (!node->shift) {
+			__atomic_store_n(slot, item, __ATOMIC_RELEASE);
+			return 0;
+		}
+
+		child = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		if (!child) {
+			new_node = radix_node_alloc(node->shift - RADIX_BITS);
+			if (!new_node)
+				goto nomem;
+
+			/* on a lost race, child is left pointing at the winner */
+			if (__atomic_compare_exchange_n(slot, (void **) &child,
+							new_node, 0,
+							__ATOMIC_RELEASE,
+							__ATOMIC_ACQUIRE))
+				child = new_node;
+			else
+				free(new_node);
+		}
+		node = child;
+	}
+
+nomem:
+	errno = ENOMEM;
+	return -1;
+}
+
+void *radix_map_clear(struct radix_map *map, uint64_t index)
+{
+	struct radix_node *node;
+
+	node = __atomic_load_n(&map->root, __ATOMIC_ACQUIRE);
+	if (!node || (index >> node->shift) >> RADIX_BITS)
+		return NULL;
+
+	while (node->shift) {
+		node = __atomic_load_n(&node->slot[(index >> node->shift) &
+						   RADIX_MASK], __ATOMIC_ACQUIRE);
+		if (!node)
+			return NULL;
+	}
+	return __atomic_exchange_n(&node->slot[index & RADIX_MASK], NULL,
+				   __ATOMIC_ACQ_REL);
+}
+
+static void radix_node_free(struct radix_node *node)
+{
+	int i;
+
+	if (node->shift) {
+		for (i = 0; i < RADIX_SIZE; i++) {
+			if (node->slot[i])
+				radix_node_free(node->slot[i]);
+		}
+	}
+	free(node);
+}
+
+void radix_map_destroy(struct radix_map *map)
+{
+	if (map->root)
+		radix_node_free(map->root);
+	map->root = NULL;
+}